@@ -0,0 +1,443 @@
+#include "checksum.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "utils.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CHECKSUM_X86        1
+#endif
+
+#define CHECKSUM_CRC32C_POLY    0x82F63B78      // Castagnoli, bit reversed
+#define CHECKSUM_NEEDED(c, i)   ((c)->expected[i] || ((c)->want & (1 << (i))))
+
+typedef guint32 (*ChecksumCrc32c) (guint32 crc, const guchar* p, size_t len);
+
+static const char* gChecksumNames[CHECKSUM_N] = { "md5", "sha256", "crc32c" };
+static const int gChecksumHexLen[CHECKSUM_N] = { 32, 64, 8 };
+
+static guint32 gCrc32cTable[8][256];
+static pthread_once_t gCrc32cOnce = PTHREAD_ONCE_INIT;
+static ChecksumCrc32c gCrc32c = NULL;
+
+static void checksum_expect_raw (Checksum* c, ChecksumType type, const char* b64, const char* source);
+static void checksum_start (Checksum* c);
+
+
+Checksum* checksum_new (void)
+{
+    return g_malloc0 (sizeof (Checksum));
+}
+
+void checksum_free (Checksum* c)
+{
+    g_return_if_fail (c);
+
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        if (c->expected[i])     g_free (c->expected[i]);
+        if (c->md[i])           EVP_MD_CTX_free (c->md[i]);
+    }
+
+    g_free (c);
+}
+
+ChecksumType checksum_type_from_name (const char* name)
+{
+    g_return_val_if_fail (name, CHECKSUM_N);
+
+    if (0 == g_ascii_strcasecmp (name, "sha-256"))  return CHECKSUM_SHA256;
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        if (0 == g_ascii_strcasecmp (name, gChecksumNames[i])) {
+            return i;
+        }
+    }
+
+    return CHECKSUM_N;
+}
+
+const char* checksum_type_name (ChecksumType type)
+{
+    g_return_val_if_fail (type >= 0 && type < CHECKSUM_N, NULL);
+
+    return gChecksumNames[type];
+}
+
+bool checksum_expect (Checksum* c, const char* spec, GError** error)
+{
+    g_return_val_if_fail (c && spec, false);
+
+    const char* hex = strchr (spec, ':');
+    g_autofree char* name = hex ? g_strndup (spec, hex - spec) : NULL;
+    ChecksumType type = name ? checksum_type_from_name (name) : CHECKSUM_N;
+    if (CHECKSUM_N == type) {
+        gf_error (error, "unknown checksum '%s', expected <md5|sha256|crc32c>:<hex>", spec);
+        return false;
+    }
+
+    ++hex;
+    bool valid = ((int) strlen (hex) == gChecksumHexLen[type]);
+    for (const char* p = hex; valid && *p; ++p) {
+        valid = g_ascii_isxdigit (*p);
+    }
+    if (!valid) {
+        gf_error (error, "%s checksum must be %d hex digits: '%s'", gChecksumNames[type], gChecksumHexLen[type], hex);
+        return false;
+    }
+
+    g_free (c->expected[type]);
+    c->expected[type] = g_ascii_strdown (hex, -1);
+    c->source[type] = "task";
+
+    return true;
+}
+
+void checksum_expect_digest_header (Checksum* c, const char* value)
+{
+    g_return_if_fail (c);
+
+    if (!value) {
+        return;
+    }
+
+    // "SHA-256=<base64>, MD5=<base64>" (RFC 3230) or "sha-256=:<base64>:" (RFC 9530)
+    char** items = g_strsplit (value, ",", -1);
+    for (int i = 0; items && items[i]; ++i) {
+        char* item = g_strstrip (items[i]);
+        char* eq = strchr (item, '=');
+        if (!eq) continue;
+        *eq = '\0';
+
+        char* b64 = g_strstrip (eq + 1);
+        size_t len = strlen (b64);
+        if (len >= 2 && ':' == b64[0] && ':' == b64[len - 1]) {
+            b64[len - 1] = '\0';
+            ++b64;
+        }
+
+        ChecksumType type = checksum_type_from_name (g_strstrip (item));
+        if (CHECKSUM_N != type) {
+            checksum_expect_raw (c, type, b64, "Digest header");
+        }
+    }
+
+    if (items) g_strfreev (items);
+}
+
+void checksum_expect_content_md5 (Checksum* c, const char* value)
+{
+    g_return_if_fail (c);
+
+    if (value) {
+        checksum_expect_raw (c, CHECKSUM_MD5, value, "Content-MD5 header");
+    }
+}
+
+bool checksum_active (const Checksum* c)
+{
+    g_return_val_if_fail (c, false);
+
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        if (CHECKSUM_NEEDED (c, i)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool checksum_expected (const Checksum* c)
+{
+    g_return_val_if_fail (c, false);
+
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        if (c->expected[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void checksum_want (Checksum* c, ChecksumType type)
+{
+    g_return_if_fail (c && type >= 0 && type < CHECKSUM_N);
+
+    c->want |= 1 << type;
+}
+
+bool checksum_complete (const Checksum* c)
+{
+    g_return_val_if_fail (c, false);
+
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        if (CHECKSUM_NEEDED (c, i) && !(c->covered & (1 << i))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void checksum_reset (Checksum* c)
+{
+    g_return_if_fail (c);
+
+    c->started = false;
+    c->length = 0;
+}
+
+void checksum_update (Checksum* c, const void* data, size_t len)
+{
+    g_return_if_fail (c && (data || 0 == len));
+
+    if (!c->started || (0 == c->length && !checksum_complete (c))) {
+        checksum_start (c);
+    }
+
+    if (c->covered & (1 << CHECKSUM_MD5))       EVP_DigestUpdate (c->md[CHECKSUM_MD5], data, len);
+    if (c->covered & (1 << CHECKSUM_SHA256))    EVP_DigestUpdate (c->md[CHECKSUM_SHA256], data, len);
+    if (c->covered & (1 << CHECKSUM_CRC32C)) {
+        c->crc32c = checksum_crc32c (c->crc32c, data, len);
+    }
+    c->length += len;
+}
+
+bool checksum_file (Checksum* c, const char* fileName, GError** error)
+{
+    g_return_val_if_fail (c && fileName, false);
+
+    checksum_reset (c);
+    if (!checksum_active (c)) {
+        return true;
+    }
+
+    int fd = open (fileName, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        gf_error (error, "open '%s' error: %s", fileName, strerror (errno));
+        return false;
+    }
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    bool ret = false;
+    char* buf = g_malloc (CHECKSUM_READ_SIZE);
+    if (!buf) {
+        gf_error (error, "malloc checksum buffer error");
+        goto out;
+    }
+
+    for (;;) {
+        ssize_t n = read (fd, buf, CHECKSUM_READ_SIZE);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        } else if (n < 0) {
+            gf_error (error, "read '%s' error: %s", fileName, strerror (errno));
+            goto out;
+        } else if (0 == n) {
+            break;
+        }
+        checksum_update (c, buf, n);
+    }
+    ret = true;
+
+out:
+    if (buf)    g_free (buf);
+    close (fd);
+
+    return ret;
+}
+
+bool checksum_verify (Checksum* c, GError** error)
+{
+    g_return_val_if_fail (c, false);
+
+    if (!c->started) {
+        checksum_start (c);
+    }
+    c->started = false;
+
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        char* actual = c->digest[i];
+        actual[0] = '\0';
+        if (!CHECKSUM_NEEDED (c, i)) continue;
+
+        if (!(c->covered & (1 << i))) {
+            gf_error (error, "%s was not computed from the first byte", gChecksumNames[i]);
+            return false;
+        } else if (CHECKSUM_CRC32C == i) {
+            snprintf (actual, sizeof (c->digest[i]), "%08x", c->crc32c);
+        } else {
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int len = 0;
+            if (!EVP_DigestFinal_ex (c->md[i], md, &len)) {
+                gf_error (error, "%s checksum error", gChecksumNames[i]);
+                return false;
+            }
+            for (unsigned int j = 0; j < len && 2 * j + 2 < sizeof (c->digest[i]); ++j) {
+                snprintf (actual + 2 * j, 3, "%02x", md[j]);
+            }
+        }
+
+        if (c->expected[i] && 0 != strcmp (actual, c->expected[i])) {
+            gf_error (error, "%s mismatch after %lld bytes: expected %s (%s), got %s",
+                      gChecksumNames[i], c->length, c->expected[i], c->source[i], actual);
+            return false;
+        }
+        logd ("%s ok: %s", gChecksumNames[i], actual);
+    }
+
+    return true;
+}
+
+char* checksum_quarantine (const char* fileName, GError** error)
+{
+    g_return_val_if_fail (fileName, NULL);
+
+    g_autofree char* dir = g_path_get_dirname (fileName);
+    g_autofree char* base = g_path_get_basename (fileName);
+    g_autofree char* qdir = g_strdup_printf ("%s/%s", dir, CHECKSUM_QUARANTINE_DIR);
+    if (0 != g_mkdir_with_parents (qdir, 0755)) {
+        gf_error (error, "create '%s' error: %s", qdir, strerror (errno));
+        return NULL;
+    }
+
+    // an earlier bad copy of the same file is kept as well
+    char* target = g_strdup_printf ("%s/%s", qdir, base);
+    for (int i = 1; g_file_test (target, G_FILE_TEST_EXISTS); ++i) {
+        g_free (target);
+        target = g_strdup_printf ("%s/%s.%d", qdir, base, i);
+    }
+
+    if (0 != rename (fileName, target)) {
+        gf_error (error, "move '%s' to '%s' error: %s", fileName, target, strerror (errno));
+        g_free (target);
+        return NULL;
+    }
+
+    return target;
+}
+
+static guint32 checksum_crc32c_sw (guint32 crc, const guchar* p, size_t len)
+{
+    crc = ~crc;
+
+    // slicing-by-8: one table lookup per byte, eight bytes per step
+    for (; len >= 8; len -= 8, p += 8) {
+        guint32 lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (guint32) p[3] << 24);
+        crc = gCrc32cTable[7][lo & 0xff] ^ gCrc32cTable[6][(lo >> 8) & 0xff]
+            ^ gCrc32cTable[5][(lo >> 16) & 0xff] ^ gCrc32cTable[4][lo >> 24]
+            ^ gCrc32cTable[3][p[4]] ^ gCrc32cTable[2][p[5]]
+            ^ gCrc32cTable[1][p[6]] ^ gCrc32cTable[0][p[7]];
+    }
+    while (len--) {
+        crc = gCrc32cTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("sse4.2")))
+static guint32 checksum_crc32c_sse42 (guint32 crc, const guchar* p, size_t len)
+{
+    guint64 c = ~crc;
+
+    for (; len > 0 && ((uintptr_t) p & 7); --len) {
+        c = _mm_crc32_u8 ((guint32) c, *p++);
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        guint64 v;
+        memcpy (&v, p, 8);
+        c = _mm_crc32_u64 (c, v);
+    }
+    for (; len > 0; --len) {
+        c = _mm_crc32_u8 ((guint32) c, *p++);
+    }
+
+    return ~(guint32) c;
+}
+#endif
+
+static void checksum_crc32c_init (void)
+{
+    for (guint32 i = 0; i < 256; ++i) {
+        guint32 crc = i;
+        for (int k = 0; k < 8; ++k) {
+            crc = (crc >> 1) ^ ((crc & 1) ? CHECKSUM_CRC32C_POLY : 0);
+        }
+        gCrc32cTable[0][i] = crc;
+    }
+    for (guint32 i = 0; i < 256; ++i) {
+        for (int t = 1; t < 8; ++t) {
+            gCrc32cTable[t][i] = (gCrc32cTable[t - 1][i] >> 8) ^ gCrc32cTable[0][gCrc32cTable[t - 1][i] & 0xff];
+        }
+    }
+
+    gCrc32c = checksum_crc32c_sw;
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse4.2")) {
+        gCrc32c = checksum_crc32c_sse42;
+    }
+#endif
+}
+
+guint32 checksum_crc32c (guint32 crc, const void* data, size_t len)
+{
+    pthread_once (&gCrc32cOnce, checksum_crc32c_init);
+
+    return gCrc32c (crc, data, len);
+}
+
+/**
+ * @brief 为有期望值的算法开始新的计算
+ */
+static void checksum_start (Checksum* c)
+{
+    const EVP_MD* mds[CHECKSUM_N] = { EVP_md5 (), EVP_sha256 (), NULL };
+
+    c->covered = 0;
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        if (!CHECKSUM_NEEDED (c, i)) continue;
+        if (mds[i]) {
+            if (!c->md[i] && !(c->md[i] = EVP_MD_CTX_new ())) continue;
+            if (!EVP_DigestInit_ex (c->md[i], mds[i], NULL)) continue;
+        }
+        c->covered |= 1 << i;
+    }
+    c->crc32c = 0;
+    c->length = 0;
+    c->started = true;
+}
+
+/**
+ * @brief 响应头里的值是 base64 编码的摘要, 转成十六进制; 已有的期望值优先
+ */
+static void checksum_expect_raw (Checksum* c, ChecksumType type, const char* b64, const char* source)
+{
+    if (c->expected[type]) {
+        return;
+    }
+
+    gsize len = 0;
+    g_autofree guchar* raw = g_base64_decode (b64, &len);
+    if (!raw || (int) len * 2 != gChecksumHexLen[type]) {
+        logd ("ignore %s %s value '%s'", source, gChecksumNames[type], b64);
+        return;
+    }
+
+    char* hex = g_malloc0 (len * 2 + 1);
+    for (gsize i = 0; i < len; ++i) {
+        snprintf (hex + 2 * i, 3, "%02x", raw[i]);
+    }
+    c->expected[type] = hex;
+    c->source[type] = source;
+}
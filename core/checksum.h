@@ -0,0 +1,113 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+#include <openssl/evp.h>
+
+#define CHECKSUM_READ_SIZE          (1 << 20)       // checksum_file() 每次读取的大小
+#define CHECKSUM_QUARANTINE_DIR     ".quarantine"   // 校验失败的文件移到同目录下的这个目录
+
+typedef struct _Checksum            Checksum;
+typedef enum _ChecksumType          ChecksumType;
+
+enum _ChecksumType
+{
+    CHECKSUM_MD5 = 0,                   // Content-MD5
+    CHECKSUM_SHA256,
+    CHECKSUM_CRC32C,                    // SSE4.2 有 crc32 指令时使用硬件计算
+    CHECKSUM_N,
+};
+
+/**
+ * @brief 边下载边计算的校验值
+ *
+ * 只计算设置了期望值或用 checksum_want() 要求的算法, 都没有时 checksum_update() 什么也不做;
+ * SHA-256 和 MD5 使用 OpenSSL, CPU 支持时会用到 SHA 扩展指令
+ */
+struct _Checksum
+{
+    char                   *expected[CHECKSUM_N];   // 期望值, 小写十六进制, 为空表示不校验
+    const char             *source[CHECKSUM_N];     // 期望值的来源, 用于日志
+    int                     want;                   // 没有期望值也要计算的算法, 按 ChecksumType 的位
+    char                    digest[CHECKSUM_N][65]; // checksum_verify() 算出的结果, 没有计算的为空串
+
+    bool                    started;
+    int                     covered;                // 从第一个字节开始计算的算法, 按 ChecksumType 的位
+    EVP_MD_CTX             *md[CHECKSUM_N];
+    guint32                 crc32c;
+    long long               length;                 // 已经计算的字节数
+};
+
+Checksum*   checksum_new        (void);
+void        checksum_free       (Checksum* c);
+
+/**
+ * @brief 算法名, 例如 "sha256"、"sha-256"、"md5"、"crc32c", 不认识返回 CHECKSUM_N
+ */
+ChecksumType    checksum_type_from_name (const char* name);
+const char*     checksum_type_name      (ChecksumType type);
+
+/**
+ * @brief 设置期望值, 格式为 "<算法>:<十六进制>", 例如 "sha256:9f86d0..."
+ */
+bool        checksum_expect         (Checksum* c, const char* spec, GError** error);
+
+/**
+ * @brief 从响应头取期望值, 已经有期望值的算法不会被覆盖
+ *
+ * Digest(RFC 3230)和 Repr-Digest(RFC 9530)描述整个文件, Content-MD5 只描述这个响应的 body
+ */
+void        checksum_expect_digest_header   (Checksum* c, const char* value);
+void        checksum_expect_content_md5     (Checksum* c, const char* value);
+
+/**
+ * @brief 没有期望值也计算这个算法, 结果在 checksum_verify() 之后的 digest 里
+ */
+void        checksum_want       (Checksum* c, ChecksumType type);
+
+/**
+ * @brief 是否有需要计算的算法
+ */
+bool        checksum_active     (const Checksum* c);
+
+/**
+ * @brief 是否有期望值, 即有没有东西需要校验
+ */
+bool        checksum_expected   (const Checksum* c);
+
+/**
+ * @brief 所有需要的算法都是从第一个字节开始计算的
+ *
+ * 续传时才从响应头得到的期望值没有覆盖前面的数据, 这时要用 checksum_file() 重新计算
+ */
+bool        checksum_complete   (const Checksum* c);
+
+/**
+ * @brief 从头开始计算, 期望值保留
+ */
+void        checksum_reset      (Checksum* c);
+void        checksum_update     (Checksum* c, const void* data, size_t len);
+
+/**
+ * @brief 重新读取整个文件计算, 用于不是按顺序写入的文件
+ */
+bool        checksum_file       (Checksum* c, const char* fileName, GError** error);
+
+/**
+ * @brief 结束计算, 结果放到 digest, 并和所有期望值比较, 不一致时 error 里是期望值和实际值
+ */
+bool        checksum_verify     (Checksum* c, GError** error);
+
+/**
+ * @brief 把校验失败的文件移到同目录的 CHECKSUM_QUARANTINE_DIR 下
+ * @return 移动后的路径, 需要释放; 失败返回 NULL
+ */
+char*       checksum_quarantine (const char* fileName, GError** error);
+
+/**
+ * @brief CRC32C(Castagnoli), crc 为之前的结果, 第一次传 0
+ */
+guint32     checksum_crc32c     (guint32 crc, const void* data, size_t len);
+
+#endif // CHECKSUM_H
@@ -0,0 +1,547 @@
+#define _GNU_SOURCE
+#include "compress.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zstd.h>
+
+#include "log.h"
+#include "utils.h"
+
+typedef struct _CompressPiece       CompressPiece;
+typedef struct _CompressContext     CompressContext;
+
+/**
+ * @brief 解压后的 [start, end) 取自第 frame 帧
+ */
+struct _CompressPiece
+{
+    int                     frame;
+    long long               start;
+    long long               end;
+};
+
+/**
+ * @brief 每个线程一份的压缩上下文
+ */
+struct _CompressContext
+{
+    ZSTD_CCtx              *cctx;
+    int                     level;
+    char                   *buf;
+    size_t                  cap;
+};
+
+static pthread_key_t gContextKey;
+static pthread_once_t gContextOnce = PTHREAD_ONCE_INIT;
+
+static void compress_context_init (void);
+static void compress_context_free (void* arg);
+static bool compress_write_header (int fd);
+static GArray* compress_plan (const GArray* frames, long long length, GError** error);
+static bool compress_load (int fd, GArray* frames, const char* fileName, GError** error);
+static char* compress_decode (int fd, const CompressFrame* f, ZSTD_DCtx* dctx, GError** error);
+static bool compress_copy (int in, int out, long long from, long long to, long long len);
+
+
+CompressIndex* compress_index_open (const char* fileName, bool truncate, GError** error)
+{
+    g_return_val_if_fail (fileName, NULL);
+
+    CompressIndex* idx = g_malloc0 (sizeof (CompressIndex));
+    if (!idx) {
+        gf_error (error, "malloc compress index error");
+        return NULL;
+    }
+    g_mutex_init (&idx->lock);
+    idx->fileName = g_strdup_printf ("%s%s", fileName, COMPRESS_INDEX_SUFFIX);
+    idx->frames = g_array_new (false, false, sizeof (CompressFrame));
+
+    // appended record by record, a crash loses at most the frame that was being written
+    idx->fd = open (idx->fileName, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (idx->fd < 0) {
+        gf_error (error, "open '%s' error: %s", idx->fileName, strerror (errno));
+        goto error;
+    }
+
+    if (!compress_load (idx->fd, idx->frames, idx->fileName, error)) {
+        goto error;
+    }
+
+    for (guint i = 0; i < idx->frames->len; ++i) {
+        const CompressFrame* f = &g_array_index (idx->frames, CompressFrame, i);
+        idx->tail = MAX (idx->tail, f->at + f->size);
+    }
+
+    return idx;
+
+error:
+    compress_index_free (idx);
+    return NULL;
+}
+
+void compress_index_free (CompressIndex* idx)
+{
+    g_return_if_fail (idx);
+
+    if (idx->fd >= 0)       close (idx->fd);
+    if (idx->frames)        g_array_free (idx->frames, true);
+    if (idx->fileName)      g_free (idx->fileName);
+    g_mutex_clear (&idx->lock);
+
+    g_free (idx);
+}
+
+bool compress_index_add (CompressIndex* idx, const CompressFrame* frame, GError** error)
+{
+    g_return_val_if_fail (idx && frame, false);
+
+    g_mutex_lock (&idx->lock);
+    ssize_t w = write (idx->fd, frame, sizeof (CompressFrame));
+    if (w == sizeof (CompressFrame)) {
+        g_array_append_val (idx->frames, *frame);
+        idx->tail = MAX (idx->tail, frame->at + frame->size);
+    }
+    g_mutex_unlock (&idx->lock);
+
+    if (w != sizeof (CompressFrame)) {
+        gf_error (error, "write '%s' error: %s", idx->fileName, w < 0 ? strerror (errno) : "short write");
+        return false;
+    }
+
+    return true;
+}
+
+int compress_frame (int level, const void* data, int len, const char** out, GError** error)
+{
+    g_return_val_if_fail (data && len >= 0 && out, -1);
+
+    pthread_once (&gContextOnce, compress_context_init);
+
+    CompressContext* ctx = pthread_getspecific (gContextKey);
+    if (!ctx) {
+        ctx = g_malloc0 (sizeof (CompressContext));
+        if (!ctx || !(ctx->cctx = ZSTD_createCCtx ())) {
+            gf_error (error, "create zstd context error");
+            g_free (ctx);
+            return -1;
+        }
+        pthread_setspecific (gContextKey, ctx);
+    }
+
+    // the content size and a checksum go into every frame, each one checks itself
+    if (ctx->level != level) {
+        ZSTD_CCtx_setParameter (ctx->cctx, ZSTD_c_compressionLevel, level);
+        ZSTD_CCtx_setParameter (ctx->cctx, ZSTD_c_checksumFlag, 1);
+        ctx->level = level;
+    }
+
+    size_t bound = ZSTD_compressBound (len);
+    if (bound > ctx->cap) {
+        g_free (ctx->buf);
+        if (!(ctx->buf = g_malloc (bound))) {
+            ctx->cap = 0;
+            gf_error (error, "malloc compress buffer error");
+            return -1;
+        }
+        ctx->cap = bound;
+    }
+
+    size_t n = ZSTD_compress2 (ctx->cctx, ctx->buf, ctx->cap, data, len);
+    if (ZSTD_isError (n)) {
+        gf_error (error, "zstd compress error: %s", ZSTD_getErrorName (n));
+        return -1;
+    }
+    *out = ctx->buf;
+
+    return (int) n;
+}
+
+bool compress_finish (int fd, const char* fileName, CompressIndex* idx, long long length, int level, GError** error)
+{
+    g_return_val_if_fail (fd >= 0 && fileName && idx, false);
+
+    bool ret = false;
+    int tmp = -1;
+    int idxTmp = -1;
+    ZSTD_DCtx* dctx = NULL;
+    GArray* ordered = g_array_new (false, false, sizeof (CompressFrame));
+    g_autofree char* tmpName = g_strdup_printf ("%s.tmp", fileName);
+    g_autofree char* idxTmpName = g_strdup_printf ("%s.tmp", idx->fileName);
+
+    GArray* plan = compress_plan (idx->frames, length, error);
+    if (!plan) {
+        goto out;
+    }
+
+    // every frame whole and already in order is the common case of a plain download
+    bool inOrder = true;
+    long long at = 0;
+    for (guint i = 0; i < plan->len && inOrder; ++i) {
+        const CompressPiece* p = &g_array_index (plan, CompressPiece, i);
+        const CompressFrame* f = &g_array_index (idx->frames, CompressFrame, p->frame);
+        inOrder = (p->start == f->offset && p->end == f->offset + f->length && f->at == at);
+        at += f->size;
+    }
+
+    if (inOrder) {
+        for (guint i = 0; i < plan->len; ++i) {
+            const CompressPiece* p = &g_array_index (plan, CompressPiece, i);
+            g_array_append_val (ordered, g_array_index (idx->frames, CompressFrame, p->frame));
+        }
+        if (0 != ftruncate (fd, at)) {
+            gf_error (error, "truncate '%s' error: %s", fileName, strerror (errno));
+            goto out;
+        }
+    } else {
+        logd ("reorder %u frames of '%s'", plan->len, fileName);
+        tmp = open (tmpName, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+        if (tmp < 0) {
+            gf_error (error, "open '%s' error: %s", tmpName, strerror (errno));
+            goto out;
+        }
+
+        at = 0;
+        for (guint i = 0; i < plan->len; ++i) {
+            const CompressPiece* p = &g_array_index (plan, CompressPiece, i);
+            const CompressFrame* f = &g_array_index (idx->frames, CompressFrame, p->frame);
+            CompressFrame nf = { p->start, at, (gint32) (p->end - p->start), f->size };
+
+            if (p->start == f->offset && p->end == f->offset + f->length) {
+                if (!compress_copy (fd, tmp, f->at, at, f->size)) {
+                    gf_error (error, "copy frame at %lld of '%s' error: %s", (long long) f->at, fileName, strerror (errno));
+                    goto out;
+                }
+            } else {
+                // partly written over later, what is left of it becomes a frame of its own
+                if (!dctx && !(dctx = ZSTD_createDCtx ())) {
+                    gf_error (error, "create zstd context error");
+                    goto out;
+                }
+                g_autofree char* plain = compress_decode (fd, f, dctx, error);
+                const char* data = NULL;
+                if (!plain || (nf.size = compress_frame (level, plain + (p->start - f->offset), nf.length, &data, error)) < 0) {
+                    goto out;
+                }
+                if (nf.size != pwrite (tmp, data, nf.size, at)) {
+                    gf_error (error, "write '%s' error: %s", tmpName, strerror (errno));
+                    goto out;
+                }
+            }
+            g_array_append_val (ordered, nf);
+            at += nf.size;
+        }
+
+        if (0 != rename (tmpName, fileName)) {
+            gf_error (error, "rename '%s' error: %s", tmpName, strerror (errno));
+            goto out;
+        }
+
+        // the caller keeps its descriptor, it now points at the reordered file
+        dup2 (tmp, fd);
+    }
+
+    idxTmp = open (idxTmpName, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (idxTmp < 0 || !compress_write_header (idxTmp)
+        || (ssize_t) (ordered->len * sizeof (CompressFrame)) != write (idxTmp, ordered->data, ordered->len * sizeof (CompressFrame))
+        || 0 != rename (idxTmpName, idx->fileName)) {
+        gf_error (error, "write '%s' error: %s", idxTmpName, strerror (errno));
+        goto out;
+    }
+
+    g_mutex_lock (&idx->lock);
+    g_array_set_size (idx->frames, 0);
+    g_array_append_vals (idx->frames, ordered->data, ordered->len);
+    idx->tail = at;
+    dup2 (idxTmp, idx->fd);
+    g_mutex_unlock (&idx->lock);
+
+    ret = true;
+
+out:
+    if (tmp >= 0)       close (tmp);
+    if (tmp >= 0 && !ret)   unlink (tmpName);
+    if (idxTmp >= 0)    close (idxTmp);
+    if (idxTmp >= 0 && !ret)    unlink (idxTmpName);
+    if (dctx)           ZSTD_freeDCtx (dctx);
+    if (plan)           g_array_free (plan, true);
+    g_array_free (ordered, true);
+
+    return ret;
+}
+
+bool compress_read (const char* fileName, CompressReadFunc func, void* udata, GError** error)
+{
+    g_return_val_if_fail (fileName && func, false);
+
+    bool ret = false;
+    ZSTD_DCtx* dctx = NULL;
+    GArray* plan = NULL;
+    GArray* frames = g_array_new (false, false, sizeof (CompressFrame));
+    g_autofree char* idxName = g_strdup_printf ("%s%s", fileName, COMPRESS_INDEX_SUFFIX);
+
+    int fd = open (fileName, O_RDONLY | O_CLOEXEC);
+    int idxFd = open (idxName, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || idxFd < 0) {
+        gf_error (error, "open '%s' error: %s", fd < 0 ? fileName : idxName, strerror (errno));
+        goto out;
+    }
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (!compress_load (idxFd, frames, idxName, error)) {
+        goto out;
+    }
+
+    long long length = 0;
+    for (guint i = 0; i < frames->len; ++i) {
+        const CompressFrame* f = &g_array_index (frames, CompressFrame, i);
+        length = MAX (length, f->offset + f->length);
+    }
+
+    if (!(plan = compress_plan (frames, length, error))) {
+        goto out;
+    }
+
+    if (!(dctx = ZSTD_createDCtx ())) {
+        gf_error (error, "create zstd context error");
+        goto out;
+    }
+
+    for (guint i = 0; i < plan->len; ++i) {
+        const CompressPiece* p = &g_array_index (plan, CompressPiece, i);
+        const CompressFrame* f = &g_array_index (frames, CompressFrame, p->frame);
+        g_autofree char* plain = compress_decode (fd, f, dctx, error);
+        if (!plain) {
+            goto out;
+        }
+        if (!func (plain + (p->start - f->offset), (int) (p->end - p->start), udata)) {
+            break;
+        }
+    }
+    ret = true;
+
+out:
+    if (fd >= 0)        close (fd);
+    if (idxFd >= 0)     close (idxFd);
+    if (dctx)           ZSTD_freeDCtx (dctx);
+    if (plan)           g_array_free (plan, true);
+    g_array_free (frames, true);
+
+    return ret;
+}
+
+static void compress_context_init (void)
+{
+    pthread_key_create (&gContextKey, compress_context_free);
+}
+
+static void compress_context_free (void* arg)
+{
+    CompressContext* ctx = arg;
+
+    if (ctx->cctx)      ZSTD_freeCCtx (ctx->cctx);
+    if (ctx->buf)       g_free (ctx->buf);
+    g_free (ctx);
+}
+
+static bool compress_write_header (int fd)
+{
+    return strlen (COMPRESS_INDEX_MAGIC) == write (fd, COMPRESS_INDEX_MAGIC, strlen (COMPRESS_INDEX_MAGIC));
+}
+
+/**
+ * @brief 读出索引里的所有帧, 空文件写上文件头; 结尾不完整的记录是写到一半中断的, 丢掉
+ */
+static bool compress_load (int fd, GArray* frames, const char* fileName, GError** error)
+{
+    g_autofree char* data = NULL;
+    gsize len = 0;
+    g_autoptr (GError) err = NULL;
+    if (!g_file_get_contents (fileName, &data, &len, &err)) {
+        gf_error (error, "read '%s' error: %s", fileName, err ? err->message : "");
+        return false;
+    }
+
+    gsize magic = strlen (COMPRESS_INDEX_MAGIC);
+    if (0 == len) {
+        if (!compress_write_header (fd)) {
+            gf_error (error, "write '%s' error: %s", fileName, strerror (errno));
+            return false;
+        }
+        return true;
+    } else if (len < magic || 0 != memcmp (data, COMPRESS_INDEX_MAGIC, magic)) {
+        gf_error (error, "'%s' is not a compress index", fileName);
+        return false;
+    }
+
+    gsize count = (len - magic) / sizeof (CompressFrame);
+    g_array_append_vals (frames, data + magic, count);
+    if (magic + count * sizeof (CompressFrame) != len && 0 != ftruncate (fd, magic + count * sizeof (CompressFrame))) {
+        gf_error (error, "truncate '%s' error: %s", fileName, strerror (errno));
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief 帧之间的比较: 后写的在前
+ */
+static inline bool compress_later (int a, int b)
+{
+    return a > b;
+}
+
+static int compress_compare_offset (const void* a, const void* b, void* frames)
+{
+    long long oa = g_array_index ((GArray*) frames, CompressFrame, *(const int*) a).offset;
+    long long ob = g_array_index ((GArray*) frames, CompressFrame, *(const int*) b).offset;
+
+    return (oa > ob) - (oa < ob);
+}
+
+static int compress_compare_bound (const void* a, const void* b)
+{
+    long long la = *(const long long*) a;
+    long long lb = *(const long long*) b;
+
+    return (la > lb) - (la < lb);
+}
+
+/**
+ * @brief 算出 [0, length) 的每一段取自哪一帧, 同一段被写过多次的取最后写的
+ *
+ * 按偏移扫过所有帧的边界, 用一个按写入顺序的大根堆记住当前覆盖着的帧
+ */
+static GArray* compress_plan (const GArray* frames, long long length, GError** error)
+{
+    int n = frames->len;
+    GArray* plan = g_array_new (false, false, sizeof (CompressPiece));
+    int* byOffset = g_malloc (sizeof (int) * MAX (n, 1));
+    int* heap = g_malloc (sizeof (int) * MAX (n, 1));
+    long long* bounds = g_malloc (sizeof (long long) * MAX (2 * n, 1));
+    int heapLen = 0;
+
+    for (int i = 0; i < n; ++i) {
+        const CompressFrame* f = &g_array_index (frames, CompressFrame, i);
+        byOffset[i] = i;
+        bounds[2 * i] = f->offset;
+        bounds[2 * i + 1] = f->offset + f->length;
+    }
+    qsort_r (byOffset, n, sizeof (int), compress_compare_offset, (void*) frames);
+    qsort (bounds, 2 * n, sizeof (long long), compress_compare_bound);
+
+    long long pos = 0;
+    int next = 0;
+    for (int b = 0; b < 2 * n && pos < length; ++b) {
+        long long start = bounds[b];
+        long long end = (b + 1 < 2 * n) ? MIN (bounds[b + 1], length) : length;
+        if (end <= start || end <= pos) {
+            continue;
+        }
+
+        // frames that begin here come in, frames that ended leave
+        while (next < n && g_array_index (frames, CompressFrame, byOffset[next]).offset <= start) {
+            int k = heapLen++;
+            heap[k] = byOffset[next++];
+            while (k > 0 && compress_later (heap[k], heap[(k - 1) / 2])) {
+                int t = heap[k]; heap[k] = heap[(k - 1) / 2]; heap[(k - 1) / 2] = t;
+                k = (k - 1) / 2;
+            }
+        }
+        while (heapLen > 0) {
+            const CompressFrame* top = &g_array_index (frames, CompressFrame, heap[0]);
+            if (top->offset + top->length > start) {
+                break;
+            }
+            heap[0] = heap[--heapLen];
+            for (int k = 0;;) {
+                int c = 2 * k + 1;
+                if (c >= heapLen) break;
+                if (c + 1 < heapLen && compress_later (heap[c + 1], heap[c])) ++c;
+                if (!compress_later (heap[c], heap[k])) break;
+                int t = heap[k]; heap[k] = heap[c]; heap[c] = t;
+                k = c;
+            }
+        }
+
+        if (0 == heapLen || start > pos) {
+            break;
+        }
+
+        CompressPiece* last = plan->len ? &g_array_index (plan, CompressPiece, plan->len - 1) : NULL;
+        if (last && last->frame == heap[0] && last->end == start) {
+            last->end = end;
+        } else {
+            CompressPiece p = { heap[0], start, end };
+            g_array_append_val (plan, p);
+        }
+        pos = end;
+    }
+
+    g_free (byOffset);
+    g_free (heap);
+    g_free (bounds);
+
+    if (pos < length) {
+        gf_error (error, "compressed data is missing at offset %lld", pos);
+        g_array_free (plan, true);
+        return NULL;
+    }
+
+    return plan;
+}
+
+static char* compress_decode (int fd, const CompressFrame* f, ZSTD_DCtx* dctx, GError** error)
+{
+    char* src = g_malloc (MAX (f->size, 1));
+    char* dst = g_malloc (MAX (f->length, 1));
+
+    if (f->size != pread (fd, src, f->size, f->at)) {
+        gf_error (error, "read frame at %lld error: %s", (long long) f->at, strerror (errno));
+        goto error;
+    }
+
+    size_t n = ZSTD_decompressDCtx (dctx, dst, f->length, src, f->size);
+    if (ZSTD_isError (n) || n != (size_t) f->length) {
+        gf_error (error, "frame at %lld is corrupt: %s", (long long) f->at, ZSTD_isError (n) ? ZSTD_getErrorName (n) : "wrong length");
+        goto error;
+    }
+    g_free (src);
+
+    return dst;
+
+error:
+    g_free (src);
+    g_free (dst);
+    return NULL;
+}
+
+static bool compress_copy (int in, int out, long long from, long long to, long long len)
+{
+    while (len > 0) {
+        loff_t inOff = from, outOff = to;
+        ssize_t n = copy_file_range (in, &inOff, out, &outOff, len, 0);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        } else if (n < 0 && (EXDEV == errno || EINVAL == errno || ENOSYS == errno || EOPNOTSUPP == errno)) {
+            char buf[64 << 10];
+            n = pread (in, buf, MIN ((long long) sizeof (buf), len), from);
+            if (n > 0 && n != pwrite (out, buf, n, to)) {
+                return false;
+            }
+        }
+        if (n <= 0) {
+            return false;
+        }
+        from += n;
+        to += n;
+        len -= n;
+    }
+
+    return true;
+}
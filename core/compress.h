@@ -0,0 +1,78 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define COMPRESS_LEVEL_DEFAULT      3
+#define COMPRESS_FRAME_MAX          (1 << 20)       // 每帧解压后的最大长度, 和写缓冲区一样大
+#define COMPRESS_INDEX_SUFFIX       ".idx"
+#define COMPRESS_INDEX_MAGIC        "GDZIDX01"
+
+typedef struct _CompressFrame       CompressFrame;
+typedef struct _CompressIndex       CompressIndex;
+
+typedef bool (*CompressReadFunc) (const char* data, int len, void* udata);
+
+/**
+ * @brief 压缩文件里的一帧, 每帧是一个独立的 zstd 帧, 可以单独解压
+ */
+struct _CompressFrame
+{
+    gint64                  offset;                 // 解压后在原文件中的偏移
+    gint64                  at;                     // 在压缩文件中的偏移
+    gint32                  length;                 // 解压后的长度
+    gint32                  size;                   // 压缩后的长度
+};
+
+/**
+ * @brief 压缩文件的定位索引 "<压缩文件>.idx"
+ *
+ * 文件头 COMPRESS_INDEX_MAGIC 之后是按写入顺序排列的 CompressFrame。
+ * 分段下载时各段各自压缩, 帧按写完的顺序追加到压缩文件里, 同一段数据写了多次时以最后写的为准;
+ * compress_finish() 把帧按原文件的顺序重排, 之后压缩文件就是普通的多帧 zstd 文件,
+ * 索引按偏移排列, 可以用来随机读取。
+ */
+struct _CompressIndex
+{
+    GMutex                  lock;
+    int                     fd;
+    char                   *fileName;
+    GArray                 *frames;                 // CompressFrame, 写入顺序
+    long long               tail;                   // 压缩文件中最后一帧的结尾
+};
+
+/**
+ * @brief 打开或创建压缩文件 fileName 的索引
+ * @param truncate 为 true 时清空已有的索引
+ */
+CompressIndex*  compress_index_open     (const char* fileName, bool truncate, GError** error);
+void            compress_index_free     (CompressIndex* idx);
+
+/**
+ * @brief 记录已经写到压缩文件里的一帧
+ */
+bool            compress_index_add      (CompressIndex* idx, const CompressFrame* frame, GError** error);
+
+/**
+ * @brief 用当前线程自己的压缩上下文把 data 压缩成一帧
+ * @param out 返回压缩后的数据, 属于当前线程, 下次调用前有效
+ * @return 压缩后的长度, 出错返回 -1
+ */
+int             compress_frame          (int level, const void* data, int len, const char** out, GError** error);
+
+/**
+ * @brief 按原文件的顺序重排压缩文件 fd(路径 fileName), 并重写索引
+ *
+ * 已经按顺序排好时只重写索引; 否则用 copy_file_range 把帧按顺序复制到新文件再替换,
+ * 被后来的写入部分覆盖的帧解压后重新压缩剩下的部分。完成后 fd 指向新文件。
+ * @param length 原文件的长度, 这之前的数据缺了任何一段都失败
+ */
+bool            compress_finish         (int fd, const char* fileName, CompressIndex* idx, long long length, int level, GError** error);
+
+/**
+ * @brief 按原文件的顺序解压整个压缩文件, 每段数据交给 func, func 返回 false 时停止
+ */
+bool            compress_read           (const char* fileName, CompressReadFunc func, void* udata, GError** error);
+
+#endif // COMPRESS_H
@@ -1,5 +1,28 @@
 #include "dm-http.h"
 
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "piece.h"
+#include "utils.h"
+#include "store.h"
+#include "output.h"
+#include "http-range.h"
+#include "http-segment.h"
+#include "zsync.h"
+#include "extract.h"
+
+static bool dm_http_finish (DownloadData* d, bool streamed, bool extracted);
+static bool dm_http_extract (DownloadData* d, bool extracted);
+static bool dm_http_verify (DownloadData* d, Checksum* c, bool streamed);
+static bool dm_http_from_store (DownloadData* d);
+static void dm_http_to_store (DownloadData* d, Checksum* c);
+static bool dm_http_repair (DownloadData* d);
+static bool dm_http_refetch (long long offset, const char* data, int len, long long total, void* udata);
+static bool dm_http_hash (const char* data, int len, void* udata);
+
 bool dm_http_init(DownloadData *d)
 {
     g_return_val_if_fail (d && d->uri, false);
@@ -7,6 +30,55 @@ bool dm_http_init(DownloadData *d)
     Http* http = http_new (d->uri);
     g_return_val_if_fail (http, false);
 
+    if (d->ioTimeout >= 0)          http->ioTimeout = d->ioTimeout;
+    if (d->lowSpeedLimit >= 0)      http->lowSpeedLimit = d->lowSpeedLimit;
+    if (d->lowSpeedTime >= 0)       http->lowSpeedTime = d->lowSpeedTime;
+    http->writeback = d->writeback;
+    http->compress = d->compress;
+
+    // both read the file as it is on disk, which is compressed
+    if (d->compress > 0 && (d->pieces || d->store)) {
+        logi ("'%s' is compressed, piece checks and the store are not used", d->outputName);
+        g_free (d->pieces);
+        g_free (d->store);
+        d->pieces = NULL;
+        d->store = NULL;
+    }
+
+    g_autoptr (GError) error = NULL;
+    if (d->extract) {
+        http->extract = extract_new (d->extract, &error);
+        if (!http->extract) {
+            loge ("download '%s' error: %s", d->outputName, error ? error->message : "");
+            http_destroy (http);
+            return false;
+        }
+
+        // a single stream that is not kept never touches the disk, then there is no file for those
+        http->discard = !d->extractKeep && !d->mirrors && d->connections <= 1;
+        if (http->discard && (d->pieces || d->store)) {
+            logi ("'%s' is not kept, piece checks and the store are not used", d->outputName);
+            g_free (d->pieces);
+            g_free (d->store);
+            d->pieces = NULL;
+            d->store = NULL;
+        }
+    }
+
+    http->checksum = checksum_new ();
+    if (!http->checksum || (d->checksum && !checksum_expect (http->checksum, d->checksum, &error))) {
+        loge ("download '%s' error: %s", d->outputName, error ? error->message : "malloc checksum error");
+        http_destroy (http);
+        return false;
+    }
+
+    // what the HEAD probe was told about the content is checked too
+    checksum_expect_digest_header (http->checksum, d->digest);
+    checksum_expect_content_md5 (http->checksum, d->contentMD5);
+    if (d->store) {
+        checksum_want (http->checksum, CHECKSUM_SHA256);
+    }
+
     d->data = http;
 
     return true;
@@ -16,7 +88,90 @@ bool dm_http_download(DownloadData *d)
 {
     g_return_val_if_fail (d && d->data, false);
 
-    return http_request ((Http*)d->data, d->outputName);
+    if (d->zsync) {
+        g_autoptr (GError) error = NULL;
+        if (!zsync_download (d->uri, d->zsync, d->outputName, &error)) {
+            loge ("zsync update '%s' error: %s", d->outputName, error ? error->message : "");
+            return false;
+        }
+        return true;
+    }
+
+    if (d->ranges) {
+        g_autoptr (GError) error = NULL;
+        GList* ranges = http_range_parse (d->ranges, &error);
+        bool ok = ranges && http_range_download (d->uri, ranges, d->outputName, d->splitRanges, &error);
+        if (!ok) {
+            loge ("range download '%s' error: %s", d->outputName, error ? error->message : "");
+        }
+        if (ranges) g_list_free_full (ranges, g_free);
+        return ok;
+    }
+
+    // an earlier run got as far as checking the pieces, it goes on from there
+    Http* http = d->data;
+    if (d->pieces && piece_state_exists (d->outputName) && g_file_test (d->outputName, G_FILE_TEST_IS_REGULAR)) {
+        logi ("'%s' is downloaded, checking the remaining pieces", d->outputName);
+        return dm_http_finish (d, false, false);
+    }
+
+    if (d->store && dm_http_from_store (d)) {
+        return true;
+    }
+
+    if (d->mirrors || d->connections > 1) {
+        g_autoptr (GError) error = NULL;
+        HttpSegmentOptions opt;
+        http_segment_options_init (&opt);
+        if (d->hedgeRatio >= 0)     opt.hedgeRatio = d->hedgeRatio;
+        if (d->hedgeBudget >= 0)    opt.hedgeBudget = d->hedgeBudget;
+        opt.mmap = d->mmap;
+        opt.writeback = d->writeback;
+        opt.compress = d->compress;
+
+        // a single source is split over several connections instead
+        GList single = { d->uri, NULL, NULL };
+        if (!d->mirrors) {
+            opt.connections = d->connections;
+        }
+
+        // what an earlier attempt wrote is kept and only the missing ranges are fetched again
+        if (!d->segment && (d->segment = g_malloc (sizeof (HttpSegmentState)))) {
+            http_segment_state_init (d->segment);
+        }
+        HttpSegmentState* state = d->segment;
+        long long done = state ? state->doneBytes : 0;
+
+        if (!http_segment_download (d->mirrors ? d->mirrors : &single, d->outputName, &opt, state, &error)) {
+            loge ("segmented download '%s' error: %s", d->outputName, error ? error->message : "");
+            d->retryable = state && http_error_retryable (state->errorKind);
+            d->retryAfter = state ? state->retryAfter : -1;
+
+            // an attempt that got further earns a fresh set of retries
+            if (state && state->doneBytes > done) {
+                d->attempts = 0;
+            }
+            return false;
+        }
+
+        // the segments arrive out of order, the file is hashed and extracted once it is complete
+        return dm_http_finish (d, false, false);
+    }
+
+    long long written = http->written;
+    if (!http_request (http, d->outputName)) {
+        loge ("download '%s' error: %s", d->outputName, http->error ? http->error->message : "");
+        d->retryable = http_error_retryable (http->errorKind);
+        d->retryAfter = http->retryAfter;
+
+        // an attempt that got further earns a fresh set of retries
+        if (http->written > written) {
+            d->attempts = 0;
+        }
+        return false;
+    }
+
+    return dm_http_finish (d, http->checksum->length == http->written, true);
 }
 
 void dm_http_free(DownloadData *d)
@@ -25,5 +180,262 @@ void dm_http_free(DownloadData *d)
 
     if (d->data)        http_destroy (d->data);
     if (d->outputName)  g_free (d->outputName);
+    if (d->finalName)   g_free (d->finalName);
     if (d->uri)         g_uri_unref (d->uri);
+    if (d->mirrors)     g_list_free_full (d->mirrors, (void*) g_uri_unref);
+    if (d->ranges)      g_free (d->ranges);
+    if (d->zsync)       g_free (d->zsync);
+    if (d->checksum)    g_free (d->checksum);
+    if (d->pieces)      g_free (d->pieces);
+    if (d->store)       g_free (d->store);
+    if (d->extract)     g_free (d->extract);
+    if (d->etag)        g_free (d->etag);
+    if (d->digest)      g_free (d->digest);
+    if (d->contentMD5)  g_free (d->contentMD5);
+    if (d->segment) {
+        http_segment_state_clear (d->segment);
+        g_free (d->segment);
+    }
+}
+
+/**
+ * @brief 下载完以后: 分块修复, 校验, 放进存储, 解包
+ * @param streamed 下载时已经算好了校验值
+ * @param extracted 下载时已经解包了
+ */
+static bool dm_http_finish (DownloadData* d, bool streamed, bool extracted)
+{
+    Http* http = d->data;
+
+    // a repaired file is no longer what went through the checksum and the extractor
+    if (d->pieces) {
+        if (!dm_http_repair (d)) {
+            return false;
+        }
+        streamed = false;
+        extracted = false;
+    }
+
+    if (!dm_http_verify (d, http->checksum, streamed)) {
+        return false;
+    }
+
+    if (d->store) {
+        dm_http_to_store (d, http->checksum);
+    }
+
+    if (d->extract && !dm_http_extract (d, extracted)) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief 没能边下载边解包时从磁盘上的归档解包, 之后不保留的归档被删除
+ */
+static bool dm_http_extract (DownloadData* d, bool extracted)
+{
+    Http* http = d->data;
+
+    if (http->discard) {
+        return true;
+    }
+
+    if (!extracted) {
+        g_autoptr (GError) error = NULL;
+        struct stat st;
+        if (0 != stat (d->outputName, &st)) {
+            loge ("extract '%s' error: %s", d->outputName, strerror (errno));
+            return false;
+        }
+        logi ("extract '%s' from disk", d->outputName);
+        if (!extract_restart (http->extract, d->outputName, st.st_size, &error) || !extract_finish (http->extract, &error)) {
+            loge ("extract '%s' error: %s", d->outputName, error ? error->message : "");
+            return false;
+        }
+    }
+
+    if (!d->extractKeep && 0 != unlink (d->outputName)) {
+        logi ("remove '%s' error: %s", d->outputName, strerror (errno));
+    }
+
+    return true;
+}
+
+/**
+ * @brief 校验下载完的文件, 不一致时任务失败并把文件移到隔离目录
+ * @param streamed 校验值已经在下载时算好, 否则重新读文件计算
+ */
+static bool dm_http_verify (DownloadData* d, Checksum* c, bool streamed)
+{
+    if (!c || !checksum_active (c)) {
+        return true;
+    }
+
+    g_autoptr (GError) error = NULL;
+    if (!streamed || !checksum_complete (c)) {
+        logd ("hash '%s' from disk", d->outputName);
+        if (d->compress > 0) {
+            checksum_reset (c);
+        }
+        if (d->compress > 0 ? !compress_read (d->outputName, dm_http_hash, c, &error) : !checksum_file (c, d->outputName, &error)) {
+            loge ("verify '%s' error: %s", d->outputName, error ? error->message : "");
+            return false;
+        }
+    }
+
+    if (checksum_verify (c, &error)) {
+        if (checksum_expected (c)) {
+            logi ("'%s' verified (%lld bytes)", d->outputName, c->length);
+        }
+        return true;
+    }
+
+    g_autoptr (GError) moveError = NULL;
+    g_autofree char* moved = checksum_quarantine (d->outputName, &moveError);
+    loge ("download '%s' corrupt: %s, %s %s", d->outputName, error ? error->message : "",
+          moved ? "moved to" : "can not quarantine:", moved ? moved : (moveError ? moveError->message : ""));
+    d->retryable = false;
+
+    return false;
+}
+
+/**
+ * @brief 分块校验下载好的文件, 只重新下载坏块, 直到全部正确或超过 PIECE_MAX_ROUNDS 轮
+ */
+static bool dm_http_repair (DownloadData* d)
+{
+    if (!d->pieces) {
+        return true;
+    }
+
+    bool ret = false;
+    Output* out = NULL;
+    g_autoptr (GError) error = NULL;
+    PieceSet* ps = piece_set_new (d->pieces, &error);
+    if (!ps || !piece_set_bind (ps, d->outputName, &error)) {
+        goto out;
+    }
+
+    for (int round = 0;; ++round) {
+        int bad = piece_verify (ps, d->outputName, &error);
+        if (bad < 0) {
+            goto out;
+        } else if (0 == bad) {
+            break;
+        } else if (round >= PIECE_MAX_ROUNDS) {
+            gf_error (&error, "%d piece(s) still bad after %d re-fetch(es)", bad, round);
+            g_autofree char* moved = checksum_quarantine (d->outputName, NULL);
+            if (moved) {
+                logi ("'%s' moved to '%s'", d->outputName, moved);
+                piece_state_remove (d->outputName);
+            }
+            goto out;
+        }
+
+        GList* ranges = piece_bad_ranges (ps);
+        if (!out) {
+            out = output_open (d->outputName, false, &error);
+        }
+        logi ("'%s': re-fetching %d bad piece(s)", d->outputName, bad);
+        bool ok = out && ranges && http_range_fetch (d->uri, ranges, dm_http_refetch, out, &error);
+        if (ranges) g_list_free_full (ranges, g_free);
+        if (!ok) {
+            // the pieces that passed stay verified for the retry
+            d->retryable = true;
+            goto out;
+        }
+        piece_set_refetched (ps);
+    }
+    ret = true;
+    piece_state_remove (d->outputName);
+
+out:
+    if (!ret) {
+        loge ("verify pieces of '%s' error: %s", d->outputName, error ? error->message : "");
+    }
+    if (out)    output_close (out);
+    if (ps)     piece_set_free (ps);
+
+    return ret;
+}
+
+static bool dm_http_refetch (long long offset, const char* data, int len, long long total, void* udata)
+{
+    return output_write (udata, offset, data, len, NULL);
+}
+
+/**
+ * @brief 已知的摘要(或者允许时的 ETag)在存储里有对应的内容时直接从存储取得, 不再下载
+ */
+static bool dm_http_from_store (DownloadData* d)
+{
+    Checksum* c = ((Http*) d->data)->checksum;
+
+    GList* keys = NULL;
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        if (c->expected[i]) {
+            keys = g_list_append (keys, g_strdup_printf ("%s:%s", checksum_type_name (i), c->expected[i]));
+        }
+    }
+    if (d->storeEtag && d->etag && !g_str_has_prefix (d->etag, "W/")) {
+        keys = g_list_append (keys, g_strdup_printf ("etag:%s:%s", g_uri_get_host (d->uri), d->etag));
+    }
+
+    bool ret = false;
+    for (GList* l = keys; NULL != l && !ret; l = l->next) {
+        g_autofree char* object = store_lookup (d->store, l->data);
+        if (!object) continue;
+
+        g_autoptr (GError) error = NULL;
+        StoreLink how = store_materialize (object, d->outputName, &error);
+        if (STORE_LINK_NONE == how) {
+            logi ("'%s' is in the store but can not be used: %s", d->outputName, error ? error->message : "");
+            continue;
+        }
+        logi ("'%s' found in the store by %s, %s instead of download", d->outputName, (char*) l->data, store_link_name (how));
+        ret = true;
+    }
+    g_list_free_full (keys, g_free);
+
+    return ret;
+}
+
+/**
+ * @brief 把校验过的文件放进存储, 记录能找到它的别名; 失败不影响下载结果
+ */
+static void dm_http_to_store (DownloadData* d, Checksum* c)
+{
+    const char* sha256 = c->digest[CHECKSUM_SHA256];
+    if (!sha256[0]) {
+        return;
+    }
+
+    bool deduplicated = false;
+    g_autoptr (GError) error = NULL;
+    if (!store_insert (d->store, d->outputName, sha256, &deduplicated, &error)) {
+        logi ("'%s' not stored: %s", d->outputName, error ? error->message : "");
+        return;
+    }
+    logi ("'%s' %s sha256:%s", d->outputName, deduplicated ? "is a duplicate of" : "stored as", sha256);
+
+    // every other digest the content was checked against leads to it as well
+    for (int i = 0; i < CHECKSUM_N; ++i) {
+        if (CHECKSUM_SHA256 != i && c->expected[i] && c->digest[i][0]) {
+            g_autofree char* key = g_strdup_printf ("%s:%s", checksum_type_name (i), c->digest[i]);
+            store_alias (d->store, key, sha256, NULL);
+        }
+    }
+    if (d->storeEtag && d->etag && !g_str_has_prefix (d->etag, "W/")) {
+        g_autofree char* key = g_strdup_printf ("etag:%s:%s", g_uri_get_host (d->uri), d->etag);
+        store_alias (d->store, key, sha256, NULL);
+    }
+}
+
+static bool dm_http_hash (const char* data, int len, void* udata)
+{
+    checksum_update (udata, data, len);
+
+    return true;
 }
@@ -1,17 +1,56 @@
 #include "download-manager.h"
 
 #include <stdlib.h>
+#include <sys/stat.h>
 
 #include "log.h"
+#include "mover.h"
+#include "output.h"
+#include "compress.h"
 #include "dm-http.h"
+#include "http-probe.h"
 #include "thread-pool.h"
+#include "download-queue.h"
+
+#define DOWNLOAD_SEGMENT_SIZE       (8 << 20)       // 分段下载时每个连接至少下载的字节数
+#define DOWNLOAD_MAX_SEGMENTS       4
+
+#define DOWNLOAD_MAX_RETRIES        8
+#define DOWNLOAD_RETRY_BASE         1000            // 第一次重试前等待的毫秒数, 之后每次翻倍
+#define DOWNLOAD_RETRY_MAX          (60 * 1000)
+#define DOWNLOAD_RETRY_AFTER_MAX    3600            // 最多按服务器的 Retry-After 等这么多秒
+#define DOWNLOAD_DEVICE_TASKS       4               // 输出到同一个设备的下载最多同时进行这么多个
+
+/**
+ * @brief 输出到同一个块设备的下载, 超过上限的排队, 不占线程池的线程
+ */
+typedef struct
+{
+    guint64         dev;
+    int             running;
+    GList*          waiting;        // Downloader
+} DownloadDevice;
 
 
 static GHashTable* gSchemaAndPortHash = NULL;
 static GHashTable* gSchemaAndDownloader = NULL;
 static GHashTable* gHostAndUserInfo = NULL;
 
+static GMutex gDeviceLock;
+static GList* gDevices = NULL;
+static int gDeviceTasks = DOWNLOAD_DEVICE_TASKS;
+static int gActive = 0;                                 // 正在线程里执行的下载
+
 void* download_worker (Downloader* d);
+void* download_schedule (GList* tasks);
+static void* download_next (void* unused);
+static void download_submit (Downloader* d, const char* uri);
+static gboolean download_retry (void* d);
+static void download_run (Downloader* d, const char* uri);
+static guint64 download_device (const Downloader* d);
+static bool download_device_enter (Downloader* d);
+static void download_device_leave (Downloader* d);
+static guint download_backoff (int attempt, int retryAfter);
 
 
 bool protocol_register ()
@@ -121,6 +160,19 @@ void download (const DownloadTask *data)
 {
     g_return_if_fail (data);
 
+    if (data->staging) {
+        mover_set_limits (data->movers, data->moveRate);
+    }
+
+    // per disk budgets are shared by all downloads
+    output_set_device_limits (data->ioWriters, data->ioDepth);
+    if (data->ioTasks > 0) {
+        g_mutex_lock (&gDeviceLock);
+        gDeviceTasks = data->ioTasks;
+        g_mutex_unlock (&gDeviceLock);
+    }
+
+    GList* tasks = NULL;
     for (GList* l = data->uris; NULL != l; l = l->next) {
         g_autofree gchar* name = NULL;
 
@@ -157,11 +209,50 @@ void download (const DownloadTask *data)
         dd->data = data1;
 
         if (l->data)        data1->uri = g_uri_ref (l->data);
+        data1->length = -1;
+
+        // all uris are mirrors of one file: a single task named after the first one
+        if (data->mirrors && g_list_length (data->uris) > 1) {
+            data1->mirrors = g_list_copy_deep (data->uris, (void*) g_uri_ref, NULL);
+        }
+        data1->hedgeRatio = data->hedgeRatio;
+        data1->hedgeBudget = data->hedgeBudget;
+        data1->ranges = g_strdup (data->ranges);
+        data1->splitRanges = data->splitRanges;
+        data1->zsync = g_strdup (data->zsync);
+        data1->ioTimeout = data->ioTimeout;
+        data1->lowSpeedLimit = data->lowSpeedLimit;
+        data1->lowSpeedTime = data->lowSpeedTime;
+        data1->mmap = data->mmap;
+        data1->writeback = data->writeback;
+        data1->compress = data->compress;
+        data1->extract = g_strdup (data->extract);
+        data1->extractKeep = data->extractKeep;
+        data1->checksum = g_strdup (data->checksum);
+        data1->pieces = g_strdup (data->pieces);
+        data1->store = g_strdup (data->store);
+        data1->storeEtag = data->storeEtag;
+        data1->priority = data->priority;
 
         if (!name || g_str_has_suffix (turi, "/")) {
             name = g_base64_encode ((void*) turi, strlen(turi));
         }
 
+        // ranges and zsync are not whole archives
+        if (data->ranges || data->zsync) {
+            g_free (data1->extract);
+            data1->extract = NULL;
+        }
+
+        // ranges and zsync write into the plain file, the extractor reads the archive as it is
+        if (data->compress > 0 && !data->ranges && !data->zsync && !data1->extract) {
+            char* zname = g_strdup_printf ("%s.zst", name);
+            g_free (name);
+            name = zname;
+        } else {
+            data1->compress = 0;
+        }
+
         if (data->dir) {
             data1->outputName = g_strdup_printf ("%s/%s", data->dir, name);
         } else {
@@ -169,6 +260,16 @@ void download (const DownloadTask *data)
             data1->outputName = g_strdup_printf ("%s/%s", dir, name);
         }
 
+        // ranges and zsync work on the file where it is, the rest lands in the staging dir first
+        if (data->staging && !data->ranges && !data->zsync && (!data1->extract || data1->extractKeep)) {
+            if (g_file_test (data1->outputName, G_FILE_TEST_EXISTS)) {
+                logi ("file '%s' already exists!", data1->outputName);
+                goto error;
+            }
+            data1->finalName = data1->outputName;
+            data1->outputName = g_strdup_printf ("%s/%s", data->staging, name);
+        }
+
         // download methos
         if (!g_hash_table_contains (gSchemaAndDownloader, schema)) {
             logd ("not found '%s' downloader", turi);
@@ -177,16 +278,144 @@ void download (const DownloadTask *data)
 
         dd->method = (DownloadMethod*) g_hash_table_lookup (gSchemaAndDownloader, schema);
 
-        thread_pool_add_work ((void*) download_worker, dd);
+        tasks = g_list_append (tasks, dd);
+
+        if (data1->mirrors) {
+            break;
+        }
 
         continue;
 
     error:
+        if (dd && dd->data && dd->data->mirrors) {
+            g_list_free_full (dd->data->mirrors, (void*) g_uri_unref);
+        }
+        if (dd && dd->data && dd->data->ranges) {
+            g_free (dd->data->ranges);
+        }
+        if (dd && dd->data && dd->data->zsync) {
+            g_free (dd->data->zsync);
+        }
+        if (dd && dd->data && dd->data->checksum) {
+            g_free (dd->data->checksum);
+        }
+        if (dd && dd->data && dd->data->pieces) {
+            g_free (dd->data->pieces);
+        }
+        if (dd && dd->data && dd->data->store) {
+            g_free (dd->data->store);
+        }
+        if (dd && dd->data && dd->data->extract) {
+            g_free (dd->data->extract);
+        }
+        if (dd && dd->data && dd->data->outputName) {
+            g_free (dd->data->outputName);
+        }
+        if (dd && dd->data && dd->data->finalName) {
+            g_free (dd->data->finalName);
+        }
+        if (dd && dd->data && dd->data->uri) {
+            g_uri_unref (dd->data->uri);
+        }
         if (dd && dd->data)     g_free (dd->data);
         if (dd)                 g_free (dd);
 
         continue;
     }
+
+    // the probe runs on the pool too, it must not hold up the command line
+    if (tasks) {
+        thread_pool_add_work ((void*) download_schedule, tasks);
+    }
+}
+
+void* download_schedule (GList* tasks)
+{
+    g_return_val_if_fail (tasks, NULL);
+
+    // HEAD every plain download first, mirrors, ranges and zsync look at the server themselves
+    GList* probes = NULL;
+    GList* probed = NULL;
+    GList* submitted = NULL;
+    for (GList* l = tasks; NULL != l; l = l->next) {
+        Downloader* dd = l->data;
+        DownloadData* d = dd->data;
+
+        // the queue knows a task by the uri it was submitted with, not where redirects lead
+        submitted = g_list_append (submitted, g_uri_to_string (d->uri));
+
+        const char* schema = g_uri_get_scheme (d->uri);
+        if (d->mirrors || d->ranges || d->zsync || (g_ascii_strcasecmp (schema, "http") && g_ascii_strcasecmp (schema, "https"))) {
+            continue;
+        }
+
+        HttpProbe* probe = http_probe_new (d->uri);
+        if (probe) {
+            probes = g_list_append (probes, probe);
+            probed = g_list_append (probed, d);
+        }
+    }
+
+    http_probe_run (probes);
+
+    for (GList* l = probes, *k = probed; NULL != l && NULL != k; l = l->next, k = k->next) {
+        HttpProbe* probe = l->data;
+        DownloadData* d = k->data;
+        if (probe->statusCode < 200 || probe->statusCode >= 300) {
+            continue;
+        }
+
+        // go straight to where the redirects end
+        if (probe->redirects > 0) {
+            g_uri_unref (d->uri);
+            d->uri = g_uri_ref (probe->location);
+        }
+
+        d->length = probe->length;
+        d->acceptRanges = probe->acceptRanges;
+        d->etag = g_strdup (probe->etag);
+        d->digest = g_strdup (probe->digest);
+        d->contentMD5 = g_strdup (probe->contentMD5);
+        d->connections = 1;
+
+        // segments arrive out of order, an archive is only extracted as it streams in from one connection
+        if (d->acceptRanges && d->length >= 2 * DOWNLOAD_SEGMENT_SIZE && !d->extract) {
+            d->connections = (int) MIN (d->length / DOWNLOAD_SEGMENT_SIZE, DOWNLOAD_MAX_SEGMENTS);
+        }
+
+        g_autofree char* uri = g_uri_to_string (d->uri);
+        logi ("'%s': %lld bytes, ranges: %s, %d connection(s)", uri, d->length, d->acceptRanges ? "yes" : "no", d->connections);
+    }
+
+    g_list_free_full (probes, (void*) http_probe_free);
+    g_list_free (probed);
+
+    for (GList* l = tasks, *k = submitted; NULL != l && NULL != k; l = l->next, k = k->next) {
+        download_submit (l->data, k->data);
+    }
+    g_list_free_full (submitted, g_free);
+    g_list_free (tasks);
+
+    return NULL;
+}
+
+/**
+ * @brief 线程池里的一个位置: 执行等待队列里最该执行的任务, 入队时放进来, 和队列里的任务一一对应
+ */
+static void* download_next (void* unused)
+{
+    Downloader* d = download_queue_pop ();
+    if (d) {
+        download_worker (d);
+    }
+
+    return NULL;
+}
+
+static void download_submit (Downloader* d, const char* uri)
+{
+    download_queue_push (d, uri);
+    thread_pool_add_work (download_next, NULL);
 }
 
 void* download_worker (Downloader* d)
@@ -195,23 +424,156 @@ void* download_worker (Downloader* d)
 
     g_autofree char* uri = g_uri_to_string (d->data->uri);
 
+    // a busy disk parks its task, the thread goes on to a download for another disk
+    if (!download_device_enter (d)) {
+        logd ("uri: %s, waiting for a free slot on the disk of '%s'", uri, d->data->outputName);
+        return NULL;
+    }
+
+    __atomic_add_fetch (&gActive, 1, __ATOMIC_RELAXED);
+    download_run (d, uri);
+    __atomic_sub_fetch (&gActive, 1, __ATOMIC_RELAXED);
+    download_device_leave (d);
+
+    return NULL;
+}
+
+int download_active (void)
+{
+    return __atomic_load_n (&gActive, __ATOMIC_RELAXED);
+}
+
+static void download_run (Downloader* d, const char* uri)
+{
     logd ("start download, uri: %s, save to: %s", uri, d->data->outputName);
 
-    if (!d->method->init || !d->method->init (d->data)) {
+    // a retry keeps the state of the earlier attempts
+    if (!d->data->data && (!d->method->init || !d->method->init (d->data))) {
         loge ("uri: %s, downloader init error!", uri);
-        return NULL;
+        return;
     }
 
+    d->data->retryable = false;
+    d->data->retryAfter = -1;
     if (!d->method->download || !d->method->download (d->data)) {
+        if (d->data->retryable && d->data->attempts < DOWNLOAD_MAX_RETRIES) {
+            guint delay = download_backoff (d->data->attempts++, d->data->retryAfter);
+            logi ("uri: %s, retry %d/%d in %u ms", uri, d->data->attempts, DOWNLOAD_MAX_RETRIES, delay);
+
+            // wait on the main loop, not in a pool thread
+            g_timeout_add (delay, download_retry, d);
+            return;
+        }
         loge ("uri: %s, downloader download error!", uri);
-        return NULL;
+        return;
+    }
+
+    // staged, the mover takes it from here and this thread is free for the next download
+    if (d->data->finalName) {
+        g_autoptr (GError) error = NULL;
+        if (!mover_submit (d->data->outputName, d->data->finalName, &error)) {
+            loge ("uri: %s, %s", uri, error ? error->message : "move error");
+        }
+
+        // the seek index goes along with the compressed file
+        g_autofree char* index = g_strdup_printf ("%s%s", d->data->outputName, COMPRESS_INDEX_SUFFIX);
+        g_autofree char* finalIndex = g_strdup_printf ("%s%s", d->data->finalName, COMPRESS_INDEX_SUFFIX);
+        if (d->data->compress > 0 && !mover_submit (index, finalIndex, NULL)) {
+            loge ("uri: %s, move '%s' error", uri, index);
+        }
     }
 
     if (d->method->free) {
         d->method->free(d->data);
     }
+}
 
-    return NULL;
+static gboolean download_retry (void* d)
+{
+    // a retry queues up again behind the tasks with a better place
+    g_autofree char* uri = g_uri_to_string (((Downloader*) d)->data->uri);
+    download_submit (d, uri);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * @brief 输出文件所在的设备, 文件可能还不存在, 所以看它的目录
+ */
+static guint64 download_device (const Downloader* d)
+{
+    struct stat st;
+    g_autofree char* dir = g_path_get_dirname (d->data->outputName);
+
+    return (0 == stat (dir, &st)) ? (guint64) st.st_dev : 0;
+}
+
+static bool download_device_enter (Downloader* d)
+{
+    guint64 dev = d->device = download_device (d);
+
+    g_mutex_lock (&gDeviceLock);
+    DownloadDevice* dd = NULL;
+    for (GList* l = gDevices; NULL != l && !dd; l = l->next) {
+        if (((DownloadDevice*) l->data)->dev == dev) {
+            dd = l->data;
+        }
+    }
+    if (!dd && (dd = g_malloc0 (sizeof (DownloadDevice)))) {
+        dd->dev = dev;
+        gDevices = g_list_append (gDevices, dd);
+    }
+
+    bool enter = !dd || dd->running < gDeviceTasks;
+    if (dd && enter) {
+        dd->running++;
+    } else if (dd) {
+        dd->waiting = g_list_append (dd->waiting, d);
+    }
+    g_mutex_unlock (&gDeviceLock);
+
+    return enter;
+}
+
+/**
+ * @brief 让出设备上的名额, 排在这个设备上的下一个下载回到线程池
+ */
+static void download_device_leave (Downloader* d)
+{
+    Downloader* next = NULL;
+
+    g_mutex_lock (&gDeviceLock);
+    for (GList* l = gDevices; NULL != l; l = l->next) {
+        DownloadDevice* dd = l->data;
+        if (dd->dev == d->device) {
+            dd->running--;
+            if (dd->waiting) {
+                next = dd->waiting->data;
+                dd->waiting = g_list_delete_link (dd->waiting, dd->waiting);
+            }
+            break;
+        }
+    }
+    g_mutex_unlock (&gDeviceLock);
+
+    if (next) {
+        thread_pool_add_work ((void*) download_worker, next);
+    }
 }
 
+/**
+ * @brief 指数退避, 加上随机抖动避免同时失败的任务同时重试; 服务器给了 Retry-After 时按它等待
+ */
+static guint download_backoff (int attempt, int retryAfter)
+{
+    if (retryAfter >= 0) {
+        return (guint) MIN (retryAfter, DOWNLOAD_RETRY_AFTER_MAX) * 1000 + g_random_int_range (0, 1000);
+    }
 
+    guint delay = DOWNLOAD_RETRY_MAX;
+    if (attempt < 16) {
+        delay = MIN ((guint) DOWNLOAD_RETRY_BASE << attempt, DOWNLOAD_RETRY_MAX);
+    }
+
+    return delay / 2 + g_random_int_range (0, delay / 2 + 1);
+}
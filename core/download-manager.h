@@ -3,12 +3,39 @@
 #include <stdbool.h>
 #include <gio/gio.h>
 
+#include "protocol-interface.h"
+
 typedef struct _DownloadTask    DownloadTask;
 
 struct _DownloadTask
 {
     GList*          uris;
     char*           dir;
+    bool            mirrors;        // uris 是同一个文件的多个镜像
+    double          hedgeRatio;     // 对冲阈值, 小于 0 使用默认值
+    double          hedgeBudget;    // 对冲额外流量比例, 小于 0 使用默认值, 0 关闭
+    char*           ranges;         // 只下载这些字节范围, 例如 "0-1023,-65536"
+    bool            splitRanges;    // 每个范围保存为单独的文件
+    char*           zsync;          // zsync 控制文件(路径或 URL), 按它增量更新已有的文件
+    int             ioTimeout;      // 多少秒收不到数据就断开重连, 小于 0 使用默认值, 0 不限制
+    int             lowSpeedLimit;  // 速度低于这么多字节每秒...
+    int             lowSpeedTime;   // ...持续这么多秒就断开重连, 小于 0 使用默认值
+    bool            mmap;           // 分段下载时把输出文件映射到内存, 不用 pwrite
+    bool            writeback;      // 边写边用 sync_file_range 回写并丢掉页缓存, 下载很大的文件时不会积累大量脏页
+    int             compress;       // 大于 0 时按这个 zstd 级别压缩保存为 "<文件>.zst", 分段下载各段各自压缩
+    char*           extract;        // 下载的是 tar、tar.gz 或 tar.zst 时边下载边解包到这个目录, 为空不解包
+    bool            extractKeep;    // 解包后保留归档
+    char*           checksum;       // 期望的校验值, 例如 "sha256:9f86d0...", 不一致时任务失败, 文件被隔离
+    char*           pieces;         // 分块校验: 块哈希列表文件或 "<块大小>:<Merkle 根>", 只重新下载坏块
+    char*           store;          // 按内容寻址的存储目录, 同样内容只存一份, 预先知道摘要时不用再下载
+    bool            storeEtag;      // 也用 ETag 在存储里查找
+    char*           staging;        // 暂存目录(快的本地盘), 下载完由后台搬到 dir, 为空时直接写到 dir
+    int             movers;         // 搬运线程数, 小于等于 0 不变
+    long long       moveRate;       // 搬运的总速度, 字节每秒, 0 不限制, 小于 0 不变
+    int             ioWriters;      // 每个设备同时写的线程数, 小于等于 0 不变
+    int             ioDepth;        // 每个设备最多占用的写缓冲区数, 小于等于 0 不变
+    int             ioTasks;        // 每个设备同时进行的下载数, 多的排队且不占线程, 小于等于 0 不变
+    DownloadPriority priority;      // 这些 uris 的优先级类别, 默认 DOWNLOAD_PRIORITY_NORMAL
 };
 
 
@@ -42,8 +69,16 @@ GUri* url_Analysis (const char* url);
 
 /**
  * @brief 开始排队执行下载任务
+ *
+ * 任务探测完大小后进入等待队列(见 download-queue.h), 线程池每空出一个位置就执行队列里最该执行的一个
  * @param data 要下载的数据信息
  */
 void download (const DownloadTask* data);
 
+
+/**
+ * @brief 正在线程里执行的下载数, 不包括排队和等设备的
+ */
+int download_active (void);
+
 #endif // DOWNLOADMANAGER_H
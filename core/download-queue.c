@@ -0,0 +1,258 @@
+#include "download-queue.h"
+
+#include <string.h>
+
+#include "log.h"
+
+typedef struct _DownloadQueueItem   DownloadQueueItem;
+
+struct _DownloadQueueItem
+{
+    Downloader*             d;
+    char*                   uri;
+    DownloadPriority        priority;
+    long long               length;                 // 预计大小, 不知道时为 -1
+    long long               key;                    // 越小越先执行, 包括类别
+    guint64                 seq;                    // 键相同时先来先执行
+    gint64                  queued;                 // 第一次入队的单调时间, 微秒
+    int                     index;                  // 在堆里的下标
+};
+
+/**
+ * @brief 堆和按 URI 的索引共用一把锁
+ */
+typedef struct
+{
+    GMutex                  lock;
+
+    DownloadQueueItem**     heap;                   // heap[0] 最先执行
+    int                     length;
+    int                     size;
+
+    GHashTable*             uris;                   // uri -> GList of DownloadQueueItem, 同一个 URI 可能提交多次
+    guint64                 seq;
+} DownloadQueue;
+
+static DownloadQueue gQueue;
+
+static long long download_queue_key (const DownloadQueueItem* item);
+static bool download_queue_before (const DownloadQueueItem* a, const DownloadQueueItem* b);
+static void download_queue_set (int i, DownloadQueueItem* item);
+static void download_queue_up (int i);
+static void download_queue_down (int i);
+
+
+void download_queue_push (Downloader* d, const char* uri)
+{
+    g_return_if_fail (d && d->data && uri);
+
+    DownloadQueueItem* item = g_malloc0 (sizeof (DownloadQueueItem));
+    if (!item) {
+        loge ("malloc queue item of '%s' error", uri);
+        return;
+    }
+    item->d = d;
+    item->uri = g_strdup (uri);
+    item->priority = d->data->priority;
+    item->length = d->data->length;
+
+    // a retry keeps the age it had, it does not go to the back of its class
+    if (0 == d->data->queued) {
+        d->data->queued = g_get_monotonic_time ();
+    }
+    item->queued = d->data->queued;
+    item->key = download_queue_key (item);
+
+    g_mutex_lock (&gQueue.lock);
+    if (gQueue.length == gQueue.size) {
+        int size = MAX (gQueue.size * 2, 64);
+        DownloadQueueItem** heap = g_realloc (gQueue.heap, sizeof (DownloadQueueItem*) * size);
+        if (!heap) {
+            g_mutex_unlock (&gQueue.lock);
+            loge ("grow download queue error");
+            g_free (item->uri);
+            g_free (item);
+            return;
+        }
+        gQueue.heap = heap;
+        gQueue.size = size;
+    }
+    if (!gQueue.uris) {
+        gQueue.uris = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    item->seq = gQueue.seq++;
+    GList* same = g_hash_table_lookup (gQueue.uris, uri);
+    g_hash_table_insert (gQueue.uris, g_strdup (uri), g_list_prepend (same, item));
+
+    download_queue_set (gQueue.length++, item);
+    download_queue_up (item->index);
+    int length = gQueue.length;
+    g_mutex_unlock (&gQueue.lock);
+
+    logd ("queued '%s' (%s, %lld bytes), %d waiting", uri, download_priority_name (item->priority), item->length, length);
+}
+
+Downloader* download_queue_pop (void)
+{
+    g_mutex_lock (&gQueue.lock);
+    if (0 == gQueue.length) {
+        g_mutex_unlock (&gQueue.lock);
+        return NULL;
+    }
+
+    DownloadQueueItem* item = gQueue.heap[0];
+    if (--gQueue.length > 0) {
+        download_queue_set (0, gQueue.heap[gQueue.length]);
+        download_queue_down (0);
+    }
+
+    GList* same = g_hash_table_lookup (gQueue.uris, item->uri);
+    same = g_list_remove (same, item);
+    if (same) {
+        g_hash_table_insert (gQueue.uris, g_strdup (item->uri), same);
+    } else {
+        g_hash_table_remove (gQueue.uris, item->uri);
+    }
+    int length = gQueue.length;
+    g_mutex_unlock (&gQueue.lock);
+
+    logi ("start '%s' (%s, %lld bytes) after %.1fs in queue, %d waiting", item->uri, download_priority_name (item->priority),
+          item->length, (g_get_monotonic_time () - item->queued) / 1e6, length);
+
+    Downloader* d = item->d;
+    g_free (item->uri);
+    g_free (item);
+
+    return d;
+}
+
+int download_queue_reprioritize (const char* uri, DownloadPriority priority)
+{
+    g_return_val_if_fail (uri, 0);
+
+    int n = 0;
+    g_mutex_lock (&gQueue.lock);
+    GList* same = gQueue.uris ? g_hash_table_lookup (gQueue.uris, uri) : NULL;
+    for (GList* l = same; NULL != l; l = l->next) {
+        DownloadQueueItem* item = l->data;
+        DownloadPriority old = item->priority;
+        if (old == priority) {
+            ++n;
+            continue;
+        }
+
+        // a retry goes back into the new class too
+        item->priority = priority;
+        item->d->data->priority = priority;
+        item->key = download_queue_key (item);
+        if (priority < old) {
+            download_queue_up (item->index);
+        } else {
+            download_queue_down (item->index);
+        }
+        logi ("'%s' moved from %s to %s", uri, download_priority_name (old), download_priority_name (priority));
+        ++n;
+    }
+    g_mutex_unlock (&gQueue.lock);
+
+    return n;
+}
+
+int download_queue_length (void)
+{
+    g_mutex_lock (&gQueue.lock);
+    int length = gQueue.length;
+    g_mutex_unlock (&gQueue.lock);
+
+    return length;
+}
+
+bool download_priority_parse (const char* name, DownloadPriority* priority)
+{
+    g_return_val_if_fail (name && priority, false);
+
+    for (DownloadPriority p = DOWNLOAD_PRIORITY_INTERACTIVE; p <= DOWNLOAD_PRIORITY_BULK; ++p) {
+        if (0 == g_ascii_strcasecmp (name, download_priority_name (p))) {
+            *priority = p;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char* download_priority_name (DownloadPriority priority)
+{
+    switch (priority) {
+    case DOWNLOAD_PRIORITY_INTERACTIVE:
+        return "interactive";
+    case DOWNLOAD_PRIORITY_NORMAL:
+        return "normal";
+    case DOWNLOAD_PRIORITY_BULK:
+        return "bulk";
+    }
+
+    return "unknown";
+}
+
+/**
+ * @brief 每等一秒减去 DOWNLOAD_QUEUE_AGING 字节, 一个类别相当于 DOWNLOAD_QUEUE_PROMOTE 秒;
+ * 大小被限制在一个类别以内, 否则超大的文件会排到低一类的后面
+ */
+static long long download_queue_key (const DownloadQueueItem* item)
+{
+    long long span = (long long) DOWNLOAD_QUEUE_PROMOTE * DOWNLOAD_QUEUE_AGING;
+    long long expected = (item->length >= 0) ? item->length : DOWNLOAD_QUEUE_UNKNOWN_SIZE;
+
+    return item->priority * span + MIN (expected, span) + item->queued / 1000 * (DOWNLOAD_QUEUE_AGING / 1000);
+}
+
+static bool download_queue_before (const DownloadQueueItem* a, const DownloadQueueItem* b)
+{
+    if (a->key != b->key) {
+        return a->key < b->key;
+    }
+
+    return a->seq < b->seq;
+}
+
+static void download_queue_set (int i, DownloadQueueItem* item)
+{
+    gQueue.heap[i] = item;
+    item->index = i;
+}
+
+static void download_queue_up (int i)
+{
+    DownloadQueueItem* item = gQueue.heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!download_queue_before (item, gQueue.heap[parent])) {
+            break;
+        }
+        download_queue_set (i, gQueue.heap[parent]);
+        i = parent;
+    }
+    download_queue_set (i, item);
+}
+
+static void download_queue_down (int i)
+{
+    DownloadQueueItem* item = gQueue.heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= gQueue.length) {
+            break;
+        }
+        if (child + 1 < gQueue.length && download_queue_before (gQueue.heap[child + 1], gQueue.heap[child])) {
+            ++child;
+        }
+        if (!download_queue_before (gQueue.heap[child], item)) {
+            break;
+        }
+        download_queue_set (i, gQueue.heap[child]);
+        i = child;
+    }
+    download_queue_set (i, item);
+}
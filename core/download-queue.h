@@ -0,0 +1,50 @@
+#ifndef DOWNLOAD_QUEUE_H
+#define DOWNLOAD_QUEUE_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#include "protocol-interface.h"
+
+#define DOWNLOAD_QUEUE_AGING            (64 << 20)      // 每排队一秒, 相当于文件小了这么多字节
+#define DOWNLOAD_QUEUE_UNKNOWN_SIZE     (1LL << 30)     // 不知道大小的任务按这么大排
+#define DOWNLOAD_QUEUE_PROMOTE          120             // 多等这么多秒相当于高一个优先级类别
+
+/**
+ * @brief 等待线程的下载任务
+ *
+ * 先按优先级类别, 同一类别里按预计大小(HEAD 得到的 Content-Length)从小到大执行;
+ * 排序键是 "类别 * 类别间隔 + 大小 + 入队时间 * DOWNLOAD_QUEUE_AGING", 等得越久越靠前, 大文件不会一直被后来的小文件挤在后面。
+ * 类别间隔是 DOWNLOAD_QUEUE_PROMOTE 秒的老化量, 大小也不超过它, 所以低一类的任务最多比高一类的多等
+ * 2 * DOWNLOAD_QUEUE_PROMOTE 秒, 不会被源源不断的高优先级任务饿死。
+ * 重试的任务保留第一次入队的时间。
+ * 任务放在带下标的二叉堆里, 入队、出队和调整优先级都是 O(log n)。
+ */
+
+/**
+ * @brief 任务入队, 优先级取 d->data->priority, 入队时间取 d->data->queued, 为 0 时是现在
+ * @param uri 提交时的 URI, download_queue_reprioritize() 用它查找
+ */
+void        download_queue_push         (Downloader* d, const char* uri);
+
+/**
+ * @brief 取出最该执行的任务, 队列为空时返回 NULL
+ */
+Downloader* download_queue_pop          (void);
+
+/**
+ * @brief 把还在排队的 uri 调整到另一个优先级类别
+ * @return 调整了的任务数, 没有在排队的返回 0
+ */
+int         download_queue_reprioritize (const char* uri, DownloadPriority priority);
+
+int         download_queue_length       (void);
+
+/**
+ * @brief "interactive"、"normal" 或 "bulk"
+ */
+bool        download_priority_parse     (const char* name, DownloadPriority* priority);
+
+const char* download_priority_name      (DownloadPriority priority);
+
+#endif // DOWNLOAD_QUEUE_H
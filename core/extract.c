@@ -0,0 +1,660 @@
+#define _GNU_SOURCE
+#include "extract.h"
+
+#include <zlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zstd.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "utils.h"
+
+static void extract_reset (Extract* x);
+static bool extract_detect (Extract* x, GError** error);
+static bool extract_input (Extract* x, const guchar* data, long long len, GError** error);
+static bool extract_tar (Extract* x, const char* data, long long len, GError** error);
+static bool extract_header (Extract* x, GError** error);
+static bool extract_member (Extract* x, const char* name, const char* link, char type, int mode, GError** error);
+static void extract_member_done (Extract* x);
+static void extract_pax (Extract* x);
+static long long extract_number (const char* field, int len);
+static char* extract_safe_path (const char* name);
+static bool extract_safe_link (const char* path, const char* target);
+static int extract_parent (Extract* x, const char* path, const char** leaf);
+
+
+Extract* extract_new (const char* dir, GError** error)
+{
+    g_return_val_if_fail (dir, NULL);
+
+    if (0 != g_mkdir_with_parents (dir, 0755)) {
+        gf_error (error, "create '%s' error: %s", dir, strerror (errno));
+        return NULL;
+    }
+
+    Extract* x = g_malloc0 (sizeof (Extract));
+    if (!x) {
+        gf_error (error, "malloc extract error");
+        return NULL;
+    }
+    x->fd = -1;
+    x->paxSize = -1;
+    x->mtime = -1;
+    x->dir = g_strdup (dir);
+    x->out = g_malloc (EXTRACT_OUT_SIZE);
+
+    x->dirFd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (x->dirFd < 0 || !x->out) {
+        gf_error (error, "open '%s' error: %s", dir, x->out ? strerror (errno) : "malloc error");
+        extract_free (x);
+        return NULL;
+    }
+
+    return x;
+}
+
+void extract_free (Extract* x)
+{
+    g_return_if_fail (x);
+
+    extract_reset (x);
+
+    if (x->dirFd >= 0)      close (x->dirFd);
+    if (x->dir)             g_free (x->dir);
+    if (x->out)             g_free (x->out);
+
+    g_free (x);
+}
+
+bool extract_feed (Extract* x, const void* data, long long len, GError** error)
+{
+    g_return_val_if_fail (x && (data || 0 == len), false);
+
+    const guchar* p = data;
+    x->fed += len;
+
+    // the format is decided on the first four bytes, which may come one at a time
+    if (EXTRACT_CODEC_UNKNOWN == x->codec) {
+        while (len > 0 && x->magicLen < (int) sizeof (x->magic)) {
+            x->magic[x->magicLen++] = *p++;
+            --len;
+        }
+        if (x->magicLen < (int) sizeof (x->magic)) {
+            return true;
+        }
+        if (!extract_detect (x, error) || !extract_input (x, x->magic, x->magicLen, error)) {
+            return false;
+        }
+    }
+
+    return extract_input (x, p, len, error);
+}
+
+bool extract_restart (Extract* x, const char* fileName, long long length, GError** error)
+{
+    g_return_val_if_fail (x && fileName && length >= 0, false);
+
+    extract_reset (x);
+    if (0 == length) {
+        return true;
+    }
+
+    int fd = open (fileName, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        gf_error (error, "open '%s' error: %s", fileName, strerror (errno));
+        return false;
+    }
+    posix_fadvise (fd, 0, length, POSIX_FADV_SEQUENTIAL);
+
+    bool ret = true;
+    for (long long done = 0; done < length && ret;) {
+        char buf[64 << 10];
+        ssize_t n = pread (fd, buf, MIN ((long long) sizeof (buf), length - done), done);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        } else if (n <= 0) {
+            gf_error (error, "read '%s' error: %s", fileName, n < 0 ? strerror (errno) : "short file");
+            ret = false;
+            break;
+        }
+        ret = extract_feed (x, buf, n, error);
+        done += n;
+    }
+    close (fd);
+
+    return ret;
+}
+
+bool extract_finish (Extract* x, GError** error)
+{
+    g_return_val_if_fail (x, false);
+
+    // shorter than a magic number, it can only be a (broken) plain tar
+    if (EXTRACT_CODEC_UNKNOWN == x->codec && x->magicLen > 0) {
+        if (!extract_detect (x, error) || !extract_input (x, x->magic, x->magicLen, error)) {
+            return false;
+        }
+    }
+
+    bool ret = false;
+    if (EXTRACT_CODEC_NONE != x->codec && !x->streamEnd) {
+        gf_error (error, "archive ends inside the compressed stream after %lld bytes", x->fed);
+    } else if (x->remaining > 0 || x->blockLen > 0 || (!x->ended && 0 == x->members)) {
+        gf_error (error, "archive ends inside a tar member after %lld bytes", x->fed);
+    } else {
+        ret = true;
+    }
+
+    extract_member_done (x);
+    logi ("extracted %d members (%lld bytes) to '%s'%s", x->members, x->bytes, x->dir,
+          x->skipped ? ", some unsafe or unsupported members were skipped" : "");
+
+    return ret;
+}
+
+static void extract_reset (Extract* x)
+{
+    if (x->stream && EXTRACT_CODEC_GZIP == x->codec) {
+        inflateEnd (x->stream);
+        g_free (x->stream);
+    } else if (x->stream && EXTRACT_CODEC_ZSTD == x->codec) {
+        ZSTD_freeDStream (x->stream);
+    }
+    x->stream = NULL;
+    x->codec = EXTRACT_CODEC_UNKNOWN;
+    x->magicLen = 0;
+    x->streamEnd = false;
+
+    if (x->fd >= 0)         close (x->fd);
+    if (x->meta)            g_string_free (x->meta, true);
+    if (x->longName)        g_free (x->longName);
+    if (x->longLink)        g_free (x->longLink);
+    x->fd = -1;
+    x->meta = NULL;
+    x->longName = NULL;
+    x->longLink = NULL;
+    x->paxSize = -1;
+    x->mtime = -1;
+    x->blockLen = 0;
+    x->remaining = 0;
+    x->padding = 0;
+    x->zeroBlocks = 0;
+    x->ended = false;
+
+    x->fed = 0;
+    x->members = 0;
+    x->skipped = 0;
+    x->bytes = 0;
+}
+
+static bool extract_detect (Extract* x, GError** error)
+{
+    static const guchar gzip[] = { 0x1f, 0x8b };
+    static const guchar zstd[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+    if (x->magicLen >= 2 && 0 == memcmp (x->magic, gzip, sizeof (gzip))) {
+        z_stream* zs = g_malloc0 (sizeof (z_stream));
+        if (!zs || Z_OK != inflateInit2 (zs, 15 + 16)) {
+            g_free (zs);
+            gf_error (error, "init gzip stream error");
+            return false;
+        }
+        x->stream = zs;
+        x->codec = EXTRACT_CODEC_GZIP;
+    } else if (x->magicLen >= 4 && 0 == memcmp (x->magic, zstd, sizeof (zstd))) {
+        ZSTD_DStream* ds = ZSTD_createDStream ();
+        if (!ds || ZSTD_isError (ZSTD_initDStream (ds))) {
+            if (ds) ZSTD_freeDStream (ds);
+            gf_error (error, "init zstd stream error");
+            return false;
+        }
+        x->stream = ds;
+        x->codec = EXTRACT_CODEC_ZSTD;
+    } else {
+        x->codec = EXTRACT_CODEC_NONE;
+    }
+
+    return true;
+}
+
+static bool extract_input (Extract* x, const guchar* data, long long len, GError** error)
+{
+    if (EXTRACT_CODEC_NONE == x->codec) {
+        return extract_tar (x, (const char*) data, len, error);
+    }
+
+    if (EXTRACT_CODEC_GZIP == x->codec) {
+        z_stream* zs = x->stream;
+        zs->next_in = (Bytef*) data;
+        zs->avail_in = (uInt) len;
+        while (zs->avail_in > 0 && !x->ended) {
+            // several gzip members one after another are one archive
+            if (x->streamEnd) {
+                inflateReset (zs);
+                x->streamEnd = false;
+            }
+            zs->next_out = (Bytef*) x->out;
+            zs->avail_out = EXTRACT_OUT_SIZE;
+            int r = inflate (zs, Z_NO_FLUSH);
+            if (Z_STREAM_END == r) {
+                x->streamEnd = true;
+            } else if (Z_OK != r && Z_BUF_ERROR != r) {
+                gf_error (error, "gzip data error: %s", zs->msg ? zs->msg : "");
+                return false;
+            }
+            long long n = EXTRACT_OUT_SIZE - zs->avail_out;
+            if (!extract_tar (x, x->out, n, error)) {
+                return false;
+            }
+            if (0 == n && Z_BUF_ERROR == r) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    ZSTD_inBuffer in = { data, (size_t) len, 0 };
+    bool full = false;
+    while ((in.pos < in.size || full) && !x->ended) {
+        ZSTD_outBuffer out = { x->out, EXTRACT_OUT_SIZE, 0 };
+        size_t r = ZSTD_decompressStream (x->stream, &out, &in);
+        if (ZSTD_isError (r)) {
+            gf_error (error, "zstd data error: %s", ZSTD_getErrorName (r));
+            return false;
+        }
+        x->streamEnd = (0 == r);
+        full = (out.pos == out.size);
+        if (!extract_tar (x, x->out, out.pos, error)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool extract_tar (Extract* x, const char* data, long long len, GError** error)
+{
+    while (len > 0 && !x->ended) {
+        long long n = 0;
+        if (x->remaining > 0) {
+            n = MIN (len, x->remaining);
+            if (x->meta) {
+                if (x->meta->len + n > EXTRACT_META_MAX) {
+                    gf_error (error, "tar extended header longer than %d bytes", EXTRACT_META_MAX);
+                    return false;
+                }
+                g_string_append_len (x->meta, data, n);
+            } else if (x->fd >= 0) {
+                for (long long w = 0; w < n;) {
+                    ssize_t k = write (x->fd, data + w, n - w);
+                    if (k < 0 && EINTR == errno) {
+                        continue;
+                    } else if (k < 0) {
+                        gf_error (error, "write member error: %s", strerror (errno));
+                        return false;
+                    }
+                    w += k;
+                }
+                x->bytes += n;
+            }
+            x->remaining -= n;
+            if (0 == x->remaining) {
+                extract_member_done (x);
+            }
+        } else if (x->padding > 0) {
+            n = MIN (len, x->padding);
+            x->padding -= n;
+        } else {
+            n = MIN (len, EXTRACT_BLOCK_SIZE - x->blockLen);
+            memcpy (x->block + x->blockLen, data, n);
+            x->blockLen += n;
+            if (EXTRACT_BLOCK_SIZE == x->blockLen) {
+                x->blockLen = 0;
+                if (!extract_header (x, error)) {
+                    return false;
+                }
+            }
+        }
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool extract_header (Extract* x, GError** error)
+{
+    const char* b = x->block;
+
+    // the archive ends with two blocks of zeros
+    bool zero = true;
+    for (int i = 0; i < EXTRACT_BLOCK_SIZE && zero; ++i) {
+        zero = (0 == b[i]);
+    }
+    if (zero) {
+        x->ended = (++x->zeroBlocks >= 2);
+        return true;
+    }
+    x->zeroBlocks = 0;
+
+    long long sum = 0;
+    for (int i = 0; i < EXTRACT_BLOCK_SIZE; ++i) {
+        sum += (i >= 148 && i < 156) ? ' ' : (guchar) b[i];
+    }
+    if (sum != extract_number (b + 148, 8)) {
+        gf_error (error, "bad tar header checksum at archive offset %lld", x->fed);
+        return false;
+    }
+
+    char type = b[156];
+    long long size = extract_number (b + 124, 12);
+    if (x->paxSize >= 0 && 'x' != type && 'g' != type && 'L' != type && 'K' != type) {
+        size = x->paxSize;
+    }
+    if (size < 0) {
+        gf_error (error, "bad tar member size at archive offset %lld", x->fed);
+        return false;
+    }
+    x->remaining = size;
+    x->padding = (EXTRACT_BLOCK_SIZE - size % EXTRACT_BLOCK_SIZE) % EXTRACT_BLOCK_SIZE;
+
+    // pax extended headers and GNU long names describe the member that follows
+    if ('x' == type || 'g' == type || 'L' == type || 'K' == type) {
+        if (size > EXTRACT_META_MAX) {
+            gf_error (error, "tar extended header of %lld bytes", size);
+            return false;
+        }
+        x->meta = g_string_sized_new (size);
+        x->metaType = type;
+        if (0 == size) {
+            extract_member_done (x);
+        }
+        return true;
+    }
+
+    char* name = NULL;
+    if (x->longName) {
+        name = x->longName;
+        x->longName = NULL;
+    } else if (0 == memcmp (b + 257, "ustar", 5) && b[345]) {
+        g_autofree char* prefix = g_strndup (b + 345, 155);
+        g_autofree char* base = g_strndup (b, 100);
+        name = g_strdup_printf ("%s/%s", prefix, base);
+    } else {
+        name = g_strndup (b, 100);
+    }
+    char* link = x->longLink ? x->longLink : g_strndup (b + 157, 100);
+    x->longLink = NULL;
+    if (x->mtime < 0) {
+        x->mtime = extract_number (b + 136, 12);
+    }
+    int mode = (int) (extract_number (b + 100, 8) & 0777);
+
+    bool ok = extract_member (x, name, link, type, mode, error);
+    x->paxSize = -1;
+    g_free (name);
+    g_free (link);
+    if (ok && 0 == x->remaining) {
+        extract_member_done (x);
+    }
+
+    return ok;
+}
+
+static bool extract_member (Extract* x, const char* name, const char* link, char type, int mode, GError** error)
+{
+    g_autofree char* path = extract_safe_path (name);
+    if (!path) {
+        if (name[0] && 0 != g_strcmp0 (name, "./") && 0 != g_strcmp0 (name, ".")) {
+            logi ("skip tar member '%s': path leaves the target directory", name);
+            x->skipped++;
+        }
+        return true;
+    }
+
+    if ('0' != type && '\0' != type && '7' != type && '5' != type && '2' != type && '1' != type) {
+        logd ("skip tar member '%s' of type '%c'", path, type);
+        x->skipped++;
+        return true;
+    }
+
+    if ('2' == type && !extract_safe_link (path, link)) {
+        logi ("skip symlink '%s' -> '%s': it points out of the target directory", path, link);
+        x->skipped++;
+        return true;
+    }
+
+    g_autofree char* linkPath = ('1' == type) ? extract_safe_path (link) : NULL;
+    if ('1' == type && !linkPath) {
+        logi ("skip hard link '%s' -> '%s': it points out of the target directory", path, link);
+        x->skipped++;
+        return true;
+    }
+
+    // a directory is its own parent plus nothing
+    g_autofree char* dirPath = ('5' == type) ? g_strdup_printf ("%s/.", path) : NULL;
+    const char* leaf = NULL;
+    int parent = extract_parent (x, dirPath ? dirPath : path, &leaf);
+    if (parent < 0) {
+        if (ELOOP == errno || ENOTDIR == errno) {
+            logi ("skip tar member '%s': a parent is a symlink or a file", path);
+            x->skipped++;
+            return true;
+        }
+        gf_error (error, "create parent of '%s' error: %s", path, strerror (errno));
+        return false;
+    }
+
+    bool ret = true;
+    int err = 0;
+    if ('5' != type) {
+        // whatever is in the way is replaced, and never followed
+        unlinkat (parent, leaf, 0);
+    }
+
+    switch (type) {
+    case '5':
+        break;
+    case '2':
+        err = symlinkat (link, parent, leaf) ? errno : 0;
+        break;
+    case '1': {
+        const char* targetLeaf = NULL;
+        int target = extract_parent (x, linkPath, &targetLeaf);
+        err = (target < 0 || linkat (target, targetLeaf, parent, leaf, 0)) ? errno : 0;
+        if (target >= 0 && target != x->dirFd) close (target);
+        break;
+    }
+    default:
+        x->fd = openat (parent, leaf, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode | S_IWUSR);
+        err = (x->fd < 0) ? errno : 0;
+        break;
+    }
+
+    if (err) {
+        gf_error (error, "extract '%s' error: %s", path, strerror (err));
+        ret = false;
+    } else {
+        x->members++;
+    }
+    if (parent != x->dirFd) close (parent);
+
+    return ret;
+}
+
+static void extract_member_done (Extract* x)
+{
+    if (x->meta) {
+        if ('x' == x->metaType) {
+            extract_pax (x);
+        } else if ('L' == x->metaType || 'K' == x->metaType) {
+            char** dst = ('L' == x->metaType) ? &x->longName : &x->longLink;
+            g_free (*dst);
+            *dst = g_strndup (x->meta->str, x->meta->len);
+        }
+        g_string_free (x->meta, true);
+        x->meta = NULL;
+        return;
+    }
+
+    if (x->fd >= 0) {
+        if (x->mtime >= 0) {
+            struct timespec times[2] = { { x->mtime, 0 }, { x->mtime, 0 } };
+            futimens (x->fd, times);
+        }
+        close (x->fd);
+        x->fd = -1;
+    }
+    x->mtime = -1;
+}
+
+/**
+ * @brief pax 扩展头: 每条记录是 "<长度> <键>=<值>\n"
+ */
+static void extract_pax (Extract* x)
+{
+    const char* p = x->meta->str;
+    const char* end = p + x->meta->len;
+
+    while (p < end) {
+        char* sp = NULL;
+        long long len = g_ascii_strtoll (p, &sp, 10);
+        if (len <= 0 || !sp || ' ' != *sp || p + len > end || '\n' != p[len - 1]) {
+            break;
+        }
+        const char* key = sp + 1;
+        const char* eq = memchr (key, '=', p + len - key);
+        if (eq) {
+            char* value = g_strndup (eq + 1, p + len - 1 - (eq + 1));
+            if (eq - key == 4 && 0 == memcmp (key, "path", 4)) {
+                g_free (x->longName);
+                x->longName = value;
+                value = NULL;
+            } else if (eq - key == 8 && 0 == memcmp (key, "linkpath", 8)) {
+                g_free (x->longLink);
+                x->longLink = value;
+                value = NULL;
+            } else if (eq - key == 4 && 0 == memcmp (key, "size", 4)) {
+                x->paxSize = g_ascii_strtoll (value, NULL, 10);
+            } else if (eq - key == 5 && 0 == memcmp (key, "mtime", 5)) {
+                x->mtime = g_ascii_strtoll (value, NULL, 10);
+            }
+            g_free (value);
+        }
+        p += len;
+    }
+}
+
+/**
+ * @brief tar 的数字是八进制文本, 太大时最高位置 1 后面是二进制(GNU 扩展)
+ */
+static long long extract_number (const char* field, int len)
+{
+    const guchar* f = (const guchar*) field;
+
+    if (f[0] & 0x80) {
+        long long v = f[0] & 0x3f;
+        for (int i = 1; i < len; ++i) {
+            v = (v << 8) | f[i];
+        }
+        return v;
+    }
+
+    long long v = 0;
+    int i = 0;
+    while (i < len && (' ' == f[i] || '\0' == f[i])) ++i;
+    for (; i < len && f[i] >= '0' && f[i] <= '7'; ++i) {
+        v = v * 8 + (f[i] - '0');
+    }
+
+    return v;
+}
+
+/**
+ * @brief 相对于目标目录的路径: 去掉开头的 '/' 和 "." 部分; 有 ".." 或者什么也不剩时返回 NULL
+ */
+static char* extract_safe_path (const char* name)
+{
+    char** parts = g_strsplit (name, "/", -1);
+    GString* path = g_string_new (NULL);
+    bool ok = true;
+
+    for (int i = 0; parts[i] && ok; ++i) {
+        if (0 == strcmp (parts[i], "..")) {
+            ok = false;
+        } else if (parts[i][0] && 0 != strcmp (parts[i], ".")) {
+            if (path->len) g_string_append_c (path, '/');
+            g_string_append (path, parts[i]);
+        }
+    }
+    g_strfreev (parts);
+
+    if (!ok || 0 == path->len) {
+        g_string_free (path, true);
+        return NULL;
+    }
+
+    return g_string_free (path, false);
+}
+
+/**
+ * @brief 符号链接 path -> target 按字面解析后还在目标目录里
+ */
+static bool extract_safe_link (const char* path, const char* target)
+{
+    if (!target[0] || '/' == target[0]) {
+        return false;
+    }
+
+    int depth = 0;
+    for (const char* p = path; *p; ++p) {
+        if ('/' == *p) ++depth;
+    }
+
+    char** parts = g_strsplit (target, "/", -1);
+    bool ok = true;
+    for (int i = 0; parts[i] && ok; ++i) {
+        if (0 == strcmp (parts[i], "..")) {
+            ok = (--depth >= 0);
+        } else if (parts[i][0] && 0 != strcmp (parts[i], ".")) {
+            ++depth;
+        }
+    }
+    g_strfreev (parts);
+
+    return ok;
+}
+
+/**
+ * @brief 逐级打开 path 的上级目录, 没有的创建; 每一级都不跟随符号链接
+ * @param leaf 返回 path 的最后一部分, 指向 path 里面
+ * @return 上级目录的描述符, 不是 x->dirFd 时调用者关闭; 出错返回 -1, errno 是原因
+ */
+static int extract_parent (Extract* x, const char* path, const char** leaf)
+{
+    int fd = x->dirFd;
+    const char* p = path;
+
+    for (const char* slash = strchr (p, '/'); slash; slash = strchr (p, '/')) {
+        g_autofree char* part = g_strndup (p, slash - p);
+        int next = openat (fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0 && ENOENT == errno && 0 == mkdirat (fd, part, 0755)) {
+            next = openat (fd, part, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        int err = errno;
+        if (fd != x->dirFd) close (fd);
+        if (next < 0) {
+            errno = err;
+            return -1;
+        }
+        fd = next;
+        p = slash + 1;
+    }
+    *leaf = p;
+
+    return fd;
+}
@@ -0,0 +1,84 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define EXTRACT_BLOCK_SIZE          512
+#define EXTRACT_OUT_SIZE            (256 << 10)     // 每次解压出的最大字节数
+#define EXTRACT_META_MAX            (1 << 20)       // pax 扩展头和 GNU 长文件名的最大长度
+
+typedef struct _Extract             Extract;
+typedef enum _ExtractCodec          ExtractCodec;
+
+enum _ExtractCodec
+{
+    EXTRACT_CODEC_UNKNOWN = 0,          // 还没有收到足够的字节判断格式
+    EXTRACT_CODEC_NONE,                 // 没有压缩的 tar
+    EXTRACT_CODEC_GZIP,
+    EXTRACT_CODEC_ZSTD,
+};
+
+/**
+ * @brief 边下载边解包 tar、tar.gz、tar.zst
+ *
+ * 压缩格式按开头的魔数判断, 解压出的 tar 流直接把成员写到目标目录, 不用先把整个归档写到磁盘再读回来。
+ * 成员路径去掉开头的 '/', 含有 ".." 的成员被跳过; 每一级目录都用 O_NOFOLLOW 打开,
+ * 归档里的符号链接不能把后面的成员引到目标目录外面; 指向目标目录外面的符号链接和硬链接也被跳过。
+ * 设备文件、FIFO 不解出, 权限去掉 setuid/setgid。
+ */
+struct _Extract
+{
+    char                   *dir;
+    int                     dirFd;
+
+    ExtractCodec            codec;
+    guchar                  magic[4];               // 判断格式前收到的字节
+    int                     magicLen;
+    void                   *stream;                 // z_stream 或 ZSTD_DStream
+    bool                    streamEnd;              // gzip 的一个成员结束了, 后面可能还有
+    char                   *out;                    // 解压缓冲区
+
+    /* tar */
+    char                    block[EXTRACT_BLOCK_SIZE];
+    int                     blockLen;
+    long long               remaining;              // 当前成员还没收到的数据
+    long long               padding;                // 成员数据后补齐到 512 的字节
+    int                     fd;                     // 当前成员的文件, -1 表示丢弃数据
+    GString                *meta;                   // 正在收的 pax 扩展头或长文件名
+    char                    metaType;
+    char                   *longName;               // 下一个成员的路径, 来自 pax 或 GNU 'L'
+    char                   *longLink;
+    long long               paxSize;                // pax 给出的长度, 小于 0 表示没有
+    long long               mtime;
+    int                     zeroBlocks;
+    bool                    ended;                  // 收到了结尾的两个全零块
+
+    long long               fed;                    // 已经收到的归档字节数
+    int                     members;
+    int                     skipped;
+    long long               bytes;                  // 解出的数据字节数
+};
+
+/**
+ * @brief 解包到 dir, 目录不存在时创建
+ */
+Extract*    extract_new         (const char* dir, GError** error);
+void        extract_free        (Extract* x);
+
+/**
+ * @brief 收到归档接下来的 len 字节
+ */
+bool        extract_feed        (Extract* x, const void* data, long long len, GError** error);
+
+/**
+ * @brief 从头重新解包, 再把文件里已经下载的前 length 字节送进来, 续传时用
+ */
+bool        extract_restart     (Extract* x, const char* fileName, long long length, GError** error);
+
+/**
+ * @brief 归档收完了, 检查它是完整的
+ */
+bool        extract_finish      (Extract* x, GError** error);
+
+#endif // EXTRACT_H
@@ -0,0 +1,103 @@
+/**
+ * 编译时生成已知 http 头部的完美哈希表
+ *
+ * 对 http_header_hash() 的结果做乘法移位: slot = (hash * mult) >> shift,
+ * 搜索一个让所有已知头部都不冲突的 mult, 输出 http-header-phash.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "http-header.h"
+
+#define PHASH_MAX_BITS          10
+#define PHASH_MAX_TRY           (1 << 22)
+
+static const char* gNames [HTTP_HEADER_ID_NUM] = {
+    [HTTP_HEADER_ID_UNKNOWN] = NULL,
+#define HTTP_HEADER(id, var, name)      [HTTP_HEADER_ID_##id] = name,
+#include "http-header-known.def"
+#undef HTTP_HEADER
+};
+
+
+static unsigned int next_random (unsigned long long* state)
+{
+    // splitmix64, fixed seed so the output is reproducible
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+
+    return (unsigned int) ((z ^ (z >> 31)) >> 32);
+}
+
+int main (int argc, char* argv[])
+{
+    if (argc != 2) {
+        fprintf (stderr, "Usage: %s <output header>\n", argv[0]);
+        return 1;
+    }
+
+    unsigned int hash[HTTP_HEADER_ID_NUM] = {0};
+    for (int i = 1; i < HTTP_HEADER_ID_NUM; ++i) {
+        hash[i] = http_header_hash (gNames[i], strlen (gNames[i]));
+    }
+
+    int bits = 1;
+    while ((1 << bits) < HTTP_HEADER_ID_NUM) ++bits;
+
+    unsigned char table[1 << PHASH_MAX_BITS];
+    unsigned long long state = 0x6772616365667531ull;
+    unsigned int mult = 0;
+    bool found = false;
+
+    for (; bits <= PHASH_MAX_BITS && !found; ++bits) {
+        for (int t = 0; t < PHASH_MAX_TRY && !found; ++t) {
+            mult = next_random (&state) | 1;
+            memset (table, 0, sizeof (table));
+
+            found = true;
+            for (int i = 1; i < HTTP_HEADER_ID_NUM; ++i) {
+                unsigned int slot = (hash[i] * mult) >> (32 - bits);
+                if (table[slot]) {
+                    found = false;
+                    break;
+                }
+                table[slot] = i;
+            }
+        }
+    }
+
+    if (!found) {
+        fprintf (stderr, "no perfect hash found for %d headers\n", HTTP_HEADER_ID_NUM - 1);
+        return 1;
+    }
+    --bits;
+
+    FILE* fp = fopen (argv[1], "w");
+    if (!fp) {
+        perror ("fopen");
+        return 1;
+    }
+
+    fprintf (fp, "/* generated by http-header-phash-gen from http-header-known.def, do not edit */\n");
+    fprintf (fp, "#ifndef HTTPHEADERPHASH_H\n#define HTTPHEADERPHASH_H\n\n");
+    fprintf (fp, "#define HTTP_HEADER_PHASH_MULT          0x%08Xu\n", mult);
+    fprintf (fp, "#define HTTP_HEADER_PHASH_SHIFT         %d\n\n", 32 - bits);
+
+    fprintf (fp, "static const unsigned char gHttpHeaderPhash [%d] = {", 1 << bits);
+    for (int i = 0; i < (1 << bits); ++i) {
+        fprintf (fp, "%s%3d,", (i % 16) ? " " : "\n    ", table[i]);
+    }
+    fprintf (fp, "\n};\n\n");
+
+    fprintf (fp, "static const unsigned int gHttpHeaderKnownHash [%d] = {", HTTP_HEADER_ID_NUM);
+    for (int i = 0; i < HTTP_HEADER_ID_NUM; ++i) {
+        fprintf (fp, "%s0x%08Xu,", (i % 6) ? " " : "\n    ", hash[i]);
+    }
+    fprintf (fp, "\n};\n\n#endif // HTTPHEADERPHASH_H\n");
+
+    fclose (fp);
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include "http-chunked.h"
+
+#include <string.h>
+#include <gio/gio.h>
+
+#include "scan.h"
+
+
+void http_chunked_init (HttpChunked* c)
+{
+    g_return_if_fail (c);
+
+    memset (c, 0, sizeof (HttpChunked));
+    c->state = HTTP_CHUNKED_SIZE;
+}
+
+bool http_chunked_done (const HttpChunked* c)
+{
+    g_return_val_if_fail (c, true);
+
+    return HTTP_CHUNKED_DONE == c->state;
+}
+
+int http_chunked_decode (HttpChunked* c, char* buf, int len)
+{
+    g_return_val_if_fail (c && buf && len >= 0, -1);
+
+    int in = 0, out = 0;
+
+    while (in < len && HTTP_CHUNKED_DONE != c->state) {
+        switch (c->state) {
+        case HTTP_CHUNKED_SIZE: {
+            int v = g_ascii_xdigit_value (buf[in]);
+            if (v >= 0) {
+                if (++c->digits > 15) {
+                    return -1;
+                }
+                c->size = (c->size << 4) | v;
+                ++in;
+            } else if (0 == c->digits) {
+                return -1;
+            } else {
+                c->state = HTTP_CHUNKED_EXT;
+            }
+            break;
+        }
+        case HTTP_CHUNKED_EXT: {
+            const char* eol = scan_byte (buf + in, len - in, '\n');
+            if (!eol) {
+                in = len;
+                break;
+            }
+            in = eol - buf + 1;
+            c->digits = 0;
+            c->state = (c->size > 0) ? HTTP_CHUNKED_DATA : HTTP_CHUNKED_TRAILER;
+            break;
+        }
+        case HTTP_CHUNKED_DATA: {
+            int n = (int) MIN ((long long) (len - in), c->size);
+            if (out != in) {
+                memmove (buf + out, buf + in, n);
+            }
+            in += n;
+            out += n;
+            c->size -= n;
+            if (0 == c->size) {
+                c->state = HTTP_CHUNKED_DATA_END;
+            }
+            break;
+        }
+        case HTTP_CHUNKED_DATA_END: {
+            const char* eol = scan_byte (buf + in, len - in, '\n');
+            if (!eol) {
+                in = len;
+                break;
+            }
+            in = eol - buf + 1;
+            c->state = HTTP_CHUNKED_SIZE;
+            break;
+        }
+        case HTTP_CHUNKED_TRAILER: {
+            // an empty line ends the message
+            if ('\r' == buf[in]) {
+                ++in;
+            } else if ('\n' == buf[in]) {
+                ++in;
+                c->state = HTTP_CHUNKED_DONE;
+            } else {
+                c->state = HTTP_CHUNKED_TRAILER_LINE;
+            }
+            break;
+        }
+        case HTTP_CHUNKED_TRAILER_LINE: {
+            const char* eol = scan_byte (buf + in, len - in, '\n');
+            if (!eol) {
+                in = len;
+                break;
+            }
+            in = eol - buf + 1;
+            c->state = HTTP_CHUNKED_TRAILER;
+            break;
+        }
+        case HTTP_CHUNKED_DONE:
+        default:
+            break;
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,45 @@
+#ifndef HTTPCHUNKED_H
+#define HTTPCHUNKED_H
+
+#include <stdbool.h>
+
+typedef struct _HttpChunked         HttpChunked;
+typedef enum _HttpChunkedState      HttpChunkedState;
+
+enum _HttpChunkedState
+{
+    HTTP_CHUNKED_SIZE = 0,              // 读取块大小(十六进制)
+    HTTP_CHUNKED_EXT,                   // 块大小后的扩展, 直到 '\n'
+    HTTP_CHUNKED_DATA,                  // 块数据
+    HTTP_CHUNKED_DATA_END,              // 块数据后的 "\r\n"
+    HTTP_CHUNKED_TRAILER,               // 尾部头部行的开始
+    HTTP_CHUNKED_TRAILER_LINE,          // 尾部头部行
+    HTTP_CHUNKED_DONE,
+};
+
+/**
+ * @brief Transfer-Encoding: chunked 的流式解码状态
+ */
+struct _HttpChunked
+{
+    HttpChunkedState        state;
+    long long               size;               // 当前块剩余字节数
+    int                     digits;
+};
+
+void http_chunked_init (HttpChunked* c);
+
+/**
+ * @brief 原地解码一段数据, 数据可以在任意位置被截断
+ * @param buf 收到的原始数据, 解码后的数据从 buf 开头存放
+ * @param len 原始数据长度
+ * @return 解码后的数据长度, 格式错误返回 -1
+ */
+int  http_chunked_decode (HttpChunked* c, char* buf, int len);
+
+/**
+ * @brief 是否已读到最后一个块(以及尾部)
+ */
+bool http_chunked_done (const HttpChunked* c);
+
+#endif // HTTPCHUNKED_H
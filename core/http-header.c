@@ -2,6 +2,9 @@
 
 #include <gio/gio.h>
 
+#include "scan.h"
+#include "http-header-phash.h"
+
 /* entity headers */
 const char gHttpHeaderAllow[]               = "Allow";
 const char gHttpHeaderContentEncoding[]     = "Content-Encoding";
@@ -49,8 +52,10 @@ const char gHttpHeaderUserAgent[]           = "User-Agent";
 /* response headers */
 const char gHttpHeaderAcceptRanges[]        = "Accept-Ranges";
 const char gHttpHeaderAge[]                 = "Age";
+const char gHttpHeaderDigest[]              = "Digest";
 const char gHttpHeaderETag[]                = "ETag";
 const char gHttpHeaderLocation[]            = "Location";
+const char gHttpHeaderReprDigest[]          = "Repr-Digest";
 const char gHttpHeaderRetryAfter[]          = "Retry-After";
 const char gHttpHeaderServer[]              = "Server";
 const char gHttpHeaderVary[]                = "Vary";
@@ -70,79 +75,51 @@ const char gHttpHeaderOverwrite[]           = "Overwrite";
 const char gHttpHeaderStatusURI[]           = "Status-URI";
 const char gHttpHeaderTimeout[]             = "Timeout";
 
-const char* gHttpHeaderKnownList [] = {
-    /* entity headers */
-    gHttpHeaderAllow,
-    gHttpHeaderContentEncoding,
-    gHttpHeaderContentLanguage,
-    gHttpHeaderContentLength,
-    gHttpHeaderContentLocation,
-    gHttpHeaderContentMD5,
-    gHttpHeaderContentRange,
-    gHttpHeaderContentType,
-    gHttpHeaderExpires,
-    gHttpHeaderLastModified,
-    /* general headers */
-    gHttpHeaderCacheControl,
-    gHttpHeaderConnection,
-    gHttpHeaderDate,
-    gHttpHeaderPragma,
-    gHttpHeaderTransferEncoding,
-    gHttpHeaderUpdate,
-    gHttpHeaderTrailer,
-    gHttpHeaderVia,
-    /* request headers */
-    gHttpHeaderAccept,
-    gHttpHeaderAcceptCharset,
-    gHttpHeaderAcceptEncoding,
-    gHttpHeaderAcceptLanguage,
-    gHttpHeaderAuthorization,
-    gHttpHeaderExpect,
-    gHttpHeaderFrom,
-    gHttpHeaderHost,
-    gHttpHeaderIfModifiedSince,
-    gHttpHeaderIfMatch,
-    gHttpHeaderIfNoneMatch,
-    gHttpHeaderIfRange,
-    gHttpHeaderIfUnmodifiedSince,
-    gHttpHeaderMaxForwards,
-    gHttpHeaderProxyAuthorization,
-    gHttpHeaderRange,
-    gHttpHeaderReferrer,
-    gHttpHeaderTE,
-    gHttpHeaderUserAgent,
-    /* response headers */
-    gHttpHeaderAcceptRanges,
-    gHttpHeaderAge,
-    gHttpHeaderETag,
-    gHttpHeaderLocation,
-    gHttpHeaderRetryAfter,
-    gHttpHeaderServer,
-    gHttpHeaderVary,
-    gHttpHeaderWarning,
-    gHttpHeaderWWWAuthenticate,
-    NULL,
+static const char* gHttpHeaderKnownList [HTTP_HEADER_ID_NUM] = {
+    [HTTP_HEADER_ID_UNKNOWN] = NULL,
+#define HTTP_HEADER(id, var, name)      [HTTP_HEADER_ID_##id] = var,
+#include "http-header-known.def"
+#undef HTTP_HEADER
+};
+
+static const int gHttpHeaderKnownLen [HTTP_HEADER_ID_NUM] = {
+    [HTTP_HEADER_ID_UNKNOWN] = 0,
+#define HTTP_HEADER(id, var, name)      [HTTP_HEADER_ID_##id] = sizeof (name) - 1,
+#include "http-header-known.def"
+#undef HTTP_HEADER
 };
 
 
+#define HTTP_HEADER_ENTRY_MIN       16
+
+static int  http_header_list_find (HttpHeaderList* ls, const char* key, int len, unsigned int hash);
+static int  http_header_list_append (HttpHeaderList* ls, const char* str, int len);
+static bool http_header_list_insert (HttpHeaderList* ls, int key, int len, int value, unsigned int hash);
+static bool http_header_list_rehash (HttpHeaderList* ls, int size);
+
+
 HttpHeaderList *http_header_list_new ()
 {
-    return g_malloc0 (sizeof (HttpHeaderList));
+    HttpHeaderList* ls = g_malloc0 (sizeof (HttpHeaderList));
+    if (!ls) {
+        return NULL;
+    }
+
+    if (!http_header_list_rehash (ls, HTTP_HEADER_ENTRY_MIN)) {
+        http_header_list_destroy (ls);
+        return NULL;
+    }
+
+    return ls;
 }
 
 void http_header_list_destroy(HttpHeaderList *ls)
 {
     g_return_if_fail (ls);
 
-    for (int i = 0; i < HTTP_HEADER_MAX; ++i) {
-        if (ls->header[i] && (NULL == http_header_is_known (ls->header[i]))) {
-            g_free (ls->header[i]);
-        }
-
-        if (ls->value[i]) {
-            g_free (ls->value[i]);
-        }
-    }
+    if (ls->buf)            g_free (ls->buf);
+    if (ls->entries)        g_free (ls->entries);
+    if (ls->slots)          g_free (ls->slots);
 
     g_free (ls);
 }
@@ -151,59 +128,98 @@ const char *http_header_is_known(const char *hKey)
 {
     g_return_val_if_fail (hKey, NULL);
 
-    int i = 0;
-    while (NULL != gHttpHeaderKnownList[i]) {
-        if (!g_ascii_strcasecmp (hKey, gHttpHeaderKnownList[i])) {
-            return gHttpHeaderKnownList[i];
-        }
-        ++i;
+    int len = strlen (hKey);
+
+    return gHttpHeaderKnownList[http_header_get_id (hKey, len, http_header_hash (hKey, len))];
+}
+
+HttpHeaderId http_header_get_id (const char* name, int len, unsigned int hash)
+{
+    g_return_val_if_fail (name, HTTP_HEADER_ID_UNKNOWN);
+
+    HttpHeaderId id = gHttpHeaderPhash[(hash * HTTP_HEADER_PHASH_MULT) >> HTTP_HEADER_PHASH_SHIFT];
+    if (HTTP_HEADER_ID_UNKNOWN != id
+        && gHttpHeaderKnownHash[id] == hash
+        && gHttpHeaderKnownLen[id] == len
+        && !g_ascii_strncasecmp (name, gHttpHeaderKnownList[id], len)) {
+        return id;
     }
 
-    return NULL;
+    return HTTP_HEADER_ID_UNKNOWN;
+}
+
+const char* http_header_get_name (HttpHeaderId id)
+{
+    g_return_val_if_fail (id > HTTP_HEADER_ID_UNKNOWN && id < HTTP_HEADER_ID_NUM, NULL);
+
+    return gHttpHeaderKnownList[id];
 }
 
 bool http_header_list_set_value(HttpHeaderList *ls, const char *key, const char *value)
 {
     g_return_val_if_fail (ls && key && value, false);
 
-    char* tmpVal = http_header_list_get_value (ls, key);
-    if (!tmpVal) {
-        for (int i = 0; i < HTTP_HEADER_MAX; ++i) {
-            if (!ls->header[i]) {
-                tmpVal = (char*) http_header_is_known (key);
-                if (tmpVal) {
-                    ls->header[i] = tmpVal;
-                } else {
-                    ls->header[i] = g_strdup (key);
-                }
-
-                ls->value[i] = g_strdup (value);
-                return true;
-            }
+    int kl = strlen (key);
+    int vl = strlen (value);
+    unsigned int hash = http_header_hash (key, kl);
+
+    int idx = http_header_list_find (ls, key, kl, hash);
+    if (idx >= 0) {
+        HttpHeaderEntry* e = &ls->entries[idx];
+        // the new value fits, overwrite it in place
+        if ((int) strlen (ls->buf + e->value) >= vl) {
+            memcpy (ls->buf + e->value, value, vl + 1);
+            return true;
         }
-    } else {
-        for (int i = 0; i < HTTP_HEADER_MAX; ++i) {
-            if (ls->value[i] == tmpVal) {
-                g_free (ls->value[i]);
-                ls->value[i] = g_strdup (value);
-                return true;
-            }
+
+        int v = http_header_list_append (ls, value, vl);
+        if (v < 0) {
+            return false;
         }
+        ls->entries[idx].value = v;
+
+        return true;
     }
 
-    return false;
+    int k = http_header_list_append (ls, key, kl);
+    if (k < 0) {
+        return false;
+    }
+
+    int v = http_header_list_append (ls, value, vl);
+    if (v < 0) {
+        return false;
+    }
+
+    return http_header_list_insert (ls, k, kl, v, hash);
 }
 
 char *http_header_list_get_value(HttpHeaderList *ls, const char *key)
 {
-    g_return_val_if_fail (ls && key, false);
+    g_return_val_if_fail (ls && key, NULL);
 
-    for (int i = 0; i < HTTP_HEADER_MAX; ++i) {
-        if (ls->header[i] && !g_ascii_strcasecmp (ls->header[i], key)) {
-            if (!ls->value[i]) {
-                break;
-            }
-            return ls->value[i];
+    int kl = strlen (key);
+    int idx = http_header_list_find (ls, key, kl, http_header_hash (key, kl));
+    if (idx < 0) {
+        return NULL;
+    }
+
+    return ls->buf + ls->entries[idx].value;
+}
+
+char* http_header_list_get_value_by_id (HttpHeaderList* ls, HttpHeaderId id)
+{
+    g_return_val_if_fail (ls && id > HTTP_HEADER_ID_UNKNOWN && id < HTTP_HEADER_ID_NUM, NULL);
+
+    unsigned int hash = gHttpHeaderKnownHash[id];
+    for (int i = hash & ls->slotMask;; i = (i + 1) & ls->slotMask) {
+        int idx = ls->slots[i];
+        if (-1 == idx) {
+            break;
+        }
+
+        if (idx >= 0 && ls->entries[idx].id == id) {
+            return ls->buf + ls->entries[idx].value;
         }
     }
 
@@ -214,68 +230,238 @@ bool http_header_list_get_headers(HttpHeaderList *ls, char ***names, int *numNam
 {
     g_return_val_if_fail (ls && names && numNames, false);
 
-    int lNumNames = 0;
-    for (int i = 0; i < HTTP_HEADER_MAX; ++i) {
-        if (ls->header[i]) {
-            ++lNumNames;
-        }
-    }
+    *names = NULL;
+    *numNames = 0;
 
-    if (0 == lNumNames) return true;
+    if (0 == ls->num) return true;
 
-    char** lNames = g_malloc0 (sizeof (char*) * lNumNames);
+    char** lNames = g_malloc0 (sizeof (char*) * ls->num);
     if (!lNames) {
-        goto error;
+        return false;
     }
 
-    for (int i = 0; i < HTTP_HEADER_MAX; ++i) {
-        if (ls->header[i]) {
-            lNames[i] = g_strdup (ls->header[i]);
-            if (!lNames[i]) {
-                goto error;
-            }
-        }
+    int n = 0;
+    const char* key = NULL;
+    for (int it = 0; http_header_list_next (ls, &it, &key, NULL);) {
+        lNames[n++] = g_strdup (key);
     }
 
     *names = lNames;
-    *numNames = lNumNames;
+    *numNames = n;
 
     return true;
+}
 
-error:
-    if (lNames) {
-        for (int i = 0; i < lNumNames; ++i) {
-            if (lNames[i]) {
-                g_free (lNames[i]);
-                lNames[i] = 0;
-            }
+bool http_header_clear_value(HttpHeaderList *ls, const char *name)
+{
+    g_return_val_if_fail (ls && name, false);
+
+    int kl = strlen (name);
+    unsigned int hash = http_header_hash (name, kl);
+
+    for (int i = hash & ls->slotMask;; i = (i + 1) & ls->slotMask) {
+        int idx = ls->slots[i];
+        if (-1 == idx) {
+            break;
         }
 
-        g_free (lNames);
-        *names = NULL;
+        if (idx >= 0) {
+            HttpHeaderEntry* e = &ls->entries[idx];
+            if (e->hash == hash && !g_ascii_strcasecmp (ls->buf + e->key, name)) {
+                e->value = -1;
+                ls->slots[i] = -2;
+                --ls->num;
+                break;
+            }
+        }
     }
 
-    *numNames = 0;
+    return true;
+}
+
+bool http_header_list_next (HttpHeaderList* ls, int* iter, const char** key, const char** value)
+{
+    g_return_val_if_fail (ls && iter, false);
+
+    for (; *iter < ls->used; ++(*iter)) {
+        HttpHeaderEntry* e = &ls->entries[*iter];
+        if (e->value < 0) {
+            continue;
+        }
+
+        if (key)    *key = ls->buf + e->key;
+        if (value)  *value = ls->buf + e->value;
+        ++(*iter);
+
+        return true;
+    }
 
     return false;
 }
 
-bool http_header_clear_value(HttpHeaderList *ls, const char *name)
+bool http_header_list_parse (HttpHeaderList* ls, char* buf, int len, int offset)
 {
-    g_return_val_if_fail (ls && name, false);
+    g_return_val_if_fail (ls && buf && len >= offset && offset >= 0, false);
+
+    // adopt the receive buffer, only copy when the list already holds strings
+    int base = 0;
+    if (!ls->buf) {
+        ls->buf = buf;
+        ls->bufLen = len + 1;
+        ls->bufSize = len + 1;
+    } else {
+        base = http_header_list_append (ls, buf, len);
+        g_free (buf);
+        if (base < 0) {
+            return false;
+        }
+    }
 
-    for (int i = 0; i < HTTP_HEADER_MAX; ++i) {
-        if (ls->header[i] && !g_ascii_strcasecmp (ls->header[i], name)) {
-            if (!http_header_is_known (name)) {
-                g_free (ls->header[i]);
+    char* p = ls->buf + base + offset;
+    char* end = ls->buf + base + len;
+    while (p < end) {
+        char* eol = (char*) scan_byte (p, end - p, '\n');
+        if (!eol) {
+            eol = end;
+        }
+        *eol = '\0';
+
+        char* colon = (char*) scan_byte (p, eol - p, ':');
+        if (colon && colon > p) {
+            char* ke = colon;
+            while (ke > p && (' ' == ke[-1] || '\t' == ke[-1])) --ke;
+            *ke = '\0';
+
+            char* v = colon + 1;
+            while (v < eol && (' ' == *v || '\t' == *v)) ++v;
+
+            char* ve = eol;
+            while (ve > v && ('\r' == ve[-1] || ' ' == ve[-1] || '\t' == ve[-1])) --ve;
+            *ve = '\0';
+
+            // repeated header: the last one wins
+            unsigned int hash = http_header_hash (p, ke - p);
+            int idx = http_header_list_find (ls, p, ke - p, hash);
+            if (idx >= 0) {
+                ls->entries[idx].value = v - ls->buf;
+            } else if (!http_header_list_insert (ls, p - ls->buf, ke - p, v - ls->buf, hash)) {
+                return false;
             }
+        }
+
+        p = eol + 1;
+    }
+
+    return true;
+}
 
-            ls->header[i] = NULL;
-            g_free (ls->value[i]);
-            ls->value[i] = NULL;
+static int http_header_list_find (HttpHeaderList* ls, const char* key, int len, unsigned int hash)
+{
+    for (int i = hash & ls->slotMask;; i = (i + 1) & ls->slotMask) {
+        int idx = ls->slots[i];
+        if (-1 == idx) {
+            return -1;
+        }
+
+        if (idx >= 0) {
+            HttpHeaderEntry* e = &ls->entries[idx];
+            if (e->hash == hash
+                && !g_ascii_strncasecmp (ls->buf + e->key, key, len)
+                && '\0' == ls->buf[e->key + len]) {
+                return idx;
+            }
         }
     }
 
+    return -1;
+}
+
+static int http_header_list_append (HttpHeaderList* ls, const char* str, int len)
+{
+    if (ls->bufLen + len + 1 > ls->bufSize) {
+        int size = MAX (ls->bufSize * 2, ls->bufLen + len + 1);
+        size = MAX (size, 256);
+        char* t = g_realloc (ls->buf, size);
+        if (!t) {
+            return -1;
+        }
+        ls->buf = t;
+        ls->bufSize = size;
+    }
+
+    int off = ls->bufLen;
+    memcpy (ls->buf + off, str, len);
+    ls->buf[off + len] = '\0';
+    ls->bufLen += len + 1;
+
+    return off;
+}
+
+static bool http_header_list_insert (HttpHeaderList* ls, int key, int len, int value, unsigned int hash)
+{
+    if (ls->used >= ls->size) {
+        int size = HTTP_HEADER_ENTRY_MIN;
+        while (size <= ls->num * 2) size <<= 1;
+        if (!http_header_list_rehash (ls, size)) {
+            return false;
+        }
+    }
+
+    int idx = ls->used++;
+    ls->entries[idx].hash = hash;
+    ls->entries[idx].id = http_header_get_id (ls->buf + key, len, hash);
+    ls->entries[idx].key = key;
+    ls->entries[idx].value = value;
+    ++ls->num;
+
+    int i = hash & ls->slotMask;
+    while (ls->slots[i] >= 0) {
+        i = (i + 1) & ls->slotMask;
+    }
+    ls->slots[i] = idx;
+
     return true;
 }
 
+static bool http_header_list_rehash (HttpHeaderList* ls, int size)
+{
+    // drop the cleared entries and rebuild the index, slots stay at most half full
+    HttpHeaderEntry* entries = g_malloc0 (sizeof (HttpHeaderEntry) * size);
+    int* slots = g_malloc (sizeof (int) * size * 2);
+    if (!entries || !slots) {
+        if (entries)    g_free (entries);
+        if (slots)      g_free (slots);
+        return false;
+    }
+
+    int mask = size * 2 - 1;
+    memset (slots, -1, sizeof (int) * size * 2);
+
+    int n = 0;
+    for (int i = 0; i < ls->used; ++i) {
+        if (ls->entries[i].value < 0) {
+            continue;
+        }
+
+        entries[n] = ls->entries[i];
+
+        int s = entries[n].hash & mask;
+        while (slots[s] >= 0) {
+            s = (s + 1) & mask;
+        }
+        slots[s] = n;
+        ++n;
+    }
+
+    if (ls->entries)    g_free (ls->entries);
+    if (ls->slots)      g_free (ls->slots);
+
+    ls->entries = entries;
+    ls->slots = slots;
+    ls->slotMask = mask;
+    ls->size = size;
+    ls->used = n;
+    ls->num = n;
+
+    return true;
+}
@@ -4,8 +4,6 @@
 #include <stdbool.h>
 
 
-#define HTTP_HEADER_MAX     256
-
 
 extern const char gHttpHeaderAllow[];
 extern const char gHttpHeaderContentEncoding[];
@@ -51,8 +49,10 @@ extern const char gHttpHeaderUserAgent[];
 /* response headers */
 extern const char gHttpHeaderAcceptRanges[];
 extern const char gHttpHeaderAge[];
+extern const char gHttpHeaderDigest[];
 extern const char gHttpHeaderETag[];
 extern const char gHttpHeaderLocation[];
+extern const char gHttpHeaderReprDigest[];
 extern const char gHttpHeaderRetryAfter[];
 extern const char gHttpHeaderServer[];
 extern const char gHttpHeaderVary[];
@@ -73,24 +73,105 @@ extern const char gHttpHeaderStatusURI[];
 extern const char gHttpHeaderTimeout[];
 
 
+typedef enum _HttpHeaderId              HttpHeaderId;
 typedef struct _HttpHeaderList          HttpHeaderList;
+typedef struct _HttpHeaderEntry         HttpHeaderEntry;
+
+/**
+ * @brief 已知头部的编号, 由 http-header-known.def 生成
+ */
+enum _HttpHeaderId
+{
+    HTTP_HEADER_ID_UNKNOWN = 0,
+#define HTTP_HEADER(id, var, name)      HTTP_HEADER_ID_##id,
+#include "http-header-known.def"
+#undef HTTP_HEADER
+    HTTP_HEADER_ID_NUM,
+};
 
+/**
+ * @brief 头部项, key/value 都是 buf 中的偏移量, value 为 -1 表示已被清除
+ */
+struct _HttpHeaderEntry
+{
+    unsigned int            hash;                   // 忽略大小写的 key 哈希
+    HttpHeaderId            id;
+    int                     key;
+    int                     value;
+};
+
+/**
+ * @brief 开放寻址的 http 头部表
+ *
+ * 所有字符串都存放在 buf 里(可以直接接管接收缓冲区), entries 按插入顺序保存,
+ * slots 是以 hash 为索引的开放寻址表, 保存 entries 下标(-1 空, -2 已删除)
+ */
 struct _HttpHeaderList
 {
-    char        *header[HTTP_HEADER_MAX];
-    char        *value[HTTP_HEADER_MAX];
+    char                   *buf;
+    int                     bufLen;
+    int                     bufSize;
+
+    int                     num;                    // 有效头部数量
+    int                     used;                   // entries 已使用数量(包括已清除的)
+    int                     size;                   // entries 容量
+    HttpHeaderEntry        *entries;
+
+    int                     slotMask;
+    int                    *slots;
 };
 
 
+/**
+ * @brief 忽略大小写的 FNV-1a 哈希, 头部表和编译时生成的完美哈希共用
+ */
+static inline unsigned int http_header_hash (const char* key, int len)
+{
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        unsigned char c = key[i];
+        h ^= (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+
 HttpHeaderList* http_header_list_new ();
 void  http_header_list_destroy (HttpHeaderList* ls);
 
 const char* http_header_is_known (const char* header);
 
+/**
+ * @brief 通过完美哈希查找已知头部编号
+ * @param hash http_header_hash() 的结果
+ * @return 未知头部返回 HTTP_HEADER_ID_UNKNOWN
+ */
+HttpHeaderId http_header_get_id (const char* name, int len, unsigned int hash);
+const char*  http_header_get_name (HttpHeaderId id);
+
 bool  http_header_list_set_value (HttpHeaderList* ls, const char* key, const char* value);
 char* http_header_list_get_value (HttpHeaderList* ls, const char* key);
+char* http_header_list_get_value_by_id (HttpHeaderList* ls, HttpHeaderId id);
 
 bool  http_header_list_get_headers (HttpHeaderList* ls, char*** names, int* numNames);
 bool  http_header_clear_value    (HttpHeaderList* ls, const char* name);
 
+/**
+ * @brief 按插入顺序遍历头部
+ * @param iter 遍历位置, 开始时置 0
+ * @return 还有头部返回 true, 遍历结束返回 false
+ */
+bool  http_header_list_next (HttpHeaderList* ls, int* iter, const char** key, const char** value);
+
+/**
+ * @brief 解析 "key: value" 行组成的头部块, 不复制字符串
+ * @param buf 以 '\0' 结尾的头部块, 解析时原地修改, 调用后归 ls 所有
+ * @param len buf 长度(不含结尾的 '\0')
+ * @param offset 从 buf 的此处开始解析(用于跳过状态行)
+ * @return 出错返回 false
+ */
+bool  http_header_list_parse (HttpHeaderList* ls, char* buf, int len, int offset);
+
 #endif // HTTPHEADER_H
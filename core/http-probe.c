@@ -0,0 +1,224 @@
+#include "http-probe.h"
+
+#include <pthread.h>
+
+#include "log.h"
+#include "http.h"
+#include "utils.h"
+
+
+static void* http_probe_host (void* arg);
+static void  http_probe_record (HttpProbe* probe, HttpResponse* resp);
+static GList* http_probe_requeue (GList* queue, GList* sent, bool charge);
+
+
+HttpProbe* http_probe_new (GUri* uri)
+{
+    g_return_val_if_fail (uri, NULL);
+
+    HttpProbe* probe = g_malloc0 (sizeof (HttpProbe));
+    if (!probe) {
+        return NULL;
+    }
+
+    probe->uri = g_uri_ref (uri);
+    probe->location = g_uri_ref (uri);
+    probe->length = -1;
+
+    return probe;
+}
+
+void http_probe_free (HttpProbe* probe)
+{
+    g_return_if_fail (probe);
+
+    if (probe->uri)         g_uri_unref (probe->uri);
+    if (probe->location)    g_uri_unref (probe->location);
+    if (probe->etag)        g_free (probe->etag);
+    if (probe->digest)      g_free (probe->digest);
+    if (probe->contentMD5)  g_free (probe->contentMD5);
+
+    g_free (probe);
+}
+
+void http_probe_run (GList* probes)
+{
+    // every round probes the pending locations, redirects to other hosts go to the next round
+    for (int round = 0; round <= HTTP_PROBE_MAX_REDIRECTS; ++round) {
+        GHashTable* hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+        if (!hosts) {
+            break;
+        }
+
+        for (GList* l = probes; NULL != l; l = l->next) {
+            HttpProbe* probe = l->data;
+            if (probe->done) continue;
+
+            GUri* uri = probe->location;
+            char* key = g_strdup_printf ("%s://%s:%d", g_uri_get_scheme (uri), g_uri_get_host (uri), g_uri_get_port (uri));
+            GList* group = g_hash_table_lookup (hosts, key);
+            if (group) {
+                g_list_append (group, probe);
+                g_free (key);
+            } else {
+                g_hash_table_insert (hosts, key, g_list_append (NULL, probe));
+            }
+        }
+
+        GList* groups = g_hash_table_get_values (hosts);
+        if (!groups) {
+            g_hash_table_destroy (hosts);
+            break;
+        }
+
+        // one connection per host, a limited number of hosts at a time
+        pthread_t tids[HTTP_PROBE_MAX_HOSTS];
+        for (GList* l = groups; NULL != l;) {
+            int n = 0;
+            for (; l && n < HTTP_PROBE_MAX_HOSTS; l = l->next) {
+                if (0 != pthread_create (&tids[n], NULL, http_probe_host, l->data)) {
+                    http_probe_host (l->data);
+                    continue;
+                }
+                ++n;
+            }
+            for (int i = 0; i < n; ++i) {
+                pthread_join (tids[i], NULL);
+            }
+        }
+
+        for (GList* l = groups; NULL != l; l = l->next) {
+            g_list_free (l->data);
+        }
+        g_list_free (groups);
+        g_hash_table_destroy (hosts);
+    }
+
+    for (GList* l = probes; NULL != l; l = l->next) {
+        HttpProbe* probe = l->data;
+        if (!probe->done) {
+            g_autofree char* uri = g_uri_to_string (probe->uri);
+            logi ("probe '%s': too many redirects", uri);
+            probe->done = true;
+        }
+    }
+}
+
+/**
+ * @brief 在一个连接上流水线探测同一主机的地址
+ */
+static void* http_probe_host (void* arg)
+{
+    GList* queue = g_list_copy (arg);
+    GList* sent = NULL;
+    HttpProbe* first = queue->data;
+
+    Http* http = http_new (first->location);
+    if (!http) {
+        for (GList* l = queue; NULL != l; l = l->next) {
+            ((HttpProbe*) l->data)->done = true;
+        }
+        g_list_free (queue);
+        return NULL;
+    }
+    http->request->type = HTTP_REQUEST_TYPE_HEAD;
+
+    while (queue || sent) {
+        // keep up to HTTP_PROBE_PIPELINE requests in flight
+        while (queue && g_list_length (sent) < HTTP_PROBE_PIPELINE) {
+            HttpProbe* probe = queue->data;
+            if (!http_set_resource (http, probe->location) || !http_write_request (http)) {
+                break;
+            }
+            ++probe->tries;
+            queue = g_list_delete_link (queue, queue);
+            sent = g_list_append (sent, probe);
+        }
+
+        if (!sent) {
+            // can not even send, e.g. the host refuses connections
+            HttpProbe* probe = queue->data;
+            if (++probe->tries >= 2) {
+                g_autofree char* uri = g_uri_to_string (probe->location);
+                logi ("probe '%s' error: %s", uri, http->error ? http->error->message : "");
+                probe->done = true;
+                queue = g_list_delete_link (queue, queue);
+            }
+            continue;
+        }
+
+        // the answers come back in the order of the requests
+        HttpProbe* probe = sent->data;
+        if (!http_read_response (http)) {
+            tcp_close (http->tcp);
+            queue = http_probe_requeue (queue, sent, true);
+            g_list_free (sent);
+            sent = NULL;
+            continue;
+        }
+        sent = g_list_delete_link (sent, sent);
+        http_probe_record (probe, http->resp);
+
+        if (!http->keepAlive) {
+            // the rest of the pipeline goes down with this connection
+            tcp_close (http->tcp);
+            queue = http_probe_requeue (queue, sent, false);
+            g_list_free (sent);
+            sent = NULL;
+        }
+    }
+
+    http_destroy (http);
+
+    return NULL;
+}
+
+/**
+ * @brief 把没有收到响应的请求放回队列开头, charge 为 true 时算一次失败
+ */
+static GList* http_probe_requeue (GList* queue, GList* sent, bool charge)
+{
+    for (GList* l = g_list_last (sent); NULL != l; l = l->prev) {
+        HttpProbe* probe = l->data;
+        if (!charge) {
+            --probe->tries;
+        }
+
+        if (probe->tries >= 2) {
+            probe->done = true;
+        } else {
+            queue = g_list_prepend (queue, probe);
+        }
+    }
+
+    return queue;
+}
+
+static void http_probe_record (HttpProbe* probe, HttpResponse* resp)
+{
+    probe->statusCode = resp->statusCode;
+
+    if (resp->statusCode >= 300 && resp->statusCode < 400) {
+        const char* location = http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_LOCATION);
+        GUri* uri = location ? g_uri_parse_relative (probe->location, location, G_URI_FLAGS_NONE, NULL) : NULL;
+        if (uri) {
+            g_uri_unref (probe->location);
+            probe->location = uri;
+            probe->tries = 0;
+            ++probe->redirects;
+            return;
+        }
+    }
+
+    probe->length = resp->contentLength;
+    probe->acceptRanges = resp->acceptRanges;
+    probe->etag = g_strdup (http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_ETAG));
+    const char* digest = http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_REPR_DIGEST);
+    probe->digest = g_strdup (digest ? digest : http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_DIGEST));
+    probe->contentMD5 = g_strdup (http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_CONTENT_MD5));
+    probe->done = true;
+
+    g_autofree char* uri = g_uri_to_string (probe->location);
+    logd ("probe '%s': %d, length %lld, ranges %d, etag %s",
+          uri, probe->statusCode, probe->length, probe->acceptRanges, probe->etag ? probe->etag : "");
+}
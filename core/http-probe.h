@@ -0,0 +1,46 @@
+#ifndef HTTPPROBE_H
+#define HTTPPROBE_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define HTTP_PROBE_PIPELINE         8               // 每个连接上同时发出的 HEAD 请求数
+#define HTTP_PROBE_MAX_REDIRECTS    5
+#define HTTP_PROBE_MAX_HOSTS        16              // 同时探测的主机数
+
+typedef struct _HttpProbe           HttpProbe;
+
+/**
+ * @brief 一个地址的 HEAD 探测结果, 未知的值为 -1
+ */
+struct _HttpProbe
+{
+    GUri                   *uri;                    // 要探测的地址
+    GUri                   *location;               // 跟随重定向之后的地址
+
+    int                     statusCode;             // 最后一个响应的状态码, 连接失败为 0
+    int                     redirects;
+    long long               length;
+    bool                    acceptRanges;
+    char                   *etag;
+    char                   *digest;                 // Repr-Digest 或 Digest
+    char                   *contentMD5;
+
+    bool                    done;
+    int                     tries;
+};
+
+HttpProbe*  http_probe_new      (GUri* uri);
+void        http_probe_free     (HttpProbe* probe);
+
+/**
+ * @brief 探测一批地址
+ *
+ * 地址按主机分组, 每个主机一个连接, 用流水线连续发送 HEAD 请求后按顺序读取响应;
+ * 重定向会被跟随, 跳到其它主机的地址在下一轮探测。
+ *
+ * @param probes HttpProbe 列表
+ */
+void        http_probe_run      (GList* probes);
+
+#endif // HTTPPROBE_H
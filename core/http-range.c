@@ -0,0 +1,671 @@
+#include "http-range.h"
+
+#include <fcntl.h>
+#include <errno.h>
+
+#include "log.h"
+#include "http.h"
+#include "scan.h"
+#include "utils.h"
+
+typedef struct _HttpRangeSink           HttpRangeSink;
+
+/**
+ * @brief 把收到的数据写到请求的范围里, 范围以外的数据丢弃
+ */
+struct _HttpRangeSink
+{
+    const char             *fileName;
+    bool                    split;
+
+    GList                  *ranges;                 // 换算后的 HttpByteRange, 有序且不重叠
+    int                     num;
+    int                    *fds;                    // split 时每个范围一个文件
+    long long              *got;                    // 每个范围已写入的字节数
+    int                     fd;
+    bool                    prepared;
+
+    HttpMultipartFunc       func;                   // 不为空时数据交给 func, 不写文件
+    void                   *udata;
+
+    GError                 *error;
+};
+
+
+static int  http_range_compare (const void* a, const void* b);
+static int  http_multipart_parse_delim (HttpMultipart* mp);
+static bool http_range_sink_prepare (HttpRangeSink* sink, long long total);
+static bool http_range_sink_write (long long offset, const char* data, int len, long long total, void* udata);
+static bool http_range_sink_complete (const HttpRangeSink* sink, int i);
+static void http_range_sink_close (HttpRangeSink* sink);
+static bool http_range_read (Http* http, HttpRangeSink* sink, char* buf);
+static bool http_range_run (GUri* uri, GList* ranges, HttpRangeSink* sink, GError** error);
+
+
+GList* http_range_parse (const char* spec, GError** error)
+{
+    g_return_val_if_fail (spec, NULL);
+
+    GList* ranges = NULL;
+    char** arr = g_strsplit (spec, ",", -1);
+    for (int i = 0; arr && arr[i]; ++i) {
+        char* item = g_strstrip (arr[i]);
+        if ('\0' == item[0]) continue;
+
+        long long s = -1, e = -1;
+        char* end = NULL;
+        if ('-' == item[0]) {
+            // last N bytes
+            s = -g_ascii_strtoll (item + 1, &end, 10);
+            if (end == item + 1 || '\0' != *end || s >= 0) goto error;
+        } else {
+            s = g_ascii_strtoll (item, &end, 10);
+            if (end == item || '-' != *end) goto error;
+            if ('\0' != end[1]) {
+                char* p = end + 1;
+                e = g_ascii_strtoll (p, &end, 10);
+                if (end == p || '\0' != *end || e < s) goto error;
+            }
+        }
+
+        HttpByteRange* r = g_malloc (sizeof (HttpByteRange));
+        if (!r) goto error;
+        r->start = s;
+        r->end = e;
+        ranges = g_list_append (ranges, r);
+        continue;
+
+    error:
+        gf_error (error, "invalid byte range '%s'", item);
+        g_list_free_full (ranges, g_free);
+        g_strfreev (arr);
+        return NULL;
+    }
+    g_strfreev (arr);
+
+    if (!ranges) {
+        gf_error (error, "no byte range in '%s'", spec);
+    }
+
+    return ranges;
+}
+
+GList* http_range_coalesce (GList* ranges)
+{
+    GList* out = NULL;
+    HttpByteRange* cur = NULL;
+    HttpByteRange* suffix = NULL;
+
+    ranges = g_list_sort (ranges, http_range_compare);
+    for (GList* l = ranges; NULL != l; l = l->next) {
+        HttpByteRange* r = l->data;
+        if (r->start < 0) {
+            // keep the longest "last N bytes"
+            if (!suffix || r->start < suffix->start) {
+                if (suffix) g_free (suffix);
+                suffix = r;
+            } else {
+                g_free (r);
+            }
+        } else if (cur && (cur->end < 0 || r->start <= cur->end + 1)) {
+            if (cur->end >= 0) {
+                cur->end = (r->end < 0) ? -1 : MAX (cur->end, r->end);
+            }
+            g_free (r);
+        } else {
+            cur = r;
+            out = g_list_prepend (out, r);
+        }
+    }
+    g_list_free (ranges);
+
+    if (suffix) {
+        out = g_list_prepend (out, suffix);
+    }
+
+    return g_list_reverse (out);
+}
+
+bool http_range_resolve (GList** ranges, long long total)
+{
+    g_return_val_if_fail (ranges, false);
+
+    if (total >= 0) {
+        for (GList* l = *ranges; NULL != l;) {
+            GList* next = l->next;
+            HttpByteRange* r = l->data;
+            if (r->start < 0) {
+                r->start = MAX (0, total + r->start);
+                r->end = total - 1;
+            } else if (r->end < 0 || r->end >= total) {
+                r->end = total - 1;
+            }
+
+            if (r->start >= total) {
+                g_free (r);
+                *ranges = g_list_delete_link (*ranges, l);
+            }
+            l = next;
+        }
+    }
+    *ranges = http_range_coalesce (*ranges);
+
+    return NULL != *ranges;
+}
+
+char* http_range_to_string (GList* ranges)
+{
+    GString* str = g_string_new ("bytes=");
+    for (GList* l = ranges; NULL != l; l = l->next) {
+        HttpByteRange* r = l->data;
+        if (l != ranges) {
+            g_string_append_c (str, ',');
+        }
+
+        if (r->start < 0) {
+            g_string_append_printf (str, "%lld", r->start);
+        } else if (r->end < 0) {
+            g_string_append_printf (str, "%lld-", r->start);
+        } else {
+            g_string_append_printf (str, "%lld-%lld", r->start, r->end);
+        }
+    }
+
+    return g_string_free (str, false);
+}
+
+bool http_multipart_init (HttpMultipart* mp, const char* contentType)
+{
+    g_return_val_if_fail (mp, false);
+
+    memset (mp, 0, sizeof (HttpMultipart));
+    mp->total = -1;
+
+    if (!contentType || g_ascii_strncasecmp (contentType, "multipart/byteranges", 20)) {
+        return false;
+    }
+
+    // multipart/byteranges; boundary=3d6b6a416f9b5 or boundary="..."
+    const char* p = contentType + 20;
+    for (; *p; ++p) {
+        if (!g_ascii_strncasecmp (p, "boundary=", 9)) {
+            p += 9;
+            break;
+        }
+    }
+    if (!*p) {
+        return false;
+    }
+
+    bool quoted = ('"' == *p);
+    if (quoted) ++p;
+
+    int len = 0;
+    while (p[len] && (quoted ? '"' != p[len] : (';' != p[len] && ' ' != p[len]))) {
+        ++len;
+    }
+    if (len <= 0 || len + 2 >= (int) sizeof (mp->boundary)) {
+        return false;
+    }
+
+    mp->boundary[0] = '-';
+    mp->boundary[1] = '-';
+    memcpy (mp->boundary + 2, p, len);
+    mp->boundary[len + 2] = '\0';
+    mp->boundaryLen = len + 2;
+
+    return true;
+}
+
+bool http_multipart_feed (HttpMultipart* mp, const char* data, int len, HttpMultipartFunc func, void* udata)
+{
+    g_return_val_if_fail (mp && mp->boundaryLen > 0 && func, false);
+
+    int used = 0;
+    while (used < len && HTTP_MULTIPART_DONE != mp->state) {
+        if (HTTP_MULTIPART_BODY == mp->state) {
+            int n = (int) MIN ((long long) (len - used), mp->partRemain);
+            if (!func (mp->partStart, data + used, n, mp->total, udata)) {
+                return false;
+            }
+            mp->partStart += n;
+            mp->partRemain -= n;
+            used += n;
+            if (0 == mp->partRemain) {
+                mp->state = HTTP_MULTIPART_DELIM;
+            }
+            continue;
+        }
+
+        // the delimiter and part headers are collected in mp->buf
+        int old = mp->bufLen;
+        int n = MIN (len - used, (int) sizeof (mp->buf) - 1 - mp->bufLen);
+        memcpy (mp->buf + mp->bufLen, data + used, n);
+        mp->bufLen += n;
+        mp->buf[mp->bufLen] = '\0';
+
+        int consumed = http_multipart_parse_delim (mp);
+        if (consumed < 0) {
+            return false;
+        } else if (consumed > 0) {
+            used += consumed - old;
+            mp->bufLen = 0;
+        } else {
+            used += n;
+            if (mp->bufLen >= (int) sizeof (mp->buf) - 1) {
+                if (g_strstr_len (mp->buf, mp->bufLen, mp->boundary)) {
+                    // part headers do not fit
+                    return false;
+                }
+                // skip the preamble, keep what may be the start of a delimiter
+                memmove (mp->buf, mp->buf + mp->bufLen - mp->boundaryLen, mp->boundaryLen);
+                mp->bufLen = mp->boundaryLen;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool http_multipart_done (const HttpMultipart* mp)
+{
+    g_return_val_if_fail (mp, false);
+
+    return HTTP_MULTIPART_DONE == mp->state;
+}
+
+bool http_range_download (GUri* uri, GList* ranges, const char* fileName, bool split, GError** error)
+{
+    g_return_val_if_fail (uri && ranges && fileName, false);
+
+    if (!split && g_file_test (fileName, G_FILE_TEST_EXISTS) && !g_file_test (fileName, G_FILE_TEST_IS_DIR)) {
+        gf_error (error, "file '%s' already exists!", fileName);
+        return false;
+    }
+
+    HttpRangeSink sink;
+    memset (&sink, 0, sizeof (sink));
+    sink.fileName = fileName;
+    sink.split = split;
+    sink.fd = -1;
+
+    return http_range_run (uri, ranges, &sink, error);
+}
+
+bool http_range_fetch (GUri* uri, GList* ranges, HttpMultipartFunc func, void* udata, GError** error)
+{
+    g_return_val_if_fail (uri && ranges && func, false);
+
+    HttpRangeSink sink;
+    memset (&sink, 0, sizeof (sink));
+    sink.fileName = g_uri_get_path (uri);
+    sink.func = func;
+    sink.udata = udata;
+    sink.fd = -1;
+
+    return http_range_run (uri, ranges, &sink, error);
+}
+
+static bool http_range_run (GUri* uri, GList* ranges, HttpRangeSink* s, GError** error)
+{
+    bool ret = false;
+    HttpRangeSink sink = *s;
+
+    char* buf = NULL;
+    char* spec = NULL;
+    Http* http = http_new (uri);
+    if (!http) {
+        gf_error (error, "http_new error");
+        goto out;
+    }
+
+    for (GList* l = ranges; NULL != l; l = l->next) {
+        HttpByteRange* r = g_malloc (sizeof (HttpByteRange));
+        if (!r) {
+            gf_error (error, "malloc range error");
+            goto out;
+        }
+        *r = *(HttpByteRange*) l->data;
+        sink.ranges = g_list_prepend (sink.ranges, r);
+    }
+    sink.ranges = http_range_coalesce (sink.ranges);
+
+    buf = g_malloc (MAX_HTTP_READ_SIZE);
+    if (!buf) {
+        gf_error (error, "malloc buffer error");
+        goto out;
+    }
+
+    // all ranges in one request
+    spec = http_range_to_string (sink.ranges);
+    logi ("fetch %s of '%s'", spec, sink.fileName);
+
+    if (!http_header_list_set_value (http->request->headers, gHttpHeaderRange, spec) || !http_send (http)) {
+        gf_error (error, "%s", http->error ? http->error->message : "http send error");
+        goto out;
+    }
+
+    bool canRange = (206 == http->resp->statusCode);
+    if (!http_range_read (http, &sink, buf)) {
+        goto out;
+    }
+
+    // the server may have answered only some of the ranges, ask for the rest one by one
+    for (int i = 0; canRange && i < sink.num; ++i) {
+        if (http_range_sink_complete (&sink, i)) continue;
+
+        HttpByteRange* r = g_list_nth_data (sink.ranges, i);
+        if (r->start < 0) {
+            gf_error (error, "the last %lld bytes can not be located without the file length", -r->start);
+            goto out;
+        }
+
+        logi ("range %lld-%lld was not sent, request it alone", r->start, r->end);
+        if (!http_set_range (http, r->start, r->end) || !http_send (http)) {
+            gf_error (error, "%s", http->error ? http->error->message : "http send error");
+            goto out;
+        }
+        if (!http_range_read (http, &sink, buf)) {
+            goto out;
+        }
+    }
+
+    for (int i = 0; i < sink.num; ++i) {
+        if (!http_range_sink_complete (&sink, i)) {
+            HttpByteRange* r = g_list_nth_data (sink.ranges, i);
+            gf_error (error, "range %lld-%lld is incomplete, %lld bytes received", r->start, r->end, sink.got[i]);
+            goto out;
+        }
+    }
+
+    ret = true;
+
+out:
+    if (sink.error) {
+        g_propagate_error (error, sink.error);
+        sink.error = NULL;
+    }
+
+    http_range_sink_close (&sink);
+    if (http)   http_destroy (http);
+    if (buf)    g_free (buf);
+    if (spec)   g_free (spec);
+
+    return ret;
+}
+
+static int http_range_compare (const void* a, const void* b)
+{
+    const HttpByteRange* ra = a;
+    const HttpByteRange* rb = b;
+
+    // "last N bytes" go to the end
+    if ((ra->start < 0) != (rb->start < 0)) {
+        return (ra->start < 0) ? 1 : -1;
+    }
+
+    return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+/**
+ * @brief 在 mp->buf 中查找分隔行和部分头
+ * @return 完整时返回消耗的字节数, 数据不够返回 0, 格式错误返回 -1
+ */
+static int http_multipart_parse_delim (HttpMultipart* mp)
+{
+    const char* p = g_strstr_len (mp->buf, mp->bufLen, mp->boundary);
+    if (!p) {
+        return 0;
+    }
+
+    const char* after = p + mp->boundaryLen;
+    const char* bufEnd = mp->buf + mp->bufLen;
+    if (bufEnd - after < 2) {
+        return 0;
+    }
+
+    // close delimiter, the epilogue is ignored
+    if ('-' == after[0] && '-' == after[1]) {
+        mp->state = HTTP_MULTIPART_DONE;
+        return mp->bufLen;
+    }
+
+    const char* end = scan_crlfcrlf (after, bufEnd - after);
+    if (!end) {
+        return 0;
+    }
+
+    // every part of a byteranges response carries its own Content-Range
+    bool found = false;
+    for (const char* line = after; line < end;) {
+        const char* eol = scan_crlf (line, end + 2 - line);
+        if (!eol) break;
+
+        if (eol - line > 14 && !g_ascii_strncasecmp (line, "Content-Range:", 14)) {
+            long long s = -1, e = -1, total = -1;
+            int n = sscanf (line + 14, " bytes %lld-%lld/%lld", &s, &e, &total);
+            if (n < 2 || s < 0 || e < s) {
+                return -1;
+            }
+            mp->partStart = s;
+            mp->partRemain = e - s + 1;
+            if (3 == n) {
+                mp->total = total;
+            }
+            found = true;
+        }
+        line = eol + 2;
+    }
+
+    if (!found) {
+        return -1;
+    }
+
+    mp->state = HTTP_MULTIPART_BODY;
+
+    return (int) (end + 4 - mp->buf);
+}
+
+static bool http_range_sink_prepare (HttpRangeSink* sink, long long total)
+{
+    if (sink->prepared) {
+        return true;
+    }
+    sink->prepared = true;
+
+    if (!http_range_resolve (&sink->ranges, total)) {
+        gf_error (&sink->error, "no requested range lies within the %lld byte file", total);
+        return false;
+    }
+
+    sink->num = g_list_length (sink->ranges);
+    sink->got = g_malloc0 (sizeof (long long) * sink->num);
+    sink->fds = g_malloc (sizeof (int) * sink->num);
+    if (!sink->got || !sink->fds) {
+        gf_error (&sink->error, "malloc sink error");
+        return false;
+    }
+
+    int i = 0;
+    for (GList* l = sink->ranges; NULL != l; l = l->next, ++i) {
+        HttpByteRange* r = l->data;
+        sink->fds[i] = -1;
+        if (!sink->split || sink->func) continue;
+
+        g_autofree char* name = (r->end >= 0)
+            ? g_strdup_printf ("%s.%lld-%lld", sink->fileName, r->start, r->end)
+            : g_strdup_printf ("%s.%lld-", sink->fileName, r->start);
+        sink->fds[i] = open (name, O_CREAT | O_TRUNC | O_RDWR, 0777);
+        if (sink->fds[i] < 0) {
+            gf_error (&sink->error, "fail to open '%s', error: %s", name, strerror (errno));
+            return false;
+        }
+    }
+
+    if (!sink->split && !sink->func) {
+        sink->fd = open (sink->fileName, O_CREAT | O_RDWR, 0777);
+        if (sink->fd < 0) {
+            gf_error (&sink->error, "fail to open '%s', error: %s", sink->fileName, strerror (errno));
+            return false;
+        }
+
+        // the bytes in between stay holes
+        if (total > 0 && ftruncate (sink->fd, total) < 0) {
+            gf_error (&sink->error, "fail to resize '%s', error: %s", sink->fileName, strerror (errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool http_range_sink_write (long long offset, const char* data, int len, long long total, void* udata)
+{
+    HttpRangeSink* sink = udata;
+
+    if (!http_range_sink_prepare (sink, total)) {
+        return false;
+    }
+
+    int i = 0;
+    for (GList* l = sink->ranges; NULL != l; l = l->next, ++i) {
+        HttpByteRange* r = l->data;
+        if (r->start < 0) continue;
+
+        long long s = MAX (offset, r->start);
+        long long e = (r->end < 0) ? offset + len : MIN (offset + len, r->end + 1);
+        if (s >= e) continue;
+
+        if (sink->func) {
+            if (!sink->func (s, data + (s - offset), (int) (e - s), total, sink->udata)) {
+                if (!sink->error) {
+                    gf_error (&sink->error, "range data at %lld rejected", s);
+                }
+                return false;
+            }
+            sink->got[i] += e - s;
+            continue;
+        }
+
+        int fd = sink->split ? sink->fds[i] : sink->fd;
+        long long pos = sink->split ? s - r->start : s;
+        for (long long done = 0; done < e - s;) {
+            ssize_t w = pwrite (fd, data + (s - offset) + done, e - s - done, pos + done);
+            if (w < 0) {
+                if (EINTR == errno) continue;
+                gf_error (&sink->error, "write error: %s", strerror (errno));
+                return false;
+            }
+            done += w;
+        }
+        sink->got[i] += e - s;
+    }
+
+    return true;
+}
+
+static bool http_range_sink_complete (const HttpRangeSink* sink, int i)
+{
+    const HttpByteRange* r = g_list_nth_data (sink->ranges, i);
+    if (r->start < 0) {
+        return false;
+    }
+
+    // without the file length an open range ends wherever the body ended
+    if (r->end < 0) {
+        return sink->got[i] > 0;
+    }
+
+    return sink->got[i] >= r->end - r->start + 1;
+}
+
+static void http_range_sink_close (HttpRangeSink* sink)
+{
+    for (int i = 0; sink->fds && i < sink->num; ++i) {
+        if (sink->fds[i] >= 0)  close (sink->fds[i]);
+    }
+
+    if (sink->fd >= 0)          close (sink->fd);
+    if (sink->fds)              g_free (sink->fds);
+    if (sink->got)              g_free (sink->got);
+    if (sink->ranges)           g_list_free_full (sink->ranges, g_free);
+    if (sink->error)            g_error_free (sink->error);
+}
+
+/**
+ * @brief 读取一个响应的 body 并写到 sink: 206 单个范围、multipart/byteranges 或者 200 整个文件
+ */
+static bool http_range_read (Http* http, HttpRangeSink* sink, char* buf)
+{
+    HttpResponse* resp = http->resp;
+
+    long long offset = 0;
+    long long total = -1;
+    if (206 == resp->statusCode) {
+        HttpMultipart mp;
+        const char* type = http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_CONTENT_TYPE);
+        if (http_multipart_init (&mp, type)) {
+            int n = 0;
+            while ((n = http_read_body (http, buf, MAX_HTTP_READ_SIZE)) > 0) {
+                if (!http_multipart_feed (&mp, buf, n, http_range_sink_write, sink)) {
+                    if (!sink->error) {
+                        gf_error (&sink->error, "invalid multipart/byteranges body");
+                    }
+                    return false;
+                }
+            }
+
+            if (n < 0 || !http_multipart_done (&mp)) {
+                gf_error (&sink->error, "multipart/byteranges body is truncated");
+                return false;
+            }
+
+            return http_range_sink_prepare (sink, mp.total);
+        }
+
+        if (resp->rangeStart < 0) {
+            gf_error (&sink->error, "206 response without Content-Range");
+            return false;
+        }
+        offset = resp->rangeStart;
+        total = resp->rangeTotal;
+    } else if (200 == resp->statusCode) {
+        // no range support, keep only the parts we want
+        total = resp->chunked ? -1 : resp->contentLength;
+    } else if (416 == resp->statusCode) {
+        gf_error (&sink->error, "requested range not satisfiable");
+        return false;
+    } else {
+        gf_error (&sink->error, "server returned %d %s", resp->statusCode, resp->reason ? resp->reason : "");
+        return false;
+    }
+
+    if (!http_range_sink_prepare (sink, total)) {
+        return false;
+    }
+
+    int n = 0;
+    while ((n = http_read_body (http, buf, MAX_HTTP_READ_SIZE)) > 0) {
+        if (!http_range_sink_write (offset, buf, n, total, sink)) {
+            return false;
+        }
+        offset += n;
+
+        // a whole-file answer can stop once everything is there
+        if (200 == resp->statusCode && offset > 0) {
+            bool all = true;
+            for (int i = 0; all && i < sink->num; ++i) {
+                HttpByteRange* r = g_list_nth_data (sink->ranges, i);
+                all = (r->end >= 0) && http_range_sink_complete (sink, i);
+            }
+            if (all) break;
+        }
+    }
+
+    if (n < 0) {
+        gf_error (&sink->error, "http read body error at offset %lld", offset);
+        return false;
+    }
+
+    return true;
+}
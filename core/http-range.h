@@ -0,0 +1,114 @@
+#ifndef HTTPRANGE_H
+#define HTTPRANGE_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define HTTP_MULTIPART_BUF          2048
+
+typedef struct _HttpByteRange       HttpByteRange;
+typedef struct _HttpMultipart       HttpMultipart;
+typedef enum _HttpMultipartState    HttpMultipartState;
+
+/**
+ * @brief 字节范围 [start, end]
+ *
+ * start 小于 0 表示文件最后 -start 个字节, end 小于 0 表示到文件结尾
+ */
+struct _HttpByteRange
+{
+    long long               start;
+    long long               end;
+};
+
+enum _HttpMultipartState
+{
+    HTTP_MULTIPART_DELIM = 0,           // 查找分隔行和部分头
+    HTTP_MULTIPART_BODY,                // 部分数据
+    HTTP_MULTIPART_DONE,                // 读到结束分隔行
+};
+
+/**
+ * @brief multipart/byteranges 的流式解析状态
+ */
+struct _HttpMultipart
+{
+    HttpMultipartState      state;
+    char                    boundary[80];       // "--" + boundary
+    int                     boundaryLen;
+
+    long long               partStart;          // 当前部分下一个字节的偏移
+    long long               partRemain;
+    long long               total;              // 文件长度, 未知为 -1
+
+    char                    buf[HTTP_MULTIPART_BUF];
+    int                     bufLen;
+};
+
+/**
+ * @brief 收到一个部分的数据
+ * @param offset 数据在文件中的偏移
+ * @param total 文件长度, 未知为 -1
+ * @return 返回 false 停止解析
+ */
+typedef bool (*HttpMultipartFunc) (long long offset, const char* data, int len, long long total, void* udata);
+
+/**
+ * @brief 解析范围列表, 例如 "0-1023,4096-,-65536"
+ * @return HttpByteRange 列表, 用 g_list_free_full (ls, g_free) 释放
+ */
+GList*  http_range_parse        (const char* spec, GError** error);
+
+/**
+ * @brief 排序并合并重叠或相邻的范围, 最后 N 字节的范围保留在末尾
+ * @param ranges 调用后归返回值所有
+ */
+GList*  http_range_coalesce     (GList* ranges);
+
+/**
+ * @brief 已知文件长度后把范围换算成绝对偏移, 丢弃超出文件的范围
+ * @param total 文件长度, 小于 0 时只处理能换算的部分
+ * @return 还有范围需要处理的时候返回 true
+ */
+bool    http_range_resolve      (GList** ranges, long long total);
+
+/**
+ * @brief 生成 Range 头的值, 例如 "bytes=0-99,200-"
+ */
+char*   http_range_to_string    (GList* ranges);
+
+/**
+ * @brief 从 Content-Type 中取得 boundary 并初始化
+ * @return 不是 multipart/byteranges 或者没有 boundary 返回 false
+ */
+bool    http_multipart_init     (HttpMultipart* mp, const char* contentType);
+
+/**
+ * @brief 解析一段 body 数据, 数据可以在任意位置被截断
+ * @return 格式错误或 func 返回 false 时返回 false
+ */
+bool    http_multipart_feed     (HttpMultipart* mp, const char* data, int len, HttpMultipartFunc func, void* udata);
+
+bool    http_multipart_done     (const HttpMultipart* mp);
+
+/**
+ * @brief 只下载文件的部分字节范围
+ *
+ * 所有范围合并后放到一个 Range 请求里, 服务器返回 multipart/byteranges 时流式解析;
+ * 服务器不支持 Range 时读取整个 body, 只保存需要的部分; 服务器漏掉的范围再单独请求。
+ *
+ * @param ranges HttpByteRange 列表, 不会被修改
+ * @param fileName 保存的文件, split 为 false 时是和远程文件等长的稀疏文件
+ * @param split 为 true 时每个范围保存到单独的文件 "<fileName>.<start>-<end>"
+ * @return 成功返回 true
+ */
+bool    http_range_download     (GUri* uri, GList* ranges, const char* fileName, bool split, GError** error);
+
+/**
+ * @brief 和 http_range_download() 一样请求这些范围, 但收到的数据交给 func, 不写文件
+ *
+ * 只有请求范围内的数据会交给 func, offset 是数据在文件中的偏移
+ */
+bool    http_range_fetch        (GUri* uri, GList* ranges, HttpMultipartFunc func, void* udata, GError** error);
+
+#endif // HTTPRANGE_H
@@ -108,19 +108,22 @@ char *http_request_get_string (HttpRequest *req)
 
     // some other fields
     int kl = 0, vl = 0, remLen = 0, lineLen = 0, ret = 0;
-    for (int i = 0; i < HTTP_HEADER_MAX; ++i) {
-        if (!req->headers->value[i] || !req->headers->header[i]) continue;
-        kl = strlen (req->headers->value[i]);
-        vl = strlen (req->headers->header[i]);
+    const char* key = NULL;
+    const char* value = NULL;
+    for (int it = 0; http_header_list_next (req->headers, &it, &key, &value);) {
+        kl = strlen (key);
+        vl = strlen (value);
         if ((kl > 0) && (vl > 0)) {
             remLen = reqLen - reqCurLen - 10;
             lineLen = kl + vl + lineAddLen;
             if (lineLen > remLen) {
-                reqStr = g_realloc (reqStr, reqLen + lineLen - remLen + 1);
-                if (reqStr) goto error;
+                char* t = g_realloc (reqStr, reqLen + lineLen - remLen + 1);
+                if (!t) goto error;
+                reqStr = t;
+                reqLen += lineLen - remLen;
             }
 
-            ret = g_snprintf (reqStr + reqCurLen, reqLen - reqCurLen, "%s: %s\r\n", req->headers->header[i], req->headers->value[i]);
+            ret = g_snprintf (reqStr + reqCurLen, reqLen - reqCurLen, "%s: %s\r\n", key, value);
             reqCurLen += ret;
         }
     }
@@ -1,5 +1,9 @@
 #include "http-respose.h"
 
+#include "scan.h"
+
+static void http_respose_parse_known (HttpResponse* resp);
+
 
 HttpResponse *http_respose_new()
 {
@@ -8,6 +12,12 @@ HttpResponse *http_respose_new()
         return NULL;
     }
 
+    resp->headers = http_header_list_new ();
+    if (!resp->headers) {
+        g_free (resp);
+        return NULL;
+    }
+
     return resp;
 }
 
@@ -21,3 +31,96 @@ void http_respose_destroy(HttpResponse *resp)
 
     g_free (resp);
 }
+
+bool http_respose_parse (HttpResponse* resp, char* buf, int len)
+{
+    g_return_val_if_fail (resp && resp->headers && buf, false);
+
+    // status line: HTTP/1.1 200 OK
+    char* eol = (char*) scan_byte (buf, len, '\n');
+    int lineLen = eol ? eol - buf : len;
+
+    int major = 0, minor = 0, code = 0, reason = 0;
+    if (sscanf (buf, "HTTP/%d.%d %d %n", &major, &minor, &code, &reason) < 3) {
+        g_free (buf);
+        return false;
+    }
+
+    resp->httpVersion = major + minor / 10.0;
+    resp->statusCode = code;
+
+    if (resp->reason) g_free (resp->reason);
+    if (reason > 0 && reason < lineLen) {
+        int rl = lineLen - reason;
+        if ('\r' == buf[reason + rl - 1]) --rl;
+        resp->reason = g_strndup (buf + reason, rl);
+    } else {
+        resp->reason = NULL;
+    }
+
+    if (!http_header_list_parse (resp->headers, buf, len, eol ? lineLen + 1 : len)) {
+        return false;
+    }
+
+    http_respose_parse_known (resp);
+
+    return true;
+}
+
+static void http_respose_parse_known (HttpResponse* resp)
+{
+    resp->contentLength = -1;
+    resp->rangeStart = -1;
+    resp->rangeEnd = -1;
+    resp->rangeTotal = -1;
+    resp->acceptRanges = false;
+    resp->chunked = false;
+    resp->identity = true;
+
+    HttpHeaderList* ls = resp->headers;
+    for (int i = 0; i < ls->used; ++i) {
+        if (ls->entries[i].value < 0) {
+            continue;
+        }
+
+        const char* value = ls->buf + ls->entries[i].value;
+        switch (ls->entries[i].id) {
+        case HTTP_HEADER_ID_CONTENT_LENGTH: {
+            resp->contentLength = g_ascii_strtoll (value, NULL, 10);
+            break;
+        }
+        case HTTP_HEADER_ID_CONTENT_RANGE: {
+            // bytes 0-499/1234 or bytes */1234
+            long long s = -1, e = -1;
+            if (2 == sscanf (value, "bytes %lld-%lld", &s, &e)) {
+                resp->rangeStart = s;
+                resp->rangeEnd = e;
+            }
+            const char* total = strchr (value, '/');
+            if (total && '*' != total[1]) {
+                resp->rangeTotal = g_ascii_strtoll (total + 1, NULL, 10);
+            }
+            break;
+        }
+        case HTTP_HEADER_ID_ACCEPT_RANGES: {
+            resp->acceptRanges = !g_ascii_strncasecmp (value, "bytes", 5);
+            break;
+        }
+        case HTTP_HEADER_ID_TRANSFER_ENCODING: {
+            resp->chunked = (NULL != strstr (value, "chunked"));
+            break;
+        }
+        case HTTP_HEADER_ID_CONTENT_ENCODING: {
+            resp->identity = ('\0' == value[0] || !g_ascii_strcasecmp (value, "identity"));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    // a 206 answer implies range support
+    if (206 == resp->statusCode && resp->rangeStart >= 0) {
+        resp->acceptRanges = true;
+    }
+}
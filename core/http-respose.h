@@ -18,11 +18,28 @@ struct _HttpRespose
     HttpHeaderList     *headers;
     char               *body;
     int                 bodyLen;
+
+    /* 解析头部得到的信息, 未知为 -1 */
+    long long           contentLength;
+    long long           rangeStart;
+    long long           rangeEnd;
+    long long           rangeTotal;
+    bool                acceptRanges;
+    bool                chunked;
+    bool                identity;               // Content-Encoding 为空或 identity
 };
 
 
 HttpResponse*   http_respose_new ();
 void            http_respose_destroy (HttpResponse* resp);
 
+/**
+ * @brief 解析响应头(状态行和头部), 头部字符串不复制
+ * @param buf 以 '\0' 结尾的响应头, 调用后归 resp->headers 所有
+ * @param len buf 长度
+ * @return 状态行不合法返回 false
+ */
+bool            http_respose_parse (HttpResponse* resp, char* buf, int len);
+
 
 #endif // HTTPRESPOSE_H
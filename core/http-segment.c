@@ -0,0 +1,848 @@
+#include "http-segment.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "http.h"
+#include "utils.h"
+#include "output.h"
+#include "http-range.h"
+
+typedef struct _HttpRange               HttpRange;
+typedef struct _HttpSource              HttpSource;
+typedef struct _HttpSegment             HttpSegment;
+typedef struct _HttpSegmentTask         HttpSegmentTask;
+typedef struct _HttpSegmentWorker       HttpSegmentWorker;
+
+#define HTTP_SEGMENT_HEDGE_POLL         (200 * G_TIME_SPAN_MILLISECOND)
+
+/**
+ * @brief [start, end) 字节范围
+ */
+struct _HttpRange
+{
+    long long               start;
+    long long               end;
+};
+
+struct _HttpSource
+{
+    GUri                   *uri;
+    char                   *name;
+
+    long long               length;
+    char                   *etag;
+
+    double                  throughput;             // 字节/秒, 按分块平滑
+    long long               bytes;
+    int                     chunks;
+    int                     errors;
+    int                     hedges;                 // 对冲请求发到此源的次数
+    bool                    usable;
+    bool                    dead;
+};
+
+/**
+ * @brief 正在下载的范围, 对冲时两个任务互为 twin
+ */
+struct _HttpSegmentTask
+{
+    long long               base;                   // 逻辑范围的起点, [base, pos) 已写入
+    long long               start;                  // 本请求的起点
+    long long               pos;
+    long long               end;
+    long long               hedgeAt;                // 对冲开始时的偏移
+    double                  startTime;
+
+    HttpSource             *src;
+    HttpSegmentTask        *twin;
+    int                     sock;                   // 正在读响应体的连接, 没有为 -1; 对冲输了时被 shutdown() 叫醒
+    int                     addrIndex;              // 对冲请求从解析结果的第几个地址开始连接
+    bool                    hedge;
+    bool                    cancelled;
+};
+
+struct _HttpSegment
+{
+    GMutex                  lock;
+    GCond                   cond;
+
+    HttpSegmentOptions      opt;
+
+    HttpSource             *sources;
+    int                     numSources;
+
+    long long               length;
+    long long               next;                   // 下一个未分配的偏移
+    GList                  *pending;                // 退回的 HttpRange
+    GList                  *tasks;                  // 正在下载的 HttpSegmentTask
+    int                     inflight;
+    int                     running;                // 还没退出的线程
+    long long               done;
+    GList                  *written;                // 这一次写到磁盘的 HttpByteRange
+
+    HttpErrorKind           errorKind;              // 最近一次失败的原因
+    int                     retryAfter;
+
+    long long               hedgeBytes;             // 对冲请求的字节数
+    long long               hedgeWasted;            // 被取消的一方多下载的字节数
+    int                     hedgeWins;              // 对冲请求先完成
+    int                     hedgeLosses;            // 原请求先完成
+
+    Output                 *out;
+    GError                 *error;
+};
+
+struct _HttpSegmentWorker
+{
+    HttpSegment            *seg;
+    HttpSource             *src;
+    HttpSegmentTask        *task;                   // 对冲线程只下载这一个任务
+    pthread_t               tid;
+};
+
+
+static bool  http_segment_probe (HttpSegment* seg, HttpSource* src);
+static void  http_segment_resume (HttpSegment* seg, const HttpSegmentState* state);
+static void  http_segment_failed (HttpSegment* seg, Http* http);
+static void* http_segment_worker (void* arg);
+static void* http_segment_hedge_worker (void* arg);
+static void  http_segment_hedge (HttpSegment* seg, GList** hedgers);
+static HttpSegmentTask* http_segment_next_range (HttpSegment* seg, HttpSource* src);
+static bool  http_segment_fetch (HttpSegment* seg, Http* http, HttpSegmentTask* t);
+static bool  http_segment_finish_range (HttpSegment* seg, HttpSegmentTask* t, bool ok);
+static void  http_segment_written (HttpSegment* seg, long long start, long long end);
+
+
+void http_segment_options_init (HttpSegmentOptions* opt)
+{
+    g_return_if_fail (opt);
+
+    opt->connections = 1;
+    opt->chunkSize = HTTP_SEGMENT_CHUNK_DEFAULT;
+    opt->slowRatio = 0.1;
+    opt->maxErrors = 3;
+    opt->hedgeRatio = 0.3;
+    opt->hedgeDelay = 1.0;
+    opt->hedgeBudget = 0.1;
+    opt->mmap = false;
+    opt->writeback = false;
+    opt->compress = 0;
+}
+
+void http_segment_state_init (HttpSegmentState* state)
+{
+    g_return_if_fail (state);
+
+    memset (state, 0, sizeof (HttpSegmentState));
+    state->retryAfter = -1;
+}
+
+void http_segment_state_clear (HttpSegmentState* state)
+{
+    g_return_if_fail (state);
+
+    if (state->etag)        g_free (state->etag);
+    if (state->done)        g_list_free_full (state->done, g_free);
+    if (state->http)        http_destroy (state->http);
+    http_segment_state_init (state);
+}
+
+bool http_segment_download (GList* uris, const char* fileName, const HttpSegmentOptions* opt, HttpSegmentState* state, GError** error)
+{
+    g_return_val_if_fail (uris && uris->data && fileName && opt, false);
+
+    bool ret = false;
+    bool resume = false;
+    HttpSegment seg;
+    memset (&seg, 0, sizeof (seg));
+    seg.opt = *opt;
+    seg.opt.connections = MAX (seg.opt.connections, 1);
+    seg.retryAfter = -1;
+    g_mutex_init (&seg.lock);
+    g_cond_init (&seg.cond);
+
+    seg.numSources = g_list_length (uris);
+    seg.sources = g_malloc0 (sizeof (HttpSource) * seg.numSources);
+    if (!seg.sources) {
+        gf_error (error, "malloc sources error");
+        goto out;
+    }
+
+    // probe every source, the first one that answers is the reference object
+    HttpSource* ref = NULL;
+    int live = 0;
+    int i = 0;
+    for (GList* l = uris; NULL != l; l = l->next, ++i) {
+        HttpSource* src = &seg.sources[i];
+        src->uri = g_uri_ref (l->data);
+        src->name = g_uri_to_string (src->uri);
+        src->usable = http_segment_probe (&seg, src);
+        if (!src->usable) {
+            logi ("mirror '%s' does not support range requests, skip it", src->name);
+            continue;
+        }
+
+        if (!ref) {
+            ref = src;
+        } else if (src->length != ref->length) {
+            logi ("mirror '%s' length %lld differs from %lld, skip it", src->name, src->length, ref->length);
+            src->usable = false;
+            continue;
+        } else if (src->etag && ref->etag && 0 != g_strcmp0 (src->etag, ref->etag)) {
+            logi ("mirror '%s' ETag %s differs from %s, skip it", src->name, src->etag, ref->etag);
+            src->usable = false;
+            continue;
+        }
+        ++live;
+    }
+
+    if (!ref) {
+        // no source can do ranges, download the whole file from the first one
+        // the request is kept in the state, a retry continues where it stopped
+        logi ("no mirror supports range requests, fall back to '%s'", seg.sources[0].name);
+        Http* http = (state && state->http) ? state->http : http_new (seg.sources[0].uri);
+        if (!http) {
+            gf_error (error, "http_new error");
+            goto out;
+        }
+        ret = http_request (http, fileName);
+        if (!ret) {
+            gf_error (error, "%s", http->error ? http->error->message : "http request error");
+            http_segment_failed (&seg, http);
+        }
+        if (state) {
+            state->http = http;
+            state->doneBytes = http->written;
+        } else {
+            http_destroy (http);
+        }
+        goto out;
+    }
+
+    seg.length = ref->length;
+    logi ("download '%s' (%lld bytes) from %d mirror(s)", fileName, seg.length, live);
+
+    // an earlier attempt left part of the file, what it wrote is not fetched again;
+    // a compressed file is a sequence of frames that can not be patched, it starts over;
+    // a file that the fallback request of an earlier attempt created is ours to overwrite
+    if (state && state->length > 0) {
+        resume = state->length == seg.length && 0 == g_strcmp0 (state->etag, ref->etag)
+            && seg.opt.compress <= 0 && g_file_test (fileName, G_FILE_TEST_IS_REGULAR);
+        if (!resume) {
+            logi ("'%s' can not be continued, downloading it from the start", fileName);
+        }
+    } else if (!(state && state->http && state->http->created)
+               && g_file_test (fileName, G_FILE_TEST_EXISTS) && !g_file_test (fileName, G_FILE_TEST_IS_DIR)) {
+        gf_error (error, "file '%s' already exists!", fileName);
+        goto out;
+    }
+
+    if (resume) {
+        http_segment_resume (&seg, state);
+        logi ("continue '%s', %lld of %lld bytes are already downloaded", fileName, seg.done, seg.length);
+    } else if (state) {
+        http_segment_state_clear (state);
+        state->length = seg.length;
+        state->etag = g_strdup (ref->etag);
+    }
+
+    // every range is written in place, so the whole file is allocated first
+    if (!(seg.out = output_open (fileName, !resume, error))
+        || (seg.opt.compress > 0 && !output_set_compress (seg.out, seg.opt.compress, error))
+        || !output_reserve (seg.out, seg.length, error)) {
+        goto out;
+    }
+
+    if (seg.opt.writeback) {
+        output_set_writeback (seg.out, OUTPUT_WRITEBACK_WINDOW);
+    }
+
+    if (seg.opt.mmap) {
+        g_autoptr (GError) merr = NULL;
+        if (!output_map (seg.out, &merr)) {
+            logi ("%s, writing with pwrite instead", merr ? merr->message : "mmap error");
+        }
+    }
+
+    // start the workers
+    int numWorkers = live * seg.opt.connections;
+    HttpSegmentWorker* workers = g_malloc0 (sizeof (HttpSegmentWorker) * numWorkers);
+    if (!workers) {
+        gf_error (error, "malloc workers error");
+        goto out;
+    }
+
+    int started = 0;
+    g_mutex_lock (&seg.lock);
+    for (int s = 0; s < seg.numSources; ++s) {
+        if (!seg.sources[s].usable) continue;
+        for (int c = 0; c < seg.opt.connections; ++c) {
+            HttpSegmentWorker* w = &workers[started];
+            w->seg = &seg;
+            w->src = &seg.sources[s];
+            if (0 == pthread_create (&w->tid, NULL, http_segment_worker, w)) {
+                ++started;
+                ++seg.running;
+            }
+        }
+    }
+
+    // watch the tail of the download and hedge ranges that fall behind
+    GList* hedgers = NULL;
+    while (seg.running > 0) {
+        g_cond_wait_until (&seg.cond, &seg.lock, g_get_monotonic_time () + HTTP_SEGMENT_HEDGE_POLL);
+        if (seg.opt.hedgeBudget > 0) {
+            http_segment_hedge (&seg, &hedgers);
+        }
+    }
+    g_mutex_unlock (&seg.lock);
+
+    for (int w = 0; w < started; ++w) {
+        pthread_join (workers[w].tid, NULL);
+    }
+    g_free (workers);
+
+    for (GList* l = hedgers; NULL != l; l = l->next) {
+        HttpSegmentWorker* w = l->data;
+        pthread_join (w->tid, NULL);
+    }
+    g_list_free_full (hedgers, g_free);
+
+    for (int s = 0; s < seg.numSources; ++s) {
+        HttpSource* src = &seg.sources[s];
+        if (!src->usable) continue;
+        logi ("mirror '%s': %lld bytes, %d chunks, %.1f KiB/s, %d errors, %d hedges%s",
+              src->name, src->bytes, src->chunks, src->throughput / 1024, src->errors, src->hedges, src->dead ? ", retired" : "");
+    }
+
+    if (seg.hedgeWins + seg.hedgeLosses > 0) {
+        logi ("hedged requests: %d won, %d lost, %lld bytes hedged, %lld bytes wasted",
+              seg.hedgeWins, seg.hedgeLosses, seg.hedgeBytes, seg.hedgeWasted);
+    }
+
+    OutputRingStats rs;
+    output_ring_stats (&rs);
+    if (!seg.out->map) {
+        logi ("write-behind: %d/%d buffers in use, high water %d, %llu waits for a free buffer, %.1f buffers per write",
+              rs.inUse, rs.capacity, rs.highWater, (unsigned long long) rs.waits, rs.writes ? (double) rs.buffers / rs.writes : 0.0);
+
+        // the disk of this file, with everything else written to it so far
+        struct stat st;
+        int count = 0;
+        OutputDeviceStats* ds = output_device_stats (&count);
+        guint64 dev = (0 == fstat (seg.out->fd, &st)) ? (guint64) st.st_dev : 0;
+        for (int i = 0; i < count; ++i) {
+            if (ds[i].dev == dev) {
+                logi ("disk %s: %.1f MiB written at %.1f MiB/s, %.2f ms per write (max %.2f ms), %llu waits for its %d buffers",
+                      ds[i].path, ds[i].bytes / 1048576.0, ds[i].busy > 0 ? ds[i].bytes / 1048576.0 / ds[i].busy : 0.0,
+                      ds[i].writes ? ds[i].busy * 1000 / ds[i].writes : 0.0, ds[i].maxLatency * 1000,
+                      (unsigned long long) ds[i].waits, ds[i].depth);
+            }
+        }
+        g_free (ds);
+    }
+
+    if (seg.error) {
+        g_propagate_error (error, seg.error);
+        seg.error = NULL;
+        seg.errorKind = HTTP_ERROR_KIND_LOCAL;
+    } else if (seg.done != seg.length) {
+        gf_error (error, "all mirrors failed, %lld of %lld bytes downloaded", seg.done, seg.length);
+    } else {
+        ret = output_finish (seg.out, seg.length, error);
+    }
+
+out:
+    if (state) {
+        state->errorKind = ret ? HTTP_ERROR_KIND_NONE : seg.errorKind;
+        state->retryAfter = ret ? -1 : seg.retryAfter;
+    }
+
+    // keep what is on disk for the next attempt
+    if (state && seg.out) {
+        state->done = http_range_coalesce (g_list_concat (state->done, seg.written));
+        seg.written = NULL;
+        state->doneBytes = 0;
+        for (GList* l = state->done; NULL != l; l = l->next) {
+            HttpByteRange* r = l->data;
+            state->doneBytes += r->end - r->start + 1;
+        }
+    }
+
+    if (seg.out)            output_close (seg.out);
+
+    for (int s = 0; seg.sources && s < seg.numSources; ++s) {
+        if (seg.sources[s].uri)     g_uri_unref (seg.sources[s].uri);
+        if (seg.sources[s].name)    g_free (seg.sources[s].name);
+        if (seg.sources[s].etag)    g_free (seg.sources[s].etag);
+    }
+    if (seg.sources)        g_free (seg.sources);
+    if (seg.pending)        g_list_free_full (seg.pending, g_free);
+    if (seg.written)        g_list_free_full (seg.written, g_free);
+    if (seg.error)          g_error_free (seg.error);
+
+    g_mutex_clear (&seg.lock);
+    g_cond_clear (&seg.cond);
+
+    return ret;
+}
+
+static bool http_segment_probe (HttpSegment* seg, HttpSource* src)
+{
+    Http* http = http_new (src->uri);
+    if (!http) {
+        return false;
+    }
+
+    bool ok = false;
+    if (http_set_range (http, 0, 0) && http_send (http)) {
+        HttpResponse* resp = http->resp;
+        if (206 == resp->statusCode && resp->rangeTotal > 0) {
+            src->length = resp->rangeTotal;
+            src->etag = g_strdup (http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_ETAG));
+            ok = true;
+        }
+    } else {
+        logi ("probe mirror '%s' error: %s", src->name, http->error ? http->error->message : "");
+        http_segment_failed (seg, http);
+    }
+
+    http_destroy (http);
+
+    return ok;
+}
+
+static void* http_segment_worker (void* arg)
+{
+    HttpSegmentWorker* w = arg;
+    HttpSegment* seg = w->seg;
+    HttpSource* src = w->src;
+
+    Http* http = http_new (src->uri);
+
+    HttpSegmentTask* t = NULL;
+    while (http && (t = http_segment_next_range (seg, src))) {
+        bool ok = http_segment_fetch (seg, http, t);
+        if (!ok && !t->cancelled) {
+            logi ("mirror '%s' range error: %s", src->name, http->error ? http->error->message : "");
+            http_segment_failed (seg, http);
+        }
+
+        if (!http_segment_finish_range (seg, t, ok)) {
+            break;
+        }
+    }
+
+    if (http)   http_destroy (http);
+
+    g_mutex_lock (&seg->lock);
+    --seg->running;
+    g_cond_broadcast (&seg->cond);
+    g_mutex_unlock (&seg->lock);
+
+    return NULL;
+}
+
+static void* http_segment_hedge_worker (void* arg)
+{
+    HttpSegmentWorker* w = arg;
+    HttpSegment* seg = w->seg;
+    HttpSegmentTask* t = w->task;
+
+    // a new connection, and another address of the host if it has more than one
+    Http* http = http_new (t->src->uri);
+
+    bool ok = false;
+    if (http) {
+        http->tcp->addrIndex = t->addrIndex;
+        ok = http_segment_fetch (seg, http, t);
+        if (!ok && !t->cancelled) {
+            logi ("mirror '%s' hedged range error: %s", t->src->name, http->error ? http->error->message : "");
+            http_segment_failed (seg, http);
+        }
+    }
+    http_segment_finish_range (seg, t, ok);
+
+    if (http)   http_destroy (http);
+
+    g_mutex_lock (&seg->lock);
+    --seg->running;
+    g_cond_broadcast (&seg->cond);
+    g_mutex_unlock (&seg->lock);
+
+    return NULL;
+}
+
+/**
+ * @brief 找出最拖后腿的范围, 在最快的源上对冲它, 调用时持有 seg->lock
+ */
+static void http_segment_hedge (HttpSegment* seg, GList** hedgers)
+{
+    // only the tail of the download is hedged
+    if (seg->pending || seg->next < seg->length || seg->error) {
+        return;
+    }
+
+    HttpSource* best = NULL;
+    for (int i = 0; i < seg->numSources; ++i) {
+        HttpSource* s = &seg->sources[i];
+        if (s->usable && !s->dead && s->throughput > 0 && (!best || s->throughput > best->throughput)) {
+            best = s;
+        }
+    }
+    if (!best) {
+        return;
+    }
+
+    double now = gf_gettime ();
+    HttpSegmentTask* slowest = NULL;
+    double slowestLeft = 0;
+    for (GList* l = seg->tasks; NULL != l; l = l->next) {
+        HttpSegmentTask* t = l->data;
+        double elapsed = now - t->startTime;
+        if (t->twin || t->hedge || t->cancelled || elapsed < seg->opt.hedgeDelay || t->pos >= t->end) {
+            continue;
+        }
+
+        double speed = (t->pos - t->start) / elapsed;
+        if (speed >= best->throughput * seg->opt.hedgeRatio) {
+            continue;
+        }
+
+        // time this request still needs at its current speed
+        double left = (speed > 0) ? (t->end - t->pos) / speed : G_MAXDOUBLE;
+        if (left > slowestLeft && left > (t->end - t->pos) / best->throughput) {
+            slowest = t;
+            slowestLeft = left;
+        }
+    }
+
+    if (!slowest || seg->hedgeBytes + (slowest->end - slowest->pos) > seg->opt.hedgeBudget * seg->length) {
+        return;
+    }
+
+    HttpSegmentTask* h = g_malloc0 (sizeof (HttpSegmentTask));
+    HttpSegmentWorker* w = g_malloc0 (sizeof (HttpSegmentWorker));
+    if (!h || !w) {
+        if (h)  g_free (h);
+        if (w)  g_free (w);
+        return;
+    }
+
+    h->base = slowest->base;
+    h->start = h->pos = h->hedgeAt = slowest->pos;
+    h->end = slowest->end;
+    h->startTime = now;
+    h->src = best;
+    h->sock = -1;
+    h->addrIndex = ++best->hedges;              // the workers start at address 0
+    h->hedge = true;
+    h->twin = slowest;
+    slowest->twin = h;
+    slowest->hedgeAt = slowest->pos;
+
+    w->seg = seg;
+    w->src = best;
+    w->task = h;
+    if (0 != pthread_create (&w->tid, NULL, http_segment_hedge_worker, w)) {
+        slowest->twin = NULL;
+        --best->hedges;
+        g_free (h);
+        g_free (w);
+        return;
+    }
+
+    logi ("hedge range %lld-%lld of mirror '%s' (%.1f KiB/s) on mirror '%s'",
+          h->start, h->end - 1, slowest->src->name, (slowest->pos - slowest->start) / (now - slowest->startTime) / 1024, best->name);
+
+    ++seg->running;
+    ++seg->inflight;
+    seg->hedgeBytes += h->end - h->start;
+    seg->tasks = g_list_prepend (seg->tasks, h);
+    *hedgers = g_list_prepend (*hedgers, w);
+}
+
+static HttpSegmentTask* http_segment_next_range (HttpSegment* seg, HttpSource* src)
+{
+    HttpSegmentTask* t = NULL;
+    HttpRange r = { -1, -1 };
+
+    g_mutex_lock (&seg->lock);
+    for (;;) {
+        if (src->dead || seg->error) {
+            break;
+        }
+
+        if (seg->pending) {
+            HttpRange* p = seg->pending->data;
+            r = *p;
+            seg->pending = g_list_delete_link (seg->pending, seg->pending);
+            g_free (p);
+            break;
+        }
+
+        if (seg->next < seg->length) {
+            // scale the chunk with this source's share of the measured throughput
+            double sum = 0;
+            int n = 0;
+            for (int i = 0; i < seg->numSources; ++i) {
+                HttpSource* s = &seg->sources[i];
+                if (s->usable && !s->dead && s->throughput > 0) {
+                    sum += s->throughput;
+                    ++n;
+                }
+            }
+
+            long long chunk = seg->opt.chunkSize;
+            if (n > 0 && src->throughput > 0) {
+                chunk = (long long) (chunk * src->throughput / (sum / n));
+            }
+            chunk = CLAMP (chunk, HTTP_SEGMENT_CHUNK_MIN, HTTP_SEGMENT_CHUNK_MAX);
+
+            r.start = seg->next;
+            r.end = MIN (seg->next + chunk, seg->length);
+            seg->next = r.end;
+            break;
+        }
+
+        // nothing left to hand out, but a failing range may still come back
+        if (0 == seg->inflight) {
+            r.start = r.end = -1;
+            break;
+        }
+        g_cond_wait (&seg->cond, &seg->lock);
+    }
+
+    if (!src->dead && !seg->error && r.start >= 0 && (t = g_malloc0 (sizeof (HttpSegmentTask)))) {
+        t->base = t->start = t->pos = t->hedgeAt = r.start;
+        t->end = r.end;
+        t->startTime = gf_gettime ();
+        t->src = src;
+        t->sock = -1;
+        seg->tasks = g_list_prepend (seg->tasks, t);
+        ++seg->inflight;
+    }
+    g_mutex_unlock (&seg->lock);
+
+    return t;
+}
+
+static bool http_segment_fetch (HttpSegment* seg, Http* http, HttpSegmentTask* t)
+{
+    http->errorKind = HTTP_ERROR_KIND_NONE;
+    http->retryAfter = -1;
+    if (!http_set_range (http, t->start, t->end - 1) || !http_send (http)) {
+        return false;
+    }
+
+    HttpResponse* resp = http->resp;
+    if (206 != resp->statusCode || resp->rangeStart != t->start) {
+        gf_error (&http->error, "unexpected answer %d for range %lld-%lld", resp->statusCode, t->start, t->end - 1);
+        http_status_error (http);
+        return false;
+    }
+
+    OutputStream* stream = output_stream_new (seg->out, t->start);
+    if (!stream) {
+        gf_error (&http->error, "malloc output stream error");
+        return false;
+    }
+
+    // from here the twin can cut this connection when it wins
+    g_mutex_lock (&seg->lock);
+    t->sock = http->tcp->sock;
+    bool ok = !t->cancelled;
+    g_mutex_unlock (&seg->lock);
+
+    long long pos = t->start;
+    while (ok && pos < t->end) {
+        // receive straight into the write buffer, or into the mapped file
+        int room = 0;
+        char* dst = output_stream_buffer (stream, &room, NULL);
+        if (!dst) {
+            ok = false;
+            break;
+        }
+
+        int n = http_read_body (http, dst, (int) MIN ((long long) MIN (room, MAX_HTTP_READ_SIZE), t->end - pos));
+        if (n <= 0) {
+            gf_error (&http->error, "connection closed at offset %lld", pos);
+            ok = false;
+            break;
+        }
+
+        output_stream_commit (stream, n, NULL);
+        pos += n;
+
+        // the other request of a hedged pair finished first
+        g_mutex_lock (&seg->lock);
+        t->pos = pos;
+        ok = !t->cancelled;
+        g_mutex_unlock (&seg->lock);
+    }
+
+    g_mutex_lock (&seg->lock);
+    t->sock = -1;
+    g_mutex_unlock (&seg->lock);
+
+    // the range only counts once it is on disk
+    g_autoptr (GError) werr = NULL;
+    if (!output_stream_close (stream, &werr)) {
+        g_mutex_lock (&seg->lock);
+        if (!seg->error) {
+            seg->error = g_error_copy (werr);
+        }
+        g_mutex_unlock (&seg->lock);
+        return false;
+    }
+
+    return ok;
+}
+
+static bool http_segment_finish_range (HttpSegment* seg, HttpSegmentTask* t, bool ok)
+{
+    HttpSource* src = t->src;
+    long long got = t->pos - t->start;
+    double dt = gf_gettime () - t->startTime;
+
+    g_mutex_lock (&seg->lock);
+
+    seg->tasks = g_list_remove (seg->tasks, t);
+    --seg->inflight;
+    src->bytes += got;
+
+    if (got > 0 && (ok || t->cancelled)) {
+        double speed = got / MAX (dt, 0.001);
+        src->throughput = (src->throughput > 0) ? (src->throughput + speed) / 2 : speed;
+    }
+
+    if (t->cancelled) {
+        // lost the race, everything past the hedge point was fetched twice
+        seg->hedgeWasted += t->pos - t->hedgeAt;
+    } else if (ok) {
+        seg->done += t->end - t->base;
+        http_segment_written (seg, t->base, t->end);
+        ++src->chunks;
+
+        if (t->twin) {
+            // wake the loser now instead of when its next read returns
+            t->twin->cancelled = true;
+            t->twin->twin = NULL;
+            if (t->twin->sock >= 0) {
+                shutdown (t->twin->sock, SHUT_RDWR);
+            }
+            if (t->hedge) {
+                ++seg->hedgeWins;
+            } else {
+                ++seg->hedgeLosses;
+            }
+        }
+
+        // retire a mirror that is far behind the best one, as long as another one is left
+        double best = 0;
+        int live = 0;
+        for (int i = 0; i < seg->numSources; ++i) {
+            HttpSource* s = &seg->sources[i];
+            if (s->usable && !s->dead) {
+                ++live;
+                best = MAX (best, s->throughput);
+            }
+        }
+
+        if (live > 1 && src->chunks >= 2 && src->throughput < best * seg->opt.slowRatio) {
+            logi ("mirror '%s' is too slow (%.1f KiB/s, best %.1f KiB/s), stop using it",
+                  src->name, src->throughput / 1024, best / 1024);
+            src->dead = true;
+        }
+    } else {
+        if (t->twin) {
+            // the other request of the pair carries on alone
+            t->twin->twin = NULL;
+        } else {
+            // [base, pos) is on disk, give the rest of the range back to the other workers
+            seg->done += t->pos - t->base;
+            http_segment_written (seg, t->base, t->pos);
+            if (t->pos < t->end) {
+                HttpRange* p = g_malloc (sizeof (HttpRange));
+                if (p) {
+                    p->start = t->pos;
+                    p->end = t->end;
+                    seg->pending = g_list_prepend (seg->pending, p);
+                }
+            }
+        }
+
+        if (++src->errors >= seg->opt.maxErrors) {
+            logi ("mirror '%s' failed %d times, stop using it", src->name, src->errors);
+            src->dead = true;
+        }
+    }
+
+    bool alive = !src->dead;
+    g_free (t);
+
+    g_cond_broadcast (&seg->cond);
+    g_mutex_unlock (&seg->lock);
+
+    return alive;
+}
+
+/**
+ * @brief 缺的范围按分块大小切开放进 pending, 多个连接可以一起补
+ */
+static void http_segment_resume (HttpSegment* seg, const HttpSegmentState* state)
+{
+    GList* gaps = NULL;
+    long long pos = 0;
+    for (GList* l = state->done;; l = l->next) {
+        long long end = l ? ((HttpByteRange*) l->data)->start : seg->length;
+        while (pos < end) {
+            HttpRange* p = g_malloc (sizeof (HttpRange));
+            if (!p) break;
+            p->start = pos;
+            p->end = MIN (pos + seg->opt.chunkSize, end);
+            pos = p->end;
+            gaps = g_list_prepend (gaps, p);
+        }
+        if (!l) break;
+        pos = ((HttpByteRange*) l->data)->end + 1;
+    }
+
+    seg->pending = g_list_reverse (gaps);
+    seg->next = seg->length;
+    seg->done = state->doneBytes;
+}
+
+/**
+ * @brief 记下失败的原因, 所有源都失败时由它决定能不能重试
+ */
+static void http_segment_failed (HttpSegment* seg, Http* http)
+{
+    g_mutex_lock (&seg->lock);
+    // a dropped connection leaves no kind behind, it is worth another try
+    seg->errorKind = (HTTP_ERROR_KIND_NONE != http->errorKind) ? http->errorKind : HTTP_ERROR_KIND_SHORT_READ;
+    seg->retryAfter = MAX (seg->retryAfter, http->retryAfter);
+    g_mutex_unlock (&seg->lock);
+}
+
+/**
+ * @brief [start, end) 已写到磁盘, 调用时持有 seg->lock
+ */
+static void http_segment_written (HttpSegment* seg, long long start, long long end)
+{
+    if (end <= start) {
+        return;
+    }
+
+    HttpByteRange* r = g_malloc (sizeof (HttpByteRange));
+    if (r) {
+        r->start = start;
+        r->end = end - 1;
+        seg->written = g_list_prepend (seg->written, r);
+    }
+}
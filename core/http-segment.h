@@ -0,0 +1,76 @@
+#ifndef HTTPSEGMENT_H
+#define HTTPSEGMENT_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#include "http.h"
+
+#define HTTP_SEGMENT_CHUNK_DEFAULT      (4 << 20)
+#define HTTP_SEGMENT_CHUNK_MIN          (256 << 10)
+#define HTTP_SEGMENT_CHUNK_MAX          (64 << 20)
+
+typedef struct _HttpSegmentOptions      HttpSegmentOptions;
+typedef struct _HttpSegmentState        HttpSegmentState;
+
+/**
+ * @brief 分段下载参数
+ */
+struct _HttpSegmentOptions
+{
+    int                     connections;            // 每个源的连接数
+    long long               chunkSize;              // 基础分块大小, 按源的吞吐量比例缩放
+    double                  slowRatio;              // 吞吐量低于最快源的此比例时停用该源
+    int                     maxErrors;              // 源出错此次数后停用
+
+    /* 对冲请求: 最后剩下的范围明显变慢时, 用新连接重复请求一次, 先完成的为准 */
+    double                  hedgeRatio;             // 范围速度低于最快源的此比例时对冲
+    double                  hedgeDelay;             // 范围至少运行这么多秒后才考虑对冲
+    double                  hedgeBudget;            // 对冲额外下载的字节数上限(占文件长度的比例), 0 表示关闭
+
+    bool                    mmap;                   // 把输出文件映射到内存, 数据直接收到映射区里
+    bool                    writeback;              // 按窗口主动回写并释放页缓存, 见 output_set_writeback()
+    int                     compress;               // 大于 0 时按这个级别压缩成 zstd 帧写入, 各段各自压缩, 见 output_set_compress()
+};
+
+/**
+ * @brief 一次分段下载留下的进度和失败原因, 失败后原样传给下一次调用就从已写入的范围接着下载
+ */
+struct _HttpSegmentState
+{
+    long long               length;                 // 文件长度, 0 表示还没有创建文件
+    char                   *etag;
+    GList                  *done;                   // 已写到磁盘的 HttpByteRange, 有序且不重叠
+    long long               doneBytes;
+    Http                   *http;                   // 没有源支持 Range 时整个下载用的请求, 留着 written 和 validator 以便续传
+
+    HttpErrorKind           errorKind;              // 失败原因, 见 http_error_retryable()
+    int                     retryAfter;             // 服务器要求等待的秒数, 没有为 -1
+};
+
+void http_segment_options_init (HttpSegmentOptions* opt);
+
+void http_segment_state_init (HttpSegmentState* state);
+void http_segment_state_clear (HttpSegmentState* state);
+
+/**
+ * @brief 从一个或多个源(镜像)分段下载同一个文件
+ *
+ * 先用 Range: bytes=0-0 探测每个源, 长度或 ETag 不一致的源会被丢弃;
+ * 然后每个源的连接不断领取下一个字节范围, 快的源自然领取得更多,
+ * 出错或明显变慢的源会被停用, 它没下载完的范围交给其它源。
+ * 所有范围都分配完以后, 拖后腿的范围会在新连接上对冲(可能连到另一个地址),
+ * 两个请求先完成的一个生效, 另一个被取消。
+ * 没有源支持 Range 时退回到第一个源的普通下载。
+ *
+ * state 记录了上一次写好的范围时, 长度和 ETag 都没变就重新打开已有的文件, 只下载缺的范围;
+ * 否则文件从头下载。退回普通下载时请求保存在 state 里, 下一次从它写到的地方用 Range 继续。
+ *
+ * @param uris GUri 列表
+ * @param fileName 保存的文件
+ * @param state 可以为 NULL, 这时已存在的文件是错误
+ * @return 成功返回 true
+ */
+bool http_segment_download (GList* uris, const char* fileName, const HttpSegmentOptions* opt, HttpSegmentState* state, GError** error);
+
+#endif // HTTPSEGMENT_H
@@ -4,9 +4,19 @@
 #include <errno.h>
 
 #include "log.h"
+#include "scan.h"
 #include "utils.h"
+#include "output.h"
 
 void http_debug (const Http* http);
+static bool http_read_header (Http* http);
+static char* http_uri_resource (GUri* uri);
+static int http_parse_retry_after (const char* value);
+static void http_stalled (Http* http, const char* reason);
+
+static GMutex gHostStallsLock;
+static GHashTable* gHostStalls = NULL;                  // host -> 卡住的次数
+static guint64 gBodyBytes = 0;                          // 所有连接收到的响应体字节数
 
 Http *http_new(GUri* uri)
 {
@@ -19,6 +29,10 @@ Http *http_new(GUri* uri)
 
     // init size
     http->headerBufLen = 1024;
+    http->retryAfter = -1;
+    http->ioTimeout = HTTP_IO_TIMEOUT;
+    http->lowSpeedLimit = HTTP_LOW_SPEED_LIMIT;
+    http->lowSpeedTime = HTTP_LOW_SPEED_TIME;
 
     // port
     const char* schema = g_uri_get_scheme (uri);
@@ -45,10 +59,7 @@ Http *http_new(GUri* uri)
 
     // resource
     const char* path = g_uri_get_path (uri);
-    if (!path) {
-        path = "/index.html";
-    }
-    http->resource = g_strdup (path);
+    http->resource = http_uri_resource (uri);
 
 
     if (!(http->tcp = tcp_new ()))              goto error;
@@ -78,15 +89,76 @@ void http_destroy(Http *http)
     if (http->resp)                 http_respose_destroy (http->resp);
     if (http->request)              http_request_destroy (http->request);
     if (http->headerBuf)            g_free (http->headerBuf);
+    if (http->bodyBuf)              g_free (http->bodyBuf);
+    if (http->validator)            g_free (http->validator);
+    if (http->checksum)             checksum_free (http->checksum);
+    if (http->extract)              extract_free (http->extract);
     if (http->error)                g_error_free (http->error);
-//    if (http->bodyBuf)              g_free (http->bodyBuf);
 
     g_free (http);
 }
 
-bool http_request(Http *http, const char* fileName)
+bool http_set_resource (Http* http, GUri* uri)
 {
-    g_return_val_if_fail (http && fileName, false);
+    g_return_val_if_fail (http && http->request && uri, false);
+
+    char* resource = http_uri_resource (uri);
+    if (!resource) {
+        return false;
+    }
+
+    if (http->resource)             g_free (http->resource);
+    if (http->request->resource)    g_free (http->request->resource);
+    http->resource = resource;
+    http->request->resource = g_strdup (resource);
+
+    return NULL != http->request->resource;
+}
+
+bool http_set_range (Http* http, long long start, long long end)
+{
+    g_return_val_if_fail (http && http->request && start >= 0, false);
+
+    g_autofree char* range = NULL;
+    if (end >= 0) {
+        range = g_strdup_printf ("bytes=%lld-%lld", start, end);
+    } else {
+        range = g_strdup_printf ("bytes=%lld-", start);
+    }
+
+    return http_header_list_set_value (http->request->headers, gHttpHeaderRange, range);
+}
+
+bool http_send (Http* http)
+{
+    g_return_val_if_fail (http, false);
+
+    bool reuse = (http->tcp->sock >= 0) && http->keepAlive && http->bodyDone;
+
+    // a reused connection may have been closed by the server, try once more on a new one
+    for (int i = reuse ? 0 : 1; i < 2; ++i) {
+        if (i > 0) {
+            tcp_close (http->tcp);
+        }
+
+        if (!http_write_request (http)) {
+            if (0 == i) continue;
+            return false;
+        }
+
+        if (http_read_response (http)) {
+            break;
+        } else if (i > 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool http_write_request (Http* http)
+{
+    g_return_val_if_fail (http, false);
 
     // get request header
     g_autofree char* req =  http_request_get_string (http->request);
@@ -95,71 +167,138 @@ bool http_request(Http *http, const char* fileName)
         return false;
     }
 
-    // connect
-    bool useSSL = !g_ascii_strcasecmp (http->schema, "https") ? true : false;
-    if (!tcp_connect (http->tcp, http->host, http->port, useSSL, NULL, -1)) {
-        gf_error (&http->error, http->tcp->error->message);
-        return false;
-    }
-
     logd ("\n================ request ===================\n"
           "%s"
           "\n============================================\n", req);
 
+    if (http->tcp->sock < 0) {
+        // connect
+        http->keepAlive = false;
+        http->bodyDone = false;
+        if (http->bodyBuf) {
+            g_free (http->bodyBuf);
+            http->bodyBuf = NULL;
+        }
+        http->bodyBufLen = http->bodyBufPos = 0;
+
+        bool useSSL = !g_ascii_strcasecmp (http->schema, "https") ? true : false;
+        if (!tcp_connect (http->tcp, http->host, http->port, useSSL, NULL, http->ioTimeout)) {
+            gf_error (&http->error, http->tcp->error ? http->tcp->error->message : "tcp connect error");
+            int code = http->tcp->error ? http->tcp->error->code : TCP_ERROR_TYPE_ERROR;
+            http->errorKind = (TCP_ERROR_TYPE_HOST == code) ? HTTP_ERROR_KIND_DNS
+                : (TCP_ERROR_TYPE_SSL == code) ? HTTP_ERROR_KIND_TLS : HTTP_ERROR_KIND_CONNECT;
+            return false;
+        }
+    }
+
     // send request
     if (tcp_write (http->tcp, req, strlen (req)) < 0) {
         gf_error (&http->error, "tcp write return false");
+        http->errorKind = HTTP_ERROR_KIND_CONNECT;
+        tcp_close (http->tcp);
         return false;
     }
 
-    // read header
-    int step = 1;
-    if (!(http->headerBuf = g_malloc0 (http->headerBufLen))) {
-        gf_error (&http->error, "http malloc header buf fail!");
+    return true;
+}
+
+bool http_read_response (Http* http)
+{
+    g_return_val_if_fail (http, false);
+
+    http->keepAlive = false;
+
+    // read and parse header
+    if (!http_read_header (http)) {
         return false;
     }
 
-    for (http->headerBufCurLen = 0;;) {
-        if (tcp_read (http->tcp, &http->headerBuf[http->headerBufCurLen], 1) <= 0) {
-            logd ("http read OK");
-            break;
-        }
+    // no body after HEAD, 1xx, 204 and 304
+    HttpResponse* resp = http->resp;
+    http->noBody = (HTTP_REQUEST_TYPE_HEAD == http->request->type) || (resp->statusCode < 200)
+        || (204 == resp->statusCode) || (304 == resp->statusCode);
 
-        if ('\r' == http->headerBuf[http->headerBufCurLen]) {
-            continue;
-        } else if (('\n' == http->headerBuf[http->headerBufCurLen])
-            && (http->headerBufCurLen > 0) && ('\n' == http->headerBuf[http->headerBufCurLen - 1])) {
-            logd ("http read header OK");
-            break;
-        }
-        ++http->headerBufCurLen;
+    // HTTP/1.1 keeps the connection unless told otherwise, and the body end must be known
+    const char* conn = http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_CONNECTION);
+    http->keepAlive = (resp->httpVersion >= 1.1)
+        && !(conn && !g_ascii_strcasecmp (conn, "close"))
+        && (http->noBody || resp->chunked || resp->contentLength >= 0);
 
-        if (http->headerBufCurLen + 10 < http->headerBufLen) {
-            int len = http->headerBufLen + step * 512;
-            char* t = g_realloc (http->headerBuf, len);
-            if (!t) {
-                gf_error (&http->error, "g_realloc header buf failed");
-                return false;
-            }
-            ++step;
-            http->headerBufLen = len;
-            http->headerBuf = t;
+    return true;
+}
+
+bool http_request(Http *http, const char* fileName)
+{
+    g_return_val_if_fail (http && fileName, false);
+
+    http->errorKind = HTTP_ERROR_KIND_NONE;
+    http->retryAfter = -1;
+
+    // continue after what an earlier attempt wrote, but only if the file is still the same
+    bool resume = http->written > 0 && !http->discard;
+    if (resume) {
+        http_set_range (http, http->written, -1);
+        if (http->validator) {
+            http_header_list_set_value (http->request->headers, gHttpHeaderIfRange, http->validator);
         }
     }
-    http->headerBuf[http->headerBufCurLen] = 0;
-    logd ("read header OK!");
 
-    logd ("\n================ respose ===================\n"
-         "%s"
-         "\n============================================\n", http->headerBuf);
+    bool sent = http_send (http);
+    if (resume) {
+        http_header_clear_value (http->request->headers, gHttpHeaderRange);
+        http_header_clear_value (http->request->headers, gHttpHeaderIfRange);
+    }
+    if (!sent) {
+        return false;
+    }
 
-    // parse header
+    HttpResponse* resp = http->resp;
+    if (resp->statusCode >= 400) {
+        gf_error (&http->error, "server returned %d %s", resp->statusCode, resp->reason ? resp->reason : "");
+        http_status_error (http);
+        tcp_close (http->tcp);
+        return false;
+    }
 
-    // Multithreaded download
+    // 206 from where we stopped continues the file, a 200 (the file changed) starts it over
+    long long offset = 0;
+    if (resume && 206 == resp->statusCode && resp->rangeStart == http->written) {
+        offset = http->written;
+    } else if (resume && 200 == resp->statusCode) {
+        logi ("can not continue at %lld, downloading '%s' from the start", http->written, fileName);
+    } else if (resume) {
+        // a part from somewhere else is not the rest of the file, the next attempt asks for all of it
+        gf_error (&http->error, "asked for %lld-, server answered %d from %lld", http->written, resp->statusCode, resp->rangeStart);
+        http->errorKind = HTTP_ERROR_KIND_SERVER;
+        http->written = 0;
+        tcp_close (http->tcp);
+        return false;
+    }
+
+    if (0 == offset) {
+        const char* validator = http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_ETAG);
+        if (!validator || g_str_has_prefix (validator, "W/")) {
+            validator = http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_LAST_MODIFIED);
+        }
+        g_free (http->validator);
+        http->validator = g_strdup (validator);
+    }
+
+    // the body is hashed on its way to the disk, a restart hashes from the start again
+    if (http->checksum) {
+        if (0 == offset) {
+            checksum_reset (http->checksum);
+        }
+        if (200 == resp->statusCode) {
+            checksum_expect_content_md5 (http->checksum, http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_CONTENT_MD5));
+        }
+        checksum_expect_digest_header (http->checksum, http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_REPR_DIGEST));
+        checksum_expect_digest_header (http->checksum, http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_DIGEST));
+    }
 
     // read body
     int ret = 0;
-    char buf[1024] = {0};
+    char buf[MAX_HTTP_READ_SIZE];
 
     g_autofree char* fileT = NULL;
     if ('/' == fileName[0]) {
@@ -174,47 +313,429 @@ bool http_request(Http *http, const char* fileName)
 
     g_autoptr (GError) error = NULL;
     g_autoptr (GFile) file = g_file_new_for_path (fileT);
-    if (G_IS_FILE (file)) {
+    if (!http->created && !http->discard && G_IS_FILE (file)) {
         if (g_file_query_exists (file, NULL)) {
             GFileType type = g_file_query_file_type (file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL);
             if (G_FILE_TYPE_DIRECTORY != type) {
                 gf_error (&http->error, "file '%s' already exists!", fileT, NULL);
+                http->errorKind = HTTP_ERROR_KIND_LOCAL;
                 return false;
             }
         }
     }
 
+    // the extractor has to be where the body continues, a resume replays the file into it
+    if (http->extract && http->extract->fed != offset && !extract_restart (http->extract, fileT, offset, &http->error)) {
+        http->errorKind = HTTP_ERROR_KIND_LOCAL;
+        return false;
+    }
+
     // permission can open? and write?
-    int fd = open (fileT, O_CREAT | O_RDWR, 0777);
-    if (fd < 0) {
-        gf_error (&http->error, "fail to open '%s', error: %s", fileT, strerror (errno), NULL);
-        goto error;
+    OutputStream* stream = NULL;
+    Output* out = NULL;
+    http->written = offset;
+    // nothing goes to the disk, the body only feeds the checksum and the extractor
+    if (!http->discard) {
+        out = output_open (fileT, 0 == offset, &http->error);
+        if (!out) {
+            http->errorKind = HTTP_ERROR_KIND_LOCAL;
+            goto error;
+        }
+        http->created = true;
+        if (http->writeback) {
+            output_set_writeback (out, OUTPUT_WRITEBACK_WINDOW);
+        }
+        if (http->compress > 0 && !output_set_compress (out, http->compress, &http->error)) {
+            http->errorKind = HTTP_ERROR_KIND_LOCAL;
+            goto error;
+        }
+
+        // the whole file up front, a full disk fails now and not at 80%
+        if (resp->contentLength > 0 && !output_reserve (out, offset + resp->contentLength, &http->error)) {
+            http->errorKind = HTTP_ERROR_KIND_LOCAL;
+            goto error;
+        }
+
+        // the disk is written behind the socket, a slow write does not stop the reads
+        stream = output_stream_new (out, http->written);
+        if (!stream) {
+            gf_error (&http->error, "malloc output stream error");
+            http->errorKind = HTTP_ERROR_KIND_LOCAL;
+            goto error;
+        }
     }
 
+    // low speed watch: the average over each lowSpeedTime window
+    double windowStart = gf_gettime ();
+    long long windowBytes = 0;
     for (int i = 0;; ++i) {
-        memset (buf, 0 , sizeof (buf));
-        ret = tcp_read (http->tcp, buf, sizeof (buf) - 1);
-        if (ret <= 0) {
+        ret = http_read_body (http, buf, sizeof (buf));
+        if (ret < 0) {
+            if (HTTP_ERROR_KIND_STALLED != http->errorKind) {
+                gf_error (&http->error, "http read body error after %lld bytes", http->written);
+                http->errorKind = HTTP_ERROR_KIND_SHORT_READ;
+            }
+            goto error;
+        } else if (0 == ret) {
             logd ("http read OK");
             break;
         }
 
-        if (write (fd, buf, ret) < 0) {
-            gf_error (&http->error, "http download error: %s", strerror (errno), NULL);
+        windowBytes += ret;
+        if (http->lowSpeedLimit > 0 && http->lowSpeedTime > 0) {
+            double elapsed = gf_gettime () - windowStart;
+            if (elapsed >= http->lowSpeedTime) {
+                if (windowBytes < http->lowSpeedLimit * elapsed) {
+                    http_stalled (http, "too slow");
+                    goto error;
+                }
+                windowStart += elapsed;
+                windowBytes = 0;
+            }
+        }
+
+        if (stream && !output_stream_write (stream, buf, ret, &http->error)) {
+            http->errorKind = HTTP_ERROR_KIND_LOCAL;
             goto error;
         }
+        http->written += ret;
+        if (http->checksum) {
+            checksum_update (http->checksum, buf, ret);
+        }
+        if (http->extract && !extract_feed (http->extract, buf, ret, &http->error)) {
+            http->errorKind = HTTP_ERROR_KIND_LOCAL;
+            goto error;
+        }
+    }
+
+    if (http->extract && !extract_finish (http->extract, &http->error)) {
+        http->errorKind = HTTP_ERROR_KIND_LOCAL;
+        goto error;
+    }
+
+    if (http->discard) {
+        return true;
+    }
+
+    if (!output_stream_close (stream, &http->error)) {
+        stream = NULL;
+        http->written = 0;
+        http->errorKind = HTTP_ERROR_KIND_LOCAL;
+        goto error;
     }
+    stream = NULL;
 
-    close (fd);
+    if (!output_finish (out, http->written, &http->error)) {
+        http->errorKind = HTTP_ERROR_KIND_LOCAL;
+        goto error;
+    }
+    output_close (out);
 
     return true;
 
 error:
-    if (fd > 0)     close (fd);
+    // what was handed to the stream is on disk afterwards, or the resume starts over
+    if (stream && !output_stream_close (stream, NULL))   http->written = 0;
+    if (out)        output_close (out);
+    tcp_close (http->tcp);
+
+    return false;
+}
+
+int http_host_stalls (const char* host)
+{
+    g_return_val_if_fail (host, 0);
+
+    g_mutex_lock (&gHostStallsLock);
+    int stalls = gHostStalls ? GPOINTER_TO_INT (g_hash_table_lookup (gHostStalls, host)) : 0;
+    g_mutex_unlock (&gHostStallsLock);
+
+    return stalls;
+}
+
+guint64 http_body_bytes (void)
+{
+    return __atomic_load_n (&gBodyBytes, __ATOMIC_RELAXED);
+}
+
+void http_status_error (Http* http)
+{
+    g_return_if_fail (http && http->resp);
+
+    HttpResponse* resp = http->resp;
+    if (429 == resp->statusCode) {
+        http->errorKind = HTTP_ERROR_KIND_THROTTLED;
+    } else if (resp->statusCode >= 500 || 408 == resp->statusCode) {
+        http->errorKind = HTTP_ERROR_KIND_SERVER;
+    } else {
+        http->errorKind = HTTP_ERROR_KIND_STATUS;
+    }
+    http->retryAfter = http_parse_retry_after (http_header_list_get_value_by_id (resp->headers, HTTP_HEADER_ID_RETRY_AFTER));
+}
+
+bool http_error_retryable (HttpErrorKind kind)
+{
+    switch (kind) {
+    case HTTP_ERROR_KIND_DNS:
+    case HTTP_ERROR_KIND_CONNECT:
+    case HTTP_ERROR_KIND_TLS:
+    case HTTP_ERROR_KIND_SERVER:
+    case HTTP_ERROR_KIND_THROTTLED:
+    case HTTP_ERROR_KIND_SHORT_READ:
+    case HTTP_ERROR_KIND_STALLED:
+        return true;
+    default:
+        break;
+    }
 
     return false;
 }
 
+int http_read_body (Http* http, char* buf, int size)
+{
+    g_return_val_if_fail (http && http->resp && buf && size > 0, -1);
+
+    HttpResponse* resp = http->resp;
+
+    if (http->noBody) {
+        http->bodyDone = true;
+        return 0;
+    }
+
+    for (;;) {
+        if (resp->chunked) {
+            if (http_chunked_done (&http->chunked)) {
+                http->bodyDone = true;
+                return 0;
+            }
+        } else if (resp->contentLength >= 0) {
+            long long remain = resp->contentLength - http->bodyRead;
+            if (remain <= 0) {
+                http->bodyDone = true;
+                return 0;
+            }
+            size = (int) MIN ((long long) size, remain);
+        }
+
+        int n = 0;
+        if (http->bodyBufPos < http->bodyBufLen) {
+            n = MIN (size, http->bodyBufLen - http->bodyBufPos);
+            memcpy (buf, http->bodyBuf + http->bodyBufPos, n);
+            http->bodyBufPos += n;
+        } else {
+            n = tcp_read (http->tcp, buf, size);
+            if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+                http_stalled (http, "no data");
+                return -1;
+            } else if (n <= 0) {
+                // a chunked body or a known length must not end early
+                if (resp->chunked || resp->contentLength >= 0) {
+                    return -1;
+                }
+                return n < 0 ? -1 : 0;
+            }
+        }
+
+        if (resp->chunked) {
+            n = http_chunked_decode (&http->chunked, buf, n);
+            if (n < 0) {
+                return -1;
+            } else if (0 == n) {
+                continue;
+            }
+        }
+
+        http->bodyRead += n;
+        __atomic_add_fetch (&gBodyBytes, (guint64) n, __ATOMIC_RELAXED);
+        if (!resp->chunked && resp->contentLength >= 0 && http->bodyRead >= resp->contentLength) {
+            http->bodyDone = true;
+        }
+
+        return n;
+    }
+
+    return -1;
+}
+
+static char* http_uri_resource (GUri* uri)
+{
+    const char* path = g_uri_get_path (uri);
+    if (!path || '\0' == path[0]) {
+        path = "/";
+    }
+
+    const char* query = g_uri_get_query (uri);
+    if (query) {
+        return g_strdup_printf ("%s?%s", path, query);
+    }
+
+    return g_strdup (path);
+}
+
+/**
+ * @brief 记录一次卡住的传输, 连接随后会被关闭
+ */
+static void http_stalled (Http* http, const char* reason)
+{
+    g_mutex_lock (&gHostStallsLock);
+    if (!gHostStalls) {
+        gHostStalls = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    }
+    int stalls = GPOINTER_TO_INT (g_hash_table_lookup (gHostStalls, http->host)) + 1;
+    g_hash_table_insert (gHostStalls, g_strdup (http->host), GINT_TO_POINTER (stalls));
+    g_mutex_unlock (&gHostStallsLock);
+
+    gf_error (&http->error, "transfer stalled (%s) after %lld bytes, %d stall(s) on '%s'", reason, http->written, stalls, http->host);
+    http->errorKind = HTTP_ERROR_KIND_STALLED;
+}
+
+/**
+ * @brief Retry-After 的值是秒数或者 HTTP 日期, 返回还要等待的秒数, 无法解析返回 -1
+ */
+static int http_parse_retry_after (const char* value)
+{
+    if (!value) {
+        return -1;
+    }
+
+    char* end = NULL;
+    long secs = strtol (value, &end, 10);
+    if (end != value && '\0' == *end) {
+        return secs >= 0 ? (int) MIN (secs, G_MAXINT) : -1;
+    }
+
+    // IMF-fixdate, e.g. "Wed, 21 Oct 2015 07:28:00 GMT"
+    static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    char mon[4] = {0};
+    int day = 0, year = 0, hour = 0, min = 0, sec = 0;
+    if (6 != sscanf (value, "%*3s, %d %3s %d %d:%d:%d", &day, mon, &year, &hour, &min, &sec)) {
+        return -1;
+    }
+
+    for (int i = 0; i < 12; ++i) {
+        if (0 == g_ascii_strcasecmp (mon, months[i])) {
+            g_autoptr (GDateTime) at = g_date_time_new_utc (year, i + 1, day, hour, min, sec);
+            g_autoptr (GDateTime) now = g_date_time_new_now_utc ();
+            if (!at || !now) {
+                return -1;
+            }
+            gint64 wait = g_date_time_to_unix (at) - g_date_time_to_unix (now);
+            return (int) CLAMP (wait, 0, G_MAXINT);
+        }
+    }
+
+    return -1;
+}
+
+static bool http_read_header (Http* http)
+{
+    http->bodyDone = false;
+
+    if (http->headerBuf) {
+        g_free (http->headerBuf);
+    }
+
+    if (!(http->headerBuf = g_malloc0 (http->headerBufLen))) {
+        gf_error (&http->error, "http malloc header buf fail!");
+        return false;
+    }
+
+    // bytes read after the previous response, e.g. the next pipelined response
+    http->headerBufCurLen = 0;
+    int left = http->bodyBufLen - http->bodyBufPos;
+    if (http->bodyBuf && left > 0) {
+        while (http->headerBufLen - 512 < left) {
+            http->headerBufLen *= 2;
+        }
+        char* t = g_realloc (http->headerBuf, http->headerBufLen);
+        if (!t) {
+            gf_error (&http->error, "g_realloc header buf failed");
+            return false;
+        }
+        http->headerBuf = t;
+        memcpy (http->headerBuf, http->bodyBuf + http->bodyBufPos, left);
+        http->headerBufCurLen = left;
+        http->bodyBufPos = http->bodyBufLen;
+    }
+
+    // read in blocks and look for the blank line, the rest belongs to the body;
+    // the terminator may be split between two reads, so the last 3 bytes are scanned again
+    const char* end = NULL;
+    int scanned = 0;
+    while (!(end = scan_crlfcrlf (http->headerBuf + MAX (scanned - 3, 0), http->headerBufCurLen - MAX (scanned - 3, 0)))) {
+        scanned = http->headerBufCurLen;
+        if (http->headerBufLen - http->headerBufCurLen < 512) {
+            int len = http->headerBufLen * 2;
+            if (len > MAX_HTTP_BUF_SIZE) {
+                gf_error (&http->error, "http header too large");
+                return false;
+            }
+            char* t = g_realloc (http->headerBuf, len);
+            if (!t) {
+                gf_error (&http->error, "g_realloc header buf failed");
+                return false;
+            }
+            http->headerBufLen = len;
+            http->headerBuf = t;
+        }
+
+        int ret = tcp_read (http->tcp, http->headerBuf + http->headerBufCurLen, http->headerBufLen - http->headerBufCurLen - 1);
+        if (ret < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            http_stalled (http, "no response header");
+            return false;
+        } else if (ret <= 0) {
+            gf_error (&http->error, "connection closed while reading http header");
+            http->errorKind = HTTP_ERROR_KIND_SHORT_READ;
+            return false;
+        }
+        http->headerBufCurLen += ret;
+    }
+
+    int headerLen = end - http->headerBuf + 2;
+    int bodyStart = headerLen + 2;
+
+    if (http->bodyBuf) {
+        g_free (http->bodyBuf);
+        http->bodyBuf = NULL;
+    }
+    http->bodyBufLen = http->headerBufCurLen - bodyStart;
+    http->bodyBufPos = 0;
+    http->bodyRead = 0;
+    http_chunked_init (&http->chunked);
+    if (http->bodyBufLen > 0) {
+        if (!(http->bodyBuf = g_malloc (http->bodyBufLen))) {
+            gf_error (&http->error, "http malloc body buf fail!");
+            return false;
+        }
+        memcpy (http->bodyBuf, http->headerBuf + bodyStart, http->bodyBufLen);
+    }
+
+    http->headerBuf[headerLen] = '\0';
+    logd ("read header OK!");
+
+    logd ("\n================ respose ===================\n"
+         "%s"
+         "\n============================================\n", http->headerBuf);
+
+    // parse header, the header buffer is handed over to a new response
+    if (http->resp) {
+        http_respose_destroy (http->resp);
+    }
+    if (!(http->resp = http_respose_new ())) {
+        gf_error (&http->error, "http malloc respose fail!");
+        return false;
+    }
+
+    bool parsed = http_respose_parse (http->resp, http->headerBuf, headerLen);
+    http->headerBuf = NULL;
+    http->headerBufCurLen = 0;
+    if (!parsed) {
+        gf_error (&http->error, "http parse response header error");
+        return false;
+    }
+
+    return true;
+}
 
 void http_debug (const Http* http)
 {
@@ -224,5 +745,14 @@ void http_debug (const Http* http)
     printf ("host: %s\n", http->host);
     printf ("resource: %s\n", http->resource);
     if (http->headerBuf)    printf ("\nheader ==>\n%s\n===\n", http->headerBuf);
+    if (http->resp && http->resp->statusCode > 0) {
+        printf ("\nrespose ==> %d %s\n", http->resp->statusCode, http->resp->reason ? http->resp->reason : "");
+        const char* key = NULL;
+        const char* value = NULL;
+        for (int it = 0; http_header_list_next (http->resp->headers, &it, &key, &value);) {
+            printf ("%s: %s\n", key, value);
+        }
+        printf ("===\n");
+    }
     printf ("===========================================================\n");
 }
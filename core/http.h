@@ -2,12 +2,38 @@
 #define HTTP_H
 
 #include "tcp.h"
+#include "extract.h"
+#include "checksum.h"
+#include "http-chunked.h"
 #include "http-request.h"
 #include "http-respose.h"
 
 #define MAX_HTTP_BUF_SIZE       (4<<20)
+#define MAX_HTTP_READ_SIZE      (64<<10)
+
+#define HTTP_IO_TIMEOUT         30              // 多少秒收不到数据算卡住
+#define HTTP_LOW_SPEED_LIMIT    1024            // 字节每秒
+#define HTTP_LOW_SPEED_TIME     60              // 速度低于 HTTP_LOW_SPEED_LIMIT 持续的秒数
 
 typedef struct _Http            Http;
+typedef enum _HttpErrorKind     HttpErrorKind;
+
+/**
+ * @brief 失败的原因, 用来判断是否值得重试
+ */
+enum _HttpErrorKind
+{
+    HTTP_ERROR_KIND_NONE = 0,
+    HTTP_ERROR_KIND_DNS,                // 域名解析失败
+    HTTP_ERROR_KIND_CONNECT,            // 连接失败或连接被重置
+    HTTP_ERROR_KIND_TLS,                // TLS 握手失败
+    HTTP_ERROR_KIND_SERVER,             // 5xx 和 408
+    HTTP_ERROR_KIND_THROTTLED,          // 429
+    HTTP_ERROR_KIND_SHORT_READ,         // 响应没有读完连接就断了
+    HTTP_ERROR_KIND_STALLED,            // 长时间没有数据或速度太低
+    HTTP_ERROR_KIND_STATUS,             // 其它 4xx, 重试没有用
+    HTTP_ERROR_KIND_LOCAL,              // 本地文件错误
+};
 
 struct _Http
 {
@@ -24,12 +50,105 @@ struct _Http
     int                     headerBufCurLen;
     char                   *headerBuf;
 
+    /* body 数据: 和头部一起读到的部分先放在 bodyBuf */
+    char                   *bodyBuf;
+    int                     bodyBufLen;
+    int                     bodyBufPos;
+    long long               bodyRead;
+    bool                    bodyDone;
+    HttpChunked             chunked;
+
+    bool                    keepAlive;              // 连接在 body 读完后可以复用
+    bool                    noBody;                 // HEAD 等没有 body 的响应
+
+    /* http_request() 的续传状态 */
+    bool                    created;                // 本地文件是之前的尝试创建的, 可以覆盖
+    long long               written;                // 已经写入本地文件的字节数, 重试时从这里继续
+    char                   *validator;              // 第一次响应的 ETag 或 Last-Modified, 用于 If-Range
+    Checksum               *checksum;               // 不为空时写入的数据同时计算校验值, http_destroy() 释放
+    bool                    writeback;              // 按窗口主动回写并释放页缓存, 见 output_set_writeback()
+    int                     compress;               // 大于 0 时压缩成 zstd 帧写入, 见 output_set_compress()
+    Extract                *extract;                // 不为空时收到的数据同时解包, http_destroy() 释放
+    bool                    discard;                // 不写本地文件, 数据只交给 checksum 和 extract, 重试时从头开始
+
+    /* 传输监控, 0 表示不限制 */
+    int                     ioTimeout;              // 连接和每次读写最多等待的秒数
+    int                     lowSpeedLimit;          // 字节每秒
+    int                     lowSpeedTime;           // 速度低于 lowSpeedLimit 持续这么多秒就断开, 重试时续传
+
+    HttpErrorKind           errorKind;
+    int                     retryAfter;             // 服务器 Retry-After 要求的秒数, 没有为 -1
     GError                 *error;
 };
 
 Http*   http_new        (GUri* uri);
 void    http_destroy    (Http* http);
+
+/**
+ * @brief 下载到文件
+ *
+ * 失败后再次调用会用 Range 请求从 written 处继续, 服务器回答 200 (不支持或文件已改变)时从头下载;
+ * 回答的 206 不是从 written 开始时这次失败(可以重试), 下次不带 Range 请求整个文件;
+ * 失败原因见 errorKind 和 retryAfter。
+ * 设置了 checksum 时响应头里的 Digest、Repr-Digest 和 Content-MD5 也作为期望值, 由调用者校验;
+ * 设置了 extract 时边下载边解包, 续传时先把文件里已有的部分重新送进去, 成功返回时归档已经完整解出
+ */
 bool    http_request    (Http* http, const char* fileName);
 
+/**
+ * @brief 响应的状态码不是想要的, 按它设置 errorKind 和 retryAfter
+ */
+void    http_status_error       (Http* http);
+
+/**
+ * @brief 这类错误是否可能重试成功
+ */
+bool    http_error_retryable    (HttpErrorKind kind);
+
+/**
+ * @brief 到目前为止在这个主机上卡住(超时或速度太低)的传输次数
+ */
+int     http_host_stalls        (const char* host);
+
+/**
+ * @brief 所有连接到目前为止收到的响应体字节数, 两次调用的差就是这段时间的总下载量
+ */
+guint64 http_body_bytes         (void);
+
+/**
+ * @brief 换成同一主机上的另一个资源(path 和 query), 连接不变
+ */
+bool    http_set_resource   (Http* http, GUri* uri);
+
+/**
+ * @brief 设置请求的字节范围
+ * @param start 起始偏移
+ * @param end 结束偏移(包含), 小于 0 表示到文件结尾
+ */
+bool    http_set_range  (Http* http, long long start, long long end);
+
+/**
+ * @brief 发送请求并读取、解析响应头, 之后用 http_read_body() 读取 body
+ *
+ * 上一个响应的 body 读完且服务器允许时复用原来的连接
+ */
+bool    http_send       (Http* http);
+
+/**
+ * @brief 只发送请求(需要时先连接), 用于流水线: 连续发送多个请求后按顺序 http_read_response()
+ */
+bool    http_write_request  (Http* http);
+
+/**
+ * @brief 读取并解析下一个响应头, 之前多读到的数据会先被使用
+ */
+bool    http_read_response  (Http* http);
+
+/**
+ * @brief 读取解码后的 body 数据(处理 chunked 和 Content-Length)
+ * @return 读取到的字节数, 读完返回 0, 出错返回 -1
+ */
+int     http_read_body  (Http* http, char* buf, int size);
+
 
 #endif // HTTP_H
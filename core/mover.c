@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include "mover.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "utils.h"
+
+typedef struct _MoverJob            MoverJob;
+
+struct _MoverJob
+{
+    char                   *src;
+    char                   *dst;
+};
+
+/**
+ * @brief 搬运队列和搬运线程
+ */
+typedef struct
+{
+    GMutex                  lock;
+    GCond                   cond;
+
+    GList                  *jobs;
+    int                     threads;                // 想要的线程数
+    int                     running;                // 已经启动的线程数, 多出来的做完手上的文件就退出
+
+    long long               rate;                   // 字节每秒, 0 不限制
+    double                  next;                   // 下一块最早可以开始复制的时间
+
+    MoverStats              stats;
+} Mover;
+
+static Mover gMover;
+static pthread_once_t gMoverOnce = PTHREAD_ONCE_INIT;
+
+static void mover_start (void);
+static void* mover_worker (void* arg);
+static bool mover_sync (const char* path, GError** error);
+static void mover_job_free (MoverJob* job);
+static void mover_throttle (long long len);
+static bool mover_copy (int in, int out, long long length, GError** error);
+
+
+void mover_set_limits (int threads, long long bytesPerSecond)
+{
+    pthread_once (&gMoverOnce, mover_start);
+
+    g_mutex_lock (&gMover.lock);
+    if (threads > 0)            gMover.threads = threads;
+    if (bytesPerSecond >= 0)    gMover.rate = bytesPerSecond;
+    g_cond_broadcast (&gMover.cond);
+    g_mutex_unlock (&gMover.lock);
+}
+
+bool mover_submit (const char* src, const char* dst, GError** error)
+{
+    g_return_val_if_fail (src && dst, false);
+
+    // the download only counts as done once the staged data is on disk
+    if (!mover_sync (src, error)) {
+        return false;
+    }
+
+    pthread_once (&gMoverOnce, mover_start);
+
+    MoverJob* job = g_malloc0 (sizeof (MoverJob));
+    if (!job) {
+        gf_error (error, "malloc mover job error");
+        return false;
+    }
+    job->src = g_strdup (src);
+    job->dst = g_strdup (dst);
+
+    g_mutex_lock (&gMover.lock);
+    gMover.jobs = g_list_append (gMover.jobs, job);
+    gMover.stats.queued++;
+
+    // threads are started when there is something to move
+    while (gMover.running < gMover.threads) {
+        pthread_t tid;
+        if (0 != pthread_create (&tid, NULL, mover_worker, NULL)) {
+            loge ("create mover thread error: %s", strerror (errno));
+            break;
+        }
+        pthread_detach (tid);
+        gMover.running++;
+    }
+    bool started = gMover.running > 0;
+    g_cond_signal (&gMover.cond);
+    g_mutex_unlock (&gMover.lock);
+
+    // it stays queued for the next submit that manages to start a thread
+    if (!started) {
+        gf_error (error, "no mover thread to move '%s'", src);
+        return false;
+    }
+
+    return true;
+}
+
+void mover_stats (MoverStats* stats)
+{
+    g_return_if_fail (stats);
+
+    pthread_once (&gMoverOnce, mover_start);
+
+    g_mutex_lock (&gMover.lock);
+    *stats = gMover.stats;
+    g_mutex_unlock (&gMover.lock);
+}
+
+bool mover_move (const char* src, const char* dst, bool* renamed, GError** error)
+{
+    g_return_val_if_fail (src && dst, false);
+
+    pthread_once (&gMoverOnce, mover_start);
+
+    if (renamed) *renamed = false;
+
+    if (g_file_test (dst, G_FILE_TEST_EXISTS)) {
+        gf_error (error, "file '%s' already exists!", dst);
+        return false;
+    }
+
+    // the same file system, nothing to copy
+    if (0 == rename (src, dst)) {
+        if (renamed) *renamed = true;
+        return true;
+    } else if (EXDEV != errno) {
+        gf_error (error, "rename '%s' to '%s' error: %s", src, dst, strerror (errno));
+        return false;
+    }
+
+    bool ret = false;
+    int out = -1;
+    g_autofree char* tmp = g_strdup_printf ("%s.moving", dst);
+
+    struct stat st;
+    int in = open (src, O_RDONLY | O_CLOEXEC);
+    if (in < 0 || 0 != fstat (in, &st)) {
+        gf_error (error, "open '%s' error: %s", src, strerror (errno));
+        goto out;
+    }
+
+    out = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+    if (out < 0) {
+        gf_error (error, "open '%s' error: %s", tmp, strerror (errno));
+        goto out;
+    }
+
+    if (!mover_copy (in, out, st.st_size, error)) {
+        goto out;
+    }
+
+    // the staged copy is only removed once the target is on disk
+    if (0 != fsync (out)) {
+        gf_error (error, "fsync '%s' error: %s", tmp, strerror (errno));
+        goto out;
+    }
+
+    if (g_file_test (dst, G_FILE_TEST_EXISTS)) {
+        gf_error (error, "file '%s' already exists!", dst);
+        goto out;
+    }
+
+    if (0 != rename (tmp, dst)) {
+        gf_error (error, "rename '%s' to '%s' error: %s", tmp, dst, strerror (errno));
+        goto out;
+    }
+
+    if (0 != unlink (src)) {
+        logi ("remove staged '%s' error: %s", src, strerror (errno));
+    }
+
+    g_mutex_lock (&gMover.lock);
+    gMover.stats.bytes += st.st_size;
+    g_mutex_unlock (&gMover.lock);
+
+    ret = true;
+
+out:
+    if (in >= 0)            close (in);
+    if (out >= 0)           close (out);
+    if (out >= 0 && !ret)   unlink (tmp);
+
+    return ret;
+}
+
+static void mover_start (void)
+{
+    g_mutex_init (&gMover.lock);
+    g_cond_init (&gMover.cond);
+    gMover.threads = MOVER_THREADS_DEFAULT;
+}
+
+static void* mover_worker (void* arg)
+{
+    g_mutex_lock (&gMover.lock);
+    for (;;) {
+        while (!gMover.jobs && gMover.running <= gMover.threads) {
+            g_cond_wait (&gMover.cond, &gMover.lock);
+        }
+
+        // the limit went down
+        if (gMover.running > gMover.threads) {
+            break;
+        }
+
+        MoverJob* job = gMover.jobs->data;
+        gMover.jobs = g_list_delete_link (gMover.jobs, gMover.jobs);
+        gMover.stats.queued--;
+        gMover.stats.moving++;
+        g_mutex_unlock (&gMover.lock);
+
+        bool renamed = false;
+        g_autoptr (GError) error = NULL;
+        double t0 = gf_gettime ();
+        bool ok = mover_move (job->src, job->dst, &renamed, &error);
+        if (ok) {
+            logi ("moved '%s' to '%s'%s in %.1fs", job->src, job->dst, renamed ? " (renamed)" : "", gf_gettime () - t0);
+        } else {
+            loge ("move '%s' error: %s, it stays there", job->src, error ? error->message : "");
+        }
+
+        g_mutex_lock (&gMover.lock);
+        gMover.stats.moving--;
+        if (ok)         gMover.stats.moved++;
+        if (!ok)        gMover.stats.failed++;
+        if (renamed)    gMover.stats.renamed++;
+        g_mutex_unlock (&gMover.lock);
+
+        mover_job_free (job);
+
+        g_mutex_lock (&gMover.lock);
+    }
+    gMover.running--;
+    g_mutex_unlock (&gMover.lock);
+
+    return NULL;
+}
+
+/**
+ * @brief 在调用者的线程里 fsync 暂存的文件, 同一文件系统上 rename 以后崩溃也不会留下空文件
+ */
+static bool mover_sync (const char* path, GError** error)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        gf_error (error, "open '%s' error: %s", path, strerror (errno));
+        return false;
+    }
+
+    bool ok = (0 == fsync (fd));
+    if (!ok) {
+        gf_error (error, "fsync '%s' error: %s", path, strerror (errno));
+    }
+    close (fd);
+
+    return ok;
+}
+
+static void mover_job_free (MoverJob* job)
+{
+    g_free (job->src);
+    g_free (job->dst);
+    g_free (job);
+}
+
+/**
+ * @brief 所有搬运线程共用一个速度: 每一块按速度排到上一块之后, 没轮到就睡
+ */
+static void mover_throttle (long long len)
+{
+    g_mutex_lock (&gMover.lock);
+    if (gMover.rate <= 0) {
+        g_mutex_unlock (&gMover.lock);
+        return;
+    }
+    double now = gf_gettime ();
+    double start = MAX (now, gMover.next);
+    gMover.next = start + (double) len / gMover.rate;
+    g_mutex_unlock (&gMover.lock);
+
+    if (start > now) {
+        double wait = start - now;
+        struct timespec delay = { (time_t) wait, (long) ((wait - (long) wait) * 1e9) };
+        gf_sleep (delay);
+    }
+}
+
+/**
+ * @brief copy_file_range 让内核直接复制, 不经过用户态; 内核或文件系统不支持时退回 pread/pwrite
+ */
+static bool mover_copy (int in, int out, long long length, GError** error)
+{
+    bool plain = false;
+    char* buf = NULL;
+    long long done = 0;
+
+    while (done < length) {
+        long long len = MIN ((long long) MOVER_CHUNK_SIZE, length - done);
+        mover_throttle (len);
+
+        ssize_t n = -1;
+        if (!plain) {
+            loff_t inOff = done, outOff = done;
+            n = copy_file_range (in, &inOff, out, &outOff, len, 0);
+            if (n < 0 && (EXDEV == errno || EINVAL == errno || ENOSYS == errno || EOPNOTSUPP == errno)) {
+                plain = true;
+            }
+        }
+
+        if (plain) {
+            if (!buf && !(buf = g_malloc (MOVER_CHUNK_SIZE))) {
+                gf_error (error, "malloc copy buffer error");
+                return false;
+            }
+            n = pread (in, buf, len, done);
+            for (ssize_t w = 0, k = 0; n > 0 && w < n; w += k) {
+                k = pwrite (out, buf + w, n - w, done + w);
+                if (k < 0 && EINTR == errno) {
+                    k = 0;
+                } else if (k < 0) {
+                    n = -1;
+                }
+            }
+        }
+
+        if (n < 0 && EINTR == errno) {
+            continue;
+        } else if (n < 0) {
+            gf_error (error, "copy at offset %lld error: %s", done, strerror (errno));
+            g_free (buf);
+            return false;
+        } else if (0 == n) {
+            gf_error (error, "source ends at %lld of %lld bytes", done, length);
+            g_free (buf);
+            return false;
+        }
+        done += n;
+    }
+    g_free (buf);
+
+    return true;
+}
@@ -0,0 +1,53 @@
+#ifndef MOVER_H
+#define MOVER_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define MOVER_THREADS_DEFAULT       1               // 同时搬运的文件数
+#define MOVER_CHUNK_SIZE            (8 << 20)       // 每次 copy_file_range 的字节数, 也是限速的粒度
+
+typedef struct _MoverStats          MoverStats;
+
+/**
+ * @brief 后台搬运的统计
+ */
+struct _MoverStats
+{
+    int                     queued;                 // 等待搬运的文件
+    int                     moving;                 // 正在搬运的文件
+    guint64                 moved;                  // 搬完的文件数
+    guint64                 failed;                 // 搬运失败留在暂存目录的文件数
+    guint64                 renamed;                // 其中同一文件系统直接 rename 的
+    guint64                 bytes;                  // 复制的字节数
+};
+
+/**
+ * @brief 暂存目录到最终目录的后台搬运
+ *
+ * 下载先写到快的本地暂存目录(NVMe、tmpfs), 完成后交给这里, 下载线程立即去做别的事;
+ * 搬运线程优先 rename, 跨文件系统时用 copy_file_range 复制到 "<目标>.moving",
+ * fsync 后 rename 成目标并删除暂存的文件, 目标目录里不会出现只复制了一半的文件。
+ * 搬运失败时文件留在暂存目录。
+ */
+
+/**
+ * @brief 设置搬运线程数和总的复制速度
+ * @param threads 小于等于 0 时不变
+ * @param bytesPerSecond 所有搬运线程加起来的上限, 0 不限制, 小于 0 时不变
+ */
+void    mover_set_limits    (int threads, long long bytesPerSecond);
+
+/**
+ * @brief 先 fsync 暂存的文件 src, 再排队搬到 dst, 不等搬运完成
+ */
+bool    mover_submit        (const char* src, const char* dst, GError** error);
+
+void    mover_stats         (MoverStats* stats);
+
+/**
+ * @brief 同步搬运一个文件
+ */
+bool    mover_move          (const char* src, const char* dst, bool* renamed, GError** error);
+
+#endif // MOVER_H
@@ -0,0 +1,856 @@
+#define _GNU_SOURCE
+#include "output.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/statvfs.h>
+#include <linux/fs.h>
+
+#include "log.h"
+#include "utils.h"
+
+typedef struct _OutputBuffer        OutputBuffer;
+typedef struct _OutputRing          OutputRing;
+
+struct _OutputBuffer
+{
+    OutputStream           *stream;
+    long long               offset;
+    int                     len;
+    int                     cap;                    // 第一个缓冲区只填到下一个对齐位置
+    char                   *data;
+};
+
+struct _OutputStream
+{
+    Output                 *out;
+    long long               offset;                 // 下一个字节在文件中的偏移
+    OutputBuffer           *cur;                    // 正在填充的缓冲区
+    int                     pending;                // 已经提交还没写完的缓冲区
+    long long               flushed;                // 映射模式: 这之前的数据已经交给内核回写
+    GError                 *error;
+
+    /* 回写模式, 都是文件中的偏移 */
+    long long               start;
+    long long               written;                // 写线程已经写完的字节数
+    long long               synced;                 // 这之前已经开始回写
+    long long               dropped;                // 这之前已经写到磁盘并从页缓存丢掉
+    bool                    syncing;                // 有写线程正在回写这个流
+};
+
+/**
+ * @brief 一个块设备的缓冲区和写线程占用, 由 gRing.lock 保护
+ */
+struct _OutputDevice
+{
+    dev_t                   dev;
+    int                     inUse;
+    int                     queued;
+    int                     writing;
+    OutputDeviceStats       stats;
+};
+
+/**
+ * @brief 所有写流共用的缓冲区和写线程
+ */
+struct _OutputRing
+{
+    GMutex                  lock;
+    GCond                   notEmpty;               // 写线程等待提交的缓冲区
+    GCond                   notFull;                // 网络线程等待空闲的缓冲区
+    GCond                   done;                   // 关闭写流时等待它的缓冲区写完
+
+    GList                  *queued;
+    GList                  *free;
+    int                     allocated;
+
+    GList                  *devices;                // OutputDevice, 不释放, 设备数很少
+    int                     deviceWriters;
+    int                     deviceDepth;
+
+    OutputRingStats         stats;
+};
+
+static OutputRing gRing;
+static pthread_once_t gRingOnce = PTHREAD_ONCE_INIT;
+
+static void output_ring_start (void);
+static void* output_ring_writer (void* arg);
+static GList* output_ring_next (void);
+static OutputDevice* output_device_get (int fd, const char* fileName);
+static bool output_unshare (const char* fileName, bool truncate, GError** error);
+static OutputBuffer* output_buffer_get (OutputStream* s);
+static void output_buffer_submit (OutputBuffer* b);
+static void output_map_flush (OutputStream* s, long long end);
+static bool output_pwrite (Output* out, long long offset, const void* data, long long len, GError** error);
+static bool output_compress_write (Output* out, long long offset, const void* data, long long len, GError** error);
+static void output_writeback (int fd, long long dropFrom, long long syncFrom, long long syncTo, bool wait);
+
+
+Output* output_open (const char* fileName, bool truncate, GError** error)
+{
+    g_return_val_if_fail (fileName, NULL);
+
+    // a hard link into the store must not be written through
+    if (!output_unshare (fileName, truncate, error)) {
+        return NULL;
+    }
+
+    int fd = open (fileName, O_CREAT | O_RDWR | (truncate ? O_TRUNC : 0), 0777);
+    if (fd < 0) {
+        gf_error (error, "fail to open '%s', error: %s", fileName, strerror (errno));
+        return NULL;
+    }
+
+    Output* out = g_malloc0 (sizeof (Output));
+    if (!out) {
+        gf_error (error, "malloc output error");
+        close (fd);
+        return NULL;
+    }
+
+    out->fileName = g_strdup (fileName);
+    out->fd = fd;
+    out->device = output_device_get (fd, fileName);
+
+    return out;
+}
+
+void output_close (Output* out)
+{
+    g_return_if_fail (out);
+
+    if (out->map)           munmap (out->map, out->mapLength);
+    if (out->index)         compress_index_free (out->index);
+    if (out->fd >= 0)       close (out->fd);
+    if (out->fileName)      g_free (out->fileName);
+
+    g_free (out);
+}
+
+bool output_reserve (Output* out, long long length, GError** error)
+{
+    g_return_val_if_fail (out && out->fd >= 0, false);
+
+    // how much the compressed file needs is not known up front
+    if (length <= out->reserved || out->compress > 0) {
+        return true;
+    }
+
+    // blocks the file already owns do not count, e.g. when resuming
+    struct stat st;
+    struct statvfs vfs;
+    if (0 == fstat (out->fd, &st) && 0 == fstatvfs (out->fd, &vfs)) {
+        long long need = length - (long long) st.st_blocks * 512;
+        long long avail = (long long) vfs.f_bavail * vfs.f_frsize;
+        if (need > avail) {
+            g_autofree char* needStr = g_format_size (need);
+            g_autofree char* availStr = g_format_size (avail);
+            gf_error (error, "not enough disk space for '%s': %s more needed, %s available", out->fileName, needStr, availStr);
+            return false;
+        }
+    }
+
+    // unlike posix_fallocate, fallocate does not fall back to writing zeros block by block
+    if (0 != fallocate (out->fd, 0, 0, length)) {
+        if (ENOSPC == errno) {
+            gf_error (error, "not enough disk space for '%s' (%lld bytes)", out->fileName, length);
+            return false;
+        } else if (EOPNOTSUPP != errno && ENOSYS != errno) {
+            gf_error (error, "fail to allocate %lld bytes for '%s', error: %s", length, out->fileName, strerror (errno));
+            return false;
+        }
+
+        // not supported by the file system, at least set the size
+        logd ("fallocate not supported for '%s', using a sparse file", out->fileName);
+        if (0 == fstat (out->fd, &st) && st.st_size < length && ftruncate (out->fd, length) < 0) {
+            gf_error (error, "fail to resize '%s' to %lld bytes, error: %s", out->fileName, length, strerror (errno));
+            return false;
+        }
+        out->allocated = false;
+    } else {
+        out->allocated = true;
+    }
+
+    out->reserved = length;
+
+    return true;
+}
+
+bool output_map (Output* out, GError** error)
+{
+    g_return_val_if_fail (out && out->fd >= 0, false);
+
+    if (out->map) {
+        return true;
+    }
+
+    if (out->compress > 0) {
+        gf_error (error, "'%s' is compressed, it can not be mapped", out->fileName);
+        return false;
+    }
+
+    if (out->reserved <= 0 || !out->allocated) {
+        gf_error (error, "'%s' is not fully allocated, it can not be mapped", out->fileName);
+        return false;
+    }
+
+    void* map = mmap (NULL, out->reserved, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+    if (MAP_FAILED == map) {
+        gf_error (error, "fail to map '%s', error: %s", out->fileName, strerror (errno));
+        return false;
+    }
+
+    out->map = map;
+    out->mapLength = out->reserved;
+
+    return true;
+}
+
+void output_set_writeback (Output* out, long long window)
+{
+    g_return_if_fail (out && window >= 0);
+
+    out->writeback = window;
+}
+
+bool output_set_compress (Output* out, int level, GError** error)
+{
+    g_return_val_if_fail (out && out->fd >= 0 && level > 0 && !out->map, false);
+
+    struct stat st;
+    if (0 != fstat (out->fd, &st)) {
+        gf_error (error, "stat '%s' error: %s", out->fileName, strerror (errno));
+        return false;
+    }
+
+    if (!(out->index = compress_index_open (out->fileName, 0 == st.st_size, error))) {
+        return false;
+    }
+
+    // whatever is past the last recorded frame was being written when the last attempt stopped
+    out->tail = out->index->tail;
+    if (st.st_size > out->tail && 0 != ftruncate (out->fd, out->tail)) {
+        gf_error (error, "truncate '%s' error: %s", out->fileName, strerror (errno));
+        return false;
+    }
+    out->compress = level;
+
+    return true;
+}
+
+bool output_finish (Output* out, long long length, GError** error)
+{
+    g_return_val_if_fail (out && out->fd >= 0 && length >= 0, false);
+
+    if (out->compress <= 0) {
+        return true;
+    }
+
+    if (!compress_finish (out->fd, out->fileName, out->index, length, out->compress, error)) {
+        return false;
+    }
+    out->tail = out->index->tail;
+
+    if (length > 0) {
+        logi ("'%s' compressed %lld -> %lld bytes (%.1f%%)", out->fileName, length, out->tail, 100.0 * out->tail / length);
+    }
+
+    return true;
+}
+
+bool output_write (Output* out, long long offset, const void* data, long long len, GError** error)
+{
+    g_return_val_if_fail (out && out->fd >= 0 && data && offset >= 0, false);
+
+    if (out->compress > 0) {
+        return output_compress_write (out, offset, data, len, error);
+    }
+
+    return output_pwrite (out, offset, data, len, error);
+}
+
+static bool output_pwrite (Output* out, long long offset, const void* data, long long len, GError** error)
+{
+    for (long long done = 0; done < len;) {
+        ssize_t w = pwrite (out->fd, (const char*) data + done, len - done, offset + done);
+        if (w < 0) {
+            if (EINTR == errno) continue;
+            if (ENOSPC == errno) {
+                gf_error (error, "disk full while writing '%s' at offset %lld", out->fileName, offset + done);
+            } else {
+                gf_error (error, "fail to write '%s' at offset %lld, error: %s", out->fileName, offset + done, strerror (errno));
+            }
+            return false;
+        }
+        done += w;
+    }
+
+    return true;
+}
+
+OutputStream* output_stream_new (Output* out, long long offset)
+{
+    g_return_val_if_fail (out && offset >= 0, NULL);
+
+    pthread_once (&gRingOnce, output_ring_start);
+
+    OutputStream* s = g_malloc0 (sizeof (OutputStream));
+    if (!s) {
+        return NULL;
+    }
+
+    s->out = out;
+    s->offset = offset;
+    s->flushed = offset;
+    s->start = offset;
+    s->synced = offset;
+    s->dropped = offset;
+
+    return s;
+}
+
+bool output_stream_write (OutputStream* s, const void* data, long long len, GError** error)
+{
+    g_return_val_if_fail (s && data, false);
+
+    g_mutex_lock (&gRing.lock);
+    if (s->error) {
+        if (error) *error = g_error_copy (s->error);
+        g_mutex_unlock (&gRing.lock);
+        return false;
+    }
+    g_mutex_unlock (&gRing.lock);
+
+    for (long long done = 0; done < len;) {
+        int size = 0;
+        char* dst = output_stream_buffer (s, &size, error);
+        if (!dst) {
+            return false;
+        }
+
+        int n = (int) MIN ((long long) size, len - done);
+        memcpy (dst, (const char*) data + done, n);
+        if (!output_stream_commit (s, n, error)) {
+            return false;
+        }
+        done += n;
+    }
+
+    return true;
+}
+
+char* output_stream_buffer (OutputStream* s, int* size, GError** error)
+{
+    g_return_val_if_fail (s && size, NULL);
+
+    // straight into the file, up to the end of the current window
+    Output* out = s->out;
+    if (out->map) {
+        if (s->offset >= out->mapLength) {
+            gf_error (error, "write past the end of '%s' at offset %lld", out->fileName, s->offset);
+            return NULL;
+        }
+        *size = (int) MIN (OUTPUT_MMAP_WINDOW - s->offset % OUTPUT_MMAP_WINDOW, out->mapLength - s->offset);
+        return out->map + s->offset;
+    }
+
+    g_mutex_lock (&gRing.lock);
+    if (s->error) {
+        if (error) *error = g_error_copy (s->error);
+        g_mutex_unlock (&gRing.lock);
+        return NULL;
+    }
+    g_mutex_unlock (&gRing.lock);
+
+    if (!s->cur && !(s->cur = output_buffer_get (s))) {
+        gf_error (error, "malloc output buffer error");
+        return NULL;
+    }
+    *size = s->cur->cap - s->cur->len;
+
+    return s->cur->data + s->cur->len;
+}
+
+bool output_stream_commit (OutputStream* s, int len, GError** error)
+{
+    g_return_val_if_fail (s && len >= 0, false);
+
+    if (s->out->map) {
+        s->offset += len;
+        if (s->offset - s->flushed >= OUTPUT_MMAP_WINDOW || s->offset == s->out->mapLength) {
+            output_map_flush (s, s->offset);
+        }
+        return true;
+    }
+
+    OutputBuffer* b = s->cur;
+    g_return_val_if_fail (b && b->len + len <= b->cap, false);
+
+    b->len += len;
+    s->offset += len;
+    if (b->len == b->cap) {
+        s->cur = NULL;
+        output_buffer_submit (b);
+    }
+
+    return true;
+}
+
+bool output_stream_close (OutputStream* s, GError** error)
+{
+    g_return_val_if_fail (s, false);
+
+    if (s->out->map && s->offset > s->flushed) {
+        output_map_flush (s, s->offset);
+    }
+
+    // an empty buffer goes through the queue as well, it is only handed back there
+    if (s->cur) {
+        output_buffer_submit (s->cur);
+        s->cur = NULL;
+    }
+
+    g_mutex_lock (&gRing.lock);
+    while (s->pending > 0 || s->syncing) {
+        g_cond_wait (&gRing.done, &gRing.lock);
+    }
+    g_mutex_unlock (&gRing.lock);
+
+    // the tail is not a whole window, it is written out and dropped here
+    if (s->out->writeback > 0 && !s->out->map && s->out->compress <= 0 && !s->error && s->offset > s->dropped) {
+        output_writeback (s->out->fd, s->dropped, s->synced, s->offset, true);
+    }
+
+    bool ret = !s->error;
+    if (s->error) {
+        if (error) {
+            if (*error) g_error_free (*error);
+            *error = s->error;
+        } else {
+            g_error_free (s->error);
+        }
+    }
+    g_free (s);
+
+    return ret;
+}
+
+void output_set_device_limits (int writers, int depth)
+{
+    pthread_once (&gRingOnce, output_ring_start);
+
+    g_mutex_lock (&gRing.lock);
+    if (writers > 0)    gRing.deviceWriters = writers;
+    if (depth > 0)      gRing.deviceDepth = depth;
+    g_cond_broadcast (&gRing.notEmpty);
+    g_cond_broadcast (&gRing.notFull);
+    g_mutex_unlock (&gRing.lock);
+}
+
+OutputDeviceStats* output_device_stats (int* count)
+{
+    g_return_val_if_fail (count, NULL);
+
+    pthread_once (&gRingOnce, output_ring_start);
+
+    g_mutex_lock (&gRing.lock);
+    *count = (int) g_list_length (gRing.devices);
+    OutputDeviceStats* stats = g_malloc0 (sizeof (OutputDeviceStats) * MAX (*count, 1));
+    int i = 0;
+    for (GList* l = gRing.devices; NULL != l && stats; l = l->next, ++i) {
+        OutputDevice* d = l->data;
+        stats[i] = d->stats;
+        stats[i].inUse = d->inUse;
+        stats[i].queued = d->queued;
+        stats[i].writing = d->writing;
+        stats[i].depth = gRing.deviceDepth;
+        stats[i].writers = gRing.deviceWriters;
+    }
+    g_mutex_unlock (&gRing.lock);
+
+    if (!stats) *count = 0;
+
+    return stats;
+}
+
+void output_ring_stats (OutputRingStats* stats)
+{
+    g_return_if_fail (stats);
+
+    pthread_once (&gRingOnce, output_ring_start);
+
+    g_mutex_lock (&gRing.lock);
+    *stats = gRing.stats;
+    stats->queued = g_list_length (gRing.queued);
+    g_mutex_unlock (&gRing.lock);
+}
+
+static void output_ring_start (void)
+{
+    g_mutex_init (&gRing.lock);
+    g_cond_init (&gRing.notEmpty);
+    g_cond_init (&gRing.notFull);
+    g_cond_init (&gRing.done);
+    gRing.stats.capacity = OUTPUT_RING_BUFFERS;
+    gRing.deviceWriters = OUTPUT_DEVICE_WRITERS;
+    gRing.deviceDepth = OUTPUT_DEVICE_DEPTH;
+
+    for (int i = 0; i < OUTPUT_RING_WRITERS; ++i) {
+        pthread_t tid;
+        if (0 == pthread_create (&tid, NULL, output_ring_writer, NULL)) {
+            pthread_detach (tid);
+        } else {
+            loge ("create output writer error: %s", strerror (errno));
+        }
+    }
+}
+
+/**
+ * @brief 文件所在的设备, 第一次见到时登记
+ */
+static OutputDevice* output_device_get (int fd, const char* fileName)
+{
+    struct stat st;
+    dev_t dev = (0 == fstat (fd, &st)) ? st.st_dev : 0;
+
+    pthread_once (&gRingOnce, output_ring_start);
+
+    g_mutex_lock (&gRing.lock);
+    OutputDevice* d = NULL;
+    for (GList* l = gRing.devices; NULL != l && !d; l = l->next) {
+        if (((OutputDevice*) l->data)->dev == dev) {
+            d = l->data;
+        }
+    }
+    if (!d && (d = g_malloc0 (sizeof (OutputDevice)))) {
+        g_autofree char* dir = g_path_get_dirname (fileName);
+        d->dev = dev;
+        d->stats.dev = dev;
+        gf_strlcpy (d->stats.path, dir, sizeof (d->stats.path));
+        gRing.devices = g_list_append (gRing.devices, d);
+    }
+    g_mutex_unlock (&gRing.lock);
+
+    return d;
+}
+
+/**
+ * @brief 文件和别的路径共享 inode 时(存储里的硬链接), 先换成只属于它的一份
+ *
+ * 要清空的直接删掉重建; 要原地修改的先 reflink 或 copy_file_range 到临时文件, 再 rename 替换
+ */
+static bool output_unshare (const char* fileName, bool truncate, GError** error)
+{
+    struct stat st;
+    if (0 != stat (fileName, &st) || !S_ISREG (st.st_mode) || st.st_nlink <= 1) {
+        return true;
+    }
+
+    if (truncate) {
+        if (0 != unlink (fileName) && ENOENT != errno) {
+            gf_error (error, "unlink '%s' error: %s", fileName, strerror (errno));
+            return false;
+        }
+        return true;
+    }
+
+    static int serial = 0;
+    g_autofree char* tmp = g_strdup_printf ("%s.%d.%d.unshare", fileName, getpid (), __atomic_add_fetch (&serial, 1, __ATOMIC_RELAXED));
+    int in = open (fileName, O_RDONLY | O_CLOEXEC);
+    int out = (in >= 0) ? open (tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, (st.st_mode & 0777) | 0200) : -1;
+    bool ok = out >= 0;
+
+#ifdef FICLONE
+    bool cloned = ok && 0 == ioctl (out, FICLONE, in);
+#else
+    bool cloned = false;
+#endif
+    for (long long done = 0; ok && !cloned && done < st.st_size;) {
+        ssize_t n = copy_file_range (in, NULL, out, NULL, st.st_size - done, 0);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        ok = n > 0;
+        done += n;
+    }
+
+    int err = errno;
+    if (out >= 0 && 0 != close (out) && ok) {
+        err = errno;
+        ok = false;
+    }
+    if (in >= 0)    close (in);
+    if (ok && 0 != rename (tmp, fileName)) {
+        err = errno;
+        ok = false;
+    }
+    if (!ok) {
+        if (out >= 0)   unlink (tmp);
+        gf_error (error, "copy hard link '%s' before writing error: %s", fileName, strerror (err));
+        return false;
+    }
+    logi ("'%s' was a hard link, %s it before writing", fileName, cloned ? "cloned" : "copied");
+
+    return true;
+}
+
+/**
+ * @brief 取一个空闲的缓冲区, 没有时等待; 缓冲区在第一次用到时才分配
+ *
+ * 文件所在的设备已经占满 deviceDepth 个缓冲区时也等待, 其它设备的写流不受影响
+ */
+static OutputBuffer* output_buffer_get (OutputStream* s)
+{
+    OutputBuffer* b = NULL;
+    OutputDevice* d = s->out->device;
+
+    g_mutex_lock (&gRing.lock);
+    bool full = !gRing.free && gRing.allocated >= OUTPUT_RING_BUFFERS;
+    bool deep = d && d->inUse >= gRing.deviceDepth;
+    if (full || deep) {
+        if (full)   ++gRing.stats.waits;
+        if (deep)   ++d->stats.waits;
+        while ((!gRing.free && gRing.allocated >= OUTPUT_RING_BUFFERS) || (d && d->inUse >= gRing.deviceDepth)) {
+            g_cond_wait (&gRing.notFull, &gRing.lock);
+        }
+    }
+
+    if (gRing.free) {
+        b = gRing.free->data;
+        gRing.free = g_list_delete_link (gRing.free, gRing.free);
+    } else if ((b = g_malloc0 (sizeof (OutputBuffer)))) {
+        if ((b->data = g_malloc (OUTPUT_BUFFER_SIZE))) {
+            ++gRing.allocated;
+        } else {
+            g_free (b);
+            b = NULL;
+        }
+    }
+
+    if (b) {
+        gRing.stats.inUse++;
+        gRing.stats.highWater = MAX (gRing.stats.highWater, gRing.stats.inUse);
+        if (d) d->inUse++;
+    }
+    g_mutex_unlock (&gRing.lock);
+
+    if (b) {
+        // end on a buffer boundary, so the following buffers are aligned
+        b->stream = s;
+        b->offset = s->offset;
+        b->len = 0;
+        b->cap = OUTPUT_BUFFER_SIZE - (int) (s->offset % OUTPUT_BUFFER_SIZE);
+    }
+
+    return b;
+}
+
+/**
+ * @brief 映射模式: 把 [flushed, end) 交给内核回写, 并释放这段内存, 常驻内存不会随文件增长
+ */
+static void output_map_flush (OutputStream* s, long long end)
+{
+    long long page = sysconf (_SC_PAGESIZE);
+    long long start = s->flushed & ~(page - 1);
+    long long stop = MIN ((end + page - 1) & ~(page - 1), s->out->mapLength);
+
+    if (stop > start) {
+        msync (s->out->map + start, stop - start, MS_ASYNC);
+        madvise (s->out->map + start, stop - start, MADV_DONTNEED);
+    }
+    s->flushed = end;
+}
+
+/**
+ * @brief 压缩成帧, 在文件末尾占好位置写进去, 写完再记到索引里, 中断时索引里不会有写了一半的帧
+ */
+static bool output_compress_write (Output* out, long long offset, const void* data, long long len, GError** error)
+{
+    for (long long done = 0; done < len;) {
+        int n = (int) MIN ((long long) COMPRESS_FRAME_MAX, len - done);
+        const char* frame = NULL;
+        int size = compress_frame (out->compress, (const char*) data + done, n, &frame, error);
+        if (size < 0) {
+            return false;
+        }
+
+        CompressFrame f = { offset + done, __atomic_fetch_add (&out->tail, size, __ATOMIC_RELAXED), n, size };
+        if (!output_pwrite (out, f.at, frame, size, error) || !compress_index_add (out->index, &f, error)) {
+            return false;
+        }
+        done += n;
+    }
+
+    return true;
+}
+
+/**
+ * @brief 回写模式: 开始回写 [syncFrom, syncTo), 等 [dropFrom, syncFrom) 写到磁盘后把它从页缓存丢掉
+ *
+ * 前一个窗口在后一个窗口写满时才等, 磁盘和网络一直都有事做
+ * @param wait 为 true 时 [syncFrom, syncTo) 也等写完并丢掉
+ */
+static void output_writeback (int fd, long long dropFrom, long long syncFrom, long long syncTo, bool wait)
+{
+    if (syncTo > syncFrom) {
+        sync_file_range (fd, syncFrom, syncTo - syncFrom, SYNC_FILE_RANGE_WRITE);
+    }
+
+    long long dropTo = wait ? syncTo : syncFrom;
+    if (dropTo > dropFrom) {
+        // pages still dirty are skipped by DONTNEED, so they are waited for first
+        sync_file_range (fd, dropFrom, dropTo - dropFrom, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise (fd, dropFrom, dropTo - dropFrom, POSIX_FADV_DONTNEED);
+    }
+}
+
+static void output_buffer_submit (OutputBuffer* b)
+{
+    g_mutex_lock (&gRing.lock);
+    b->stream->pending++;
+    if (b->stream->out->device) b->stream->out->device->queued++;
+    gRing.queued = g_list_append (gRing.queued, b);
+    g_cond_signal (&gRing.notEmpty);
+    g_mutex_unlock (&gRing.lock);
+}
+
+/**
+ * @brief 最早提交的、所在设备还没有 deviceWriters 个线程在写的缓冲区
+ */
+static GList* output_ring_next (void)
+{
+    for (GList* l = gRing.queued; NULL != l; l = l->next) {
+        OutputDevice* d = ((OutputBuffer*) l->data)->stream->out->device;
+        if (!d || d->writing < gRing.deviceWriters) {
+            return l;
+        }
+    }
+
+    return NULL;
+}
+
+static void* output_ring_writer (void* arg)
+{
+    OutputBuffer* run[OUTPUT_COALESCE_MAX];
+    struct iovec iov[OUTPUT_COALESCE_MAX];
+
+    for (;;) {
+        g_mutex_lock (&gRing.lock);
+        GList* next = NULL;
+        while (!(next = output_ring_next ())) {
+            g_cond_wait (&gRing.notEmpty, &gRing.lock);
+        }
+
+        // take the oldest buffer of a device with a free writer, and whatever continues it in the same file
+        int n = 0;
+        run[n++] = next->data;
+        GList* from = next->next;
+        gRing.queued = g_list_delete_link (gRing.queued, next);
+        long long end = run[0]->offset + run[0]->len;
+        for (GList* l = from; NULL != l && n < OUTPUT_COALESCE_MAX;) {
+            OutputBuffer* b = l->data;
+            if (b->stream->out->fd == run[0]->stream->out->fd && b->offset == end) {
+                run[n++] = b;
+                end += b->len;
+                GList* following = l->next;
+                gRing.queued = g_list_delete_link (gRing.queued, l);
+                l = following;
+                continue;
+            }
+            l = l->next;
+        }
+        OutputDevice* device = run[0]->stream->out->device;
+        if (device) {
+            device->queued -= n;
+            device->writing++;
+        }
+        g_mutex_unlock (&gRing.lock);
+
+        long long total = 0;
+        for (int i = 0; i < n; ++i) {
+            iov[i].iov_base = run[i]->data;
+            iov[i].iov_len = run[i]->len;
+            total += run[i]->len;
+        }
+
+        // a short or failed pwritev is finished buffer by buffer, which also gives the error;
+        // compressed buffers always go one by one, every one becomes a frame on this thread
+        g_autoptr (GError) error = NULL;
+        double t0 = gf_gettime ();
+        ssize_t w = run[0]->stream->out->compress > 0 ? -1 : pwritev (run[0]->stream->out->fd, iov, n, run[0]->offset);
+        if (w != total) {
+            for (int i = 0; i < n && !error; ++i) {
+                output_write (run[i]->stream->out, run[i]->offset, run[i]->data, run[i]->len, &error);
+            }
+        }
+        double latency = gf_gettime () - t0;
+
+        // at most one window of one stream is synced per run, by whichever writer completes it
+        OutputStream* sync = NULL;
+        int syncFd = -1;
+        long long dropFrom = 0, syncFrom = 0, syncTo = 0;
+
+        g_mutex_lock (&gRing.lock);
+        gRing.stats.writes++;
+        gRing.stats.buffers += n;
+        gRing.stats.bytes += total;
+        if (device) {
+            device->writing--;
+            device->inUse -= n;
+            device->stats.writes++;
+            device->stats.bytes += total;
+            device->stats.busy += latency;
+            device->stats.maxLatency = MAX (device->stats.maxLatency, latency);
+        }
+        for (int i = 0; i < n; ++i) {
+            OutputStream* s = run[i]->stream;
+            if (error && !s->error) {
+                s->error = g_error_copy (error);
+            }
+            s->written += run[i]->len;
+            s->pending--;
+            gRing.stats.inUse--;
+            gRing.free = g_list_prepend (gRing.free, run[i]);
+
+            // buffers of a stream may finish out of order, a page still being written is caught by the next wait
+            long long window = s->out->compress > 0 ? 0 : s->out->writeback;
+            long long end = (window > 0) ? (s->start + s->written) / window * window : 0;
+            if (!sync && !s->syncing && !s->error && end > s->synced) {
+                sync = s;
+                syncFd = s->out->fd;
+                dropFrom = s->dropped;
+                syncFrom = s->synced;
+                syncTo = end;
+                s->syncing = true;
+                s->dropped = s->synced;
+                s->synced = end;
+            }
+        }
+        g_cond_broadcast (&gRing.notFull);
+        g_cond_broadcast (&gRing.done);
+
+        // buffers of this device may have been skipped while its writers were busy
+        if (gRing.queued) {
+            g_cond_signal (&gRing.notEmpty);
+        }
+        g_mutex_unlock (&gRing.lock);
+
+        if (sync) {
+            output_writeback (syncFd, dropFrom, syncFrom, syncTo, false);
+
+            g_mutex_lock (&gRing.lock);
+            sync->syncing = false;
+            g_cond_broadcast (&gRing.done);
+            g_mutex_unlock (&gRing.lock);
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,188 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#include "compress.h"
+
+#define OUTPUT_BUFFER_SIZE          (1 << 20)       // 写缓冲区大小, 缓冲区按它对齐
+#define OUTPUT_RING_BUFFERS         32              // 缓冲区总数, 都被占用时写数据的线程等待
+#define OUTPUT_RING_WRITERS         4               // 写磁盘的线程数
+#define OUTPUT_DEVICE_WRITERS       2               // 同时写一个设备的线程数上限
+#define OUTPUT_DEVICE_DEPTH         16              // 一个设备最多占用的缓冲区数
+#define OUTPUT_COALESCE_MAX         16              // 一次 pwritev 最多合并的缓冲区数
+#define OUTPUT_MMAP_WINDOW          (32 << 20)      // 映射模式下每写满这么多就交给内核回写并释放内存
+#define OUTPUT_WRITEBACK_WINDOW     (8 << 20)       // 回写模式下每个写流按这个大小分窗口回写和释放页缓存
+
+typedef struct _Output              Output;
+typedef struct _OutputStream        OutputStream;
+typedef struct _OutputRingStats     OutputRingStats;
+typedef struct _OutputDevice        OutputDevice;
+typedef struct _OutputDeviceStats   OutputDeviceStats;
+
+/**
+ * @brief 下载的输出文件
+ *
+ * 数据按文件中的偏移用 pwrite 写入, 多个线程可以同时写同一个 Output
+ */
+struct _Output
+{
+    char                   *fileName;
+    int                     fd;
+    long long               reserved;               // 已经预分配的长度
+    bool                    allocated;              // reserved 的空间是真正分配的, 不是稀疏文件
+
+    char                   *map;                    // output_map() 之后整个文件的映射
+    long long               mapLength;
+
+    long long               writeback;              // 回写窗口大小, 0 表示交给内核自己决定何时回写
+
+    int                     compress;               // zstd 压缩级别, 0 表示不压缩
+    CompressIndex          *index;                  // 压缩时的定位索引
+    long long               tail;                   // 压缩时下一帧写在文件的这里
+
+    OutputDevice           *device;                 // 文件所在的块设备, 写缓冲按设备分配和调度
+};
+
+/**
+ * @brief 写缓冲环的统计
+ */
+struct _OutputRingStats
+{
+    int                     capacity;               // 缓冲区总数
+    int                     inUse;                  // 正在填充、等待写入或正在写入的缓冲区
+    int                     queued;                 // 等待写入的缓冲区
+    int                     highWater;              // inUse 的最大值
+    guint64                 waits;                  // 没有空闲缓冲区, 网络线程等待的次数
+    guint64                 writes;                 // pwritev 次数
+    guint64                 buffers;                // 写入的缓冲区数, 除以 writes 是平均每次合并的个数
+    guint64                 bytes;
+};
+
+/**
+ * @brief 一个块设备(st_dev)上的写入统计
+ */
+struct _OutputDeviceStats
+{
+    guint64                 dev;                    // st_dev
+    char                    path[256];              // 第一个写到这个设备的文件所在的目录
+    int                     inUse;                  // 这个设备占用的缓冲区
+    int                     queued;                 // 其中等待写入的
+    int                     writing;                // 正在写这个设备的线程
+    int                     depth;                  // 缓冲区上限
+    int                     writers;                // 线程上限
+    guint64                 waits;                  // 网络线程因为这个设备的缓冲区用完而等待的次数
+    guint64                 writes;
+    guint64                 bytes;
+    double                  busy;                   // 写入花的时间, 秒
+    double                  maxLatency;             // 最慢的一次写入, 秒
+};
+
+/**
+ * @brief 打开或创建输出文件
+ *
+ * 文件是硬链接(例如存储里的对象)时先换成自己的一份, 写入不会改到共享 inode 的其它路径
+ * @param truncate 为 true 时清空已有的内容
+ */
+Output*     output_open     (const char* fileName, bool truncate, GError** error);
+void        output_close    (Output* out);
+
+/**
+ * @brief 预先分配 length 字节的磁盘空间
+ *
+ * 先检查磁盘剩余空间, 不够时直接失败; 文件系统不支持 fallocate 时只设置文件大小(稀疏文件)
+ */
+bool        output_reserve  (Output* out, long long length, GError** error);
+
+/**
+ * @brief 把预分配的整个文件映射到内存, 之后写流直接把数据放进映射区, 不经过 write()
+ *
+ * 稀疏文件在磁盘写满时访问映射区会收到 SIGBUS, 所以只有 output_reserve() 真正分配了空间时才能映射
+ */
+bool        output_map      (Output* out, GError** error);
+
+/**
+ * @brief 写流按 window 大小的窗口主动回写: 写满一个窗口就用 sync_file_range 开始回写它,
+ *        同时等上一个窗口写到磁盘后用 posix_fadvise(DONTNEED) 把它从页缓存里丢掉
+ *
+ * 每个写流的脏页大约不超过两个窗口, 下载很大的文件时不会把页缓存塞满脏页后一起刷盘;
+ * 代价是写线程会等磁盘。映射模式有自己的 msync/madvise, 不受影响。
+ * @param window 窗口大小, 0 关闭
+ */
+void        output_set_writeback    (Output* out, long long window);
+
+/**
+ * @brief 压缩写入: 数据在写线程上按 COMPRESS_FRAME_MAX 压缩成独立的 zstd 帧, 追加到文件里,
+ *        每一帧的位置记在 "<文件>.idx"
+ *
+ * 这之后的偏移都是解压后的偏移; 文件是空的时候清空索引, 否则接着已有的索引续传。
+ * 压缩时不预分配空间, 不能映射, 也不做窗口回写; 下载完要调用 output_finish()
+ * @param level zstd 压缩级别
+ */
+bool        output_set_compress     (Output* out, int level, GError** error);
+
+/**
+ * @brief 文件的 [0, length) 已经全部写完; 压缩时把帧按顺序重排, 之后是普通的多帧 zstd 文件
+ */
+bool        output_finish   (Output* out, long long length, GError** error);
+
+/**
+ * @brief 把数据写到文件的 offset 处, 处理被信号打断和部分写入; 压缩时压缩成帧追加
+ */
+bool        output_write    (Output* out, long long offset, const void* data, long long len, GError** error);
+
+/**
+ * @brief 从 offset 开始顺序写入的后台写流
+ *
+ * 数据先拷贝到大的缓冲区, 缓冲区满了交给写线程, 写线程把相邻的缓冲区合并成一次 pwritev;
+ * 只有所有缓冲区都被占用时 output_stream_write() 才会等待。
+ * Output 已经映射时数据直接放进映射区, 每写满 OUTPUT_MMAP_WINDOW 就 msync 并 madvise 释放这段内存。
+ * 设置了回写窗口时, 写线程写完一个窗口就开始回写它, 关闭写流时等剩下的数据写到磁盘并释放页缓存。
+ * 关闭 Output 之前要先关闭它上面所有的写流。
+ */
+OutputStream*   output_stream_new       (Output* out, long long offset);
+
+/**
+ * @brief 写入数据, 之前的后台写入出错时返回 false
+ */
+bool            output_stream_write     (OutputStream* s, const void* data, long long len, GError** error);
+
+/**
+ * @brief 取得下一段数据应该放的位置, 接收数据时直接读到这里可以省掉一次拷贝
+ * @param size 返回最多能放的字节数
+ * @return 之前的后台写入出错时返回 NULL
+ */
+char*           output_stream_buffer    (OutputStream* s, int* size, GError** error);
+
+/**
+ * @brief 确认 output_stream_buffer() 返回的位置已经放了 len 字节
+ */
+bool            output_stream_commit    (OutputStream* s, int len, GError** error);
+
+/**
+ * @brief 提交剩下的数据, 等这个流的数据全部写到文件后释放
+ * @return 有任何一次写入失败返回 false
+ */
+bool            output_stream_close     (OutputStream* s, GError** error);
+
+void            output_ring_stats       (OutputRingStats* stats);
+
+/**
+ * @brief 每个设备的并发写线程数和缓冲区数上限, 对已有的和以后的设备都生效
+ *
+ * 写线程按提交顺序取缓冲区, 但跳过已经有 writers 个线程在写的设备;
+ * 一个设备占用 depth 个缓冲区后只有写这个设备的网络线程等待, 慢盘不会占满整个写缓冲环,
+ * 拖住写其它盘的下载。
+ * @param writers 小于等于 0 不变
+ * @param depth 小于等于 0 不变
+ */
+void            output_set_device_limits    (int writers, int depth);
+
+/**
+ * @brief 所有用到过的设备的统计
+ * @return OutputDeviceStats 数组, 用 g_free() 释放
+ */
+OutputDeviceStats*  output_device_stats     (int* count);
+
+#endif // OUTPUT_H
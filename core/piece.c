@@ -0,0 +1,496 @@
+#include "piece.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "log.h"
+#include "utils.h"
+#include "http-range.h"
+#include "thread-pool.h"
+
+typedef struct _PieceStateHeader    PieceStateHeader;
+typedef struct _PieceJob            PieceJob;
+
+/**
+ * @brief "<文件>.st" 的开头, 后面是 count 字节的状态和 count 个叶子哈希
+ */
+struct _PieceStateHeader
+{
+    char                    magic[8];
+    gint64                  length;
+    gint64                  pieceSize;
+    gint32                  count;
+    gint32                  reserved;
+    guchar                  fingerprint[PIECE_HASH_SIZE];
+};
+
+/**
+ * @brief 一轮并行校验, 线程从 todo 里依次领取块
+ */
+struct _PieceJob
+{
+    PieceSet*               ps;
+    int                     fd;
+    int*                    todo;
+    int                     todoCount;
+    int                     next;
+    int                     workers;                // 真正领到过块的线程数
+    int                     failed;                 // 读文件出错的 errno
+};
+
+static void* piece_worker (void* arg);
+static bool piece_hash (int fd, long long offset, long long len, EVP_MD_CTX* ctx, char* buf, guchar out[PIECE_HASH_SIZE]);
+static void piece_store (PieceSet* ps, int i, PieceState state);
+static bool piece_parse_hash (const char* hex, guchar out[PIECE_HASH_SIZE]);
+static bool piece_parse_list (PieceSet* ps, const char* path, GError** error);
+
+
+PieceSet* piece_set_new (const char* spec, GError** error)
+{
+    g_return_val_if_fail (spec, NULL);
+
+    PieceSet* ps = g_malloc0 (sizeof (PieceSet));
+    if (!ps) {
+        gf_error (error, "malloc piece set error");
+        return NULL;
+    }
+    ps->stateFd = -1;
+
+    // "<piece size>:<merkle root>", anything else is the path of a piece list
+    char* end = NULL;
+    long long size = g_ascii_strtoll (spec, &end, 10);
+    if (end != spec && ':' == *end) {
+        ps->pieceSize = size;
+        ps->hasRoot = piece_parse_hash (end + 1, ps->root);
+        if (!ps->hasRoot) {
+            gf_error (error, "merkle root must be %d hex digits: '%s'", PIECE_HASH_SIZE * 2, end + 1);
+            goto error;
+        }
+    } else if (!piece_parse_list (ps, spec, error)) {
+        goto error;
+    }
+
+    if (ps->pieceSize <= 0) {
+        gf_error (error, "invalid piece size %lld", ps->pieceSize);
+        goto error;
+    }
+
+    // the state on disk is only reused for the same pieces
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new ();
+    gint64 pieceSize = ps->pieceSize;
+    bool ok = ctx && EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL)
+        && EVP_DigestUpdate (ctx, &pieceSize, sizeof (pieceSize))
+        && EVP_DigestUpdate (ctx, ps->root, ps->hasRoot ? PIECE_HASH_SIZE : 0)
+        && EVP_DigestUpdate (ctx, ps->expected, (size_t) ps->expectedCount * PIECE_HASH_SIZE)
+        && EVP_DigestFinal_ex (ctx, ps->fingerprint, NULL);
+    if (ctx) EVP_MD_CTX_free (ctx);
+    if (!ok) {
+        gf_error (error, "sha256 error");
+        goto error;
+    }
+
+    return ps;
+
+error:
+    piece_set_free (ps);
+
+    return NULL;
+}
+
+void piece_set_free (PieceSet* ps)
+{
+    g_return_if_fail (ps);
+
+    if (ps->stateFd >= 0)   close (ps->stateFd);
+    if (ps->expected)       g_free (ps->expected);
+    if (ps->state)          g_free (ps->state);
+    if (ps->actual)         g_free (ps->actual);
+
+    g_free (ps);
+}
+
+bool piece_set_bind (PieceSet* ps, const char* fileName, GError** error)
+{
+    g_return_val_if_fail (ps && fileName && !ps->state, false);
+
+    struct stat st;
+    if (0 != stat (fileName, &st)) {
+        gf_error (error, "stat '%s' error: %s", fileName, strerror (errno));
+        return false;
+    }
+    ps->length = st.st_size;
+    ps->count = (int) ((ps->length + ps->pieceSize - 1) / ps->pieceSize);
+
+    if (ps->expected && ps->expectedCount != ps->count) {
+        gf_error (error, "piece list has %d pieces, '%s' has %d", ps->expectedCount, fileName, ps->count);
+        return false;
+    }
+
+    // a list that does not add up to its own root is no good for finding bad pieces
+    if (ps->expected && ps->hasRoot) {
+        guchar root[PIECE_HASH_SIZE];
+        piece_merkle_root (ps->expected, ps->count, root);
+        if (0 != memcmp (root, ps->root, PIECE_HASH_SIZE)) {
+            gf_error (error, "piece list does not match its merkle root");
+            return false;
+        }
+    }
+
+    ps->state = g_malloc0 (ps->count + 1);
+    ps->actual = g_malloc0 ((size_t) ps->count * PIECE_HASH_SIZE + 1);
+    if (!ps->state || !ps->actual) {
+        gf_error (error, "malloc piece state error");
+        return false;
+    }
+
+    ps->stateFd = stfile_open (fileName, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (ps->stateFd < 0) {
+        gf_error (error, "open state of '%s' error: %s", fileName, strerror (errno));
+        return false;
+    }
+
+    PieceStateHeader h;
+    off_t hashes = sizeof (h) + ps->count;
+    if (sizeof (h) == pread (ps->stateFd, &h, sizeof (h), 0)
+        && 0 == memcmp (h.magic, PIECE_STATE_MAGIC, sizeof (h.magic))
+        && h.length == ps->length && h.pieceSize == ps->pieceSize && h.count == ps->count
+        && 0 == memcmp (h.fingerprint, ps->fingerprint, PIECE_HASH_SIZE)
+        && ps->count == pread (ps->stateFd, ps->state, ps->count, sizeof (h))
+        && (ssize_t) ps->count * PIECE_HASH_SIZE == pread (ps->stateFd, ps->actual, (size_t) ps->count * PIECE_HASH_SIZE, hashes)) {
+        int good = 0;
+        for (int i = 0; i < ps->count; ++i) {
+            if (PIECE_GOOD == ps->state[i]) ++good;
+        }
+        logi ("'%s': %d of %d pieces already verified", fileName, good, ps->count);
+        return true;
+    }
+
+    // no state yet, or it belongs to another file or other pieces
+    memset (&h, 0, sizeof (h));
+    memcpy (h.magic, PIECE_STATE_MAGIC, sizeof (h.magic));
+    h.length = ps->length;
+    h.pieceSize = ps->pieceSize;
+    h.count = ps->count;
+    memcpy (h.fingerprint, ps->fingerprint, PIECE_HASH_SIZE);
+    memset (ps->state, 0, ps->count);
+    if (0 != ftruncate (ps->stateFd, 0) || sizeof (h) != pwrite (ps->stateFd, &h, sizeof (h), 0)
+        || 0 != ftruncate (ps->stateFd, hashes + (off_t) ps->count * PIECE_HASH_SIZE)) {
+        gf_error (error, "write state of '%s' error: %s", fileName, strerror (errno));
+        return false;
+    }
+
+    return true;
+}
+
+int piece_verify (PieceSet* ps, const char* fileName, GError** error)
+{
+    g_return_val_if_fail (ps && ps->state && fileName, -1);
+
+    PieceJob job;
+    memset (&job, 0, sizeof (job));
+    job.ps = ps;
+    job.todo = g_malloc ((ps->count + 1) * sizeof (int));
+    job.fd = open (fileName, O_RDONLY | O_CLOEXEC);
+    if (!job.todo || job.fd < 0) {
+        gf_error (error, "open '%s' error: %s", fileName, strerror (errno));
+        if (job.todo) g_free (job.todo);
+        if (job.fd >= 0) close (job.fd);
+        return -1;
+    }
+    posix_fadvise (job.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (int i = 0; i < ps->count; ++i) {
+        if (PIECE_UNKNOWN == ps->state[i]) {
+            job.todo[job.todoCount++] = i;
+        }
+    }
+
+    // the pieces are independent, every thread takes the next one until none is left;
+    // on a pool thread the helpers are subtasks idle pool threads steal, elsewhere threads of their own
+    long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    int threads = (int) MIN (MIN ((long) PIECE_MAX_THREADS, cpus > 0 ? cpus : 1), (long) job.todoCount);
+    double t0 = gf_gettime ();
+    if (thread_pool_current ()) {
+        thread_group_t group;
+        memset (&group, 0, sizeof (group));
+        for (int i = 1; i < threads; ++i) {
+            if (0 != thread_pool_spawn (&group, piece_worker, &job)) {
+                break;
+            }
+        }
+        piece_worker (&job);
+        thread_pool_wait (&group);
+    } else {
+        pthread_t tids[PIECE_MAX_THREADS];
+        int started = 0;
+        for (; started < threads; ++started) {
+            if (0 != pthread_create (&tids[started], NULL, piece_worker, &job)) {
+                break;
+            }
+        }
+        if (0 == started && job.todoCount > 0) {
+            piece_worker (&job);
+        }
+        for (int i = 0; i < started; ++i) {
+            pthread_join (tids[i], NULL);
+        }
+    }
+    close (job.fd);
+    g_free (job.todo);
+
+    if (job.failed) {
+        gf_error (error, "read '%s' error: %s", fileName, strerror (job.failed));
+        return -1;
+    }
+
+    // with only the root every leaf is needed before anything is known
+    if (!ps->expected) {
+        guchar root[PIECE_HASH_SIZE];
+        piece_merkle_root (ps->actual, ps->count, root);
+        PieceState state = (0 == memcmp (root, ps->root, PIECE_HASH_SIZE)) ? PIECE_GOOD : PIECE_BAD;
+        for (int i = 0; i < ps->count; ++i) {
+            piece_store (ps, i, state);
+        }
+    }
+    fdatasync (ps->stateFd);
+
+    int bad = 0;
+    for (int i = 0; i < ps->count; ++i) {
+        if (PIECE_BAD == ps->state[i]) ++bad;
+    }
+    logi ("'%s': hashed %d of %d pieces in %.2fs on %d thread(s), %d bad",
+          fileName, job.todoCount, ps->count, gf_gettime () - t0, MAX (job.workers, 1), bad);
+
+    return bad;
+}
+
+GList* piece_bad_ranges (const PieceSet* ps)
+{
+    g_return_val_if_fail (ps && ps->state, NULL);
+
+    GList* ranges = NULL;
+    for (int i = 0; i < ps->count; ++i) {
+        if (PIECE_BAD != ps->state[i]) continue;
+
+        HttpByteRange* r = g_malloc (sizeof (HttpByteRange));
+        if (!r) break;
+        r->start = i * ps->pieceSize;
+        r->end = MIN (r->start + ps->pieceSize, ps->length) - 1;
+        ranges = g_list_prepend (ranges, r);
+    }
+
+    return http_range_coalesce (ranges);
+}
+
+void piece_set_refetched (PieceSet* ps)
+{
+    g_return_if_fail (ps && ps->state);
+
+    for (int i = 0; i < ps->count; ++i) {
+        if (PIECE_BAD == ps->state[i]) {
+            piece_store (ps, i, PIECE_UNKNOWN);
+        }
+    }
+}
+
+void piece_state_remove (const char* fileName)
+{
+    g_return_if_fail (fileName);
+
+    stfile_unlink (fileName);
+}
+
+bool piece_state_exists (const char* fileName)
+{
+    g_return_val_if_fail (fileName, false);
+
+    return 0 == stfile_access (fileName, F_OK);
+}
+
+void piece_merkle_root (const guchar* leaves, int count, guchar root[PIECE_HASH_SIZE])
+{
+    g_return_if_fail (root);
+
+    int width = 1;
+    while (width < count) width <<= 1;
+
+    // missing leaves up to the next power of two are zero hashes
+    guchar* level = g_malloc0 ((size_t) width * PIECE_HASH_SIZE);
+    if (!level) {
+        memset (root, 0, PIECE_HASH_SIZE);
+        return;
+    }
+    if (count > 0) {
+        memcpy (level, leaves, (size_t) count * PIECE_HASH_SIZE);
+    }
+
+    for (; width > 1; width >>= 1) {
+        for (int i = 0; i < width / 2; ++i) {
+            EVP_Digest (level + 2 * i * PIECE_HASH_SIZE, 2 * PIECE_HASH_SIZE, level + i * PIECE_HASH_SIZE, NULL, EVP_sha256 (), NULL);
+        }
+    }
+    memcpy (root, level, PIECE_HASH_SIZE);
+    g_free (level);
+}
+
+static void* piece_worker (void* arg)
+{
+    PieceJob* job = arg;
+    PieceSet* ps = job->ps;
+
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new ();
+    char* buf = g_malloc (PIECE_READ_SIZE);
+    if (!ctx || !buf) {
+        __atomic_store_n (&job->failed, ENOMEM, __ATOMIC_RELAXED);
+        goto out;
+    }
+
+    for (bool counted = false;; counted = true) {
+        int n = __atomic_fetch_add (&job->next, 1, __ATOMIC_RELAXED);
+        if (n >= job->todoCount || __atomic_load_n (&job->failed, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (!counted) {
+            __atomic_add_fetch (&job->workers, 1, __ATOMIC_RELAXED);
+        }
+
+        int i = job->todo[n];
+        long long offset = i * ps->pieceSize;
+        guchar* leaf = ps->actual + (size_t) i * PIECE_HASH_SIZE;
+        if (!piece_hash (job->fd, offset, MIN (ps->pieceSize, ps->length - offset), ctx, buf, leaf)) {
+            __atomic_store_n (&job->failed, errno ? errno : EIO, __ATOMIC_RELAXED);
+            break;
+        }
+
+        if (!ps->expected) {
+            piece_store (ps, i, PIECE_HASHED);
+        } else if (0 == memcmp (leaf, ps->expected + (size_t) i * PIECE_HASH_SIZE, PIECE_HASH_SIZE)) {
+            piece_store (ps, i, PIECE_GOOD);
+        } else {
+            logd ("piece %d at %lld is bad", i, offset);
+            piece_store (ps, i, PIECE_BAD);
+        }
+    }
+
+out:
+    if (ctx)    EVP_MD_CTX_free (ctx);
+    if (buf)    g_free (buf);
+
+    return NULL;
+}
+
+static bool piece_hash (int fd, long long offset, long long len, EVP_MD_CTX* ctx, char* buf, guchar out[PIECE_HASH_SIZE])
+{
+    if (!EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL)) {
+        return false;
+    }
+
+    while (len > 0) {
+        ssize_t n = pread (fd, buf, MIN (len, (long long) PIECE_READ_SIZE), offset);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        } else if (n <= 0) {
+            if (0 == n) errno = EIO;
+            return false;
+        }
+        EVP_DigestUpdate (ctx, buf, n);
+        offset += n;
+        len -= n;
+    }
+
+    return EVP_DigestFinal_ex (ctx, out, NULL);
+}
+
+/**
+ * @brief 更新一块的状态并写到 "<文件>.st", 每块只有一个线程写, 不用加锁
+ */
+static void piece_store (PieceSet* ps, int i, PieceState state)
+{
+    ps->state[i] = state;
+    if (ps->stateFd < 0) {
+        return;
+    }
+
+    off_t hashes = sizeof (PieceStateHeader) + ps->count;
+    guchar s = state;
+    if (PIECE_UNKNOWN != state) {
+        pwrite (ps->stateFd, ps->actual + (size_t) i * PIECE_HASH_SIZE, PIECE_HASH_SIZE, hashes + (off_t) i * PIECE_HASH_SIZE);
+    }
+    if (1 != pwrite (ps->stateFd, &s, 1, sizeof (PieceStateHeader) + i)) {
+        logd ("write piece state error: %s", strerror (errno));
+    }
+}
+
+static bool piece_parse_hash (const char* hex, guchar out[PIECE_HASH_SIZE])
+{
+    if (!hex || strlen (hex) != PIECE_HASH_SIZE * 2) {
+        return false;
+    }
+
+    for (int i = 0; i < PIECE_HASH_SIZE; ++i) {
+        int hi = g_ascii_xdigit_value (hex[2 * i]);
+        int lo = g_ascii_xdigit_value (hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = (guchar) (hi << 4 | lo);
+    }
+
+    return true;
+}
+
+static bool piece_parse_list (PieceSet* ps, const char* path, GError** error)
+{
+    char* text = NULL;
+    if (!g_file_get_contents (path, &text, NULL, NULL)) {
+        gf_error (error, "can not read piece list '%s'", path);
+        return false;
+    }
+
+    bool ret = false;
+    int cap = 0;
+    char** lines = g_strsplit (text, "\n", -1);
+    for (int n = 0; lines && lines[n]; ++n) {
+        char* line = g_strstrip (lines[n]);
+        if ('\0' == line[0] || '#' == line[0]) {
+            continue;
+        }
+
+        if (g_str_has_prefix (line, "size ")) {
+            ps->pieceSize = g_ascii_strtoll (line + 5, NULL, 10);
+        } else if (g_str_has_prefix (line, "root ")) {
+            ps->hasRoot = piece_parse_hash (g_strstrip (line + 5), ps->root);
+            if (!ps->hasRoot) {
+                gf_error (error, "%s:%d: bad merkle root", path, n + 1);
+                goto out;
+            }
+        } else {
+            if (ps->expectedCount == cap) {
+                cap = cap ? cap * 2 : 1024;
+                ps->expected = g_realloc (ps->expected, (size_t) cap * PIECE_HASH_SIZE);
+            }
+            if (!piece_parse_hash (line, ps->expected + (size_t) ps->expectedCount * PIECE_HASH_SIZE)) {
+                gf_error (error, "%s:%d: expected %d hex digits", path, n + 1, PIECE_HASH_SIZE * 2);
+                goto out;
+            }
+            ++ps->expectedCount;
+        }
+    }
+
+    if (0 == ps->expectedCount) {
+        gf_error (error, "piece list '%s' has no pieces", path);
+        goto out;
+    }
+    ret = true;
+
+out:
+    if (lines)  g_strfreev (lines);
+    g_free (text);
+
+    return ret;
+}
@@ -0,0 +1,88 @@
+#ifndef PIECE_H
+#define PIECE_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define PIECE_HASH_SIZE             32              // SHA-256
+#define PIECE_MAX_THREADS           8               // 并行校验的线程数上限
+#define PIECE_READ_SIZE             (1 << 20)
+#define PIECE_MAX_ROUNDS            3               // 重新下载坏块的最多轮数
+#define PIECE_STATE_MAGIC           "GDPIECE1"
+
+typedef struct _PieceSet            PieceSet;
+typedef enum _PieceState            PieceState;
+
+enum _PieceState
+{
+    PIECE_UNKNOWN = 0,                  // 还没有校验
+    PIECE_GOOD,
+    PIECE_BAD,
+    PIECE_HASHED,                       // 只有根哈希时: 算好了叶子哈希, 要等整棵树算完才知道对错
+};
+
+/**
+ * @brief 按固定大小分块校验的文件
+ *
+ * 每块的 SHA-256 是 Merkle 树的叶子, 叶子数补齐到 2 的幂(补零哈希), 父节点是 SHA-256(左 || 右)。
+ * 有每块的哈希列表时只重新下载出错的块; 只有根哈希时无法定位, 根不一致就所有块都算坏块。
+ * 校验状态保存在 "<文件>.st", 中断后重新校验时跳过已经校验通过的块。
+ */
+struct _PieceSet
+{
+    long long               pieceSize;
+    long long               length;                 // 文件长度, piece_set_bind() 之后有效
+    int                     count;
+
+    guchar                 *expected;               // count 个期望的叶子哈希, 只有根哈希时为空
+    int                     expectedCount;
+    guchar                  root[PIECE_HASH_SIZE];
+    bool                    hasRoot;
+    guchar                  fingerprint[PIECE_HASH_SIZE];   // 参数的哈希, 参数变了以前的校验状态作废
+
+    guchar                 *state;                  // 每块一个 PieceState
+    guchar                 *actual;                 // 每块计算出的叶子哈希
+    int                     stateFd;                // "<文件>.st", 每校验完一块就写入它的状态
+};
+
+/**
+ * @brief 解析分块校验参数
+ * @param spec "<块大小>:<Merkle 根>" 或者块哈希列表文件的路径, 列表文件格式:
+ *             "size <块大小>", 可选的 "root <十六进制>", 然后每行一个块的 SHA-256
+ */
+PieceSet*   piece_set_new       (const char* spec, GError** error);
+void        piece_set_free      (PieceSet* ps);
+
+/**
+ * @brief 对应到下载好的文件, 读取 "<文件>.st" 中和这些参数一致的校验状态
+ */
+bool        piece_set_bind      (PieceSet* ps, const char* fileName, GError** error);
+
+/**
+ * @brief 用多个线程并行校验状态是 PIECE_UNKNOWN 的块, 已知的坏块要先 piece_set_refetched()
+ * @return 坏块的个数, 出错返回 -1
+ */
+int         piece_verify        (PieceSet* ps, const char* fileName, GError** error);
+
+/**
+ * @brief 坏块的字节范围, HttpByteRange 列表, 用 g_list_free_full (ls, g_free) 释放
+ */
+GList*      piece_bad_ranges    (const PieceSet* ps);
+
+/**
+ * @brief 块被重新下载, 之后要重新校验
+ */
+void        piece_set_refetched (PieceSet* ps);
+
+/**
+ * @brief 删除文件的校验状态
+ */
+void        piece_state_remove  (const char* fileName);
+bool        piece_state_exists  (const char* fileName);
+
+/**
+ * @brief 计算叶子哈希的 Merkle 根
+ */
+void        piece_merkle_root   (const guchar* leaves, int count, guchar root[PIECE_HASH_SIZE]);
+
+#endif // PIECE_H
@@ -0,0 +1,148 @@
+#include "pool-tuner.h"
+
+#include "log.h"
+#include "http.h"
+#include "thread-pool.h"
+#include "download-queue.h"
+#include "download-manager.h"
+
+/**
+ * @brief 控制器的状态, 上下限可能在命令行线程里修改, 都由 lock 保护
+ */
+typedef struct
+{
+    GMutex                  lock;
+    guint                   source;
+
+    int                     min;
+    int                     max;
+
+    guint64                 bytes;                  // 上次采样时的 http_body_bytes()
+    gint64                  time;                   // 上次采样的单调时间, 微秒
+
+    double                  before;                 // 上次加线程之前的总速度, 小于 0 表示没有在试探
+    int                     grown;                  // 上次加的线程数
+    int                     settle;                 // 调整后跳过几次采样, 新线程和新连接要时间爬坡
+    int                     hold;                   // 还要等几次采样才能再加线程
+    int                     idle;                   // 连续有空闲线程的采样次数
+    int                     idleMin;                // 这期间最少的空闲线程数
+} PoolTuner;
+
+static PoolTuner gTuner;
+
+static gboolean pool_tuner_tick (void* unused);
+static void pool_tuner_resize (int from, int to, const char* why, double rate, int waiting, int active);
+
+
+void pool_tuner_start (int min, int max)
+{
+    g_mutex_lock (&gTuner.lock);
+    gTuner.min = (min > 0) ? min : POOL_TUNER_MIN_DEFAULT;
+    gTuner.max = (max > 0) ? max : POOL_TUNER_MAX_DEFAULT;
+    gTuner.max = MIN (MAX (gTuner.max, gTuner.min), THREAD_POOL_MAX_THREADS);
+    gTuner.min = MIN (gTuner.min, gTuner.max);
+    logi ("pool: %d to %d threads", gTuner.min, gTuner.max);
+
+    if (!gTuner.source) {
+        gTuner.bytes = http_body_bytes ();
+        gTuner.time = g_get_monotonic_time ();
+        gTuner.before = -1;
+        gTuner.source = g_timeout_add_seconds (POOL_TUNER_INTERVAL, pool_tuner_tick, NULL);
+    }
+    g_mutex_unlock (&gTuner.lock);
+}
+
+void pool_tuner_stop (void)
+{
+    g_mutex_lock (&gTuner.lock);
+    if (gTuner.source) {
+        g_source_remove (gTuner.source);
+        gTuner.source = 0;
+    }
+    g_mutex_unlock (&gTuner.lock);
+}
+
+static gboolean pool_tuner_tick (void* unused)
+{
+    thread_pool_stats_t stats;
+    thread_pool_stats (&stats);
+    int waiting = download_queue_length ();
+    int active = download_active ();
+
+    g_mutex_lock (&gTuner.lock);
+    guint64 bytes = http_body_bytes ();
+    gint64 now = g_get_monotonic_time ();
+    double rate = (now > gTuner.time) ? (bytes - gTuner.bytes) * 1e6 / (now - gTuner.time) : 0;
+    gTuner.bytes = bytes;
+    gTuner.time = now;
+
+    int size = stats.target;
+    int next = size;
+    const char* why = NULL;
+
+    if (size < gTuner.min || size > gTuner.max) {
+        // the limits changed
+        next = MIN (MAX (size, gTuner.min), gTuner.max);
+        why = "limits";
+        gTuner.before = -1;
+    } else if (gTuner.settle > 0) {
+        gTuner.settle--;
+    } else if (gTuner.before >= 0) {
+        // judge the last step by what it added, a plateau means the link or the servers are the limit;
+        // with nothing left waiting the work simply ran out, idle threads retire below
+        if (0 == waiting) {
+            logi ("pool: %d threads, queue drained", size);
+        } else if (rate > gTuner.before * (1 + POOL_TUNER_GAIN)) {
+            logi ("pool: %d threads, %.1f MiB/s (%+.0f%%), keeping them", size, rate / 1048576,
+                  gTuner.before > 0 ? (rate / gTuner.before - 1) * 100 : 100.0);
+        } else {
+            next = MAX (size - gTuner.grown, gTuner.min);
+            why = "no gain";
+            gTuner.hold = POOL_TUNER_HOLD;
+        }
+        gTuner.before = -1;
+    } else if (waiting > 0 && size < gTuner.max && 0 == gTuner.hold) {
+        gTuner.grown = MIN (MAX (size / 4, 1), MIN (waiting, gTuner.max - size));
+        gTuner.before = rate;
+        next = size + gTuner.grown;
+        why = "tasks waiting";
+    } else {
+        if (gTuner.hold > 0) {
+            gTuner.hold--;
+        }
+
+        // threads that sat idle for the whole window are not needed
+        if (0 == waiting && stats.idle > 0) {
+            gTuner.idleMin = (0 == gTuner.idle) ? stats.idle : MIN (gTuner.idleMin, stats.idle);
+            if (++gTuner.idle >= POOL_TUNER_IDLE) {
+                next = MAX (size - gTuner.idleMin, gTuner.min);
+                why = "idle";
+                gTuner.idle = 0;
+            }
+        } else {
+            gTuner.idle = 0;
+        }
+    }
+
+    if (next != size) {
+        gTuner.settle = 1;
+        gTuner.idle = 0;
+    }
+    g_mutex_unlock (&gTuner.lock);
+
+    if (next != size) {
+        pool_tuner_resize (size, next, why, rate, waiting, active);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void pool_tuner_resize (int from, int to, const char* why, double rate, int waiting, int active)
+{
+    logi ("pool: %d -> %d threads (%s), %.1f MiB/s, %d waiting, %d running at %.1f KiB/s each",
+          from, to, why, rate / 1048576, waiting, active, active > 0 ? rate / 1024 / active : 0.0);
+
+    if (0 != thread_pool_resize (to)) {
+        loge ("pool: resize to %d threads error", to);
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef POOL_TUNER_H
+#define POOL_TUNER_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define POOL_TUNER_MIN_DEFAULT      4               // 下载线程数的下限
+#define POOL_TUNER_MAX_DEFAULT      64              // 下载线程数的上限
+#define POOL_TUNER_INTERVAL         2               // 每隔几秒采样一次
+#define POOL_TUNER_GAIN             0.05            // 加了线程后总下载速度至少要提高这么多(比例), 否则撤回
+#define POOL_TUNER_HOLD             15              // 撤回后隔这么多次采样再试着加线程
+#define POOL_TUNER_IDLE             3               // 连续这么多次采样都有空闲线程, 就让它们退出
+
+/**
+ * @brief 按吞吐量调整线程池的线程数
+ *
+ * 在主循环里每 POOL_TUNER_INTERVAL 秒采样一次总下载速度、等待线程的任务数和每个任务的平均速度:
+ * 有任务在等线程时加线程(每次加当前的四分之一), 下一段时间总速度提高不到 POOL_TUNER_GAIN 就撤回,
+ * 说明带宽或对端已经到头, 过一阵再试; 没有任务在等、线程一直空闲时让空闲的线程退出。
+ * 线程数始终在 [min, max] 之内, 每次调整都写日志。
+ */
+
+/**
+ * @brief 开始调整, 需要默认的 GMainContext 在运行; 再次调用只更新上下限
+ * @param min 小于等于 0 时使用 POOL_TUNER_MIN_DEFAULT
+ * @param max 小于等于 0 时使用 POOL_TUNER_MAX_DEFAULT; min 等于 max 时线程数固定
+ */
+void    pool_tuner_start        (int min, int max);
+
+void    pool_tuner_stop         (void);
+
+#endif // POOL_TUNER_H
@@ -10,16 +10,62 @@
 typedef struct _Downloader          Downloader;
 typedef struct _DownloadData        DownloadData;
 typedef struct _DownloadMethod      DownloadMethod;
+typedef enum _DownloadPriority      DownloadPriority;
 
 typedef bool (*Init)        (DownloadData* data);
 typedef bool (*Download)    (DownloadData* data);
 typedef void (*Free)        (DownloadData* data);
 
 
+/**
+ * @brief 优先级类别, 值越小越先执行; 同一类别里小文件先执行
+ */
+enum _DownloadPriority
+{
+    DOWNLOAD_PRIORITY_INTERACTIVE   = -1,           // 有人在等结果
+    DOWNLOAD_PRIORITY_NORMAL        = 0,
+    DOWNLOAD_PRIORITY_BULK          = 1,            // 前两类都没有在排队时才执行
+};
+
 struct _DownloadData
 {
     GUri*                   uri;
+    GList*                  mirrors;                // 同一文件的所有源(GUri), 包括 uri, 为空表示只有 uri
     char*                   outputName;
+    char*                   finalName;              // 不为空时 outputName 在暂存目录, 下载完交给 mover 搬到这里
+    double                  hedgeRatio;             // 小于 0 表示使用默认值
+    double                  hedgeBudget;            // 小于 0 表示使用默认值
+    char*                   ranges;                 // 只下载的字节范围, 为空表示整个文件
+    bool                    splitRanges;            // 每个范围保存为 "<outputName>.<start>-<end>"
+    char*                   zsync;                  // zsync 控制文件, 不为空时增量更新 outputName
+    int                     ioTimeout;              // 以下三项小于 0 表示使用默认值
+    int                     lowSpeedLimit;
+    int                     lowSpeedTime;
+    bool                    mmap;                   // 分段下载写映射的文件
+    bool                    writeback;              // 按窗口主动回写, 每个下载的脏页有上限
+    int                     compress;               // 大于 0 时 outputName 是 zstd 压缩文件, 旁边有 ".idx" 索引
+    char*                   extract;                // 解包到的目录, 为空表示不解包
+    bool                    extractKeep;            // 解包后保留归档, 否则归档不写到磁盘(能流式解包时)或解包后删除
+    char*                   checksum;               // 期望的校验值 "<算法>:<十六进制>", 为空时只用响应头里的
+    char*                   pieces;                 // 分块校验参数, 见 piece_set_new()
+    char*                   store;                  // 按内容寻址的存储目录, 为空表示不使用
+    bool                    storeEtag;              // 同一主机上 ETag 相同就认为内容相同
+    DownloadPriority        priority;
+    gint64                  queued;                 // 第一次排队的单调时间(微秒), 重试时不变, 0 表示还没有排队
+
+    /* 调度前 HEAD 探测得到的信息, 未知时 length 为 -1 */
+    long long               length;
+    bool                    acceptRanges;
+    char*                   etag;
+    char*                   digest;                 // Repr-Digest 或 Digest 响应头
+    char*                   contentMD5;
+    int                     connections;            // 大于 1 时分段下载
+
+    /* 失败重试, retryable 和 retryAfter 由下载器在失败时设置 */
+    int                     attempts;               // 已经重试的次数
+    bool                    retryable;
+    int                     retryAfter;             // 服务器要求等待的秒数, 小于 0 表示没有要求
+    void*                   segment;                // 分段下载已写好的范围, 重试时接着下载, 由下载器释放
 
     /**
      * @TODO read and write lock for progress
@@ -39,6 +85,7 @@ struct _Downloader
     const DownloadMethod*   method;
 
     DownloadData*           data;
+    guint64                 device;                 // 输出文件所在的设备, 同一设备上同时进行的下载有上限
 };
 
 
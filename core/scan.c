@@ -0,0 +1,251 @@
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86            1
+#endif
+
+static const ScanKernels* gScanAuto = NULL;
+
+
+static const char* scan_byte_scalar (const char* buf, size_t len, int c)
+{
+    for (size_t i = 0; i < len; ++i) {
+        if (buf[i] == (char) c) {
+            return buf + i;
+        }
+    }
+
+    return NULL;
+}
+
+static const char* scan_crlf_scalar (const char* buf, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; ++i) {
+        if ('\r' == buf[i] && '\n' == buf[i + 1]) {
+            return buf + i;
+        }
+    }
+
+    return NULL;
+}
+
+static const char* scan_crlfcrlf_scalar (const char* buf, size_t len)
+{
+    for (size_t i = 0; i + 3 < len; ++i) {
+        if ('\r' == buf[i] && '\n' == buf[i + 1] && '\r' == buf[i + 2] && '\n' == buf[i + 3]) {
+            return buf + i;
+        }
+    }
+
+    return NULL;
+}
+
+static const ScanKernels gScanScalar = {
+    "scalar",
+    scan_byte_scalar,
+    scan_crlf_scalar,
+    scan_crlfcrlf_scalar,
+};
+
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static const char* scan_byte_sse2 (const char* buf, size_t len, int c)
+{
+    size_t i = 0;
+    const __m128i vc = _mm_set1_epi8 ((char) c);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i*) (buf + i));
+        unsigned int m = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, vc));
+        if (m) {
+            return buf + i + __builtin_ctz (m);
+        }
+    }
+
+    return scan_byte_scalar (buf + i, len - i, c);
+}
+
+__attribute__((target("sse2")))
+static const char* scan_crlf_sse2 (const char* buf, size_t len)
+{
+    size_t i = 0;
+    const __m128i cr = _mm_set1_epi8 ('\r');
+    const __m128i lf = _mm_set1_epi8 ('\n');
+
+    for (; i + 17 <= len; i += 16) {
+        __m128i v0 = _mm_loadu_si128 ((const __m128i*) (buf + i));
+        __m128i v1 = _mm_loadu_si128 ((const __m128i*) (buf + i + 1));
+        __m128i m = _mm_and_si128 (_mm_cmpeq_epi8 (v0, cr), _mm_cmpeq_epi8 (v1, lf));
+        unsigned int bits = _mm_movemask_epi8 (m);
+        if (bits) {
+            return buf + i + __builtin_ctz (bits);
+        }
+    }
+
+    return scan_crlf_scalar (buf + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static const char* scan_crlfcrlf_sse2 (const char* buf, size_t len)
+{
+    size_t i = 0;
+    const __m128i cr = _mm_set1_epi8 ('\r');
+    const __m128i lf = _mm_set1_epi8 ('\n');
+
+    for (; i + 19 <= len; i += 16) {
+        __m128i v0 = _mm_loadu_si128 ((const __m128i*) (buf + i));
+        __m128i v1 = _mm_loadu_si128 ((const __m128i*) (buf + i + 1));
+        __m128i v2 = _mm_loadu_si128 ((const __m128i*) (buf + i + 2));
+        __m128i v3 = _mm_loadu_si128 ((const __m128i*) (buf + i + 3));
+        __m128i m = _mm_and_si128 (_mm_and_si128 (_mm_cmpeq_epi8 (v0, cr), _mm_cmpeq_epi8 (v1, lf)),
+                                   _mm_and_si128 (_mm_cmpeq_epi8 (v2, cr), _mm_cmpeq_epi8 (v3, lf)));
+        unsigned int bits = _mm_movemask_epi8 (m);
+        if (bits) {
+            return buf + i + __builtin_ctz (bits);
+        }
+    }
+
+    return scan_crlfcrlf_scalar (buf + i, len - i);
+}
+
+static const ScanKernels gScanSSE2 = {
+    "sse2",
+    scan_byte_sse2,
+    scan_crlf_sse2,
+    scan_crlfcrlf_sse2,
+};
+
+
+__attribute__((target("avx2")))
+static const char* scan_byte_avx2 (const char* buf, size_t len, int c)
+{
+    size_t i = 0;
+    const __m256i vc = _mm256_set1_epi8 ((char) c);
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i*) (buf + i));
+        unsigned int m = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, vc));
+        if (m) {
+            return buf + i + __builtin_ctz (m);
+        }
+    }
+
+    return scan_byte_sse2 (buf + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_crlf_avx2 (const char* buf, size_t len)
+{
+    size_t i = 0;
+    const __m256i cr = _mm256_set1_epi8 ('\r');
+    const __m256i lf = _mm256_set1_epi8 ('\n');
+
+    for (; i + 33 <= len; i += 32) {
+        __m256i v0 = _mm256_loadu_si256 ((const __m256i*) (buf + i));
+        __m256i v1 = _mm256_loadu_si256 ((const __m256i*) (buf + i + 1));
+        __m256i m = _mm256_and_si256 (_mm256_cmpeq_epi8 (v0, cr), _mm256_cmpeq_epi8 (v1, lf));
+        unsigned int bits = _mm256_movemask_epi8 (m);
+        if (bits) {
+            return buf + i + __builtin_ctz (bits);
+        }
+    }
+
+    return scan_crlf_sse2 (buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_crlfcrlf_avx2 (const char* buf, size_t len)
+{
+    size_t i = 0;
+    const __m256i cr = _mm256_set1_epi8 ('\r');
+    const __m256i lf = _mm256_set1_epi8 ('\n');
+
+    for (; i + 35 <= len; i += 32) {
+        __m256i v0 = _mm256_loadu_si256 ((const __m256i*) (buf + i));
+        __m256i v1 = _mm256_loadu_si256 ((const __m256i*) (buf + i + 1));
+        __m256i v2 = _mm256_loadu_si256 ((const __m256i*) (buf + i + 2));
+        __m256i v3 = _mm256_loadu_si256 ((const __m256i*) (buf + i + 3));
+        __m256i m = _mm256_and_si256 (_mm256_and_si256 (_mm256_cmpeq_epi8 (v0, cr), _mm256_cmpeq_epi8 (v1, lf)),
+                                      _mm256_and_si256 (_mm256_cmpeq_epi8 (v2, cr), _mm256_cmpeq_epi8 (v3, lf)));
+        unsigned int bits = _mm256_movemask_epi8 (m);
+        if (bits) {
+            return buf + i + __builtin_ctz (bits);
+        }
+    }
+
+    return scan_crlfcrlf_sse2 (buf + i, len - i);
+}
+
+static const ScanKernels gScanAVX2 = {
+    "avx2",
+    scan_byte_avx2,
+    scan_crlf_avx2,
+    scan_crlfcrlf_avx2,
+};
+
+/* header lines are shorter than a few vectors, sse2 wins there (see demo/bench/scan-bench) */
+static const ScanKernels gScanAVX2Mixed = {
+    "avx2",
+    scan_byte_sse2,
+    scan_crlf_sse2,
+    scan_crlfcrlf_avx2,
+};
+#endif
+
+
+const ScanKernels* scan_kernels (ScanImpl impl)
+{
+    switch (impl) {
+    case SCAN_IMPL_SCALAR:
+        return &gScanScalar;
+#ifdef SCAN_X86
+    case SCAN_IMPL_SSE2:
+        __builtin_cpu_init ();
+        return __builtin_cpu_supports ("sse2") ? &gScanSSE2 : NULL;
+    case SCAN_IMPL_AVX2:
+        __builtin_cpu_init ();
+        return __builtin_cpu_supports ("avx2") ? &gScanAVX2 : NULL;
+#else
+    case SCAN_IMPL_SSE2:
+    case SCAN_IMPL_AVX2:
+        return NULL;
+#endif
+    case SCAN_IMPL_AUTO:
+    default:
+        break;
+    }
+
+    const ScanKernels* k = __atomic_load_n (&gScanAuto, __ATOMIC_ACQUIRE);
+    if (!k) {
+#ifdef SCAN_X86
+        if (scan_kernels (SCAN_IMPL_AVX2)) {
+            k = &gScanAVX2Mixed;
+        } else {
+            k = scan_kernels (SCAN_IMPL_SSE2);
+        }
+#endif
+        if (!k) k = &gScanScalar;
+        __atomic_store_n (&gScanAuto, k, __ATOMIC_RELEASE);
+    }
+
+    return k;
+}
+
+const char* scan_byte (const char* buf, size_t len, int c)
+{
+    return scan_kernels (SCAN_IMPL_AUTO)->find_byte (buf, len, c);
+}
+
+const char* scan_crlf (const char* buf, size_t len)
+{
+    return scan_kernels (SCAN_IMPL_AUTO)->find_crlf (buf, len);
+}
+
+const char* scan_crlfcrlf (const char* buf, size_t len)
+{
+    return scan_kernels (SCAN_IMPL_AUTO)->find_crlfcrlf (buf, len);
+}
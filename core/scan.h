@@ -0,0 +1,51 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef enum _ScanImpl          ScanImpl;
+typedef struct _ScanKernels     ScanKernels;
+
+enum _ScanImpl
+{
+    SCAN_IMPL_AUTO = 0,
+    SCAN_IMPL_SCALAR,
+    SCAN_IMPL_SSE2,
+    SCAN_IMPL_AVX2,
+};
+
+/**
+ * @brief 分隔符查找函数, 找不到返回 NULL
+ */
+struct _ScanKernels
+{
+    const char*             name;
+    const char*             (*find_byte)      (const char* buf, size_t len, int c);
+    const char*             (*find_crlf)      (const char* buf, size_t len);
+    const char*             (*find_crlfcrlf)  (const char* buf, size_t len);
+};
+
+/**
+ * @brief 获取指定实现的查找函数
+ * @param impl SCAN_IMPL_AUTO 表示运行时按 CPU 选择最快的实现
+ * @return CPU 不支持该实现时返回 NULL
+ */
+const ScanKernels* scan_kernels (ScanImpl impl);
+
+/**
+ * @brief 查找字节 c (如 ':' 和 '\n')
+ */
+const char* scan_byte (const char* buf, size_t len, int c);
+
+/**
+ * @brief 查找 "\r\n"
+ */
+const char* scan_crlf (const char* buf, size_t len);
+
+/**
+ * @brief 查找 "\r\n\r\n", 即 http 头部结束的位置
+ */
+const char* scan_crlfcrlf (const char* buf, size_t len);
+
+#endif // SCAN_H
@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "log.h"
+#include "utils.h"
+
+static char* store_object_path (const char* dir, const char* sha256);
+static char* store_alias_path (const char* dir, const char* key);
+static StoreLink store_link (const char* src, const char* dst, bool copy, GError** error);
+static bool store_reflink (const char* src, const char* dst);
+static bool store_hardlink (const char* src, const char* dst);
+static bool store_copy (const char* src, const char* dst);
+
+
+char* store_lookup (const char* dir, const char* key)
+{
+    g_return_val_if_fail (dir && key, NULL);
+
+    g_autofree char* sha256 = NULL;
+    if (g_str_has_prefix (key, "sha256:")) {
+        sha256 = g_ascii_strdown (key + strlen ("sha256:"), -1);
+    } else {
+        g_autofree char* alias = store_alias_path (dir, key);
+        if (!g_file_get_contents (alias, &sha256, NULL, NULL)) {
+            return NULL;
+        }
+        g_strstrip (sha256);
+    }
+
+    char* object = store_object_path (dir, sha256);
+    if (!object || !g_file_test (object, G_FILE_TEST_IS_REGULAR)) {
+        g_free (object);
+        return NULL;
+    }
+
+    return object;
+}
+
+StoreLink store_materialize (const char* object, const char* fileName, GError** error)
+{
+    g_return_val_if_fail (object && fileName, STORE_LINK_NONE);
+
+    if (g_file_test (fileName, G_FILE_TEST_EXISTS)) {
+        gf_error (error, "file '%s' already exists!", fileName);
+        return STORE_LINK_NONE;
+    }
+
+    return store_link (object, fileName, true, error);
+}
+
+bool store_insert (const char* dir, const char* fileName, const char* sha256, bool* deduplicated, GError** error)
+{
+    g_return_val_if_fail (dir && fileName && sha256 && deduplicated, false);
+
+    *deduplicated = false;
+    g_autofree char* object = store_object_path (dir, sha256);
+    if (!object) {
+        gf_error (error, "bad sha256 '%s'", sha256);
+        return false;
+    }
+
+    struct stat a, b;
+    if (0 != stat (fileName, &a)) {
+        gf_error (error, "stat '%s' error: %s", fileName, strerror (errno));
+        return false;
+    }
+
+    // the same content is already there, the new file becomes another view of it
+    if (0 == stat (object, &b)) {
+        if (a.st_dev == b.st_dev && a.st_ino == b.st_ino) {
+            return true;
+        } else if (a.st_size != b.st_size) {
+            gf_error (error, "object '%s' has %lld bytes, '%s' has %lld", object, (long long) b.st_size, fileName, (long long) a.st_size);
+            return false;
+        }
+        *deduplicated = (STORE_LINK_NONE != store_link (object, fileName, false, error));
+        return *deduplicated;
+    }
+
+    g_autofree char* parent = g_path_get_dirname (object);
+    if (0 != g_mkdir_with_parents (parent, 0755)) {
+        gf_error (error, "create '%s' error: %s", parent, strerror (errno));
+        return false;
+    }
+
+    return STORE_LINK_NONE != store_link (fileName, object, false, error);
+}
+
+bool store_alias (const char* dir, const char* key, const char* sha256, GError** error)
+{
+    g_return_val_if_fail (dir && key && sha256, false);
+
+    g_autofree char* alias = store_alias_path (dir, key);
+    g_autofree char* parent = g_path_get_dirname (alias);
+    if (0 != g_mkdir_with_parents (parent, 0755)) {
+        gf_error (error, "create '%s' error: %s", parent, strerror (errno));
+        return false;
+    }
+
+    // written to a temporary file and renamed, a reader never sees half of it
+    g_autoptr (GError) err = NULL;
+    if (!g_file_set_contents (alias, sha256, -1, &err)) {
+        gf_error (error, "write alias '%s' error: %s", key, err ? err->message : "");
+        return false;
+    }
+
+    return true;
+}
+
+const char* store_link_name (StoreLink link)
+{
+    switch (link) {
+    case STORE_LINK_REFLINK:    return "reflink";
+    case STORE_LINK_HARDLINK:   return "hardlink";
+    case STORE_LINK_COPY:       return "copy";
+    default:                    break;
+    }
+
+    return "none";
+}
+
+static char* store_object_path (const char* dir, const char* sha256)
+{
+    if (64 != strlen (sha256)) {
+        return NULL;
+    }
+
+    for (const char* p = sha256; *p; ++p) {
+        if (!g_ascii_isxdigit (*p)) {
+            return NULL;
+        }
+    }
+
+    return g_strdup_printf ("%s/%s/%.2s/%s", dir, STORE_OBJECTS_DIR, sha256, sha256);
+}
+
+static char* store_alias_path (const char* dir, const char* key)
+{
+    g_autofree char* name = g_compute_checksum_for_string (G_CHECKSUM_SHA256, key, -1);
+
+    return g_strdup_printf ("%s/%s/%.2s/%s", dir, STORE_ALIAS_DIR, name, name);
+}
+
+/**
+ * @brief 让 dst 和 src 共享内容, dst 已经存在时被原子地替换
+ * @param copy dst 以后可能被改写, reflink 不行时先复制, 硬链接只是最后的办法
+ */
+static StoreLink store_link (const char* src, const char* dst, bool copy, GError** error)
+{
+    static int serial = 0;
+    g_autofree char* tmp = g_strdup_printf ("%s.%d.%d.tmp", dst, getpid (), __atomic_add_fetch (&serial, 1, __ATOMIC_RELAXED));
+
+    StoreLink how = STORE_LINK_NONE;
+    if (store_reflink (src, tmp)) {
+        how = STORE_LINK_REFLINK;
+    } else if (copy && store_copy (src, tmp)) {
+        how = STORE_LINK_COPY;
+    } else if (store_hardlink (src, tmp)) {
+        how = STORE_LINK_HARDLINK;
+    } else {
+        gf_error (error, "can not reflink or link '%s' to '%s': %s", src, dst, strerror (errno));
+        return STORE_LINK_NONE;
+    }
+
+    if (0 != rename (tmp, dst)) {
+        gf_error (error, "rename '%s' error: %s", tmp, strerror (errno));
+        unlink (tmp);
+        return STORE_LINK_NONE;
+    }
+
+    return how;
+}
+
+static bool store_reflink (const char* src, const char* dst)
+{
+#ifdef FICLONE
+    int in = open (src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+
+    int out = open (dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool ok = (out >= 0) && (0 == ioctl (out, FICLONE, in));
+    int err = errno;
+    if (out >= 0)   close (out);
+    if (out >= 0 && !ok) unlink (dst);
+    close (in);
+    errno = err;
+
+    return ok;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+/**
+ * @brief 硬链接之前把 inode 设为只读, 共享它的路径都不能再原地写, 要写的一方先复制一份(见 output_open())
+ */
+static bool store_hardlink (const char* src, const char* dst)
+{
+    int fd = open (src, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    bool ok = (0 == fstat (fd, &st)) && (0 == fchmod (fd, 0444));
+    if (ok && 0 != link (src, dst)) {
+        // not shared after all, e.g. across file systems
+        int err = errno;
+        fchmod (fd, st.st_mode & 07777);
+        errno = err;
+        ok = false;
+    }
+    int err = errno;
+    close (fd);
+    errno = err;
+
+    return ok;
+}
+
+static bool store_copy (const char* src, const char* dst)
+{
+    int in = open (src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+
+    int out = open (dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    bool ok = out >= 0;
+    while (ok) {
+        ssize_t n = copy_file_range (in, NULL, out, NULL, 1 << 30, 0);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        ok = n >= 0;
+        if (n <= 0) break;
+    }
+    int err = errno;
+    if (out >= 0)   close (out);
+    if (out >= 0 && !ok) unlink (dst);
+    close (in);
+    errno = err;
+
+    return ok;
+}
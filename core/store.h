@@ -0,0 +1,61 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+#define STORE_OBJECTS_DIR           "objects"       // objects/<sha256 前两位>/<sha256>
+#define STORE_ALIAS_DIR             "alias"         // alias/<键的 sha256>, 内容是对象的 sha256
+
+typedef enum _StoreLink             StoreLink;
+
+/**
+ * @brief 文件和存储中的对象共享内容的方式
+ */
+enum _StoreLink
+{
+    STORE_LINK_NONE = 0,
+    STORE_LINK_REFLINK,                 // FICLONE, 写时复制, 两边互不影响
+    STORE_LINK_HARDLINK,                // 同一个 inode, 链接前设为只读(0444), output_open() 写之前先复制一份
+    STORE_LINK_COPY,                    // 只有 store_materialize() 在不能 reflink 时复制
+};
+
+/**
+ * @brief 按内容寻址的本地存储
+ *
+ * 对象以 SHA-256 命名, 同样内容的文件只存一份; 其它能确定内容的键
+ * (例如 "md5:<十六进制>"、"etag:<主机>:<ETag>")作为别名指向对象。
+ */
+
+/**
+ * @brief 查找对象
+ * @param key "sha256:<十六进制>" 直接对应对象, 其它的键先查别名
+ * @return 对象的路径, 需要释放; 没有返回 NULL
+ */
+char*       store_lookup        (const char* dir, const char* key);
+
+/**
+ * @brief 把对象放到 fileName, 以后可能被改写, 优先 reflink, 其次复制, 都不行时硬链接
+ * @return 使用的方式, 失败返回 STORE_LINK_NONE
+ */
+StoreLink   store_materialize   (const char* object, const char* fileName, GError** error);
+
+/**
+ * @brief 把下载好的文件加入存储
+ *
+ * 已经有同样内容的对象时, fileName 换成对象的 reflink 或硬链接, 省掉这一份空间;
+ * 否则用 reflink 或硬链接把文件加为新对象, 两种都不支持(例如跨文件系统)时不加入。
+ * 硬链接的文件和对象都变成只读
+ * @param sha256 文件内容的 SHA-256, 十六进制
+ * @param deduplicated 返回 fileName 是否换成了已有的对象
+ */
+bool        store_insert        (const char* dir, const char* fileName, const char* sha256, bool* deduplicated, GError** error);
+
+/**
+ * @brief 记录别名 key -> 对象
+ */
+bool        store_alias         (const char* dir, const char* key, const char* sha256, GError** error);
+
+const char* store_link_name     (StoreLink link);
+
+#endif // STORE_H
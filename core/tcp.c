@@ -26,14 +26,6 @@
 
 #include "log.h"
 
-enum _TcpError {
-    TCP_ERROR_TYPE_SSL = 1,
-    TCP_ERROR_TYPE_HOST,
-    TCP_ERROR_TYPE_ERROR,
-    TCP_ERROR_TYPE_MEM_INSUFFICIENT,            /* insufficient memory */
-};
-typedef enum _TcpError          TcpError;
-
 static const char* gCertFile = "/etc/ssl/certs/ca-certificates.crt";
 
 static inline void tcp_error (GError**, TcpError err, const char* errStr);
@@ -92,7 +84,9 @@ void tcp_close(Tcp *tcp)
 
         if (tcp->sslCtx) {
             SSL_CTX_free (tcp->sslCtx);
+            tcp->sslCtx = NULL;
         }
+        tcp->sslInitialized = false;
 
         if (tcp->sslCert) {
             X509_free (tcp->sslCert);
@@ -145,16 +139,24 @@ bool tcp_connect(Tcp *tcp, const char *hostname, int port, bool secure, const ch
         return false;
     }
 
+    // start from the addrIndex-th address so that extra connections can go to another one
+    int numAddr = 0;
+    for (gairesult = gairesults; gairesult; gairesult = gairesult->ai_next) {
+        ++numAddr;
+    }
+
     gairesult = gairesults;
-    do {
-        int tcpFastopen = -1;
+    for (int i = tcp->addrIndex % numAddr; i > 0; --i) {
+        gairesult = gairesult->ai_next;
+    }
 
-        if (sockfd != -1) {
-            close (sockfd);
-        }
+    int lastError = ECONNREFUSED;
+    for (int k = 0; k < numAddr; ++k, gairesult = gairesult->ai_next ? gairesult->ai_next : gairesults) {
+        int tcpFastopen = -1;
 
         sockfd = socket (gairesult->ai_family, gairesult->ai_socktype, gairesult->ai_protocol);
         if (sockfd == -1) {
+            lastError = errno;
             continue;
         }
 
@@ -174,37 +176,51 @@ bool tcp_connect(Tcp *tcp, const char *hostname, int port, bool secure, const ch
             break;
         }
 
-        if (errno != EINPROGRESS) {
-            continue;
-        }
+        if (errno == EINPROGRESS) {
+            /* With TFO we must assume success */
+            if (tcpFastopen != -1) {
+                break;
+            }
 
-        /* With TFO we must assume success */
-        if (tcpFastopen != -1) {
-            break;
+            /* Wait for the connection */
+            fd_set fdset;
+            FD_ZERO (&fdset);
+            FD_SET (sockfd, &fdset);
+            struct timeval tout = { .tv_sec  = ioTimeout };
+            ret = select (sockfd + 1, NULL, &fdset, NULL, &tout);
+
+            /* Success? A timeout or a refused connection is not */
+            int soError = 0;
+            socklen_t soLen = sizeof (soError);
+            if (ret > 0 && 0 == getsockopt (sockfd, SOL_SOCKET, SO_ERROR, &soError, &soLen) && 0 == soError) {
+                break;
+            }
+            lastError = (ret > 0 && soError) ? soError : (0 == ret ? ETIMEDOUT : errno);
+        } else {
+            lastError = errno;
         }
 
-        /* Wait for the connection */
-        fd_set fdset;
-        FD_ZERO (&fdset);
-        FD_SET (sockfd, &fdset);
-        struct timeval tout = { .tv_sec  = ioTimeout };
-        ret = select (sockfd + 1, NULL, &fdset, NULL, &tout);
-
-        /* Success? */
-        if (ret != -1) {
-            break;
-        }
-    } while ((gairesult = gairesult->ai_next));
+        // this address failed, try the next one with a new socket
+        close (sockfd);
+        sockfd = -1;
+    }
 
     freeaddrinfo(gairesults);
 
     if (sockfd == -1) {
-        tcp_error (&tcp->error, TCP_ERROR_TYPE_ERROR, strerror(errno));
+        tcp_error (&tcp->error, TCP_ERROR_TYPE_ERROR, strerror(lastError));
         return false;
     }
 
     fcntl(sockfd, F_SETFL, 0);
 
+    /* Set I/O timeout, before the TLS handshake which may stall as well */
+    if (ioTimeout > 0 && ioTimeout != (unsigned) -1) {
+        struct timeval tout = { .tv_sec  = ioTimeout };
+        setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, &tout, sizeof(tout));
+        setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, &tout, sizeof(tout));
+    }
+
     if (tcp->useSSL) {
         if (!tcp->sslInitialized) {
             SSLeay_add_ssl_algorithms ();
@@ -226,6 +242,7 @@ bool tcp_connect(Tcp *tcp, const char *hostname, int port, bool secure, const ch
         }
 
         SSL_set_fd (tcp->ssl, sockfd);
+        SSL_set_tlsext_host_name (tcp->ssl, hostname);
 
         if (-1 == SSL_connect (tcp->ssl)) {
             tcp_error (&tcp->error, TCP_ERROR_TYPE_SSL, NULL);
@@ -234,11 +251,6 @@ bool tcp_connect(Tcp *tcp, const char *hostname, int port, bool secure, const ch
     }
     tcp->sock = sockfd;
 
-    /* Set I/O timeout */
-    struct timeval tout = { .tv_sec  = ioTimeout };
-    setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, &tout, sizeof(tout));
-    setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, &tout, sizeof(tout));
-
     return true;
 }
 
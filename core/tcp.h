@@ -9,12 +9,24 @@
 #include <gio/gio.h>
 
 typedef struct _Tcp             Tcp;
+typedef enum _TcpError          TcpError;
+
+/**
+ * @brief Tcp.error 的错误码
+ */
+enum _TcpError {
+    TCP_ERROR_TYPE_SSL = 1,
+    TCP_ERROR_TYPE_HOST,
+    TCP_ERROR_TYPE_ERROR,
+    TCP_ERROR_TYPE_MEM_INSUFFICIENT,            /* insufficient memory */
+};
 
 struct _Tcp {
     int                 sock;
 
     sa_family_t         aiFamily;
     int                 nTimeoutInSecond;
+    int                 addrIndex;             // 从解析结果的第几个地址开始尝试连接
     GError             *error;                 // a hint as to an error
 
     /* SSL */
@@ -42,7 +54,7 @@ void tcp_close (Tcp* tcp);
  * @param port 要连接的端口
  * @param secure 是否使用 https:// 协议
  * @param localIf
- * @param ioTimout
+ * @param ioTimout 连接和每次读写最多等待的秒数, 0 或 -1 不限制
  *
  * @return 成功返回 true， 失败返回 false
  */
@@ -1,10 +1,68 @@
+#define _GNU_SOURCE
 #include "thread-pool.h"
 
 #include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
 #include <gio/gio.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define THREAD_POOL_CACHE_LINE      64
+#define THREAD_POOL_SPINS           64          // 睡眠前再让出 CPU 检查几次, 连续提交时不用每次都 futex 唤醒
+#define THREAD_POOL_DEQUE_SIZE      256         // 每个线程双端队列的初始格数, 满了翻倍
+#define THREAD_POOL_WAIT_NS         1000000     // thread_pool_wait() 没有可帮忙的任务时睡多久再找
+
+/* 有界无锁队列(Vyukov MPMC)的一格
+ *
+ * seq 等于格子的下标(加上若干圈)时可以写入, 等于下标 + 1 时可以读出
+ */
+typedef struct
+{
+    size_t                      seq;
+    thread_worker_cb            worker;
+    void*                       arg;
+} thread_cell_t;
+
+/* 双端队列里的一个子任务, group 不为空时执行完要通知等待者
+ */
+typedef struct
+{
+    thread_worker_cb            worker;
+    void*                       arg;
+    thread_group_t*             group;
+} thread_task_t;
 
+/* 双端队列的存储, 扩容后旧数组挂在 prev 上, 直到线程池销毁才释放(窃取者可能还在读)
+ */
+typedef struct _thread_array_t
+{
+    long                        size;
+    struct _thread_array_t*     prev;
+    thread_task_t               tasks[];
+} thread_array_t;
+
+/* 每个线程自己的 Chase-Lev 双端队列
+ *
+ * 只有所属线程在 bottom 端压入和弹出(后进先出, 缓存里还是热的), 其它线程用 CAS 从 top 端窃取(先进先出)
+ */
+typedef struct
+{
+    long                        top;
+    char                        pad0[THREAD_POOL_CACHE_LINE - sizeof (long)];
+    long                        bottom;
+    thread_array_t*             array;
+    char                        pad1[THREAD_POOL_CACHE_LINE - sizeof (long) - sizeof (void*)];
+} thread_deque_t;
+
+/* 环满时的溢出链表, 只在突发提交超过 THREAD_POOL_QUEUE_SIZE 时用到
+ */
 struct _thread_worker_t
 {
     thread_worker_cb            worker;
@@ -12,161 +70,578 @@ struct _thread_worker_t
     struct _thread_worker_t*    next;
 };
 
-struct _thread_pool_t 
+struct _thread_pool_t
 {
+    /* 生产者和消费者的位置各占一个缓存行, 互不干扰 */
+    size_t                      enqueuepos;
+    char                        pad0[THREAD_POOL_CACHE_LINE - sizeof (size_t)];
+    size_t                      dequeuepos;
+    char                        pad1[THREAD_POOL_CACHE_LINE - sizeof (size_t)];
+
+    /* 空闲线程在 futexword 上睡眠, 提交任务时有空闲线程才唤醒 */
+    int                         idle;
+    uint32_t                    futexword;
+    char                        pad2[THREAD_POOL_CACHE_LINE - sizeof (int) - sizeof (uint32_t)];
+
+    thread_cell_t*              cells;
+    size_t                      mask;
+
+    int                         overflownum;
+    thread_worker_t*            overflowhead;
+    thread_worker_t*            overflowtail;
+    pthread_mutex_t             overflowlock;
+
+    /* 每个线程一个双端队列, 下标和线程的序号一致; 线程退出后留给以后同一序号的线程 */
+    thread_deque_t*             deques;
+    int                         dequenum;
+
+    /* 线程数可以调整, 序号不小于 target 的线程空闲时退出; 由 resizelock 保护 */
     int                         threadnum;
+    int                         target;
     int                         shutdown;
-    int                         workernum;
     pthread_t*                  threadid;
-    thread_worker_t*            workerlist;
-    pthread_mutex_t             lock;
-    pthread_cond_t              ready;
+    int*                        threadstate;
+    pthread_mutex_t             resizelock;
+};
+
+enum
+{
+    THREAD_SLOT_EMPTY = 0,
+    THREAD_SLOT_RUNNING,
+    THREAD_SLOT_EXITED,                     // 线程已经退出, 等着 join
 };
 
-static void thread_pool_routine (void* arg);
+static void* thread_pool_routine (void* arg);
+static bool thread_pool_push (thread_worker_cb worker, void* arg);
+static bool thread_pool_pop (thread_worker_cb* worker, void** arg);
+static bool thread_pool_take (thread_worker_cb* worker, void** arg);
+static void thread_pool_wake (int num);
+static bool thread_pool_find (int self, bool inject, thread_task_t* task);
+static bool thread_pool_retire (int self);
+static void thread_pool_run (thread_task_t* task);
+static bool thread_deque_push (thread_deque_t* dq, const thread_task_t* task);
+static bool thread_deque_pop (thread_deque_t* dq, thread_task_t* task);
+static bool thread_deque_steal (thread_deque_t* dq, thread_task_t* task);
 
 static thread_pool_t*           threadpool = NULL;
+static __thread int             threadindex = -1;           // 当前线程在线程池里的序号, 不是线程池的线程时为 -1
+static __thread unsigned int    threadseed = 0;             // 随机挑选窃取对象
 
 int thread_pool_init (int num)
 {
-    if (num <= 0) {
+    if (num <= 0 || num > THREAD_POOL_MAX_THREADS) {
         return -1;
     }
 
-    int             ret = 0;
-
     threadpool = (thread_pool_t*) g_malloc0 (sizeof(thread_pool_t));
     if (NULL == threadpool) {
         return -1;
     }
 
-    // 初始化线程池参数
-    threadpool->threadnum = num;
-    threadpool->shutdown = 0;
-    threadpool->workernum = 0;
-    threadpool->workerlist = NULL;
-
-    // 初始化锁和条件变量
-    pthread_mutex_init (&(threadpool->lock), NULL);
-    pthread_cond_init (&(threadpool->ready), NULL);
-
-    // 创建线程
-    threadpool->threadid = (pthread_t*) g_malloc0 (sizeof (pthread_t) * num);
-    if (NULL == threadpool->threadid) {
-        free (threadpool);
+    // 初始化队列, 每一格的序号从它的下标开始
+    threadpool->cells = (thread_cell_t*) g_malloc0 (sizeof (thread_cell_t) * THREAD_POOL_QUEUE_SIZE);
+    threadpool->threadid = (pthread_t*) g_malloc0 (sizeof (pthread_t) * THREAD_POOL_MAX_THREADS);
+    threadpool->threadstate = (int*) g_malloc0 (sizeof (int) * THREAD_POOL_MAX_THREADS);
+    threadpool->deques = (thread_deque_t*) g_malloc0 (sizeof (thread_deque_t) * THREAD_POOL_MAX_THREADS);
+    if (NULL == threadpool->cells || NULL == threadpool->threadid || NULL == threadpool->threadstate || NULL == threadpool->deques) {
+        g_free (threadpool->cells);
+        g_free (threadpool->threadid);
+        g_free (threadpool->threadstate);
+        g_free (threadpool->deques);
+        g_free (threadpool);
+        threadpool = NULL;
         return -1;
     }
+    threadpool->mask = THREAD_POOL_QUEUE_SIZE - 1;
+    for (size_t i = 0; i < THREAD_POOL_QUEUE_SIZE; ++i) {
+        threadpool->cells[i].seq = i;
+    }
+    pthread_mutex_init (&(threadpool->overflowlock), NULL);
+    pthread_mutex_init (&(threadpool->resizelock), NULL);
 
-    for (int i = 0; i < num; ++i) {
-        ret = pthread_create (&(threadpool->threadid[i]), NULL, (void*) thread_pool_routine, NULL);
-        if (0 != ret) {
-            free (threadpool->threadid);
-            free (threadpool);
-            threadpool = NULL;
-            return -1;
-        }
+    // 创建线程
+    if (0 != thread_pool_resize (num)) {
+        thread_pool_destory ();
+        return -1;
     }
 
     return 0;
 }
 
-static void thread_pool_routine (void* arg)
+int thread_pool_resize (int num)
 {
-    while (1) {
-        pthread_mutex_lock (&(threadpool->lock));
-        while ((0 == threadpool->shutdown) && (0 == threadpool->workernum)) {
-            pthread_cond_wait (&(threadpool->ready), &(threadpool->lock));
+    if (NULL == threadpool || num <= 0 || num > THREAD_POOL_MAX_THREADS) return -1;
+
+    int ret = 0;
+    pthread_mutex_lock (&(threadpool->resizelock));
+    __atomic_store_n (&threadpool->target, num, __ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < THREAD_POOL_MAX_THREADS; ++i) {
+        // 退出了的线程先回收, 序号小于 num 的再启动一个
+        if (THREAD_SLOT_EXITED == threadpool->threadstate[i]) {
+            pthread_join (threadpool->threadid[i], NULL);
+            threadpool->threadstate[i] = THREAD_SLOT_EMPTY;
+        }
+        if (i >= num || THREAD_SLOT_RUNNING == threadpool->threadstate[i]) {
+            continue;
         }
 
-        if (1 == threadpool->shutdown) {
-            pthread_mutex_unlock (&(threadpool->lock));
-            pthread_exit (NULL);
+        if (NULL == threadpool->deques[i].array) {
+            thread_array_t* array = (thread_array_t*) g_malloc0 (sizeof (thread_array_t) + sizeof (thread_task_t) * THREAD_POOL_DEQUE_SIZE);
+            if (NULL == array) {
+                ret = -1;
+                break;
+            }
+            array->size = THREAD_POOL_DEQUE_SIZE;
+            threadpool->deques[i].array = array;
+            __atomic_store_n (&threadpool->dequenum, MAX (threadpool->dequenum, i + 1), __ATOMIC_RELEASE);
         }
 
-        --threadpool->workernum;
-        thread_worker_t* worker = threadpool->workerlist;
-        threadpool->workerlist = threadpool->workerlist->next;
-        pthread_mutex_unlock (&(threadpool->lock));
-        (*(worker->worker))(worker->arg);
-        free (worker);
-        worker = NULL;
+        if (0 != pthread_create (&(threadpool->threadid[i]), NULL, thread_pool_routine, (void*) (intptr_t) i)) {
+            ret = -1;
+            break;
+        }
+        threadpool->threadstate[i] = THREAD_SLOT_RUNNING;
+        __atomic_add_fetch (&threadpool->threadnum, 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock (&(threadpool->resizelock));
+
+    // 叫醒睡着的线程, 序号超出的会退出
+    thread_pool_wake (INT32_MAX);
+
+    return ret;
 }
 
-int thread_pool_add_work (thread_worker_cb workerfunc, void* arg)
+void thread_pool_stats (thread_pool_stats_t* stats)
 {
-    if (NULL == workerfunc) return -1;
+    if (NULL == stats) return;
 
-    thread_worker_t*            workertmp = NULL;
-    thread_worker_t*            curworker = NULL;
+    memset (stats, 0, sizeof (thread_pool_stats_t));
+    if (NULL == threadpool) return;
 
-    workertmp = (thread_worker_t*) malloc (sizeof(thread_worker_t));
-    if (NULL == workertmp) {
-        return -1;
+    stats->threads = __atomic_load_n (&threadpool->threadnum, __ATOMIC_RELAXED);
+    stats->target = __atomic_load_n (&threadpool->target, __ATOMIC_RELAXED);
+    stats->idle = __atomic_load_n (&threadpool->idle, __ATOMIC_RELAXED);
+
+    size_t enqueuepos = __atomic_load_n (&threadpool->enqueuepos, __ATOMIC_RELAXED);
+    size_t dequeuepos = __atomic_load_n (&threadpool->dequeuepos, __ATOMIC_RELAXED);
+    stats->queued = (enqueuepos > dequeuepos ? (int) (enqueuepos - dequeuepos) : 0)
+                  + __atomic_load_n (&threadpool->overflownum, __ATOMIC_RELAXED);
+}
+
+int thread_pool_add_work (thread_worker_cb workerfunc, void* arg)
+{
+    if (NULL == workerfunc || NULL == threadpool) return -1;
+
+    // 溢出链表不空时新任务也排在链表后面, 保持先进先出
+    if (0 != __atomic_load_n (&threadpool->overflownum, __ATOMIC_ACQUIRE) || !thread_pool_push (workerfunc, arg)) {
+        pthread_mutex_lock (&(threadpool->overflowlock));
+        if (NULL != threadpool->overflowhead || !thread_pool_push (workerfunc, arg)) {
+            thread_worker_t* node = (thread_worker_t*) malloc (sizeof (thread_worker_t));
+            if (NULL == node) {
+                pthread_mutex_unlock (&(threadpool->overflowlock));
+                return -1;
+            }
+            node->worker = workerfunc;
+            node->arg = arg;
+            node->next = NULL;
+            if (NULL == threadpool->overflowtail) {
+                threadpool->overflowhead = node;
+            } else {
+                threadpool->overflowtail->next = node;
+            }
+            threadpool->overflowtail = node;
+            __atomic_add_fetch (&threadpool->overflownum, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock (&(threadpool->overflowlock));
     }
 
-    memset (workertmp, 0, sizeof(thread_worker_t));
+    // 和 thread_pool_routine() 里 idle 的增加配对: 要么它看到这个任务, 要么这里看到它在睡
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&threadpool->idle, __ATOMIC_RELAXED) > 0) {
+        thread_pool_wake (1);
+    }
 
-    workertmp->worker = workerfunc;
-    workertmp->arg = arg;
-    workertmp->next = NULL;
+    return 0;
+}
 
-    pthread_mutex_lock (&(threadpool->lock));
-    curworker = threadpool->workerlist;
+int thread_pool_spawn (thread_group_t* group, thread_worker_cb workerfunc, void* arg)
+{
+    if (NULL == workerfunc || NULL == threadpool || threadindex < 0) return -1;
 
-    while (1) {
-        if (NULL == threadpool->workerlist) {
-            threadpool->workerlist = workertmp;
-            break;
-        } else if (NULL == curworker->next) {
-            curworker->next = workertmp;
-            break;
+    thread_task_t task = { workerfunc, arg, group };
+    if (NULL != group) {
+        __atomic_add_fetch (&group->pending, 1, __ATOMIC_RELAXED);
+    }
+    if (!thread_deque_push (&threadpool->deques[threadindex], &task)) {
+        if (NULL != group) {
+            __atomic_sub_fetch (&group->pending, 1, __ATOMIC_RELAXED);
         }
-        curworker = curworker->next;
+        return -1;
+    }
+
+    // 有线程在睡就叫醒一个来窃取
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&threadpool->idle, __ATOMIC_RELAXED) > 0) {
+        thread_pool_wake (1);
     }
-    ++ threadpool->workernum;
-    pthread_mutex_unlock (&(threadpool->lock));
-    pthread_cond_signal (&(threadpool->ready));
 
     return 0;
 }
 
+void thread_pool_wait (thread_group_t* group)
+{
+    if (NULL == group) return;
+
+    thread_task_t task;
+    int pending = 0;
+    while (0 != (pending = __atomic_load_n (&group->pending, __ATOMIC_ACQUIRE))) {
+        // 等的时候帮着执行双端队列里的子任务, 不碰注入队列里下载这类长任务
+        if (NULL != threadpool && thread_pool_find (threadindex, false, &task)) {
+            thread_pool_run (&task);
+            continue;
+        }
+
+        // 子任务都被别的线程拿走了, 等它们做完; 超时是为了回头再看有没有新的子任务可以帮忙
+        struct timespec ts = { 0, THREAD_POOL_WAIT_NS };
+        syscall (SYS_futex, &group->pending, FUTEX_WAIT_PRIVATE, pending, &ts, NULL, 0);
+    }
+}
+
+bool thread_pool_current ()
+{
+    return NULL != threadpool && threadindex >= 0;
+}
+
 void thread_pool_destory ()
 {
     if (!threadpool || (1 == threadpool->shutdown)) {
         return;
     }
 
-    thread_worker_t*    phead = NULL;
-    thread_worker_t*    pnext = NULL;
+    __atomic_store_n (&threadpool->shutdown, 1, __ATOMIC_SEQ_CST);
+    thread_pool_wake (INT32_MAX);
 
-    threadpool->shutdown = 1;
-    pthread_cond_broadcast (&(threadpool->ready));
+    // 等正在退出的线程登记完, 之后不会再有线程改 threadstate
+    pthread_mutex_lock (&(threadpool->resizelock));
+    pthread_mutex_unlock (&(threadpool->resizelock));
 
-    for (int i = 0; i < threadpool->threadnum; ++i) {
-        if (threadpool->threadid[i] > 0) {
+    for (int i = 0; i < THREAD_POOL_MAX_THREADS; ++i) {
+        if (THREAD_SLOT_EMPTY != threadpool->threadstate[i]) {
             pthread_join (threadpool->threadid[i], NULL);
         }
     }
     threadpool->threadnum = 0;
 
-    if (NULL != threadpool->threadid) {
-        free (threadpool->threadid);
+    // 没有执行的任务直接丢弃
+    thread_worker_t* phead = threadpool->overflowhead;
+    while (NULL != phead) {
+        thread_worker_t* pnext = phead->next;
+        free (phead);
+        phead = pnext;
     }
+    pthread_mutex_destroy (&(threadpool->overflowlock));
+    pthread_mutex_destroy (&(threadpool->resizelock));
+
+    for (int i = 0; i < threadpool->dequenum; ++i) {
+        thread_array_t* array = threadpool->deques[i].array;
+        while (NULL != array) {
+            thread_array_t* prev = array->prev;
+            g_free (array);
+            array = prev;
+        }
+    }
+    g_free (threadpool->deques);
+
+    g_free (threadpool->threadid);
+    g_free (threadpool->threadstate);
+    g_free (threadpool->cells);
+    g_free (threadpool);
+    threadpool = NULL;
+}
 
-    phead = threadpool->workerlist;
+static void* thread_pool_routine (void* arg)
+{
+    int self = (int) (intptr_t) arg;
+    thread_task_t task;
 
-    while (NULL != phead) {
-        pnext = phead->next;
-        if (NULL == pnext) break;
-        free (phead);
-        phead = pnext->next;
+    threadindex = self;
+    threadseed = (unsigned int) self * 2654435761u + 1;
+
+    while (1) {
+        bool got = false;
+        for (int i = 0; i < THREAD_POOL_SPINS; ++i) {
+            if ((got = thread_pool_find (self, true, &task))) {
+                break;
+            }
+            sched_yield ();
+        }
+        if (got) {
+            thread_pool_run (&task);
+            continue;
+        }
+
+        // 先记下 futexword, 再登记为空闲并重新检查队列, 之后的提交一定会改变 futexword
+        uint32_t word = __atomic_load_n (&threadpool->futexword, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch (&threadpool->idle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n (&threadpool->shutdown, __ATOMIC_SEQ_CST)) {
+            __atomic_sub_fetch (&threadpool->idle, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        if (self >= __atomic_load_n (&threadpool->target, __ATOMIC_SEQ_CST) && thread_pool_retire (self)) {
+            __atomic_sub_fetch (&threadpool->idle, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+        if (thread_pool_find (self, true, &task)) {
+            __atomic_sub_fetch (&threadpool->idle, 1, __ATOMIC_SEQ_CST);
+            thread_pool_run (&task);
+            continue;
+        }
+        syscall (SYS_futex, &threadpool->futexword, FUTEX_WAIT_PRIVATE, word, NULL, NULL, 0);
+        __atomic_sub_fetch (&threadpool->idle, 1, __ATOMIC_SEQ_CST);
     }
-    pthread_mutex_destroy (&(threadpool->lock));
-    pthread_cond_destroy (&(threadpool->ready));
 
-    if (NULL != threadpool) {
-        free (threadpool);
-        threadpool = NULL;
+    threadindex = -1;
+
+    return NULL;
+}
+
+/* 线程池缩小后多出来的空闲线程退出; 加锁再看一次, 以免同时又被扩大回来
+ */
+static bool thread_pool_retire (int self)
+{
+    bool retire = false;
+
+    pthread_mutex_lock (&(threadpool->resizelock));
+    if (self >= threadpool->target && !__atomic_load_n (&threadpool->shutdown, __ATOMIC_SEQ_CST)) {
+        threadpool->threadstate[self] = THREAD_SLOT_EXITED;
+        __atomic_sub_fetch (&threadpool->threadnum, 1, __ATOMIC_RELAXED);
+        retire = true;
+    }
+    pthread_mutex_unlock (&(threadpool->resizelock));
+
+    return retire;
+}
+
+/* 找一个任务: 先是自己的双端队列, 再是注入队列(inject 为 true 时), 最后从随机一个线程开始挨个窃取
+ */
+static bool thread_pool_find (int self, bool inject, thread_task_t* task)
+{
+    if (self >= 0 && thread_deque_pop (&threadpool->deques[self], task)) {
+        return true;
+    }
+
+    if (inject && thread_pool_take (&task->worker, &task->arg)) {
+        task->group = NULL;
+        return true;
+    }
+
+    int num = __atomic_load_n (&threadpool->dequenum, __ATOMIC_ACQUIRE);
+    int start = (int) (rand_r (&threadseed) % (unsigned int) num);
+    for (int i = 0; i < num; ++i) {
+        int victim = (start + i) % num;
+        if (victim != self && thread_deque_steal (&threadpool->deques[victim], task)) {
+            return true;
+        }
     }
+
+    return false;
+}
+
+static void thread_pool_run (thread_task_t* task)
+{
+    thread_group_t* group = task->group;
+
+    (*task->worker) (task->arg);
+
+    if (NULL != group && 0 == __atomic_sub_fetch (&group->pending, 1, __ATOMIC_ACQ_REL)) {
+        syscall (SYS_futex, &group->pending, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+    }
+}
+
+/* 所属线程在 bottom 端压入, 满了换一个两倍大的数组
+ */
+static bool thread_deque_push (thread_deque_t* dq, const thread_task_t* task)
+{
+    long b = __atomic_load_n (&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n (&dq->top, __ATOMIC_ACQUIRE);
+    thread_array_t* array = __atomic_load_n (&dq->array, __ATOMIC_RELAXED);
+
+    if (b - t > array->size - 1) {
+        thread_array_t* bigger = (thread_array_t*) g_malloc0 (sizeof (thread_array_t) + sizeof (thread_task_t) * array->size * 2);
+        if (NULL == bigger) {
+            return false;
+        }
+        bigger->size = array->size * 2;
+        bigger->prev = array;
+        for (long i = t; i < b; ++i) {
+            bigger->tasks[i & (bigger->size - 1)] = array->tasks[i & (array->size - 1)];
+        }
+        __atomic_store_n (&dq->array, bigger, __ATOMIC_RELEASE);
+        array = bigger;
+    }
+
+    // 窃取者可能同时在读同一格(随后 CAS 失败丢弃), 逐个字段原子地写
+    thread_task_t* slot = &array->tasks[b & (array->size - 1)];
+    __atomic_store_n (&slot->worker, task->worker, __ATOMIC_RELAXED);
+    __atomic_store_n (&slot->arg, task->arg, __ATOMIC_RELAXED);
+    __atomic_store_n (&slot->group, task->group, __ATOMIC_RELAXED);
+    __atomic_store_n (&dq->bottom, b + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/* 所属线程从 bottom 端弹出最近压入的任务, 只剩一个时和窃取者用 CAS 争
+ */
+static bool thread_deque_pop (thread_deque_t* dq, thread_task_t* task)
+{
+    long b = __atomic_load_n (&dq->bottom, __ATOMIC_RELAXED) - 1;
+    thread_array_t* array = __atomic_load_n (&dq->array, __ATOMIC_RELAXED);
+    __atomic_store_n (&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n (&dq->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n (&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    thread_task_t* slot = &array->tasks[b & (array->size - 1)];
+    task->worker = __atomic_load_n (&slot->worker, __ATOMIC_RELAXED);
+    task->arg = __atomic_load_n (&slot->arg, __ATOMIC_RELAXED);
+    task->group = __atomic_load_n (&slot->group, __ATOMIC_RELAXED);
+    if (t < b) {
+        return true;
+    }
+
+    bool ret = __atomic_compare_exchange_n (&dq->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n (&dq->bottom, b + 1, __ATOMIC_RELAXED);
+
+    return ret;
+}
+
+/* 其它线程从 top 端窃取最早压入的任务, 和别的窃取者或所属线程冲突时放弃
+ */
+static bool thread_deque_steal (thread_deque_t* dq, thread_task_t* task)
+{
+    long t = __atomic_load_n (&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n (&dq->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b) {
+        return false;
+    }
+
+    thread_array_t* array = __atomic_load_n (&dq->array, __ATOMIC_ACQUIRE);
+    thread_task_t* slot = &array->tasks[t & (array->size - 1)];
+    task->worker = __atomic_load_n (&slot->worker, __ATOMIC_RELAXED);
+    task->arg = __atomic_load_n (&slot->arg, __ATOMIC_RELAXED);
+    task->group = __atomic_load_n (&slot->group, __ATOMIC_RELAXED);
+
+    return __atomic_compare_exchange_n (&dq->top, &t, t + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* 放进环里, 环满时返回 false
+ */
+static bool thread_pool_push (thread_worker_cb worker, void* arg)
+{
+    size_t pos = __atomic_load_n (&threadpool->enqueuepos, __ATOMIC_RELAXED);
+    thread_cell_t* cell = NULL;
+
+    while (1) {
+        cell = &threadpool->cells[pos & threadpool->mask];
+        size_t seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (0 == diff) {
+            if (__atomic_compare_exchange_n (&threadpool->enqueuepos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n (&threadpool->enqueuepos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->worker = worker;
+    cell->arg = arg;
+    __atomic_store_n (&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/* 从环里取出最早的任务, 环空时返回 false
+ */
+static bool thread_pool_pop (thread_worker_cb* worker, void** arg)
+{
+    size_t pos = __atomic_load_n (&threadpool->dequeuepos, __ATOMIC_RELAXED);
+    thread_cell_t* cell = NULL;
+
+    while (1) {
+        cell = &threadpool->cells[pos & threadpool->mask];
+        size_t seq = __atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (0 == diff) {
+            if (__atomic_compare_exchange_n (&threadpool->dequeuepos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n (&threadpool->dequeuepos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *worker = cell->worker;
+    *arg = cell->arg;
+    __atomic_store_n (&cell->seq, pos + threadpool->mask + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/* 取一个任务: 溢出链表里有任务时先把它们挪进环里腾出的位置, 再从环里取
+ */
+static bool thread_pool_take (thread_worker_cb* worker, void** arg)
+{
+    if (0 != __atomic_load_n (&threadpool->overflownum, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock (&(threadpool->overflowlock));
+        while (NULL != threadpool->overflowhead) {
+            thread_worker_t* node = threadpool->overflowhead;
+            if (!thread_pool_push (node->worker, node->arg)) {
+                break;
+            }
+            threadpool->overflowhead = node->next;
+            if (NULL == threadpool->overflowhead) {
+                threadpool->overflowtail = NULL;
+            }
+            __atomic_sub_fetch (&threadpool->overflownum, 1, __ATOMIC_RELEASE);
+            free (node);
+        }
+
+        // 环被别的线程占满了, 直接从链表头取
+        bool ret = thread_pool_pop (worker, arg);
+        if (!ret && NULL != threadpool->overflowhead) {
+            thread_worker_t* node = threadpool->overflowhead;
+            threadpool->overflowhead = node->next;
+            if (NULL == threadpool->overflowhead) {
+                threadpool->overflowtail = NULL;
+            }
+            __atomic_sub_fetch (&threadpool->overflownum, 1, __ATOMIC_RELEASE);
+            *worker = node->worker;
+            *arg = node->arg;
+            free (node);
+            ret = true;
+        }
+        pthread_mutex_unlock (&(threadpool->overflowlock));
+
+        if (ret) return true;
+    }
+
+    return thread_pool_pop (worker, arg);
+}
+
+static void thread_pool_wake (int num)
+{
+    __atomic_add_fetch (&threadpool->futexword, 1, __ATOMIC_SEQ_CST);
+    syscall (SYS_futex, &threadpool->futexword, FUTEX_WAKE_PRIVATE, num, NULL, NULL, 0);
 }
@@ -6,14 +6,36 @@ extern "C" {
 #endif
 
 #include <pthread.h>
+#include <stdbool.h>
+
+#define THREAD_POOL_QUEUE_SIZE  4096            // 无锁队列的格数, 必须是 2 的幂; 满了以后的任务放进溢出链表
+#define THREAD_POOL_MAX_THREADS 256             // thread_pool_resize() 的上限
+
 typedef struct _thread_pool_t   thread_pool_t;
 typedef struct _thread_worker_t thread_worker_t;
 
 typedef void* (*thread_worker_cb) (void* arg);
 
+/* 线程池的状态, 给调整线程数的控制器用
+ */
+typedef struct _thread_pool_stats_t
+{
+    int                 threads;        // 正在运行的线程
+    int                 target;         // 想要的线程数, 缩小时多出来的线程做完手上的任务才退出
+    int                 idle;           // 没有任务在睡眠的线程
+    int                 queued;         // 注入队列里等待的任务
+} thread_pool_stats_t;
+
+/* 一组用 thread_pool_spawn() 派生的子任务, 用前清零, 用 thread_pool_wait() 等它们全部完成
+ */
+typedef struct _thread_group_t
+{
+    int                 pending;
+} thread_group_t;
+
 /* 线程池初始化
  *
- * @param num: 线程池初始化线程数量
+ * @param num: 线程池初始化线程数量, 之后可以用 thread_pool_resize() 调整
  * @return:
  *      失败: -1
  *      成功: 0
@@ -21,6 +43,10 @@ typedef void* (*thread_worker_cb) (void* arg);
 int thread_pool_init(int num);
 
 /* 添加工作到线程池
+ *
+ * 这是线程池的注入队列: 线程先执行自己双端队列里的子任务, 再从这里取, 最后去别的线程那里窃取。
+ * 任务放进多生产者多消费者的无锁环形队列, 不分配内存, 不加锁; 有空闲线程时用 futex 唤醒一个。
+ * 环满时放进溢出链表(加锁, O(1)), 线程取任务时再挪回环里, 整体仍然先进先出
  *
  * @param workfunc: 线程要执行的操作
  * @param arg: 传入参数
@@ -30,6 +56,43 @@ int thread_pool_init(int num);
  */
 int thread_pool_add_work(thread_worker_cb workfunc, void* argv);
 
+/* 在线程池的线程里派生子任务
+ *
+ * 子任务压进当前线程自己的双端队列, 当前线程后进先出地执行, 空闲线程从另一端窃取;
+ * 给下载内部的流水线阶段(比如并行校验)用, 外部提交的任务用 thread_pool_add_work()
+ *
+ * @param group: 子任务所属的组, 可以为 NULL
+ * @param workfunc: 线程要执行的操作
+ * @param arg: 传入参数
+ * @return:
+ *      成功: 0
+ *      失败: -1, 不在线程池的线程里时也失败, 调用者自己执行即可
+ */
+int thread_pool_spawn(thread_group_t* group, thread_worker_cb workfunc, void* arg);
+
+/* 等待一组子任务全部完成
+ *
+ * 等待期间帮着执行自己和其它线程双端队列里的子任务, 不会去执行注入队列里的任务
+ */
+void thread_pool_wait(thread_group_t* group);
+
+/* 当前线程是否是线程池的线程
+ */
+bool thread_pool_current();
+
+/* 调整线程数
+ *
+ * 扩大时立即启动新线程; 缩小时序号超出的线程空闲了才退出, 不会打断正在执行的任务
+ *
+ * @param num: 1 到 THREAD_POOL_MAX_THREADS
+ * @return:
+ *      成功: 0
+ *      失败: -1
+ */
+int thread_pool_resize(int num);
+
+void thread_pool_stats(thread_pool_stats_t* stats);
+
 /* 线程池销毁
  */
 void thread_pool_destory();
@@ -0,0 +1,639 @@
+#include "zsync.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "http.h"
+#include "scan.h"
+#include "utils.h"
+#include "output.h"
+#include "http-range.h"
+
+#define ZSYNC_READ_SIZE         (1 << 20)
+
+typedef struct _ZsyncRsum       ZsyncRsum;
+typedef struct _ZsyncMatcher    ZsyncMatcher;
+
+/**
+ * @brief rsync 风格的滚动校验: a 为字节和, b 为加权和, 都是 16 位
+ */
+struct _ZsyncRsum
+{
+    guint16                 a;
+    guint16                 b;
+};
+
+struct _ZsyncMatcher
+{
+    const ZsyncControl     *zc;
+    guint32                 rsumMask;
+
+    int                    *head;                   // rsum 哈希表, 块号链表
+    int                    *next;
+    guint32                 hashMask;
+
+    bool                   *known;
+    int                     numKnown;
+
+    const guchar           *seed;                   // 本地旧文件
+    long long               seedLen;
+    guchar                 *window;                 // 跨过旧文件结尾的块, 用 0 补齐
+
+    Output                 *out;
+    long long               fetched;
+};
+
+
+static void zsync_md4 (const guchar* data, size_t len, guchar out[16]);
+static bool zsync_fetch_control (const char* url, char** data, gsize* len, GError** error);
+static ZsyncRsum zsync_rsum (const ZsyncMatcher* m, long long off);
+static const guchar* zsync_window (ZsyncMatcher* m, long long off);
+static int  zsync_match (ZsyncMatcher* m, long long off, ZsyncRsum r0, ZsyncRsum r1);
+static void zsync_scan_seed (ZsyncMatcher* m);
+static bool zsync_write (Output* out, const guchar* data, long long len, long long offset);
+static bool zsync_write_func (long long offset, const char* data, int len, long long total, void* udata);
+static bool zsync_verify (int fd, long long length, const char* sha1);
+static bool zsync_delta (GUri* uri, const ZsyncControl* zc, const char* fileName, const char* tmpName, GError** error);
+
+
+static inline guint32 zsync_rsum_value (ZsyncRsum r, guint32 mask)
+{
+    return (((guint32) r.a << 16) | r.b) & mask;
+}
+
+static inline guint32 zsync_hash (guint32 v, guint32 mask)
+{
+    v ^= v >> 16;
+    v *= 0x45d9f3b;
+    v ^= v >> 16;
+
+    return v & mask;
+}
+
+static inline guchar zsync_at (const ZsyncMatcher* m, long long off)
+{
+    return (off < m->seedLen) ? m->seed[off] : 0;
+}
+
+
+ZsyncControl* zsync_control_load (const char* path, GError** error)
+{
+    g_return_val_if_fail (path, NULL);
+
+    char* data = NULL;
+    gsize len = 0;
+    ZsyncControl* zc = NULL;
+
+    if (strstr (path, "://")) {
+        if (!zsync_fetch_control (path, &data, &len, error)) {
+            goto error;
+        }
+    } else {
+        g_autoptr (GError) err = NULL;
+        if (!g_file_get_contents (path, &data, &len, &err)) {
+            gf_error (error, "read '%s' error: %s", path, err ? err->message : "");
+            goto error;
+        }
+    }
+
+    zc = g_malloc0 (sizeof (ZsyncControl));
+    if (!zc) {
+        gf_error (error, "malloc zsync control error");
+        goto error;
+    }
+    zc->length = -1;
+    zc->seqMatches = 1;
+    zc->rsumBytes = 4;
+    zc->checksumBytes = 16;
+
+    // "Key: value" lines up to an empty line, then the block checksums
+    const char* p = data;
+    const char* end = data + len;
+    bool version = false;
+    for (;;) {
+        const char* eol = scan_byte (p, end - p, '\n');
+        if (!eol) {
+            gf_error (error, "'%s' has no block checksums", path);
+            goto error;
+        }
+
+        if (eol == p) {
+            ++p;
+            break;
+        }
+
+        const char* colon = scan_byte (p, eol - p, ':');
+        if (colon) {
+            g_autofree char* key = g_strndup (p, colon - p);
+            g_autofree char* value = g_strstrip (g_strndup (colon + 1, eol - colon - 1));
+            if (!g_ascii_strcasecmp (key, "zsync")) {
+                version = true;
+            } else if (!g_ascii_strcasecmp (key, "Filename")) {
+                zc->fileName = g_strdup (value);
+            } else if (!g_ascii_strcasecmp (key, "URL")) {
+                zc->url = g_strdup (value);
+            } else if (!g_ascii_strcasecmp (key, "SHA-1")) {
+                zc->sha1 = g_ascii_strdown (value, -1);
+            } else if (!g_ascii_strcasecmp (key, "Length")) {
+                zc->length = g_ascii_strtoll (value, NULL, 10);
+            } else if (!g_ascii_strcasecmp (key, "Blocksize")) {
+                zc->blockSize = (int) g_ascii_strtoll (value, NULL, 10);
+            } else if (!g_ascii_strcasecmp (key, "Hash-Lengths")) {
+                sscanf (value, "%d,%d,%d", &zc->seqMatches, &zc->rsumBytes, &zc->checksumBytes);
+            }
+        }
+        p = eol + 1;
+    }
+
+    if (!version || zc->length < 0 || zc->blockSize <= 0 || (zc->blockSize & (zc->blockSize - 1))
+        || zc->seqMatches < 1 || zc->seqMatches > 2 || zc->rsumBytes < 1 || zc->rsumBytes > 4
+        || zc->checksumBytes < 3 || zc->checksumBytes > 16) {
+        gf_error (error, "'%s' is not a valid zsync control file", path);
+        goto error;
+    }
+
+    zc->numBlocks = (int) ((zc->length + zc->blockSize - 1) / zc->blockSize);
+    int sumLen = zc->rsumBytes + zc->checksumBytes;
+    if (end - p < (long long) zc->numBlocks * sumLen) {
+        gf_error (error, "'%s' is truncated, %d block checksums expected", path, zc->numBlocks);
+        goto error;
+    }
+
+    zc->sums = g_malloc0 (sizeof (ZsyncBlockSum) * MAX (zc->numBlocks, 1));
+    if (!zc->sums) {
+        gf_error (error, "malloc block checksums error");
+        goto error;
+    }
+
+    // the rsum is stored big-endian, only its last rsumBytes bytes
+    for (int i = 0; i < zc->numBlocks; ++i, p += sumLen) {
+        guint32 rsum = 0;
+        for (int k = 0; k < zc->rsumBytes; ++k) {
+            rsum = (rsum << 8) | (guchar) p[k];
+        }
+        zc->sums[i].rsum = rsum;
+        memcpy (zc->sums[i].checksum, p + zc->rsumBytes, zc->checksumBytes);
+    }
+
+    g_free (data);
+
+    return zc;
+
+error:
+    if (data)   g_free (data);
+    if (zc)     zsync_control_free (zc);
+
+    return NULL;
+}
+
+void zsync_control_free (ZsyncControl* zc)
+{
+    g_return_if_fail (zc);
+
+    if (zc->fileName)   g_free (zc->fileName);
+    if (zc->url)        g_free (zc->url);
+    if (zc->sha1)       g_free (zc->sha1);
+    if (zc->sums)       g_free (zc->sums);
+
+    g_free (zc);
+}
+
+bool zsync_download (GUri* uri, const char* control, const char* fileName, GError** error)
+{
+    g_return_val_if_fail (uri && control && fileName, false);
+
+    bool ret = false;
+    g_autoptr (GError) err = NULL;
+    g_autofree char* tmpName = g_strdup_printf ("%s.zsync-part", fileName);
+
+    unlink (tmpName);
+
+    ZsyncControl* zc = zsync_control_load (control, &err);
+    if (zc && zsync_delta (uri, zc, fileName, tmpName, &err)) {
+        ret = true;
+    } else {
+        // the delta did not work out, download the whole file instead
+        logi ("zsync '%s' error: %s, fall back to a full download", fileName, err ? err->message : "");
+        unlink (tmpName);
+
+        Http* http = http_new (uri);
+        if (!http) {
+            gf_error (error, "http_new error");
+            goto out;
+        }
+
+        ret = http_request (http, tmpName);
+        if (!ret) {
+            gf_error (error, "%s", http->error ? http->error->message : "http request error");
+        }
+        http_destroy (http);
+    }
+
+    if (ret && rename (tmpName, fileName) < 0) {
+        gf_error (error, "rename '%s' error: %s", tmpName, strerror (errno));
+        ret = false;
+    }
+
+out:
+    if (!ret)   unlink (tmpName);
+    if (zc)     zsync_control_free (zc);
+
+    return ret;
+}
+
+static bool zsync_delta (GUri* uri, const ZsyncControl* zc, const char* fileName, const char* tmpName, GError** error)
+{
+    bool ret = false;
+    GList* ranges = NULL;
+    int seedFd = -1;
+
+    ZsyncMatcher m;
+    memset (&m, 0, sizeof (m));
+    m.zc = zc;
+    m.seed = MAP_FAILED;
+    m.rsumMask = (4 == zc->rsumBytes) ? 0xffffffff : ((1u << (8 * zc->rsumBytes)) - 1);
+
+    if (!(m.out = output_open (tmpName, true, error)) || !output_reserve (m.out, zc->length, error)) {
+        goto out;
+    }
+
+    // index the block checksums by rsum
+    guint32 size = 16;
+    while (size < 2 * (guint32) zc->numBlocks) {
+        size <<= 1;
+    }
+    m.hashMask = size - 1;
+    m.head = g_malloc (sizeof (int) * size);
+    m.next = g_malloc (sizeof (int) * MAX (zc->numBlocks, 1));
+    m.known = g_malloc0 (sizeof (bool) * MAX (zc->numBlocks, 1));
+    m.window = g_malloc (zc->blockSize);
+    if (!m.head || !m.next || !m.known || !m.window) {
+        gf_error (error, "malloc zsync index error");
+        goto out;
+    }
+
+    memset (m.head, 0xff, sizeof (int) * size);
+    for (int i = zc->numBlocks - 1; i >= 0; --i) {
+        guint32 h = zsync_hash (zc->sums[i].rsum, m.hashMask);
+        m.next[i] = m.head[h];
+        m.head[h] = i;
+    }
+
+    // look for the new blocks anywhere in the old file
+    struct stat st;
+    seedFd = open (fileName, O_RDONLY);
+    if (seedFd >= 0 && 0 == fstat (seedFd, &st) && st.st_size > 0) {
+        m.seedLen = st.st_size;
+        m.seed = mmap (NULL, m.seedLen, PROT_READ, MAP_PRIVATE, seedFd, 0);
+        if (MAP_FAILED != m.seed) {
+            madvise ((void*) m.seed, m.seedLen, MADV_SEQUENTIAL);
+            zsync_scan_seed (&m);
+        }
+    }
+
+    // the rest comes from the server, adjacent missing blocks become one range
+    for (int i = 0; i < zc->numBlocks;) {
+        if (m.known[i]) {
+            ++i;
+            continue;
+        }
+
+        int j = i;
+        while (j + 1 < zc->numBlocks && !m.known[j + 1]) {
+            ++j;
+        }
+
+        HttpByteRange* r = g_malloc (sizeof (HttpByteRange));
+        if (!r) {
+            gf_error (error, "malloc range error");
+            goto out;
+        }
+        r->start = (long long) i * zc->blockSize;
+        r->end = MIN ((long long) (j + 1) * zc->blockSize, zc->length) - 1;
+        ranges = g_list_prepend (ranges, r);
+        i = j + 1;
+    }
+    ranges = g_list_reverse (ranges);
+
+    long long reused = MIN ((long long) m.numKnown * zc->blockSize, zc->length);
+    logi ("zsync '%s': %d of %d blocks found in the local copy (%lld bytes), %d ranges to fetch",
+          fileName, m.numKnown, zc->numBlocks, reused, g_list_length (ranges));
+
+    if (ranges && !http_range_fetch (uri, ranges, zsync_write_func, &m, error)) {
+        goto out;
+    }
+
+    if (zc->sha1 && !zsync_verify (m.out->fd, zc->length, zc->sha1)) {
+        gf_error (error, "SHA-1 of the assembled file does not match");
+        goto out;
+    }
+
+    logi ("zsync '%s' done, %lld bytes downloaded for a %lld byte file", fileName, m.fetched, zc->length);
+
+    ret = true;
+
+out:
+    if (MAP_FAILED != m.seed)   munmap ((void*) m.seed, m.seedLen);
+    if (seedFd >= 0)            close (seedFd);
+    if (m.out)                  output_close (m.out);
+    if (m.head)                 g_free (m.head);
+    if (m.next)                 g_free (m.next);
+    if (m.known)                g_free (m.known);
+    if (m.window)               g_free (m.window);
+    if (ranges)                 g_list_free_full (ranges, g_free);
+
+    return ret;
+}
+
+static bool zsync_fetch_control (const char* url, char** data, gsize* len, GError** error)
+{
+    g_autoptr (GUri) uri = g_uri_parse (url, G_URI_FLAGS_NONE, NULL);
+    if (!uri) {
+        gf_error (error, "invalid url '%s'", url);
+        return false;
+    }
+
+    Http* http = http_new (uri);
+    if (!http) {
+        gf_error (error, "http_new error");
+        return false;
+    }
+
+    bool ret = false;
+    GString* str = g_string_new (NULL);
+    char* buf = g_malloc (MAX_HTTP_READ_SIZE);
+    if (!buf || !http_send (http)) {
+        gf_error (error, "fetch '%s' error: %s", url, http->error ? http->error->message : "");
+        goto out;
+    }
+
+    if (200 != http->resp->statusCode) {
+        gf_error (error, "fetch '%s' error: server returned %d", url, http->resp->statusCode);
+        goto out;
+    }
+
+    int n = 0;
+    while ((n = http_read_body (http, buf, MAX_HTTP_READ_SIZE)) > 0) {
+        g_string_append_len (str, buf, n);
+    }
+
+    if (n < 0) {
+        gf_error (error, "fetch '%s' error: read body error", url);
+        goto out;
+    }
+
+    *len = str->len;
+    *data = g_string_free (str, false);
+    str = NULL;
+    ret = true;
+
+out:
+    if (str)    g_string_free (str, true);
+    if (buf)    g_free (buf);
+    http_destroy (http);
+
+    return ret;
+}
+
+static ZsyncRsum zsync_rsum (const ZsyncMatcher* m, long long off)
+{
+    ZsyncRsum r = {0, 0};
+    int bs = m->zc->blockSize;
+
+    for (int i = 0; i < bs; ++i) {
+        guchar c = zsync_at (m, off + i);
+        r.a += c;
+        r.b += (guint16) ((bs - i) * c);
+    }
+
+    return r;
+}
+
+static const guchar* zsync_window (ZsyncMatcher* m, long long off)
+{
+    int bs = m->zc->blockSize;
+    if (off + bs <= m->seedLen) {
+        return m->seed + off;
+    }
+
+    long long n = MAX (0, m->seedLen - off);
+    memcpy (m->window, m->seed + off, n);
+    memset (m->window + n, 0, bs - n);
+
+    return m->window;
+}
+
+/**
+ * @brief 检查 off 处的块是否是新文件中的某些块
+ * @return 新找到的块数
+ */
+static int zsync_match (ZsyncMatcher* m, long long off, ZsyncRsum r0, ZsyncRsum r1)
+{
+    const ZsyncControl* zc = m->zc;
+    int bs = zc->blockSize;
+    guint32 v0 = zsync_rsum_value (r0, m->rsumMask);
+    guint32 v1 = zsync_rsum_value (r1, m->rsumMask);
+
+    int found = 0;
+    bool haveSum = false;
+    bool haveNextSum = false;
+    guchar sum[16];
+    guchar nextSum[16];
+
+    for (int i = m->head[zsync_hash (v0, m->hashMask)]; i >= 0; i = m->next[i]) {
+        const ZsyncBlockSum* s = &zc->sums[i];
+        if (s->rsum != v0 || m->known[i]) {
+            continue;
+        }
+
+        // with seq_matches 2 the following block has to match as well
+        bool seq = (zc->seqMatches > 1 && i + 1 < zc->numBlocks);
+        if (seq && zc->sums[i + 1].rsum != v1) {
+            continue;
+        }
+
+        if (!haveSum) {
+            zsync_md4 (zsync_window (m, off), bs, sum);
+            haveSum = true;
+        }
+        if (memcmp (sum, s->checksum, zc->checksumBytes)) {
+            continue;
+        }
+
+        if (seq) {
+            if (!haveNextSum) {
+                zsync_md4 (zsync_window (m, off + bs), bs, nextSum);
+                haveNextSum = true;
+            }
+            if (memcmp (nextSum, zc->sums[i + 1].checksum, zc->checksumBytes)) {
+                continue;
+            }
+        }
+
+        long long pos = (long long) i * bs;
+        if (!zsync_write (m->out, zsync_window (m, off), MIN ((long long) bs, zc->length - pos), pos)) {
+            continue;
+        }
+        m->known[i] = true;
+        ++m->numKnown;
+        ++found;
+    }
+
+    return found;
+}
+
+static void zsync_scan_seed (ZsyncMatcher* m)
+{
+    const ZsyncControl* zc = m->zc;
+    int bs = zc->blockSize;
+    bool seq = (zc->seqMatches > 1);
+
+    long long off = 0;
+    ZsyncRsum r0 = zsync_rsum (m, off);
+    ZsyncRsum r1 = seq ? zsync_rsum (m, off + bs) : r0;
+
+    while (off < m->seedLen && m->numKnown < zc->numBlocks) {
+        if (zsync_match (m, off, r0, r1) > 0) {
+            // a match, go on right after it
+            off += bs;
+            r0 = zsync_rsum (m, off);
+            r1 = seq ? zsync_rsum (m, off + bs) : r0;
+            continue;
+        }
+
+        // roll the window(s) one byte forward
+        guchar out = zsync_at (m, off);
+        guchar in = zsync_at (m, off + bs);
+        r0.a += in - out;
+        r0.b += r0.a - (guint16) (bs * out);
+        if (seq) {
+            out = in;
+            in = zsync_at (m, off + 2 * bs);
+            r1.a += in - out;
+            r1.b += r1.a - (guint16) (bs * out);
+        } else {
+            r1 = r0;
+        }
+        ++off;
+    }
+}
+
+static bool zsync_write (Output* out, const guchar* data, long long len, long long offset)
+{
+    g_autoptr (GError) error = NULL;
+    if (!output_write (out, offset, data, len, &error)) {
+        loge ("%s", error->message);
+        return false;
+    }
+
+    return true;
+}
+
+static bool zsync_write_func (long long offset, const char* data, int len, long long total, void* udata)
+{
+    ZsyncMatcher* m = udata;
+
+    if (total >= 0 && total != m->zc->length) {
+        loge ("remote file is %lld bytes, the control file says %lld", total, m->zc->length);
+        return false;
+    }
+
+    m->fetched += len;
+
+    return zsync_write (m->out, (const guchar*) data, len, offset);
+}
+
+static bool zsync_verify (int fd, long long length, const char* sha1)
+{
+    g_autoptr (GChecksum) sum = g_checksum_new (G_CHECKSUM_SHA1);
+    guchar* buf = g_malloc (ZSYNC_READ_SIZE);
+    if (!sum || !buf) {
+        if (buf) g_free (buf);
+        return false;
+    }
+
+    bool ret = true;
+    for (long long off = 0; off < length;) {
+        ssize_t n = pread (fd, buf, MIN ((long long) ZSYNC_READ_SIZE, length - off), off);
+        if (n <= 0) {
+            if (n < 0 && EINTR == errno) continue;
+            ret = false;
+            break;
+        }
+        g_checksum_update (sum, buf, n);
+        off += n;
+    }
+    g_free (buf);
+
+    return ret && 0 == g_ascii_strcasecmp (g_checksum_get_string (sum), sha1);
+}
+
+/**
+ * @brief MD4 (RFC 1320), zsync 的强校验
+ */
+static void zsync_md4 (const guchar* data, size_t len, guchar out[16])
+{
+    static const int s1[4] = {3, 7, 11, 19};
+    static const int s2[4] = {3, 5, 9, 13};
+    static const int s3[4] = {3, 9, 11, 15};
+    static const int k2[16] = {0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15};
+    static const int k3[16] = {0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15};
+
+    guint32 h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    guchar tail[128];
+
+    // the message, then 0x80, zeros and the bit length in the last 64-bit word
+    size_t full = len & ~(size_t) 63;
+    size_t rest = len - full;
+    size_t tailLen = (rest < 56) ? 64 : 128;
+    memset (tail, 0, sizeof (tail));
+    memcpy (tail, data + full, rest);
+    tail[rest] = 0x80;
+    guint64 bits = (guint64) len * 8;
+    for (int i = 0; i < 8; ++i) {
+        tail[tailLen - 8 + i] = (guchar) (bits >> (8 * i));
+    }
+
+    for (size_t off = 0; off < full + tailLen; off += 64) {
+        const guchar* p = (off < full) ? data + off : tail + (off - full);
+        guint32 x[16];
+        for (int i = 0; i < 16; ++i) {
+            x[i] = (guint32) p[4 * i] | ((guint32) p[4 * i + 1] << 8) | ((guint32) p[4 * i + 2] << 16) | ((guint32) p[4 * i + 3] << 24);
+        }
+
+        // every step updates a, d, c, b in turn
+        guint32 v[4] = {h[0], h[1], h[2], h[3]};
+        for (int i = 0; i < 48; ++i) {
+            int t = (4 - (i & 3)) & 3;
+            guint32 b = v[(t + 1) & 3], c = v[(t + 2) & 3], d = v[(t + 3) & 3];
+            guint32 f = 0;
+            int k = 0, s = 0;
+            if (i < 16) {
+                f = (b & c) | (~b & d);
+                k = i;
+                s = s1[i & 3];
+            } else if (i < 32) {
+                f = ((b & c) | (b & d) | (c & d)) + 0x5a827999;
+                k = k2[i - 16];
+                s = s2[i & 3];
+            } else {
+                f = (b ^ c ^ d) + 0x6ed9eba1;
+                k = k3[i - 32];
+                s = s3[i & 3];
+            }
+            guint32 a = v[t] + f + x[k];
+            v[t] = (a << s) | (a >> (32 - s));
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            h[i] += v[i];
+        }
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        out[i] = (guchar) (h[i / 4] >> (8 * (i % 4)));
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef ZSYNC_H
+#define ZSYNC_H
+
+#include <stdbool.h>
+#include <gio/gio.h>
+
+typedef struct _ZsyncControl        ZsyncControl;
+typedef struct _ZsyncBlockSum       ZsyncBlockSum;
+
+/**
+ * @brief 一个块的校验和: 滚动弱校验(rsum) 和 MD4 强校验(只保留前 checksumBytes 字节)
+ */
+struct _ZsyncBlockSum
+{
+    guint32                 rsum;
+    guchar                  checksum[16];
+};
+
+/**
+ * @brief zsync 控制文件(zsyncmake 生成的 .zsync)
+ */
+struct _ZsyncControl
+{
+    char                   *fileName;
+    char                   *url;
+    char                   *sha1;                   // 整个文件的 SHA-1, 十六进制
+    long long               length;
+
+    int                     blockSize;
+    int                     numBlocks;
+    int                     seqMatches;             // 连续几个块都匹配才算匹配
+    int                     rsumBytes;
+    int                     checksumBytes;
+
+    ZsyncBlockSum          *sums;
+};
+
+/**
+ * @brief 读取控制文件
+ * @param path 本地路径或 http(s) URL
+ */
+ZsyncControl*   zsync_control_load      (const char* path, GError** error);
+void            zsync_control_free      (ZsyncControl* zc);
+
+/**
+ * @brief 按控制文件增量更新本地文件
+ *
+ * 在本地旧文件里逐字节滚动查找和新文件相同的块, 缺少的块合并成字节范围用 Range 请求下载,
+ * 拼好的文件通过 SHA-1 校验后替换旧文件; 增量更新失败时退回到完整下载。
+ *
+ * @param uri 新文件的地址
+ * @param control 控制文件的本地路径或 URL
+ * @param fileName 本地文件, 不存在时等同于完整下载
+ */
+bool            zsync_download          (GUri* uri, const char* control, const char* fileName, GError** error);
+
+#endif // ZSYNC_H
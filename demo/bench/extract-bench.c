@@ -0,0 +1,118 @@
+#define _GNU_SOURCE
+#include <ftw.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "output.h"
+#include "extract.h"
+
+#define BENCH_READ_SIZE     (64 << 10)          // 模拟每次从 socket 读到的数据量
+
+typedef enum
+{
+    BENCH_THEN_EXTRACT = 0,                     // 先下载完整个归档, 再从磁盘读回来解包
+    BENCH_STREAM,                               // 边下载边解包, 归档也写到磁盘
+    BENCH_STREAM_NOKEEP,                        // 边下载边解包, 归档不落盘
+} BenchMode;
+
+static int bench_remove (const char* path, const struct stat* st, int flag, struct FTW* ftw)
+{
+    return remove (path);
+}
+
+static char* bench_load (const char* fileName, long long* len)
+{
+    char* data = NULL;
+    gsize size = 0;
+    if (!g_file_get_contents (fileName, &data, &size, NULL)) {
+        return NULL;
+    }
+    *len = size;
+
+    return data;
+}
+
+/**
+ * @brief 把内存里的归档当作网络数据按 BENCH_READ_SIZE 一块块收下来
+ */
+static bool bench_run (BenchMode mode, const char* data, long long len, const char* archive, const char* target, GError** error)
+{
+    bool ok = false;
+    Output* out = NULL;
+    Extract* x = extract_new (target, error);
+    if (!x) {
+        return false;
+    }
+
+    if (BENCH_STREAM_NOKEEP != mode && !(out = output_open (archive, true, error))) {
+        goto out;
+    }
+
+    for (long long pos = 0; pos < len; pos += BENCH_READ_SIZE) {
+        int n = (int) MIN ((long long) BENCH_READ_SIZE, len - pos);
+        if (out && !output_write (out, pos, data + pos, n, error)) {
+            goto out;
+        }
+        if (BENCH_THEN_EXTRACT != mode && !extract_feed (x, data + pos, n, error)) {
+            goto out;
+        }
+    }
+
+    // the download is done, only now does extraction start
+    if (BENCH_THEN_EXTRACT == mode && !extract_restart (x, archive, len, error)) {
+        goto out;
+    }
+    ok = extract_finish (x, error);
+
+out:
+    if (out)    output_close (out);
+    extract_free (x);
+
+    return ok;
+}
+
+int main (int argc, char* argv[])
+{
+    if (argc < 2) {
+        printf ("Usage: %s <archive.tar[.gz|.zst]> [dir]\n", argv[0]);
+        return -1;
+    }
+    const char* dir = argc > 2 ? argv[2] : g_get_tmp_dir ();
+
+    long long len = 0;
+    char* data = bench_load (argv[1], &len);
+    if (!data) {
+        printf ("read '%s' error\n", argv[1]);
+        return -1;
+    }
+
+    g_autofree char* archive = g_strdup_printf ("%s/extract-bench.%d.archive", dir, getpid ());
+    g_autofree char* target = g_strdup_printf ("%s/extract-bench.%d", dir, getpid ());
+    const char* names[] = { "then-extract", "stream", "stream-nokeep" };
+
+    printf ("%s: %.1f MiB, %d KiB per read, into %s\n", argv[1], len / 1048576.0, BENCH_READ_SIZE >> 10, target);
+    printf ("%-14s %10s %14s %12s\n", "mode", "seconds", "s (synced)", "MiB/s");
+    for (int m = BENCH_THEN_EXTRACT; m <= BENCH_STREAM_NOKEEP; ++m) {
+        g_autoptr (GError) error = NULL;
+        nftw (target, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+        unlink (archive);
+        sync ();
+
+        double t0 = gf_gettime ();
+        bool ok = bench_run (m, data, len, archive, target, &error);
+        double t1 = gf_gettime ();
+        sync ();
+        double t2 = gf_gettime ();
+
+        printf ("%-14s %10.3f %14.3f %12.1f%s%s\n", names[m], t1 - t0, t2 - t0, len / 1048576.0 / (t1 - t0),
+                ok ? "" : "  ", ok ? "" : (error ? error->message : "error"));
+    }
+    nftw (target, bench_remove, 16, FTW_DEPTH | FTW_PHYS);
+    unlink (archive);
+    g_free (data);
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "output.h"
+
+#define BENCH_READ_SIZE     (64 << 10)          // 模拟每次从 socket 读到的数据量
+#define BENCH_DEFAULT_MB    1024
+#define BENCH_DEFAULT_THREADS 4
+
+typedef enum
+{
+    BENCH_PWRITE = 0,                           // 每次读到数据就 pwrite
+    BENCH_WRITE_BEHIND,                         // 写缓冲环
+    BENCH_MMAP,                                 // 数据直接放进映射区
+    BENCH_WRITEBACK,                            // 写缓冲环, 按窗口 sync_file_range 并丢掉页缓存
+} BenchMode;
+
+typedef struct
+{
+    Output*         out;
+    BenchMode       mode;
+    long long       start;
+    long long       end;
+    const char*     src;
+    bool            ok;
+    int*            finished;
+} BenchWorker;
+
+static void* bench_worker (void* arg)
+{
+    BenchWorker* w = arg;
+    w->ok = true;
+
+    if (BENCH_PWRITE == w->mode) {
+        for (long long pos = w->start; pos < w->end && w->ok; pos += BENCH_READ_SIZE) {
+            w->ok = output_write (w->out, pos, w->src, MIN ((long long) BENCH_READ_SIZE, w->end - pos), NULL);
+        }
+        return NULL;
+    }
+
+    // the memcpy stands in for the socket read into the stream's memory
+    OutputStream* s = output_stream_new (w->out, w->start);
+    for (long long pos = w->start; pos < w->end && w->ok;) {
+        int room = 0;
+        char* dst = output_stream_buffer (s, &room, NULL);
+        if (!dst) {
+            w->ok = false;
+            break;
+        }
+        int n = (int) MIN ((long long) MIN (room, BENCH_READ_SIZE), w->end - pos);
+        memcpy (dst, w->src, n);
+        w->ok = output_stream_commit (s, n, NULL);
+        pos += n;
+    }
+    w->ok = output_stream_close (s, NULL) && w->ok;
+
+    return NULL;
+}
+
+static void* bench_worker_run (void* arg)
+{
+    BenchWorker* w = arg;
+    bench_worker (w);
+    __atomic_add_fetch (w->finished, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static long bench_rss_kb ()
+{
+    long pages = 0, resident = 0;
+    FILE* f = fopen ("/proc/self/statm", "r");
+    if (f) {
+        if (2 != fscanf (f, "%ld %ld", &pages, &resident)) resident = 0;
+        fclose (f);
+    }
+
+    return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * @brief 整个系统里脏的和正在回写的页缓存, 其它进程的写入也算在里面
+ */
+static long bench_dirty_kb ()
+{
+    long dirty = 0;
+    char line[256];
+    FILE* f = fopen ("/proc/meminfo", "r");
+    if (f) {
+        while (fgets (line, sizeof (line), f)) {
+            long kb = 0;
+            if (1 == sscanf (line, "Dirty: %ld kB", &kb) || 1 == sscanf (line, "Writeback: %ld kB", &kb)) {
+                dirty += kb;
+            }
+        }
+        fclose (f);
+    }
+
+    return dirty;
+}
+
+int main (int argc, char* argv[])
+{
+    const char* dir = argc > 1 ? argv[1] : g_get_tmp_dir ();
+    long long size = (long long) (argc > 2 ? atoi (argv[2]) : BENCH_DEFAULT_MB) << 20;
+    int threads = argc > 3 ? atoi (argv[3]) : BENCH_DEFAULT_THREADS;
+    if (size <= 0 || threads <= 0) {
+        printf ("Usage: %s [dir] [MiB] [threads]\n", argv[0]);
+        return -1;
+    }
+
+    char* src = malloc (BENCH_READ_SIZE);
+    BenchWorker* workers = calloc (threads, sizeof (BenchWorker));
+    pthread_t* tids = calloc (threads, sizeof (pthread_t));
+    if (!src || !workers || !tids) {
+        return -1;
+    }
+    memset (src, 'x', BENCH_READ_SIZE);
+
+    g_autofree char* fileName = g_strdup_printf ("%s/output-bench.%d", dir, getpid ());
+    const char* names[] = { "pwrite", "write-behind", "mmap", "writeback" };
+
+    printf ("%lld MiB, %d threads, %d KiB per read, file %s\n", size >> 20, threads, BENCH_READ_SIZE >> 10, fileName);
+    printf ("%-14s %12s %14s %12s %14s\n", "mode", "MiB/s", "MiB/s (sync)", "+rss KiB", "+dirty KiB");
+    for (int m = BENCH_PWRITE; m <= BENCH_WRITEBACK; ++m) {
+        g_autoptr (GError) error = NULL;
+        unlink (fileName);
+        Output* out = output_open (fileName, true, &error);
+        if (!out || !output_reserve (out, size, &error) || (BENCH_MMAP == m && !output_map (out, &error))) {
+            printf ("%-14s %s\n", names[m], error ? error->message : "error");
+            if (out) output_close (out);
+            continue;
+        }
+        if (BENCH_WRITEBACK == m) {
+            output_set_writeback (out, OUTPUT_WRITEBACK_WINDOW);
+        }
+
+        // every thread fills its own part of the file, like the segments of a download
+        long rss0 = bench_rss_kb ();
+        long dirty0 = bench_dirty_kb ();
+        long dirtyPeak = dirty0;
+        int finished = 0;
+        double t0 = gf_gettime ();
+        long long part = size / threads;
+        for (int i = 0; i < threads; ++i) {
+            workers[i] = (BenchWorker) { out, m, i * part, (i == threads - 1) ? size : (i + 1) * part, src, false, &finished };
+            pthread_create (&tids[i], NULL, bench_worker_run, &workers[i]);
+        }
+
+        // the peak of dirty memory while the file is written, not what is left at the end
+        while (__atomic_load_n (&finished, __ATOMIC_ACQUIRE) < threads) {
+            dirtyPeak = MAX (dirtyPeak, bench_dirty_kb ());
+            usleep (10000);
+        }
+        bool ok = true;
+        for (int i = 0; i < threads; ++i) {
+            pthread_join (tids[i], NULL);
+            ok = ok && workers[i].ok;
+        }
+        double t1 = gf_gettime ();
+        long rss = bench_rss_kb () - rss0;
+        fdatasync (out->fd);
+        double t2 = gf_gettime ();
+
+        printf ("%-14s %12.1f %14.1f %12ld %14ld%s\n", names[m], (size >> 20) / (t1 - t0), (size >> 20) / (t2 - t0), rss, dirtyPeak - dirty0, ok ? "" : "  (write error)");
+        output_close (out);
+    }
+    unlink (fileName);
+
+    free (src);
+    free (workers);
+    free (tids);
+
+    return 0;
+}
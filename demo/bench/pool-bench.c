@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <sched.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "utils.h"
+#include "thread-pool.h"
+
+#define BENCH_DEFAULT_TASKS     1000000
+#define BENCH_DEFAULT_THREADS   10
+#define BENCH_BACKLOG           100000          // 线程都忙时一次提交的任务数, 像一次加入十万个 URL
+
+static long long gDone = 0;
+static int gRelease = 0;
+static int gRunning = 0;
+
+typedef struct
+{
+    long long       tasks;
+    bool            spawn;
+    long long       done;
+    double          seconds;
+} BenchProducer;
+
+static void* bench_task (void* arg)
+{
+    __atomic_add_fetch (&gDone, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+static void* bench_count (void* arg)
+{
+    __atomic_add_fetch ((long long*) arg, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+/**
+ * @brief 占住一个线程, 直到 gRelease 被设置
+ */
+static void* bench_block (void* arg)
+{
+    while (!__atomic_load_n (&gRelease, __ATOMIC_ACQUIRE)) {
+        usleep (1000);
+    }
+    __atomic_add_fetch (&gDone, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+static void* bench_producer (void* arg)
+{
+    BenchProducer* p = arg;
+    double t0 = gf_gettime ();
+    for (long long i = 0; i < p->tasks; ++i) {
+        while (0 != thread_pool_add_work (bench_task, NULL));
+    }
+    p->seconds = gf_gettime () - t0;
+
+    return NULL;
+}
+
+/**
+ * @brief 在线程池的线程里提交 tasks 个子任务并等它们完成, spawn 为 true 时走自己的双端队列, 否则走注入队列
+ */
+static void* bench_fork (void* arg)
+{
+    BenchProducer* p = arg;
+    if (p->spawn) {
+        thread_group_t group;
+        memset (&group, 0, sizeof (group));
+        for (long long i = 0; i < p->tasks; ++i) {
+            if (0 != thread_pool_spawn (&group, bench_count, &p->done)) {
+                bench_count (&p->done);
+            }
+        }
+        thread_pool_wait (&group);
+    } else {
+        for (long long i = 0; i < p->tasks; ++i) {
+            while (0 != thread_pool_add_work (bench_count, &p->done));
+        }
+        while (__atomic_load_n (&p->done, __ATOMIC_ACQUIRE) < p->tasks) {
+            sched_yield ();
+        }
+    }
+    __atomic_sub_fetch (&gRunning, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static void bench_wait (long long total)
+{
+    while (__atomic_load_n (&gDone, __ATOMIC_RELAXED) < total) {
+        usleep (100);
+    }
+}
+
+int main (int argc, char* argv[])
+{
+    long long tasks = argc > 1 ? atoll (argv[1]) : BENCH_DEFAULT_TASKS;
+    int threads = argc > 2 ? atoi (argv[2]) : BENCH_DEFAULT_THREADS;
+    if (tasks <= 0 || threads <= 0) {
+        printf ("Usage: %s [tasks] [pool threads]\n", argv[0]);
+        return -1;
+    }
+
+    if (0 != thread_pool_init (threads)) {
+        printf ("thread_pool_init error\n");
+        return -1;
+    }
+
+    // every thread is busy, the whole backlog has to be queued
+    __atomic_store_n (&gDone, 0, __ATOMIC_RELAXED);
+    for (int i = 0; i < threads; ++i) {
+        thread_pool_add_work (bench_block, NULL);
+    }
+    double t0 = gf_gettime ();
+    for (int i = 0; i < BENCH_BACKLOG; ++i) {
+        thread_pool_add_work (bench_task, NULL);
+    }
+    double t1 = gf_gettime ();
+    __atomic_store_n (&gRelease, 1, __ATOMIC_RELEASE);
+    bench_wait (BENCH_BACKLOG + threads);
+    double t2 = gf_gettime ();
+    printf ("backlog of %d tasks with %d busy threads: %.1f ns per enqueue, drained in %.1f ms\n",
+            BENCH_BACKLOG, threads, (t1 - t0) * 1e9 / BENCH_BACKLOG, (t2 - t1) * 1e3);
+
+    // producers and pool threads running at the same time
+    printf ("%lld no-op tasks, %d pool threads\n", tasks, threads);
+    printf ("%-10s %16s %16s\n", "producers", "enqueue Mops/s", "total Mops/s");
+    for (int producers = 1; producers <= 8; producers *= 2) {
+        BenchProducer ps[8];
+        pthread_t tids[8];
+        __atomic_store_n (&gDone, 0, __ATOMIC_RELAXED);
+
+        t0 = gf_gettime ();
+        for (int i = 0; i < producers; ++i) {
+            ps[i].tasks = tasks / producers;
+            pthread_create (&tids[i], NULL, bench_producer, &ps[i]);
+        }
+        double slowest = 0;
+        for (int i = 0; i < producers; ++i) {
+            pthread_join (tids[i], NULL);
+            slowest = MAX (slowest, ps[i].seconds);
+        }
+        long long total = tasks / producers * producers;
+        bench_wait (total);
+        t1 = gf_gettime ();
+
+        printf ("%-10d %16.2f %16.2f\n", producers, total / slowest / 1e6, total / (t1 - t0) / 1e6);
+    }
+
+    // pipeline stages on pool threads forking subtasks and joining them
+    printf ("fork/join of %lld no-op subtasks from pool threads\n", tasks);
+    printf ("%-10s %16s %16s\n", "roots", "add_work Mops/s", "spawn Mops/s");
+    for (int roots = 1; roots <= threads; roots = (roots * 2 > threads && roots < threads) ? threads : roots * 2) {
+        double rate[2] = { 0, 0 };
+        for (int spawn = 0; spawn <= 1; ++spawn) {
+            // a root waiting on add_work tasks cannot help run them, keep one thread free for those
+            if (!spawn && roots >= threads) continue;
+
+            BenchProducer ps[BENCH_DEFAULT_THREADS * 4];
+            int n = MIN (roots, (int) G_N_ELEMENTS (ps));
+            __atomic_store_n (&gRunning, n, __ATOMIC_RELAXED);
+            t0 = gf_gettime ();
+            for (int i = 0; i < n; ++i) {
+                ps[i].tasks = tasks / n;
+                ps[i].spawn = spawn;
+                ps[i].done = 0;
+                thread_pool_add_work (bench_fork, &ps[i]);
+            }
+            while (0 != __atomic_load_n (&gRunning, __ATOMIC_ACQUIRE)) {
+                usleep (100);
+            }
+            rate[spawn] = tasks / n * n / (gf_gettime () - t0) / 1e6;
+        }
+        if (rate[0] > 0) {
+            printf ("%-10d %16.2f %16.2f\n", roots, rate[0], rate[1]);
+        } else {
+            printf ("%-10d %16s %16.2f\n", roots, "-", rate[1]);
+        }
+    }
+
+    thread_pool_destory ();
+
+    return 0;
+}
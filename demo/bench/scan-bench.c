@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_ticks()       __rdtsc ()
+#define TICK_NAME           "cycle"
+#else
+static unsigned long long bench_ticks ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#define TICK_NAME           "ns"
+#endif
+
+#define BENCH_BUF_SIZE      (256 << 10)
+#define BENCH_ROUNDS        200
+
+static const char* gHeaders[] = {
+    "HTTP/1.1 200 OK\r\n"
+    "Date: Mon, 19 Oct 2026 08:12:44 GMT\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "Content-Length: 734003200\r\n"
+    "Connection: keep-alive\r\n"
+    "Last-Modified: Tue, 06 Oct 2026 21:08:07 GMT\r\n"
+    "ETag: \"2bc00000-5b2c3f4a1e7c0\"\r\n"
+    "Accept-Ranges: bytes\r\n"
+    "Server: nginx/1.24.0\r\n"
+    "\r\n",
+
+    "HTTP/1.1 206 Partial Content\r\n"
+    "Content-Type: application/x-tar\r\n"
+    "Content-Range: bytes 1048576-2097151/734003200\r\n"
+    "Content-Length: 1048576\r\n"
+    "Cache-Control: public, max-age=31536000, immutable\r\n"
+    "X-Amz-Cf-Id: 3mT2bYlqZc9kqB1YwQ8kD3nHk3m1s0a5xZkTL2hVn8u1c9ZyK0Lk1A==\r\n"
+    "Via: 1.1 6b2c0b1e4c2b0b7a.cloudfront.net (CloudFront)\r\n"
+    "Age: 5123\r\n"
+    "\r\n",
+
+    "HTTP/1.1 302 Found\r\n"
+    "Location: https://mirror.example.org/pub/releases/2026.10/images/disk-amd64.img\r\n"
+    "Set-Cookie: session=9f8e7d6c5b4a39281706f5e4d3c2b1a0; Path=/; HttpOnly; Secure\r\n"
+    "Strict-Transport-Security: max-age=63072000; includeSubDomains; preload\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n",
+};
+
+
+typedef size_t (*BenchFunc) (const ScanKernels* k, const char* buf, size_t len);
+
+static size_t bench_lines (const ScanKernels* k, const char* buf, size_t len)
+{
+    size_t n = 0;
+    for (const char* p = buf, *end = buf + len; (p = k->find_byte (p, end - p, '\n')); ++p) ++n;
+
+    return n;
+}
+
+static size_t bench_colon (const ScanKernels* k, const char* buf, size_t len)
+{
+    size_t n = 0;
+    for (const char* p = buf, *end = buf + len; (p = k->find_byte (p, end - p, ':')); ++p) ++n;
+
+    return n;
+}
+
+static size_t bench_crlf (const ScanKernels* k, const char* buf, size_t len)
+{
+    size_t n = 0;
+    for (const char* p = buf, *end = buf + len; (p = k->find_crlf (p, end - p)); p += 2) ++n;
+
+    return n;
+}
+
+static size_t bench_header_end (const ScanKernels* k, const char* buf, size_t len)
+{
+    size_t n = 0;
+    for (const char* p = buf, *end = buf + len; (p = k->find_crlfcrlf (p, end - p)); p += 4) ++n;
+
+    return n;
+}
+
+static size_t bench_chunk_size (const ScanKernels* k, const char* buf, size_t len)
+{
+    // chunk data is opaque, only the size line terminators are searched
+    size_t n = 0;
+    for (const char* p = buf, *end = buf + len; p < end; p += 4096 + 2) {
+        p = k->find_byte (p, end - p, '\n');
+        if (!p) break;
+        ++n;
+    }
+
+    return n;
+}
+
+int main (int argc, char* argv[])
+{
+    char* buf = malloc (BENCH_BUF_SIZE);
+    char* chunked = malloc (BENCH_BUF_SIZE);
+    if (!buf || !chunked) {
+        return -1;
+    }
+
+    // realistic response headers back to back
+    size_t len = 0;
+    for (int i = 0; ; i = (i + 1) % 3) {
+        size_t l = strlen (gHeaders[i]);
+        if (len + l > BENCH_BUF_SIZE) break;
+        memcpy (buf + len, gHeaders[i], l);
+        len += l;
+    }
+
+    // 4 KiB chunks: "1000;name=value\r\n" <data> "\r\n"
+    size_t clen = 0;
+    while (clen + 4096 + 64 < BENCH_BUF_SIZE) {
+        clen += sprintf (chunked + clen, "1000;name=value\r\n");
+        memset (chunked + clen, 'x', 4096);
+        clen += 4096;
+        chunked[clen++] = '\r';
+        chunked[clen++] = '\n';
+    }
+
+    struct {
+        const char*     name;
+        BenchFunc       func;
+        const char*     buf;
+        size_t          len;
+    } cases[] = {
+        { "line '\\n'",          bench_lines,        buf,        len },
+        { "colon ':'",          bench_colon,        buf,        len },
+        { "crlf",               bench_crlf,         buf,        len },
+        { "header end",         bench_header_end,   buf,        len },
+        { "chunk size line",    bench_chunk_size,   chunked,    clen },
+    };
+
+    ScanImpl impls[] = { SCAN_IMPL_SCALAR, SCAN_IMPL_SSE2, SCAN_IMPL_AVX2, SCAN_IMPL_AUTO };
+
+    printf ("%-18s %-8s %12s %14s %10s\n", "case", "impl", "matches", "bytes/" TICK_NAME, "speedup");
+    for (int c = 0; c < (int) (sizeof (cases) / sizeof (cases[0])); ++c) {
+        double base = 0;
+        for (int i = 0; i < (int) (sizeof (impls) / sizeof (impls[0])); ++i) {
+            const ScanKernels* k = scan_kernels (impls[i]);
+            if (!k) continue;
+
+            size_t matches = cases[c].func (k, cases[c].buf, cases[c].len);
+            unsigned long long best = ~0ull;
+            for (int r = 0; r < BENCH_ROUNDS; ++r) {
+                unsigned long long t0 = bench_ticks ();
+                matches = cases[c].func (k, cases[c].buf, cases[c].len);
+                unsigned long long t = bench_ticks () - t0;
+                if (t < best) best = t;
+            }
+
+            double bpt = (double) cases[c].len / (double) best;
+            if (0 == i) base = bpt;
+            printf ("%-18s %-8s %12zu %14.2f %9.2fx\n", cases[c].name, SCAN_IMPL_AUTO == impls[i] ? "auto" : k->name, matches, bpt, bpt / base);
+        }
+    }
+
+    free (buf);
+    free (chunked);
+
+    return 0;
+}
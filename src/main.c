@@ -10,16 +10,21 @@
 #include <sys/ipc.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
 #include <semaphore.h>
 
 #include "log.h"
 #include "utils.h"
+#include "output.h"
+#include "compress.h"
 #include "global.h"
+#include "pool-tuner.h"
 #include "thread-pool.h"
+#include "download-queue.h"
 #include "download-manager.h"
 
-#define MAX_THREAD                  10
+#define START_THREAD                10              // 初始线程数, 之后由 pool-tuner 按吞吐量调整
 #define SEM_KEY                     202112
 #define COMMANDLINE_BUF             10240
 #define PROGRESS_NAME               "graceful-downloader"
@@ -78,6 +83,8 @@ int main (int argc, char *argv[])
     signal(SIGINT, stop);
     signal(SIGTERM, stop);
     signal(SIGKILL, stop);
+    // a peer that went away must fail the write, not kill the process
+    signal(SIGPIPE, SIG_IGN);
 
     g_autofree gchar* dir = NULL;
     g_autoptr (GError) error = NULL;
@@ -131,12 +138,13 @@ int main (int argc, char *argv[])
     logi ("%s is starting ...", PROGRESS_NAME);
 
     // start main
-    ret = thread_pool_init (MAX_THREAD);
+    ret = thread_pool_init (START_THREAD);
     if (0 != ret) {
         printf ("thread_pool_init error!\n");
         destory ();
         exit (-1);
     }
+    pool_tuner_start (POOL_TUNER_MIN_DEFAULT, POOL_TUNER_MAX_DEFAULT);
 
     g_main_loop_run (gMain->mainLoop);
 
@@ -272,6 +280,7 @@ static void destory ()
             sem_unlink (key);
         }
 
+        pool_tuner_stop ();
         thread_pool_destory();
         protocol_unregister ();
     }
@@ -301,8 +310,52 @@ static void* start_routine (void* data)
                         "  -h\tThis information\n"
                         "  -v\tVersion information\n"
                         "  -l\tList supported protocols\n"
+                        "  -i\tShow write throughput and latency per disk\n"
                         "  -d\tSet the path for saving the downloaded file,\n"
                         "    \t<Note that this parameter only applies to the URI appended this time>\n"
+                        "  -m\tThe URIs appended this time are mirrors of one file,\n"
+                        "    \tdownload it from all of them at once\n"
+                        "  -s\t<ratio>[,<budget>] Hedge the last ranges that run below <ratio>\n"
+                        "    \tof the best throughput, using at most <budget> extra bytes\n"
+                        "    \t(a fraction of the file size, 0 disables hedging)\n"
+                        "  -r\t<ranges> Only download these byte ranges into a sparse file,\n"
+                        "    \te.g. 0-1023,4096-8191,-65536 (the last 64 KiB)\n"
+                        "  -rp\t<ranges> Like -r, but save every range to <file>.<start>-<end>\n"
+                        "  -z\t<control> Update the local copy of the file with a zsync control\n"
+                        "    \tfile (path or URL), only the changed blocks are downloaded\n"
+                        "  -t\t<timeout>[,<bytes/s>,<seconds>] Reconnect and resume when nothing\n"
+                        "    \tarrives for <timeout> seconds (default 30, 0 never), or when the\n"
+                        "    \tspeed stays below <bytes/s> for <seconds> (default 1024,60)\n"
+                        "  -b\t<pwrite|mmap|writeback|zstd[:<level>]> How downloads write the file\n"
+                        "    \t(default pwrite), writeback keeps dirty page cache per download\n"
+                        "    \tbounded, zstd saves <file>.zst in independent frames and a seek\n"
+                        "    \tindex <file>.zst.idx\n"
+                        "  -c\t<md5|sha256|crc32c>:<hex> Verify the file while it downloads; without it\n"
+                        "    \tDigest, Repr-Digest and Content-MD5 response headers are checked. A file\n"
+                        "    \tthat does not match fails the task and is moved to .quarantine/\n"
+                        "  -k\t<list|size:root> Check the file in pieces of <size> bytes against a\n"
+                        "    \tpiece list file (\"size <n>\", optional \"root <hex>\", one SHA-256 per\n"
+                        "    \tline) or a merkle root, and download only the bad pieces again\n"
+                        "  -a\t<dir>[,etag] Keep finished files in a content-addressed store, a file\n"
+                        "    \twith known content is linked from there instead of downloaded again\n"
+                        "    \t(\"etag\" also trusts equal ETags from the same host)\n"
+                        "  -g\t<dir>[,<movers>[,<bytes/s>]] Download into a fast staging dir and move\n"
+                        "    \tfinished files to -d in the background with <movers> threads\n"
+                        "    \t(default 1) sharing at most <bytes/s> (default unlimited)\n"
+                        "  -q\t<writers>,<buffers>[,<tasks>] Budget per disk: writer threads, write\n"
+                        "    \tbuffers (1 MiB) and downloads at once (default 2,16,4); a slow disk\n"
+                        "    \tdoes not hold threads and buffers that other disks could use\n"
+                        "  -x\t<dir>[,nokeep] Extract a .tar, .tar.gz or .tar.zst into <dir> while it\n"
+                        "    \tdownloads; with nokeep the archive is not written to disk and a broken\n"
+                        "    \tconnection starts over (mirrors: it is removed after extracting)\n"
+                        "  -p\t<interactive|normal|bulk> Priority of the URIs appended this time\n"
+                        "    \t(default normal); within a priority smaller files go first and\n"
+                        "    \ttasks move up the longer they wait\n"
+                        "  -pr\t<interactive|normal|bulk> Move the given URIs that are still\n"
+                        "    \twaiting in the queue to this priority\n"
+                        "  -w\t<min>,<max> Keep between <min> and <max> download threads (default\n"
+                        "    \t4,64); threads are added while they raise the total speed and idle\n"
+                        "    \tones retire, <min> equal to <max> fixes the number\n"
                         "", PROGRESS_NAME);
 
     // version
@@ -316,6 +369,32 @@ static void* start_routine (void* data)
 
         // parse command line
         char* dir = NULL;
+        bool mirrors = false;
+        double hedgeRatio = -1;
+        double hedgeBudget = -1;
+        char* ranges = NULL;
+        bool splitRanges = false;
+        char* zsync = NULL;
+        int ioTimeout = -1;
+        int lowSpeedLimit = -1;
+        int lowSpeedTime = -1;
+        bool useMmap = false;
+        bool writeback = false;
+        int compress = 0;
+        char* checksum = NULL;
+        char* pieces = NULL;
+        char* store = NULL;
+        bool storeEtag = false;
+        char* staging = NULL;
+        int movers = -1;
+        long long moveRate = -1;
+        char* extract = NULL;
+        bool extractKeep = true;
+        int ioWriters = -1;
+        int ioDepth = -1;
+        int ioTasks = -1;
+        DownloadPriority priority = DOWNLOAD_PRIORITY_NORMAL;
+        bool reprioritize = false;
         GList* uris = NULL;
         bool hasUri = false;
         GList* notSupportedUri = NULL;
@@ -344,12 +423,143 @@ static void* start_routine (void* data)
                     g_list_free_full (ll, g_free);
                     message_to_client (schemas);
                     goto out;
+                } else if (0 == g_ascii_strcasecmp ("-i", arr[i])) {
+                    int count = 0;
+                    OutputDeviceStats* ds = output_device_stats (&count);
+                    GString* msg = g_string_new (NULL);
+                    g_string_append_printf (msg, "%-8s %10s %10s %10s %10s %8s %9s %8s  %s\n",
+                                            "device", "MiB", "MiB/s", "avg ms", "max ms", "waits", "buffers", "writers", "path");
+                    for (int k = 0; k < count; ++k) {
+                        g_autofree char* dev = g_strdup_printf ("%u:%u", major (ds[k].dev), minor (ds[k].dev));
+                        g_autofree char* buffers = g_strdup_printf ("%d/%d", ds[k].inUse, ds[k].depth);
+                        g_autofree char* writers = g_strdup_printf ("%d/%d", ds[k].writing, ds[k].writers);
+                        g_string_append_printf (msg, "%-8s %10.1f %10.1f %10.2f %10.2f %8llu %9s %8s  %s\n", dev,
+                                                ds[k].bytes / 1048576.0, ds[k].busy > 0 ? ds[k].bytes / 1048576.0 / ds[k].busy : 0.0,
+                                                ds[k].writes ? ds[k].busy * 1000 / ds[k].writes : 0.0, ds[k].maxLatency * 1000,
+                                                (unsigned long long) ds[k].waits, buffers, writers, ds[k].path);
+                    }
+                    g_free (ds);
+                    message_to_client (msg->str);
+                    g_string_free (msg, true);
+                    goto out;
                 } else if (0 == g_ascii_strcasecmp ("-d", arr[i])) {
                     if (i + 1 < len) {
                         i += 1;
                         dir = arr [i];
                     }
                     continue;
+                } else if (0 == g_ascii_strcasecmp ("-m", arr[i])) {
+                    mirrors = true;
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-s", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        sscanf (arr[i], "%lf,%lf", &hedgeRatio, &hedgeBudget);
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-r", arr[i]) || 0 == g_ascii_strcasecmp ("-rp", arr[i])) {
+                    splitRanges = (0 == g_ascii_strcasecmp ("-rp", arr[i]));
+                    if (i + 1 < len) {
+                        i += 1;
+                        ranges = arr[i];
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-z", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        zsync = arr[i];
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-t", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        sscanf (arr[i], "%d,%d,%d", &ioTimeout, &lowSpeedLimit, &lowSpeedTime);
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-b", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        useMmap = (0 == g_ascii_strcasecmp ("mmap", arr[i]));
+                        writeback = (0 == g_ascii_strcasecmp ("writeback", arr[i]));
+                        if (0 == g_ascii_strncasecmp ("zstd", arr[i], 4)) {
+                            compress = COMPRESS_LEVEL_DEFAULT;
+                            sscanf (arr[i] + 4, ":%d", &compress);
+                        }
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-c", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        checksum = arr[i];
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-k", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        pieces = arr[i];
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-a", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        store = arr[i];
+                        char* opt = strrchr (store, ',');
+                        if (opt && 0 == g_ascii_strcasecmp (opt, ",etag")) {
+                            *opt = '\0';
+                            storeEtag = true;
+                        }
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-g", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        staging = arr[i];
+                        char* opt = strchr (staging, ',');
+                        if (opt) {
+                            *opt = '\0';
+                            sscanf (opt + 1, "%d,%lld", &movers, &moveRate);
+                        }
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-q", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        sscanf (arr[i], "%d,%d,%d", &ioWriters, &ioDepth, &ioTasks);
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-p", arr[i]) || 0 == g_ascii_strcasecmp ("-pr", arr[i])) {
+                    reprioritize = (0 == g_ascii_strcasecmp ("-pr", arr[i]));
+                    if (i + 1 < len) {
+                        i += 1;
+                        if (!download_priority_parse (arr[i], &priority)) {
+                            g_autofree char* msg = g_strdup_printf ("Unknown priority '%s', use interactive, normal or bulk\n", arr[i]);
+                            message_to_client (msg);
+                            g_list_free_full (uris, (void*) g_uri_unref);
+                            g_list_free (notSupportedUri);
+                            goto out;
+                        }
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-w", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        int minThreads = -1;
+                        int maxThreads = -1;
+                        sscanf (arr[i], "%d,%d", &minThreads, &maxThreads);
+                        pool_tuner_start (minThreads, maxThreads);
+                    }
+                    continue;
+                } else if (0 == g_ascii_strcasecmp ("-x", arr[i])) {
+                    if (i + 1 < len) {
+                        i += 1;
+                        extract = arr[i];
+                        char* opt = strrchr (extract, ',');
+                        if (opt && 0 == g_ascii_strcasecmp (opt, ",nokeep")) {
+                            *opt = '\0';
+                            extractKeep = false;
+                        }
+                    }
+                    continue;
                 }
             } else {
                 hasUri = true;
@@ -386,13 +596,57 @@ static void* start_routine (void* data)
                 message_to_client (nsupportMsg);
             }
 
+            // only tasks still waiting for a thread can move
+            if (uris && reprioritize) {
+                GString* msg = g_string_new (NULL);
+                for (GList* l = uris; NULL != l; l = l->next) {
+                    g_autofree char* uri = g_uri_to_string (l->data);
+                    int n = download_queue_reprioritize (uri, priority);
+                    if (n > 0) {
+                        g_string_append_printf (msg, "%s: %s\n", uri, download_priority_name (priority));
+                    } else {
+                        g_string_append_printf (msg, "%s: not waiting in the queue\n", uri);
+                    }
+                }
+                message_to_client_append (msg->str);
+                g_string_free (msg, true);
+                g_list_free_full (uris, (void*) g_uri_unref);
+                uris = NULL;
+            }
+
             // print callback
             if (uris) {
                 // add Task
-                DownloadTask task;
+                DownloadTask task = {0};
                 task.uris = uris;
+                task.mirrors = mirrors;
+                task.hedgeRatio = hedgeRatio;
+                task.hedgeBudget = hedgeBudget;
+                task.ranges = ranges;
+                task.splitRanges = splitRanges;
+                task.zsync = zsync;
+                task.ioTimeout = ioTimeout;
+                task.lowSpeedLimit = lowSpeedLimit;
+                task.lowSpeedTime = lowSpeedTime;
+                task.mmap = useMmap;
+                task.writeback = writeback;
+                task.compress = compress;
+                task.checksum = checksum;
+                task.pieces = pieces;
+                task.store = store;
+                task.storeEtag = storeEtag;
+                task.staging = staging;
+                task.movers = movers;
+                task.moveRate = moveRate;
+                task.extract = extract;
+                task.extractKeep = extractKeep;
+                task.ioWriters = ioWriters;
+                task.ioDepth = ioDepth;
+                task.ioTasks = ioTasks;
+                task.priority = priority;
                 if (dir) task.dir = g_strdup (dir);
                 download (&task);
+                if (task.dir) g_free (task.dir);
 
                 g_autofree char* turi = NULL;
                 for (GList* l = uris; NULL != l; l = l->next) {